@@ -0,0 +1,207 @@
+/*
+ * SPDX-FileCopyrightText: 2026 Espressif Systems (Shanghai) CO LTD
+ *
+ * SPDX-License-Identifier: Apache-2.0
+ */
+
+#pragma once
+
+#include <stdint.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <esp_err.h>
+#include <esp_rmaker_cmd_resp.h>
+
+#ifdef __cplusplus
+extern "C"
+{
+#endif
+
+/** CBOR (RFC 8949) helpers for command data.
+ *
+ * Commands with ESP_RMAKER_CMD_CONTENT_TYPE_CBOR data can be read with the reader below, directly
+ * from the \ref esp_rmaker_cmd_data_view_t (ESP_RMAKER_CMD_FLAG_DATA_VIEW), even when the data is
+ * split across TLV records. Nothing is allocated, and strings are returned as pointers into the
+ * input whenever they lie within a single record.
+ *
+ * The writer encodes into a caller provided buffer, which the handler can return as its response
+ * after setting ctx->resp_content_type to ESP_RMAKER_CMD_CONTENT_TYPE_CBOR.
+ *
+ * Only definite length strings, arrays and maps are supported.
+ *
+ * Unless mentioned otherwise, the read functions return:
+ * - ESP_OK on success, with the reader moved past the item.
+ * - ESP_ERR_INVALID_STATE if the next item is of another type.
+ * - ESP_ERR_INVALID_SIZE if the data is truncated, or the value does not fit.
+ * - ESP_ERR_NOT_SUPPORTED for indefinite length items.
+ * - ESP_ERR_INVALID_ARG for invalid arguments or malformed data.
+ * The reader is left unchanged on failure, so that the item can be read as another type or skipped.
+ */
+
+/** Type of a CBOR data item */
+typedef enum {
+    /** Unsigned or negative integer */
+    ESP_RMAKER_CMD_CBOR_TYPE_INT,
+    /** Byte string */
+    ESP_RMAKER_CMD_CBOR_TYPE_BYTES,
+    /** UTF-8 text string */
+    ESP_RMAKER_CMD_CBOR_TYPE_TEXT,
+    /** Array */
+    ESP_RMAKER_CMD_CBOR_TYPE_ARRAY,
+    /** Map */
+    ESP_RMAKER_CMD_CBOR_TYPE_MAP,
+    /** Tag, followed by the tagged item */
+    ESP_RMAKER_CMD_CBOR_TYPE_TAG,
+    /** true or false */
+    ESP_RMAKER_CMD_CBOR_TYPE_BOOL,
+    /** null */
+    ESP_RMAKER_CMD_CBOR_TYPE_NULL,
+    /** Half, single or double precision float */
+    ESP_RMAKER_CMD_CBOR_TYPE_FLOAT,
+    /** Any other simple value, like undefined */
+    ESP_RMAKER_CMD_CBOR_TYPE_OTHER,
+} esp_rmaker_cmd_cbor_type_t;
+
+/** CBOR reader. All members are internal. */
+typedef struct {
+    /** Records after the current one */
+    esp_rmaker_cmd_data_iter_t iter;
+    /** Unread part of the current record */
+    const uint8_t *seg;
+    size_t seg_len;
+    /** Bytes left, including seg_len */
+    size_t remaining;
+} esp_rmaker_cmd_cbor_reader_t;
+
+/** CBOR writer. All members are internal. */
+typedef struct {
+    uint8_t *buf;
+    size_t size;
+    /** Bytes written, or which would have been written if buf was large enough */
+    size_t len;
+} esp_rmaker_cmd_cbor_writer_t;
+
+/** Initialise a reader over the command data view
+ *
+ * @param[out] reader Reader to initialise.
+ * @param[in] view Command data view. Must remain valid while the reader is used.
+ *
+ * @return ESP_OK on success.
+ * @return ESP_ERR_INVALID_ARG for NULL arguments.
+ */
+esp_err_t esp_rmaker_cmd_cbor_reader_init(esp_rmaker_cmd_cbor_reader_t *reader, const esp_rmaker_cmd_data_view_t *view);
+
+/** Initialise a reader over contiguous data
+ *
+ * @param[out] reader Reader to initialise.
+ * @param[in] data CBOR data. Must remain valid while the reader is used.
+ * @param[in] len Length of the data.
+ *
+ * @return ESP_OK on success.
+ * @return ESP_ERR_INVALID_ARG for NULL arguments.
+ */
+esp_err_t esp_rmaker_cmd_cbor_reader_init_buf(esp_rmaker_cmd_cbor_reader_t *reader, const void *data, size_t len);
+
+/** Check if all the data has been read
+ *
+ * @param[in] reader The reader.
+ *
+ * @return true if there are no more items.
+ */
+bool esp_rmaker_cmd_cbor_reader_at_end(const esp_rmaker_cmd_cbor_reader_t *reader);
+
+/** Get the type of the next item, without reading it
+ *
+ * @param[in] reader The reader.
+ * @param[out] type Type of the next item.
+ *
+ * @return ESP_OK on success.
+ * @return ESP_ERR_INVALID_SIZE if there are no more items.
+ */
+esp_err_t esp_rmaker_cmd_cbor_peek_type(const esp_rmaker_cmd_cbor_reader_t *reader, esp_rmaker_cmd_cbor_type_t *type);
+
+/** Read an unsigned integer */
+esp_err_t esp_rmaker_cmd_cbor_read_uint(esp_rmaker_cmd_cbor_reader_t *reader, uint64_t *value);
+
+/** Read a signed integer. ESP_ERR_INVALID_SIZE if it does not fit in an int64_t. */
+esp_err_t esp_rmaker_cmd_cbor_read_int(esp_rmaker_cmd_cbor_reader_t *reader, int64_t *value);
+
+/** Read a boolean */
+esp_err_t esp_rmaker_cmd_cbor_read_bool(esp_rmaker_cmd_cbor_reader_t *reader, bool *value);
+
+/** Read a null */
+esp_err_t esp_rmaker_cmd_cbor_read_null(esp_rmaker_cmd_cbor_reader_t *reader);
+
+/** Read a float of any precision, or an integer, as a double */
+esp_err_t esp_rmaker_cmd_cbor_read_double(esp_rmaker_cmd_cbor_reader_t *reader, double *value);
+
+/** Read a tag number. The tagged item is read next. */
+esp_err_t esp_rmaker_cmd_cbor_read_tag(esp_rmaker_cmd_cbor_reader_t *reader, uint64_t *tag);
+
+/** Read the start of an array. The count items are read next. */
+esp_err_t esp_rmaker_cmd_cbor_read_array(esp_rmaker_cmd_cbor_reader_t *reader, size_t *count);
+
+/** Read the start of a map. The count key-value pairs are read next. */
+esp_err_t esp_rmaker_cmd_cbor_read_map(esp_rmaker_cmd_cbor_reader_t *reader, size_t *count);
+
+/** Read a text or byte string
+ *
+ * If the string lies within a single TLV record, *value points to it in the input and buf is not
+ * used. Otherwise, it is copied to buf. Text strings are not NULL terminated.
+ *
+ * @param[in] reader The reader.
+ * @param[out] value Pointer to the string.
+ * @param[out] len Length of the string. Set even if it does not fit in buf.
+ * @param[in] buf Buffer for strings split across records. Can be NULL.
+ * @param[in] buf_size Size of buf.
+ *
+ * @return ESP_OK on success.
+ * @return ESP_ERR_INVALID_SIZE if the string is split across records and does not fit in buf.
+ * @return See above for the other errors.
+ */
+esp_err_t esp_rmaker_cmd_cbor_read_string(esp_rmaker_cmd_cbor_reader_t *reader, const void **value, size_t *len,
+                                          void *buf, size_t buf_size);
+
+/** Skip the next item, including all the items in it, for arrays, maps and tags */
+esp_err_t esp_rmaker_cmd_cbor_skip(esp_rmaker_cmd_cbor_reader_t *reader);
+
+/** Initialise a writer
+ *
+ * @param[out] writer Writer to initialise.
+ * @param[in] buf Buffer to encode into. Can be NULL, to just get the encoded length.
+ * @param[in] size Size of buf.
+ */
+void esp_rmaker_cmd_cbor_writer_init(esp_rmaker_cmd_cbor_writer_t *writer, void *buf, size_t size);
+
+/** Write functions
+ *
+ * These return ESP_ERR_INVALID_SIZE once the buffer is full, but keep counting the length, so
+ * that esp_rmaker_cmd_cbor_writer_finish() can report the size needed.
+ */
+esp_err_t esp_rmaker_cmd_cbor_write_uint(esp_rmaker_cmd_cbor_writer_t *writer, uint64_t value);
+esp_err_t esp_rmaker_cmd_cbor_write_int(esp_rmaker_cmd_cbor_writer_t *writer, int64_t value);
+esp_err_t esp_rmaker_cmd_cbor_write_bool(esp_rmaker_cmd_cbor_writer_t *writer, bool value);
+esp_err_t esp_rmaker_cmd_cbor_write_null(esp_rmaker_cmd_cbor_writer_t *writer);
+/** Written as single precision if that is exact, and as double precision otherwise */
+esp_err_t esp_rmaker_cmd_cbor_write_double(esp_rmaker_cmd_cbor_writer_t *writer, double value);
+esp_err_t esp_rmaker_cmd_cbor_write_tag(esp_rmaker_cmd_cbor_writer_t *writer, uint64_t tag);
+esp_err_t esp_rmaker_cmd_cbor_write_text(esp_rmaker_cmd_cbor_writer_t *writer, const char *text, size_t len);
+esp_err_t esp_rmaker_cmd_cbor_write_bytes(esp_rmaker_cmd_cbor_writer_t *writer, const void *data, size_t len);
+/** Start an array of count items, to be written next */
+esp_err_t esp_rmaker_cmd_cbor_write_array(esp_rmaker_cmd_cbor_writer_t *writer, size_t count);
+/** Start a map of count key-value pairs, to be written next */
+esp_err_t esp_rmaker_cmd_cbor_write_map(esp_rmaker_cmd_cbor_writer_t *writer, size_t count);
+
+/** Get the encoded length
+ *
+ * @param[in] writer The writer.
+ * @param[out] len Encoded length, or the buffer size needed if it was too small.
+ *
+ * @return ESP_OK on success.
+ * @return ESP_ERR_INVALID_SIZE if the buffer was too small (or NULL).
+ */
+esp_err_t esp_rmaker_cmd_cbor_writer_finish(const esp_rmaker_cmd_cbor_writer_t *writer, size_t *len);
+
+#ifdef __cplusplus
+}
+#endif
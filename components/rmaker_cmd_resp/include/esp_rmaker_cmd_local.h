@@ -0,0 +1,186 @@
+/*
+ * SPDX-FileCopyrightText: 2026 Espressif Systems (Shanghai) CO LTD
+ *
+ * SPDX-License-Identifier: Apache-2.0
+ */
+
+#pragma once
+
+#include <stdint.h>
+#include <stddef.h>
+#include <esp_err.h>
+
+#ifdef __cplusplus
+extern "C"
+{
+#endif
+
+/** Local network transport for commands.
+ *
+ * Receives command-response TLV payloads from clients on the same network, over UDP or TCP, hands
+ * them to esp_rmaker_cmd_response_handler_with_role() and sends the responses back directly, without
+ * going through the cloud.
+ *
+ * Every message is a frame authenticated with a session key:
+ *
+ *     | Version (1) | Type (1) | Reserved (2) | Sequence (4, LE) | Payload | Tag (16) |
+ *
+ * The tag is the HMAC-SHA256 of the rest of the frame, truncated to 16 bytes. The session key is
+ * derived from the key shared with the clients and a nonce chosen by the device, using
+ * esp_rmaker_cmd_local_session_key(). Clients get the nonce by sending ESP_RMAKER_CMD_LOCAL_FRAME_HELLO
+ * without any payload. The response is ESP_RMAKER_CMD_LOCAL_FRAME_HELLO with the same sequence number
+ * and the nonce as the payload. Both are authenticated with the shared key itself. Clients should pick
+ * a random sequence number for it, so that an old response is not taken for a new one. Requests carry
+ * ESP_RMAKER_CMD_LOCAL_FRAME_REQUEST and a sequence number which the client increments for every
+ * request. Responses carry ESP_RMAKER_CMD_LOCAL_FRAME_RESPONSE and the sequence number of the
+ * request. Requests which fail authentication, or whose sequence number was seen already, or is too
+ * old, are dropped without any response. Over UDP, every datagram is a frame. Over TCP, every frame
+ * is preceded by its length, as 2 bytes, little endian.
+ *
+ * A fresh nonce is chosen for every start and every change of the key, and the sequence numbers start
+ * afresh with it. Frames captured earlier are not accepted then, even if the same key is used again,
+ * like after a reboot. A client whose requests get no response should get the nonce again.
+ *
+ * The payload is authenticated, but not encrypted. The user role of the commands comes from the
+ * session and not from the payload, so a client cannot get more access than the key was issued for.
+ * All the responses are sent right away. Commands with worker pool limits run in the local task,
+ * within their limits, and handlers cannot defer their responses for these requests.
+ */
+
+/** Length of the shared key, and of the session key */
+#define ESP_RMAKER_CMD_LOCAL_KEY_LEN        32
+
+/** Length of the nonce for the session key */
+#define ESP_RMAKER_CMD_LOCAL_NONCE_LEN      16
+
+/** Frame overhead, i.e. header and tag */
+#define ESP_RMAKER_CMD_LOCAL_HEADER_LEN     8
+#define ESP_RMAKER_CMD_LOCAL_TAG_LEN        16
+#define ESP_RMAKER_CMD_LOCAL_OVERHEAD       (ESP_RMAKER_CMD_LOCAL_HEADER_LEN + ESP_RMAKER_CMD_LOCAL_TAG_LEN)
+
+/** Frame version */
+#define ESP_RMAKER_CMD_LOCAL_VERSION        1
+
+/** Frame types */
+#define ESP_RMAKER_CMD_LOCAL_FRAME_REQUEST  0
+#define ESP_RMAKER_CMD_LOCAL_FRAME_RESPONSE 1
+#define ESP_RMAKER_CMD_LOCAL_FRAME_HELLO    2
+
+/** Transport protocol */
+typedef enum {
+    ESP_RMAKER_CMD_LOCAL_UDP,
+    ESP_RMAKER_CMD_LOCAL_TCP,
+} esp_rmaker_cmd_local_proto_t;
+
+/** Local transport configuration */
+typedef struct {
+    /** UDP or TCP */
+    esp_rmaker_cmd_local_proto_t proto;
+    /** Port to listen on. 0 for any free port, which can be read using esp_rmaker_cmd_local_get_port(). */
+    uint16_t port;
+    /** Key shared with the clients */
+    uint8_t key[ESP_RMAKER_CMD_LOCAL_KEY_LEN];
+    /** User role (with optional sub-role) for the commands received from the clients */
+    uint8_t user_role;
+} esp_rmaker_cmd_local_config_t;
+
+/** Start the local transport
+ *
+ * Opens the socket and starts a task which serves the clients, till esp_rmaker_cmd_local_stop().
+ *
+ * @param[in] config Transport configuration.
+ *
+ * @return ESP_OK on success.
+ * @return ESP_ERR_INVALID_ARG for invalid configuration.
+ * @return ESP_ERR_INVALID_STATE if already started.
+ * @return error on failure.
+ */
+esp_err_t esp_rmaker_cmd_local_start(const esp_rmaker_cmd_local_config_t *config);
+
+/** Stop the local transport
+ *
+ * Closes the socket and all the client connections, and waits for the task to exit.
+ *
+ * @return ESP_OK on success.
+ * @return ESP_ERR_INVALID_STATE if not started.
+ */
+esp_err_t esp_rmaker_cmd_local_stop(void);
+
+/** Change the session key
+ *
+ * Requests are accepted only with the new key after this, with a fresh nonce, which the clients need
+ * to get again. The sequence numbers start afresh.
+ *
+ * @param[in] key New shared key, of ESP_RMAKER_CMD_LOCAL_KEY_LEN bytes.
+ *
+ * @return ESP_OK on success.
+ * @return ESP_ERR_INVALID_STATE if not started.
+ * @return ESP_ERR_INVALID_ARG for NULL key.
+ */
+esp_err_t esp_rmaker_cmd_local_set_key(const uint8_t *key);
+
+/** Get the port the transport is listening on
+ *
+ * @param[out] port The port.
+ *
+ * @return ESP_OK on success.
+ * @return ESP_ERR_INVALID_STATE if not started.
+ */
+esp_err_t esp_rmaker_cmd_local_get_port(uint16_t *port);
+
+/** Derive the session key from the shared key and the nonce, like the clients do
+ *
+ * The session key is the HMAC-SHA256 of the nonce, with the shared key.
+ *
+ * @param[in] key Shared key, of ESP_RMAKER_CMD_LOCAL_KEY_LEN bytes.
+ * @param[in] nonce Nonce from the device, of ESP_RMAKER_CMD_LOCAL_NONCE_LEN bytes.
+ * @param[out] session_key Buffer for the session key, of ESP_RMAKER_CMD_LOCAL_KEY_LEN bytes.
+ *
+ * @return ESP_OK on success.
+ * @return ESP_ERR_INVALID_ARG for NULL arguments.
+ * @return error on failure.
+ */
+esp_err_t esp_rmaker_cmd_local_session_key(const uint8_t *key, const uint8_t *nonce, uint8_t *session_key);
+
+/** Build a frame, like the clients do for requests
+ *
+ * @param[in] key Session key, or the shared key for ESP_RMAKER_CMD_LOCAL_FRAME_HELLO, of
+ * ESP_RMAKER_CMD_LOCAL_KEY_LEN bytes.
+ * @param[in] type ESP_RMAKER_CMD_LOCAL_FRAME_* value.
+ * @param[in] seq Sequence number.
+ * @param[in] payload Payload. Can be within frame, at offset ESP_RMAKER_CMD_LOCAL_HEADER_LEN.
+ * @param[in] payload_len Length of the payload.
+ * @param[out] frame Buffer for the frame.
+ * @param[in] frame_size Size of the buffer. Should be at least payload_len + ESP_RMAKER_CMD_LOCAL_OVERHEAD.
+ * @param[out] frame_len Length of the frame.
+ *
+ * @return ESP_OK on success.
+ * @return ESP_ERR_INVALID_SIZE if the buffer is too small.
+ * @return error on failure.
+ */
+esp_err_t esp_rmaker_cmd_local_frame_encode(const uint8_t *key, uint8_t type, uint32_t seq,
+                                            const void *payload, size_t payload_len,
+                                            void *frame, size_t frame_size, size_t *frame_len);
+
+/** Authenticate a frame and get its contents, like the clients do for responses
+ *
+ * @param[in] key Session key, or the shared key for ESP_RMAKER_CMD_LOCAL_FRAME_HELLO, of
+ * ESP_RMAKER_CMD_LOCAL_KEY_LEN bytes.
+ * @param[in] frame The frame.
+ * @param[in] frame_len Length of the frame.
+ * @param[out] type Frame type.
+ * @param[out] seq Sequence number.
+ * @param[out] payload Pointer to the payload, within the frame.
+ * @param[out] payload_len Length of the payload.
+ *
+ * @return ESP_OK on success.
+ * @return ESP_ERR_INVALID_SIZE if the frame is too short.
+ * @return ESP_ERR_NOT_SUPPORTED for another version.
+ * @return ESP_ERR_INVALID_CRC if the authentication fails.
+ */
+esp_err_t esp_rmaker_cmd_local_frame_decode(const uint8_t *key, const void *frame, size_t frame_len,
+                                            uint8_t *type, uint32_t *seq, const void **payload, size_t *payload_len);
+
+#ifdef __cplusplus
+}
+#endif
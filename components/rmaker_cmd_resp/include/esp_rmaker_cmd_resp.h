@@ -7,6 +7,7 @@
 #pragma once
 
 #include <stdint.h>
+#include <stdbool.h>
 #include <esp_err.h>
 #include <esp_event.h>
 
@@ -55,9 +56,25 @@ typedef enum {
     /** Command : 2 bytes*/
     ESP_RMAKER_TLV_TYPE_CMD,
     /** Data : Variable length */
-    ESP_RMAKER_TLV_TYPE_DATA
+    ESP_RMAKER_TLV_TYPE_DATA,
+    /** Batch Record : Variable length, a complete command or response payload.
+     * A record whose length is a multiple of 255 is terminated by an empty record TLV.
+     */
+    ESP_RMAKER_TLV_TYPE_BATCH_RECORD,
+    /** Content Type : 1 byte, one of esp_rmaker_cmd_content_type_t. Optional, describes the Data. */
+    ESP_RMAKER_TLV_TYPE_CONTENT_TYPE
 } esp_rmaker_tlv_type_t;
 
+/** Encoding of the command or response Data */
+typedef enum {
+    /** Not specified. Data format is as agreed for the command (typically JSON). */
+    ESP_RMAKER_CMD_CONTENT_TYPE_UNSPECIFIED = 0,
+    /** JSON text */
+    ESP_RMAKER_CMD_CONTENT_TYPE_JSON,
+    /** CBOR (RFC 8949). See esp_rmaker_cmd_cbor.h */
+    ESP_RMAKER_CMD_CONTENT_TYPE_CBOR,
+} esp_rmaker_cmd_content_type_t;
+
 /* RainMaker Command Response Status */
 typedef enum {
     /** Success */
@@ -84,6 +101,15 @@ typedef struct {
     uint8_t user_role;
     /** Timestamp (epoch seconds). 0 if not present in the command. */
     uint32_t timestamp;
+    /** Content type of the command data (esp_rmaker_cmd_content_type_t). 0 if not present in the command. */
+    uint8_t content_type;
+    /** Content type of the response data. Set by the handler if needed, to add it to the response. */
+    uint8_t resp_content_type;
+    /** True if the user role was set by the transport, using esp_rmaker_cmd_response_handler_with_role(),
+     * like for local control, instead of being taken from the command. */
+    bool transport_role;
+    /** Response being prepared while the handler runs (internal). Used by esp_rmaker_cmd_respond_encoded(). */
+    void *resp_state;
 } esp_rmaker_cmd_ctx_t;
 
 typedef enum {
@@ -95,6 +121,158 @@ typedef enum {
     ESP_RMAKER_CMD_CUSTOM_START = 0x1000
 } esp_rmaker_cmd_t;
 
+/** Command registration flag: Pass the command data to the handler as a \ref esp_rmaker_cmd_data_view_t
+ *
+ * The handler then gets a pointer to the data view as in_data and the total data length as in_len,
+ * instead of a copy of the data. The data view points directly into the received command, so that
+ * no memory is allocated or copied, even for data split across multiple TLV records.
+ */
+#define ESP_RMAKER_CMD_FLAG_DATA_VIEW   (1 << 0)
+
+/** Command registration flag: Cache the response of the command
+ *
+ * Meant for commands which only read state, like diagnostics, and are polled. Once the handler has
+ * responded successfully, the encoded response is cached, and sent again for requests with the same
+ * data, without calling the handler, till CONFIG_ESP_RMAKER_CMD_CACHE_TTL (or the TTL set with
+ * esp_rmaker_cmd_set_cache_ttl()) expires, or esp_rmaker_cmd_cache_invalidate() is called. Only the
+ * request id is changed, as per the request.
+ *
+ * A single response is cached per command, and it is only sent again for requests from the same
+ * user role and sub-role as the request it was prepared for. Users with the same role share it, so
+ * the response should not depend on anything else about the user.
+ */
+#define ESP_RMAKER_CMD_FLAG_CACHEABLE   (1 << 1)
+
+/** Command Data View
+ *
+ * Read-only view of the command data in the received buffer. Data of 255 bytes or more is split
+ * across multiple TLV records, and so, may not be contiguous. Use esp_rmaker_cmd_data_view_get_ptr()
+ * for contiguous data or the segment iterator otherwise. Valid only till the handler returns.
+ */
+typedef struct {
+    /** Pointer to the first TLV record of the data (internal). NULL if there is no data. */
+    const uint8_t *tlv;
+    /** Total length of the data */
+    size_t len;
+} esp_rmaker_cmd_data_view_t;
+
+/** Command Data View segment iterator */
+typedef struct {
+    /** Next TLV record (internal) */
+    const uint8_t *next;
+    /** Data remaining (internal) */
+    size_t remaining;
+} esp_rmaker_cmd_data_iter_t;
+
+/** Get a pointer to contiguous command data
+ *
+ * @param[in] view The data view.
+ *
+ * @return Pointer to the data if it is in a single segment.
+ * @return NULL if the data is split across multiple segments, or if there is no data.
+ */
+const void *esp_rmaker_cmd_data_view_get_ptr(const esp_rmaker_cmd_data_view_t *view);
+
+/** Initialise a segment iterator for command data
+ *
+ * @param[in] view The data view.
+ * @param[out] iter The iterator to be initialised.
+ */
+void esp_rmaker_cmd_data_view_iter_init(const esp_rmaker_cmd_data_view_t *view, esp_rmaker_cmd_data_iter_t *iter);
+
+/** Get the next segment of command data
+ *
+ * @param[in] iter The iterator initialised using esp_rmaker_cmd_data_view_iter_init().
+ * @param[out] segment Pointer to the segment data.
+ * @param[out] segment_len Length of the segment.
+ *
+ * @return true if a segment was returned.
+ * @return false if there are no more segments.
+ */
+bool esp_rmaker_cmd_data_view_iter_next(esp_rmaker_cmd_data_iter_t *iter, const void **segment, size_t *segment_len);
+
+/** Copy command data into a buffer
+ *
+ * @param[in] view The data view.
+ * @param[out] buf Buffer into which the data should be copied.
+ * @param[in] buf_size Size of the buffer.
+ *
+ * @return Number of bytes copied. Less than the data length if the buffer is too small.
+ */
+size_t esp_rmaker_cmd_data_view_copy(const esp_rmaker_cmd_data_view_t *view, void *buf, size_t buf_size);
+
+/** Add a command or response payload to a batch
+ *
+ * A batch is a sequence of ESP_RMAKER_TLV_TYPE_BATCH_RECORD TLVs, each carrying a complete payload,
+ * as generated by esp_rmaker_cmd_prepare_payload(). It is handled by esp_rmaker_cmd_response_handler()
+ * like any other command.
+ *
+ * @param[in] batch Buffer holding the batch.
+ * @param[in] batch_size Size of the buffer.
+ * @param[in,out] batch_len Current length of the batch. Should be 0 for the first payload. Updated on success.
+ * @param[in] payload The payload to be added.
+ * @param[in] payload_len Length of the payload.
+ *
+ * @return ESP_OK on success.
+ * @return ESP_ERR_INVALID_SIZE if there is no room for the payload.
+ * @return error on failure.
+ */
+esp_err_t esp_rmaker_cmd_batch_add(void *batch, size_t batch_size, size_t *batch_len, const void *payload, size_t payload_len);
+
+/** Get the next payload from a batch
+ *
+ * Payloads of 255 bytes or more are split across multiple TLVs and so, may not be contiguous.
+ * Use the command data view APIs to access them.
+ *
+ * @param[in] batch The batch.
+ * @param[in] batch_len Length of the batch.
+ * @param[in,out] offset Offset to continue from. Should be 0 for the first payload. Updated on success.
+ * @param[out] record View of the payload, pointing into the batch.
+ *
+ * @return true if a payload was found.
+ * @return false if there are no more payloads.
+ */
+bool esp_rmaker_cmd_batch_get_next(const void *batch, size_t batch_len, size_t *offset, esp_rmaker_cmd_data_view_t *record);
+
+/** Parsed Response
+ *
+ * Fields of a response, as received for a command sent by the node, e.g. to another node or to the
+ * cloud. The data is not copied, but points into the response buffer.
+ */
+typedef struct {
+    /** Request id. Empty if not present in the response. */
+    char req_id[REQ_ID_LEN];
+    /** Command id */
+    uint16_t cmd;
+    /** Status (esp_rmaker_cmd_status_t). May be beyond ESP_RMAKER_CMD_STATUS_MAX for newer peers. */
+    uint8_t status;
+    /** Content type of the data (esp_rmaker_cmd_content_type_t). 0 if not present in the response. */
+    uint8_t content_type;
+    /** View of the response data. Valid only as long as the response buffer is. */
+    esp_rmaker_cmd_data_view_t data;
+} esp_rmaker_cmd_response_t;
+
+/** Parse a response
+ *
+ * Unlike esp_rmaker_cmd_resp_parse_response(), which only logs the response, this gets its fields for
+ * further processing, without any allocation or copy of the data, and without any limit on its size.
+ * Use the command data view APIs to access the data.
+ *
+ * A batch of responses has to be split using esp_rmaker_cmd_batch_get_next() first. Records which are
+ * not contiguous (i.e. for which esp_rmaker_cmd_data_view_get_ptr() returns NULL) need to be copied
+ * to a buffer using esp_rmaker_cmd_data_view_copy(), before parsing.
+ *
+ * @param[in] response Pointer to the response received.
+ * @param[in] response_len Length of the response.
+ * @param[out] parsed The parsed response.
+ *
+ * @return ESP_OK on success.
+ * @return ESP_ERR_INVALID_ARG for NULL arguments.
+ * @return ESP_ERR_NOT_SUPPORTED for a batch of responses.
+ * @return ESP_ERR_INVALID_RESPONSE if the command or status is missing, or a field is invalid.
+ */
+esp_err_t esp_rmaker_cmd_parse_response(const void *response, size_t response_len, esp_rmaker_cmd_response_t *parsed);
+
 /** Command Response Handler
  *
  * If any command data is received from any of the supported transports (which are outside the scope of this core framework),
@@ -104,6 +282,13 @@ typedef enum {
  * *output set to NULL. The caller should not publish anything in that case; the handler will later build
  * and publish the response via esp_rmaker_cmd_prepare_payload() and the transport's publish API.
  *
+ * If a request with the same request id and command was handled recently, its cached response is
+ * returned without invoking the handler again.
+ *
+ * The input can also be a batch of commands (see esp_rmaker_cmd_batch_add()), up to
+ * CONFIG_ESP_RMAKER_CMD_MAX_BATCH_RECORDS. The commands are handled in order and the responses
+ * are aggregated into a single batch, in the same order. Deferred responses are not part of it.
+ *
  * @param[in] input Pointer to input data.
  * @param[in] input_len data len.
  * @param[in] output Pointer to output data which should be set by the handler. Will be NULL if the handler deferred the response.
@@ -114,17 +299,45 @@ typedef enum {
  */
 esp_err_t esp_rmaker_cmd_response_handler(const void *input, size_t input_len, void **output, size_t *output_len);
 
+/** Command Response Handler, for transports which establish the user role themselves
+ *
+ * Same as esp_rmaker_cmd_response_handler(), but @p user_role is used for the commands instead of
+ * the role in them, like for a local transport, where the role comes from the authenticated session
+ * rather than from the cloud.
+ *
+ * With a @p user_role, all the responses are returned right away, since the transport may have no other
+ * way to get them. Commands with worker pool limits run in the calling task, within their limits, and
+ * handlers cannot defer their responses (esp_rmaker_cmd_deferred_register() fails, and
+ * ESP_ERR_NOT_FINISHED gets a response with ESP_RMAKER_CMD_STATUS_FAILED).
+ *
+ * @param[in] input Pointer to input data.
+ * @param[in] input_len data len.
+ * @param[in] user_role User role (with optional sub-role) for the commands. 0 to use the role in the commands.
+ * @param[in] output Pointer to output data which should be set by the handler. Will be NULL if the handler deferred the response.
+ * @param[out] output_len Length of output generated. Will be 0 if the handler deferred the response.
+ *
+ * @return ESP_OK on success (including the deferred case).
+ * @return error on failure.
+ */
+esp_err_t esp_rmaker_cmd_response_handler_with_role(const void *input, size_t input_len, uint8_t user_role,
+                                                    void **output, size_t *output_len);
+
 /** Prototype for Command Handler
  *
  * The handler to be invoked when a given command is received.
  *
  * For handlers that can complete synchronously, populate *out_data / *out_len and return ESP_OK.
  *
+ * If the command was registered with ESP_RMAKER_CMD_FLAG_DATA_VIEW, in_data points to an
+ * \ref esp_rmaker_cmd_data_view_t instead of the data itself, and in_len is the total data length.
+ *
  * For handlers that need to defer the response (e.g. the command must be forwarded to another task or device
  * and the reply is needed to build the response), copy whatever is needed from in_data and ctx (both point to
  * framework-owned memory that is freed after this returns), queue the work, and return ESP_ERR_NOT_FINISHED.
  * When the async work completes, call esp_rmaker_cmd_prepare_payload() with the saved req_id and cmd (role=0,
  * status=STATUS_*, data=response) to assemble the TLV and hand the buffer to the transport's publish API.
+ * Alternatively, call esp_rmaker_cmd_deferred_register() before returning and esp_rmaker_cmd_deferred_complete()
+ * with the token later, so that the request is tracked and a FAILED response is sent if it times out.
  * Do not set *out_data when returning ESP_ERR_NOT_FINISHED.
  *
  * @param[in] in_data Pointer to input data.
@@ -140,6 +353,38 @@ esp_err_t esp_rmaker_cmd_response_handler(const void *input, size_t input_len, v
  */
 typedef esp_err_t (*esp_rmaker_cmd_handler_t)(const void *in_data, size_t in_len, void **out_data, size_t *out_len, esp_rmaker_cmd_ctx_t *ctx, void *priv);
 
+/** Prototype for a response data encoder, used with esp_rmaker_cmd_respond_encoded()
+ *
+ * @param[in] arg Argument passed to esp_rmaker_cmd_respond_encoded().
+ * @param[out] buf Buffer to encode the response data into.
+ * @param[in] buf_size Size of @p buf, which is the data size passed to esp_rmaker_cmd_respond_encoded().
+ * @param[out] out_len Length of the encoded data.
+ *
+ * @return ESP_OK on success. Any other value fails the command.
+ */
+typedef esp_err_t (*esp_rmaker_cmd_resp_encode_t)(const void *arg, void *buf, size_t buf_size, size_t *out_len);
+
+/** Encode the response data of a command directly into its response
+ *
+ * To be called from a command handler, instead of returning the response data in out_data. The data
+ * is encoded by @p encode right away, into the response buffer itself where possible, so that the
+ * handler does not need a buffer of its own which the framework then copies. The handler should then
+ * return ESP_OK without setting out_data. Returning an error drops the response prepared here.
+ *
+ * @param[in] ctx Command Context passed to the handler.
+ * @param[in] data_size Maximum size of the encoded data.
+ * @param[in] encode Encoder for the data.
+ * @param[in] arg Argument to be passed to @p encode.
+ *
+ * @return ESP_OK on success.
+ * @return ESP_ERR_INVALID_ARG if @p ctx or @p encode is NULL.
+ * @return ESP_ERR_INVALID_STATE if not called from a command handler, or called again.
+ * @return ESP_ERR_NO_MEM on allocation failure.
+ * @return error from @p encode.
+ */
+esp_err_t esp_rmaker_cmd_respond_encoded(esp_rmaker_cmd_ctx_t *ctx, size_t data_size,
+                                         esp_rmaker_cmd_resp_encode_t encode, const void *arg);
+
 /** Register a new command
  *
  * @param[in] cmd Command Identifier. Custom commands should start beyond ESP_RMAKER_CMD_STANDARD_LAST
@@ -154,6 +399,71 @@ typedef esp_err_t (*esp_rmaker_cmd_handler_t)(const void *in_data, size_t in_len
  */
 esp_err_t esp_rmaker_cmd_register(uint16_t cmd, uint8_t access, esp_rmaker_cmd_handler_t handler, bool free_on_return, void *priv);
 
+/** Register a new command, with flags
+ *
+ * Same as esp_rmaker_cmd_register(), with additional flags to control how the command is handled.
+ *
+ * @param[in] cmd Command Identifier. Custom commands should start beyond ESP_RMAKER_CMD_STANDARD_LAST
+ * @param[in] access User Access for the command. Can be an OR of the various user role flags.
+ * @param[in] handler The handler to be invoked when the given command is received.
+ * @param[in] free_on_return Flag to indicate of the framework should free the output after it has been sent as response.
+ * @param[in] flags OR of ESP_RMAKER_CMD_FLAG_* values. 0 for the default behaviour.
+ * @param[in] priv Optional private data to be passed to the handler.
+ *
+ * @return ESP_OK on success.
+ * @return error on failure.
+ */
+esp_err_t esp_rmaker_cmd_register_with_flags(uint16_t cmd, uint8_t access, esp_rmaker_cmd_handler_t handler,
+                                             bool free_on_return, uint32_t flags, void *priv);
+
+/** Prototype for Chunked Command Handler
+ *
+ * The handler to be invoked for a command registered with esp_rmaker_cmd_register_chunked().
+ * Data which spans multiple TLV records is passed one record (at most 255 bytes) at a time,
+ * straight from the input, so that the memory needed does not depend on the size of the data.
+ * A command without data results in a single call with chunk as NULL and last set.
+ *
+ * Only the call with last set can respond. out_data and out_len are NULL for the other calls.
+ * The return value of the last call is handled like that of \ref esp_rmaker_cmd_handler_t,
+ * including ESP_ERR_NOT_FINISHED to defer the response. Returning an error for any other chunk
+ * fails the command, without calling the handler for the remaining chunks.
+ *
+ * @param[in] chunk Pointer to the data in this chunk. Valid only till the handler returns.
+ * @param[in] chunk_len Length of the data in this chunk.
+ * @param[in] offset Offset of this chunk in the command data.
+ * @param[in] total_len Total length of the command data.
+ * @param[in] last True for the last chunk.
+ * @param[out] out_data Pointer to output data which should be set by the handler. NULL if last is false.
+ * @param[out] out_len Length of output generated. NULL if last is false.
+ * @param[in] ctx Command Context. Copy before returning if the response will be built asynchronously.
+ * @param[in] priv Private data, if specified while registering command.
+ *
+ * @return ESP_OK on success.
+ * @return ESP_ERR_NOT_FINISHED from the last chunk to defer the response.
+ * @return Any other error to fail immediately with CMD_STATUS_FAILED.
+ */
+typedef esp_err_t (*esp_rmaker_cmd_chunk_handler_t)(const void *chunk, size_t chunk_len, size_t offset, size_t total_len,
+                                                    bool last, void **out_data, size_t *out_len,
+                                                    esp_rmaker_cmd_ctx_t *ctx, void *priv);
+
+/** Register a new command, which takes its data in chunks
+ *
+ * Same as esp_rmaker_cmd_register(), but the data is passed to the handler as it was received,
+ * one TLV record at a time, instead of being merged into a single buffer first. Useful for
+ * commands with large data, like firmware chunks or bulk configuration.
+ *
+ * @param[in] cmd Command Identifier. Custom commands should start beyond ESP_RMAKER_CMD_STANDARD_LAST
+ * @param[in] access User Access for the command. Can be an OR of the various user role flags.
+ * @param[in] handler The handler to be invoked for each chunk of the command data.
+ * @param[in] free_on_return Flag to indicate of the framework should free the output after it has been sent as response.
+ * @param[in] priv Optional private data to be passed to the handler.
+ *
+ * @return ESP_OK on success.
+ * @return error on failure.
+ */
+esp_err_t esp_rmaker_cmd_register_chunked(uint16_t cmd, uint8_t access, esp_rmaker_cmd_chunk_handler_t handler,
+                                          bool free_on_return, void *priv);
+
 /** De-register a command
  *
  * @param[in] cmd Command Identifier. Custom commands should start beyond ESP_RMAKER_CMD_STANDARD_LAST
@@ -176,7 +486,9 @@ esp_err_t esp_rmaker_cmd_deregister(uint16_t cmd);
  */
  esp_err_t esp_rmaker_cmd_prepare_empty_response(void **output, size_t *output_len);
 
-/** Prototype for Command sending function (TESTING only)
+/** Prototype for Command sending function
+ *
+ * Used to send test commands and deferred responses.
  *
  * @param[in] data Pointer to the data to be sent.
  * @param[in] data_len Size of data to be sent.
@@ -187,6 +499,374 @@ esp_err_t esp_rmaker_cmd_deregister(uint16_t cmd);
  */
 typedef esp_err_t (*esp_rmaker_cmd_send_t)(const void *data, size_t data_len, void *priv);
 
+/** Deferred request statistics */
+typedef struct {
+    /** Requests currently awaiting their responses */
+    uint16_t pending;
+    /** Maximum requests which can be awaiting their responses (CONFIG_ESP_RMAKER_CMD_MAX_DEFERRED) */
+    uint16_t max_pending;
+    /** Age of the oldest pending request, in milliseconds */
+    uint32_t oldest_age_ms;
+    /** Requests completed with esp_rmaker_cmd_deferred_complete() */
+    uint32_t completed;
+    /** Requests for which a FAILED response was sent on timeout */
+    uint32_t timed_out;
+    /** Requests which could not be registered because the table was full */
+    uint32_t rejected;
+} esp_rmaker_cmd_deferred_stats_t;
+
+/** Initialise the deferred response tracker
+ *
+ * Should be called by the transport before any command handler defers its response. The timeouts
+ * are handled in the RainMaker Work Queue context.
+ *
+ * @param[in] send Function to send the deferred responses, including the ones sent on timeout.
+ * @param[in] priv Private data to be passed to @p send.
+ *
+ * @return ESP_OK on success.
+ * @return error on failure.
+ */
+esp_err_t esp_rmaker_cmd_deferred_init(esp_rmaker_cmd_send_t send, void *priv);
+
+/** Register a deferred request
+ *
+ * Called by a command handler before returning ESP_ERR_NOT_FINISHED. Only the request id and
+ * command are saved from @p ctx. If the request is not completed within @p timeout_ms, a response
+ * with ESP_RMAKER_CMD_STATUS_FAILED is sent for it.
+ *
+ * @param[in] ctx Command Context received by the handler.
+ * @param[in] timeout_ms Timeout in milliseconds. 0 for the default (CONFIG_ESP_RMAKER_CMD_DEFERRED_TIMEOUT).
+ * @param[out] token Token to be used to complete the request.
+ *
+ * @return ESP_OK on success.
+ * @return ESP_ERR_INVALID_STATE if esp_rmaker_cmd_deferred_init() was not called.
+ * @return ESP_ERR_NO_MEM if the maximum deferred requests are already pending.
+ * @return ESP_ERR_NOT_SUPPORTED if the request came through esp_rmaker_cmd_response_handler_with_role()
+ * with a user role, since its response cannot be sent later.
+ * @return error on failure.
+ */
+esp_err_t esp_rmaker_cmd_deferred_register(const esp_rmaker_cmd_ctx_t *ctx, uint32_t timeout_ms, uint32_t *token);
+
+/** Complete a deferred request
+ *
+ * Builds the response for the request and sends it.
+ *
+ * @param[in] token Token received from esp_rmaker_cmd_deferred_register().
+ * @param[in] status ESP_RMAKER_CMD_STATUS_* value for the response.
+ * @param[in] data Response data (may be NULL).
+ * @param[in] data_size Size of @p data.
+ *
+ * @return ESP_OK on success.
+ * @return ESP_ERR_NOT_FOUND if the request is not pending, e.g. if it has already timed out.
+ * @return error on failure.
+ */
+esp_err_t esp_rmaker_cmd_deferred_complete(uint32_t token, uint8_t status, const void *data, size_t data_size);
+
+/** Get the age of a deferred request
+ *
+ * @param[in] token Token received from esp_rmaker_cmd_deferred_register().
+ * @param[out] age_ms Time since the request was registered, in milliseconds.
+ *
+ * @return ESP_OK on success.
+ * @return ESP_ERR_NOT_FOUND if the request is not pending.
+ * @return error on failure.
+ */
+esp_err_t esp_rmaker_cmd_deferred_get_age(uint32_t token, uint32_t *age_ms);
+
+/** Get the deferred request statistics
+ *
+ * @param[out] stats Statistics.
+ *
+ * @return ESP_OK on success.
+ * @return error on failure.
+ */
+esp_err_t esp_rmaker_cmd_deferred_get_stats(esp_rmaker_cmd_deferred_stats_t *stats);
+
+/** Clear the replay cache
+ *
+ * Responses are cached against their request id, command and user role, and whether the role was set
+ * by the transport (see CONFIG_ESP_RMAKER_CMD_REPLAY_CACHE_SIZE), so that requests received again are
+ * not executed again. Responses larger than CONFIG_ESP_RMAKER_CMD_REPLAY_CACHE_MAX_RESPONSE are not
+ * cached. A cached response is only sent once the access check for the request passes.
+ * This drops all the cached responses.
+ *
+ * @return ESP_OK on success.
+ * @return error on failure.
+ */
+esp_err_t esp_rmaker_cmd_replay_cache_clear(void);
+
+/** Start the command worker pool
+ *
+ * Starts CONFIG_ESP_RMAKER_CMD_WORKERS worker tasks, on which the commands configured with
+ * esp_rmaker_cmd_set_worker_limits() are run, instead of the task calling
+ * esp_rmaker_cmd_response_handler(). The responses for such commands are sent using the send
+ * function given to esp_rmaker_cmd_deferred_init(), which should be called first.
+ *
+ * @return ESP_OK on success.
+ * @return ESP_ERR_INVALID_STATE if esp_rmaker_cmd_deferred_init() was not called.
+ * @return error on failure.
+ */
+esp_err_t esp_rmaker_cmd_worker_pool_init(void);
+
+/** Set the worker pool limits for a command
+ *
+ * Once set, esp_rmaker_cmd_response_handler() queues the command for the worker pool and returns
+ * without any response, like for a deferred response. If the command already has @p max_concurrency
+ * instances running and @p max_queued waiting, a response with ESP_RMAKER_CMD_STATUS_FAILED is
+ * returned right away, so that a slow command does not hold up the others. Commands received through
+ * esp_rmaker_cmd_response_handler_with_role() with a user role are not queued, but run right away
+ * within the same limits.
+ *
+ * @param[in] cmd Command Identifier. Should already be registered.
+ * @param[in] max_concurrency Maximum instances of the command running at a time. 0 to run it in the
+ * context of esp_rmaker_cmd_response_handler(), which is the default.
+ * @param[in] max_queued Maximum instances of the command waiting for a running one to finish.
+ *
+ * @return ESP_OK on success.
+ * @return ESP_ERR_INVALID_STATE if the worker pool was not started.
+ * @return ESP_ERR_INVALID_ARG if the command is not registered.
+ */
+esp_err_t esp_rmaker_cmd_set_worker_limits(uint16_t cmd, uint8_t max_concurrency, uint8_t max_queued);
+
+/** Set the response cache TTL for a command
+ *
+ * @param[in] cmd Command Identifier. Should already be registered.
+ * @param[in] ttl_ms Time for which a response is cached, in milliseconds. Caching is enabled for
+ * the command, like with ESP_RMAKER_CMD_FLAG_CACHEABLE, if it was not already. 0 to disable caching.
+ *
+ * @return ESP_OK on success.
+ * @return ESP_ERR_INVALID_ARG if the command is not registered.
+ */
+esp_err_t esp_rmaker_cmd_set_cache_ttl(uint16_t cmd, uint32_t ttl_ms);
+
+/** Invalidate the cached response of a command
+ *
+ * Should be called when the state returned by a cacheable command changes, so that the next request
+ * gets the new state. A response still being prepared by the handler at this time is not cached.
+ *
+ * @param[in] cmd Command Identifier. 0 for all the commands.
+ *
+ * @return ESP_OK on success.
+ * @return ESP_ERR_INVALID_ARG if the command is not registered.
+ */
+esp_err_t esp_rmaker_cmd_cache_invalidate(uint16_t cmd);
+
+/** Rate limit and priority for the commands from a user role */
+typedef struct {
+    /** Average commands allowed per second. 0 for no limit. */
+    uint16_t rate;
+    /** Commands allowed in a burst, before the average rate applies. At least 1 if rate is set. */
+    uint16_t burst;
+    /** Priority of the commands on the worker pool. Higher priority commands are run first.
+     * 0 to keep the default priority of the role. */
+    uint8_t priority;
+} esp_rmaker_cmd_role_limits_t;
+
+/** Set the rate limit and priority for a user role
+ *
+ * Commands are checked against a token bucket for the role of the user, before being looked up, and
+ * a response with ESP_RMAKER_CMD_STATUS_FAILED is returned right away if the limit is exceeded, like
+ * when the worker pool is busy. So, a flood of commands from one role costs little, and does not hold
+ * up the commands from others. The throttled commands are counted, see esp_rmaker_cmd_get_throttled_count().
+ *
+ * Limits can be set for a role as a whole, like ESP_RMAKER_USER_ROLE_SECONDARY_USER, or for a
+ * sub-role of it, by adding the sub-role flag. A sub-role with its own limits gets its own bucket,
+ * while all the other sub-roles share the one for the role.
+ *
+ * The priority decides the order in which the commands waiting for the worker pool are run. By
+ * default, super admin commands have priority 4, primary user ones 3, secondary user ones 2 and node
+ * ones 1. Commands with the same priority run in the order received. There are no rate limits by default.
+ *
+ * @param[in] user_role A single user role flag, optionally with a single sub-role flag.
+ * @param[in] limits Limits for the role. NULL to go back to the default.
+ *
+ * @return ESP_OK on success.
+ * @return ESP_ERR_INVALID_ARG for an invalid role or limits.
+ * @return error on failure.
+ */
+esp_err_t esp_rmaker_cmd_set_role_limits(uint8_t user_role, const esp_rmaker_cmd_role_limits_t *limits);
+
+/** Get the number of commands throttled for a user role
+ *
+ * @param[in] user_role User role flag, optionally with a sub-role flag, as for esp_rmaker_cmd_set_role_limits().
+ * @param[out] count Commands throttled against the limits for the role (or sub-role).
+ *
+ * @return ESP_OK on success.
+ * @return ESP_ERR_INVALID_ARG for an invalid role.
+ */
+esp_err_t esp_rmaker_cmd_get_throttled_count(uint8_t user_role, uint32_t *count);
+
+/** Middleware pre hook
+ *
+ * Called before the handler, with the context and the data view, as parsed once for all the hooks and
+ * the handler. The context can be updated, e.g. its response content type, for the later hooks and
+ * the handler.
+ *
+ * @param[in] data View of the command data.
+ * @param[in,out] ctx Command context.
+ * @param[in] priv Private data of the middleware.
+ *
+ * @return ESP_RMAKER_CMD_STATUS_SUCCESS to go on with the command.
+ * @return Any other status to respond with it right away, e.g. ESP_RMAKER_CMD_STATUS_CMD_INVALID for
+ * invalid data. The later pre hooks and the handler are not called then.
+ */
+typedef esp_rmaker_cmd_status_t (*esp_rmaker_cmd_middleware_pre_t)(const esp_rmaker_cmd_data_view_t *data,
+                                                                   esp_rmaker_cmd_ctx_t *ctx, void *priv);
+
+/** Middleware post hook
+ *
+ * Called once the response has been prepared.
+ *
+ * @param[in] data View of the command data.
+ * @param[in] ctx Command context.
+ * @param[in] status Status of the response. ESP_RMAKER_CMD_STATUS_MAX if the handler deferred the response.
+ * @param[in] priv Private data of the middleware.
+ */
+typedef void (*esp_rmaker_cmd_middleware_post_t)(const esp_rmaker_cmd_data_view_t *data,
+                                                 const esp_rmaker_cmd_ctx_t *ctx, uint8_t status, void *priv);
+
+/** Command Middleware */
+typedef struct {
+    /** Pre hook. Can be NULL. */
+    esp_rmaker_cmd_middleware_pre_t pre;
+    /** Post hook. Can be NULL. */
+    esp_rmaker_cmd_middleware_post_t post;
+    /** Private data passed to the hooks */
+    void *priv;
+} esp_rmaker_cmd_middleware_t;
+
+/** Add a middleware for the commands
+ *
+ * Middleware run common work, like validation, logging or metrics, for all the commands, so that the
+ * handlers need not do it (or parse the command again) themselves. The chain of middleware is fixed
+ * for a command when it is registered, so a middleware applies only to the commands registered after
+ * it has been added. Middleware cannot be removed.
+ *
+ * The pre hooks run in the order in which the middleware were added, after the access check and the
+ * rate limits, and before the response cache and the worker pool. The post hooks run in the reverse
+ * order, for all the middleware whose pre hooks were run (or which do not have one), including the
+ * one which rejected the command, if any. For commands on the worker pool, they run on the worker.
+ *
+ * @param[in] middleware The middleware. It is copied, so need not be kept by the caller.
+ *
+ * @return ESP_OK on success.
+ * @return ESP_ERR_INVALID_ARG if there are no hooks.
+ * @return ESP_ERR_NO_MEM if CONFIG_ESP_RMAKER_CMD_MAX_MIDDLEWARE have been added already.
+ */
+esp_err_t esp_rmaker_cmd_middleware_add(const esp_rmaker_cmd_middleware_t *middleware);
+
+/** Command-response codec statistics */
+typedef struct {
+    /** Buffers allocated */
+    uint32_t allocs;
+    /** Payload bytes copied */
+    uint64_t bytes_copied;
+} esp_rmaker_cmd_resp_stats_t;
+
+/** Get the codec statistics
+ *
+ * Available only if CONFIG_ESP_RMAKER_CMD_RESP_STATS is enabled. The counters are not updated
+ * atomically, so they are only approximate if commands are handled in parallel.
+ *
+ * @param[out] stats Statistics since boot or the last esp_rmaker_cmd_resp_reset_stats().
+ *
+ * @return ESP_OK on success.
+ * @return ESP_ERR_NOT_SUPPORTED if the statistics are not enabled.
+ * @return error on failure.
+ */
+esp_err_t esp_rmaker_cmd_resp_get_stats(esp_rmaker_cmd_resp_stats_t *stats);
+
+/** Reset the codec statistics */
+void esp_rmaker_cmd_resp_reset_stats(void);
+
+/** Number of buckets in a command trace histogram */
+#define ESP_RMAKER_CMD_TRACE_BUCKETS    16
+
+/** Upper limit (exclusive) of a histogram bucket, in microseconds
+ *
+ * Bucket 0 covers [0, 64) us and bucket i covers [32 << i, 64 << i) us. The last bucket also holds
+ * everything above its range, i.e. from about 1 second.
+ */
+#define ESP_RMAKER_CMD_TRACE_BUCKET_LIMIT_US(bucket)    ((uint32_t)64 << (bucket))
+
+/** Phases of command handling which are timed */
+typedef enum {
+    /** From receiving the command till it is ready to be dispatched */
+    ESP_RMAKER_CMD_TRACE_PARSE = 0,
+    /** Command handler */
+    ESP_RMAKER_CMD_TRACE_HANDLER,
+    /** Encoding the response */
+    ESP_RMAKER_CMD_TRACE_ENCODE,
+    /** From esp_rmaker_cmd_deferred_register() till the response is completed or times out */
+    ESP_RMAKER_CMD_TRACE_DEFERRED,
+    /** Number of phases */
+    ESP_RMAKER_CMD_TRACE_PHASE_MAX,
+} esp_rmaker_cmd_trace_phase_t;
+
+/** Latency histogram */
+typedef struct {
+    /** Number of samples */
+    uint32_t count;
+    /** Sum of all the samples, for the average */
+    uint64_t total_us;
+    /** Largest sample */
+    uint32_t max_us;
+    /** Samples per bucket. See ESP_RMAKER_CMD_TRACE_BUCKET_LIMIT_US(). */
+    uint32_t buckets[ESP_RMAKER_CMD_TRACE_BUCKETS];
+} esp_rmaker_cmd_histogram_t;
+
+/** Latency and outcome trace of a command */
+typedef struct {
+    /** Command id */
+    uint16_t cmd;
+    /** Histogram per phase, indexed by esp_rmaker_cmd_trace_phase_t */
+    esp_rmaker_cmd_histogram_t phases[ESP_RMAKER_CMD_TRACE_PHASE_MAX];
+    /** Responses per status, indexed by esp_rmaker_cmd_status_t */
+    uint32_t status[ESP_RMAKER_CMD_STATUS_MAX];
+} esp_rmaker_cmd_trace_t;
+
+/** Get the trace of a command
+ *
+ * Available only if CONFIG_ESP_RMAKER_CMD_TRACE is enabled. Commands are traced in a fixed size
+ * table, in the order they are first seen, so commands beyond CONFIG_ESP_RMAKER_CMD_TRACE_MAX_CMDS
+ * are not traced. Responses sent again from the replay cache are not counted.
+ *
+ * @param[in] cmd Command Identifier.
+ * @param[out] trace Trace since boot or the last esp_rmaker_cmd_trace_reset().
+ *
+ * @return ESP_OK on success.
+ * @return ESP_ERR_NOT_FOUND if the command has not been traced.
+ * @return ESP_ERR_NOT_SUPPORTED if tracing is not enabled.
+ */
+esp_err_t esp_rmaker_cmd_trace_get(uint16_t cmd, esp_rmaker_cmd_trace_t *trace);
+
+/** Get the traces of all the commands
+ *
+ * @param[out] traces Array for the traces.
+ * @param[in] max_traces Number of entries in traces.
+ * @param[out] count Number of traces copied.
+ *
+ * @return ESP_OK on success.
+ * @return ESP_ERR_NOT_SUPPORTED if tracing is not enabled.
+ */
+esp_err_t esp_rmaker_cmd_trace_get_all(esp_rmaker_cmd_trace_t *traces, size_t max_traces, size_t *count);
+
+/** Clear the traces of all the commands */
+void esp_rmaker_cmd_trace_reset(void);
+
+/** Estimate a percentile from a histogram
+ *
+ * @param[in] hist The histogram.
+ * @param[in] percentile Percentile, from 0 to 100.
+ *
+ * @return Upper limit of the bucket having the percentile (or the maximum, if lower), in microseconds.
+ * 0 if there are no samples.
+ */
+uint32_t esp_rmaker_cmd_trace_get_percentile(const esp_rmaker_cmd_histogram_t *hist, uint8_t percentile);
+
+/** Log a summary of the traces of all the commands */
+void esp_rmaker_cmd_trace_log(void);
+
 /** Send Test command (TESTING only)
  *
  * @param[in] req_id NULL terminated request id of max 32 characters.
@@ -247,6 +927,113 @@ esp_err_t esp_rmaker_cmd_prepare_payload(const char *req_id, uint8_t role, uint8
                                          const void *data, size_t data_size,
                                          void **output, size_t *output_len);
 
+/** Prepare a command/response TLV buffer, with a content type
+ *
+ * Same as esp_rmaker_cmd_prepare_payload(), but also emits a CONTENT_TYPE TLV (after CMD) iff
+ * @p content_type is non-zero. Use it for deferred responses whose data is, for example, CBOR.
+ *
+ * @param[in] req_id       NULL terminated request id of max 32 characters (NULL to skip REQ_ID).
+ * @param[in] role         User Role flag (0 to skip USER_ROLE).
+ * @param[in] status       ESP_RMAKER_CMD_STATUS_* value for the STATUS TLV.
+ * @param[in] cmd          Command Identifier.
+ * @param[in] content_type esp_rmaker_cmd_content_type_t value for the data (0 to skip CONTENT_TYPE).
+ * @param[in] data         Pointer to payload data (may be NULL).
+ * @param[in] data_size    Size of @p data.
+ * @param[out] output      Allocated TLV buffer. Caller frees.
+ * @param[out] output_len  Length of @p output.
+ *
+ * @return ESP_OK on success.
+ * @return ESP_ERR_INVALID_ARG if @p output or @p output_len is NULL.
+ * @return ESP_ERR_NO_MEM on allocation failure.
+ */
+esp_err_t esp_rmaker_cmd_prepare_payload_with_type(const char *req_id, uint8_t role, uint8_t status,
+                                                   uint16_t cmd, uint8_t content_type,
+                                                   const void *data, size_t data_size,
+                                                   void **output, size_t *output_len);
+
+/** Prototype for the payload writer used by esp_rmaker_cmd_encode_payload_to_writer()
+ *
+ * @param[in] data Pointer to the next chunk of the encoded payload.
+ * @param[in] len Length of the chunk.
+ * @param[in] priv Private data passed to esp_rmaker_cmd_encode_payload_to_writer().
+ *
+ * @return ESP_OK on success. Any other value aborts the encoding.
+ */
+typedef esp_err_t (*esp_rmaker_cmd_write_t)(const void *data, size_t len, void *priv);
+
+/** Encode a command payload into a caller provided buffer
+ *
+ * Same as esp_rmaker_cmd_prepare_payload(), but without any allocation. Useful for callers
+ * that already own a suitable buffer, like a transport's transmit buffer or a static buffer.
+ *
+ * @param[in] req_id      NULL terminated request id of max 32 characters (NULL to skip REQ_ID).
+ * @param[in] role        User Role flag (0 to skip USER_ROLE).
+ * @param[in] status      ESP_RMAKER_CMD_STATUS_* value for the STATUS TLV.
+ * @param[in] cmd         Command Identifier.
+ * @param[in] data        Pointer to payload data (may be NULL).
+ * @param[in] data_size   Size of @p data.
+ * @param[out] buf        Buffer to encode the payload into. Can be NULL to just query the size.
+ * @param[in] buf_size    Size of @p buf.
+ * @param[out] output_len Length of the encoded payload, or the required buffer size if
+ *                        ESP_ERR_INVALID_SIZE is returned.
+ *
+ * @return ESP_OK on success.
+ * @return ESP_ERR_INVALID_ARG if @p output_len is NULL.
+ * @return ESP_ERR_INVALID_SIZE if @p buf is NULL or smaller than the required size.
+ * @return error on failure.
+ */
+esp_err_t esp_rmaker_cmd_encode_payload(const char *req_id, uint8_t role, uint8_t status,
+                                        uint16_t cmd,
+                                        const void *data, size_t data_size,
+                                        void *buf, size_t buf_size, size_t *output_len);
+
+/** Encode a command payload through a writer
+ *
+ * Same as esp_rmaker_cmd_encode_payload(), but the encoded payload is passed to @p write in
+ * chunks (TLV headers and values) instead of being copied into a buffer. Large data values
+ * are passed on as is, so the payload never needs to be assembled in memory.
+ *
+ * @param[in] req_id      NULL terminated request id of max 32 characters (NULL to skip REQ_ID).
+ * @param[in] role        User Role flag (0 to skip USER_ROLE).
+ * @param[in] status      ESP_RMAKER_CMD_STATUS_* value for the STATUS TLV.
+ * @param[in] cmd         Command Identifier.
+ * @param[in] data        Pointer to payload data (may be NULL).
+ * @param[in] data_size   Size of @p data.
+ * @param[in] write       Writer to be invoked for each chunk of the payload.
+ * @param[in] priv        Private data to be passed to @p write.
+ * @param[out] output_len Total length written (optional).
+ *
+ * @return ESP_OK on success.
+ * @return ESP_ERR_INVALID_ARG if @p write is NULL.
+ * @return error on failure, including if @p write fails.
+ */
+esp_err_t esp_rmaker_cmd_encode_payload_to_writer(const char *req_id, uint8_t role, uint8_t status,
+                                                  uint16_t cmd,
+                                                  const void *data, size_t data_size,
+                                                  esp_rmaker_cmd_write_t write, void *priv, size_t *output_len);
+
+/** Command Response Handler, with the response passed to a writer
+ *
+ * Same as esp_rmaker_cmd_response_handler_with_role(), but the response is passed to @p write
+ * instead of being returned in an allocated buffer. A successful response is encoded straight from
+ * the buffer returned by the handler, so large responses are never assembled in memory. Responses
+ * which go to the replay cache, those of commands registered with ESP_RMAKER_CMD_FLAG_CACHEABLE,
+ * failures and batches are still prepared in a buffer first, and then passed to @p write in one go.
+ *
+ * @param[in] input Pointer to input data.
+ * @param[in] input_len data len.
+ * @param[in] user_role User role (with optional sub-role) for the commands. 0 to use the role in the commands.
+ * @param[in] write Writer to be invoked for each chunk of the response.
+ * @param[in] priv Private data to be passed to @p write.
+ * @param[out] output_len Total length written (optional). Will be 0 if the handler deferred the response.
+ *
+ * @return ESP_OK on success (including the deferred case).
+ * @return ESP_ERR_INVALID_ARG if @p input or @p write is NULL.
+ * @return error on failure, including if @p write fails. Part of the response may have been written by then.
+ */
+esp_err_t esp_rmaker_cmd_response_handler_to_writer(const void *input, size_t input_len, uint8_t user_role,
+                                                    esp_rmaker_cmd_write_t write, void *priv, size_t *output_len);
+
 /** @deprecated Use esp_rmaker_cmd_prepare_payload() instead. Retained as a one-release alias; will be
  *  removed in a future release. Expands to esp_rmaker_cmd_prepare_payload() with status = 0 (which the
  *  cloud ignores on node-initiated commands, matching the old behavior).
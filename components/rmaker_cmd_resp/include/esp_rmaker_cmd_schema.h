@@ -0,0 +1,284 @@
+/*
+ * SPDX-FileCopyrightText: 2026 Espressif Systems (Shanghai) CO LTD
+ *
+ * SPDX-License-Identifier: Apache-2.0
+ */
+
+#pragma once
+
+#include <stdint.h>
+#include <stdbool.h>
+#include <stdlib.h>
+#include <string.h>
+#include <esp_err.h>
+#include <esp_rmaker_cmd_resp.h>
+
+#ifdef __cplusplus
+extern "C"
+{
+#endif
+
+/** Compile-time schemas for command data.
+ *
+ * A schema lists the fields of a command request or response once, and generates a struct along
+ * with static inline encode, decode and size functions for it. There are no field descriptors
+ * to walk at runtime and no allocations.
+ *
+ * The fields are given as an X-macro taking two arguments, one for scalar fields and one for
+ * byte fields:
+ *
+ * @code{c}
+ * #define LIGHT_REQ_FIELDS(SCALAR, BYTES) \
+ *     SCALAR(1, U8, brightness)           \
+ *     SCALAR(2, BOOL, power)              \
+ *     BYTES(3, name, 32)
+ *
+ * ESP_RMAKER_CMD_SCHEMA_DEFINE(light_req, LIGHT_REQ_FIELDS)
+ * @endcode
+ *
+ * This generates:
+ * - light_req_t, with a member and a has_<field> flag for every field. Byte fields are a
+ *   const uint8_t pointer and a <field>_len.
+ * - size_t light_req_encoded_size(const light_req_t *s)
+ * - esp_err_t light_req_encode(const light_req_t *s, void *buf, size_t buf_size, size_t *out_len)
+ * - esp_err_t light_req_decode(const void *data, size_t data_len, light_req_t *s)
+ *
+ * Each field is encoded as a 1 byte tag, a 1 byte length and the value. Scalars are little
+ * endian. Tags must be unique within a schema (duplicates fail to compile) and byte fields can
+ * have at most 255 bytes. The encoder writes all the fields. The decoder sets the has_<field>
+ * flags for the fields found, skips unknown tags so that newer peers can add fields, and points
+ * byte fields into the input instead of copying them.
+ *
+ * Scalar types: U8, U16, U32, U64, I8, I16, I32, I64, BOOL.
+ */
+
+/** Maximum length of a byte field */
+#define ESP_RMAKER_CMD_SCHEMA_MAX_BYTES     255
+
+/* Scalar type mappings. These are used by the schema macros, and are not meant to be used directly. */
+#define ESP_RMAKER_CMD_SCHEMA_CTYPE_U8      uint8_t
+#define ESP_RMAKER_CMD_SCHEMA_CTYPE_U16     uint16_t
+#define ESP_RMAKER_CMD_SCHEMA_CTYPE_U32     uint32_t
+#define ESP_RMAKER_CMD_SCHEMA_CTYPE_U64     uint64_t
+#define ESP_RMAKER_CMD_SCHEMA_CTYPE_I8      int8_t
+#define ESP_RMAKER_CMD_SCHEMA_CTYPE_I16     int16_t
+#define ESP_RMAKER_CMD_SCHEMA_CTYPE_I32     int32_t
+#define ESP_RMAKER_CMD_SCHEMA_CTYPE_I64     int64_t
+#define ESP_RMAKER_CMD_SCHEMA_CTYPE_BOOL    bool
+
+#define ESP_RMAKER_CMD_SCHEMA_UTYPE_U8      uint8_t
+#define ESP_RMAKER_CMD_SCHEMA_UTYPE_U16     uint16_t
+#define ESP_RMAKER_CMD_SCHEMA_UTYPE_U32     uint32_t
+#define ESP_RMAKER_CMD_SCHEMA_UTYPE_U64     uint64_t
+#define ESP_RMAKER_CMD_SCHEMA_UTYPE_I8      uint8_t
+#define ESP_RMAKER_CMD_SCHEMA_UTYPE_I16     uint16_t
+#define ESP_RMAKER_CMD_SCHEMA_UTYPE_I32     uint32_t
+#define ESP_RMAKER_CMD_SCHEMA_UTYPE_I64     uint64_t
+#define ESP_RMAKER_CMD_SCHEMA_UTYPE_BOOL    uint8_t
+
+#define ESP_RMAKER_CMD_SCHEMA_WIDTH(type)   sizeof(ESP_RMAKER_CMD_SCHEMA_UTYPE_##type)
+
+#ifdef __cplusplus
+#define ESP_RMAKER_CMD_SCHEMA_ASSERT(expr, msg)  static_assert(expr, msg)
+#else
+#define ESP_RMAKER_CMD_SCHEMA_ASSERT(expr, msg)  _Static_assert(expr, msg)
+#endif
+
+static inline uint8_t *esp_rmaker_cmd_schema_put_uint(uint8_t *p, uint8_t tag, uint64_t value, size_t width)
+{
+    *p++ = tag;
+    *p++ = (uint8_t)width;
+    for (size_t i = 0; i < width; i++) {
+        *p++ = (uint8_t)(value >> (8 * i));
+    }
+    return p;
+}
+
+static inline uint8_t *esp_rmaker_cmd_schema_put_bytes(uint8_t *p, uint8_t tag, const uint8_t *value, size_t len)
+{
+    *p++ = tag;
+    *p++ = (uint8_t)len;
+    if (len) {
+        memcpy(p, value, len);
+    }
+    return p + len;
+}
+
+static inline uint64_t esp_rmaker_cmd_schema_get_uint(const uint8_t *p, size_t width)
+{
+    uint64_t value = 0;
+    for (size_t i = 0; i < width; i++) {
+        value |= (uint64_t)p[i] << (8 * i);
+    }
+    return value;
+}
+
+/* Per field expansions of the X-macro */
+#define ESP_RMAKER_CMD_SCHEMA_MEMBER_SCALAR(tag, type, field) \
+    ESP_RMAKER_CMD_SCHEMA_CTYPE_##type field; \
+    bool has_##field;
+
+#define ESP_RMAKER_CMD_SCHEMA_MEMBER_BYTES(tag, field, max) \
+    const uint8_t *field; \
+    size_t field##_len; \
+    bool has_##field;
+
+#define ESP_RMAKER_CMD_SCHEMA_SIZE_SCALAR(tag, type, field) \
+    len += 2 + ESP_RMAKER_CMD_SCHEMA_WIDTH(type);
+
+#define ESP_RMAKER_CMD_SCHEMA_SIZE_BYTES(tag, field, max) \
+    len += 2 + s->field##_len;
+
+#define ESP_RMAKER_CMD_SCHEMA_ENCODE_SCALAR(tag, type, field) \
+    ESP_RMAKER_CMD_SCHEMA_ASSERT((unsigned)(tag) <= 0xff, "Schema tags must fit in a byte"); \
+    p = esp_rmaker_cmd_schema_put_uint(p, (tag), (uint64_t)(ESP_RMAKER_CMD_SCHEMA_UTYPE_##type)s->field, \
+                                       ESP_RMAKER_CMD_SCHEMA_WIDTH(type));
+
+#define ESP_RMAKER_CMD_SCHEMA_ENCODE_BYTES(tag, field, max) \
+    ESP_RMAKER_CMD_SCHEMA_ASSERT((unsigned)(tag) <= 0xff, "Schema tags must fit in a byte"); \
+    ESP_RMAKER_CMD_SCHEMA_ASSERT((max) <= ESP_RMAKER_CMD_SCHEMA_MAX_BYTES, "Schema byte fields are limited to 255 bytes"); \
+    if (s->field##_len > (max) || (s->field##_len && !s->field)) { \
+        return ESP_ERR_INVALID_ARG; \
+    } \
+    p = esp_rmaker_cmd_schema_put_bytes(p, (tag), s->field, s->field##_len);
+
+#define ESP_RMAKER_CMD_SCHEMA_DECODE_SCALAR(tag, type, field) \
+    case (tag): \
+        if (len != ESP_RMAKER_CMD_SCHEMA_WIDTH(type)) { \
+            return ESP_ERR_INVALID_ARG; \
+        } \
+        s->field = (ESP_RMAKER_CMD_SCHEMA_CTYPE_##type)(ESP_RMAKER_CMD_SCHEMA_UTYPE_##type) \
+                   esp_rmaker_cmd_schema_get_uint(value, len); \
+        s->has_##field = true; \
+        break;
+
+#define ESP_RMAKER_CMD_SCHEMA_DECODE_BYTES(tag, field, max) \
+    case (tag): \
+        if (len > (max)) { \
+            return ESP_ERR_INVALID_SIZE; \
+        } \
+        s->field = value; \
+        s->field##_len = len; \
+        s->has_##field = true; \
+        break;
+
+/** Define a command data schema
+ *
+ * Generates the name_t struct and its name_encoded_size(), name_encode() and name_decode()
+ * functions. Use it at file scope, once per schema.
+ *
+ * name_encode() returns ESP_ERR_INVALID_SIZE, with the required size in out_len, if buf is
+ * NULL or too small, and ESP_ERR_INVALID_ARG if a byte field is longer than its maximum.
+ * name_decode() returns ESP_ERR_INVALID_SIZE for truncated input or oversized byte fields, and
+ * ESP_ERR_INVALID_ARG for scalars of the wrong width. Byte fields in the decoded struct point
+ * into data, so they are valid only as long as data is.
+ *
+ * @param[in] name Name of the schema, used as the prefix for the generated struct and functions.
+ * @param[in] FIELDS X-macro listing the fields, as FIELDS(SCALAR, BYTES). See above.
+ */
+#define ESP_RMAKER_CMD_SCHEMA_DEFINE(name, FIELDS) \
+    typedef struct { \
+        FIELDS(ESP_RMAKER_CMD_SCHEMA_MEMBER_SCALAR, ESP_RMAKER_CMD_SCHEMA_MEMBER_BYTES) \
+    } name##_t; \
+    \
+    static inline __attribute__((unused)) size_t name##_encoded_size(const name##_t *s) \
+    { \
+        size_t len = 0; \
+        (void)s; \
+        FIELDS(ESP_RMAKER_CMD_SCHEMA_SIZE_SCALAR, ESP_RMAKER_CMD_SCHEMA_SIZE_BYTES) \
+        return len; \
+    } \
+    \
+    static inline __attribute__((unused)) esp_err_t name##_encode(const name##_t *s, void *buf, \
+                                                                  size_t buf_size, size_t *out_len) \
+    { \
+        if (!s || !out_len) { \
+            return ESP_ERR_INVALID_ARG; \
+        } \
+        *out_len = name##_encoded_size(s); \
+        if (!buf || buf_size < *out_len) { \
+            return ESP_ERR_INVALID_SIZE; \
+        } \
+        uint8_t *p = (uint8_t *)buf; \
+        FIELDS(ESP_RMAKER_CMD_SCHEMA_ENCODE_SCALAR, ESP_RMAKER_CMD_SCHEMA_ENCODE_BYTES) \
+        (void)p; \
+        return ESP_OK; \
+    } \
+    \
+    static inline __attribute__((unused)) esp_err_t name##_decode(const void *data, size_t data_len, name##_t *s) \
+    { \
+        if (!s || (!data && data_len)) { \
+            return ESP_ERR_INVALID_ARG; \
+        } \
+        memset(s, 0, sizeof(*s)); \
+        const uint8_t *p = (const uint8_t *)data; \
+        size_t offset = 0; \
+        while (offset < data_len) { \
+            if (data_len - offset < 2 || data_len - offset - 2 < p[offset + 1]) { \
+                return ESP_ERR_INVALID_SIZE; \
+            } \
+            uint8_t tag = p[offset]; \
+            size_t len = p[offset + 1]; \
+            const uint8_t *value = &p[offset + 2]; \
+            offset += 2 + len; \
+            switch (tag) { \
+            FIELDS(ESP_RMAKER_CMD_SCHEMA_DECODE_SCALAR, ESP_RMAKER_CMD_SCHEMA_DECODE_BYTES) \
+            default: \
+                /* Unknown field, possibly from a newer peer */ \
+                (void)value; \
+                break; \
+            } \
+        } \
+        return ESP_OK; \
+    }
+
+/** Define a command handler for a pair of schemas
+ *
+ * Generates a static esp_rmaker_cmd_handler_t named handler, which decodes the command data as
+ * req_name_t, calls
+ *
+ *     esp_err_t impl(const req_name_t *req, resp_name_t *resp, esp_rmaker_cmd_ctx_t *ctx, void *priv)
+ *
+ * with a zeroed response, and encodes the response on ESP_OK. Invalid data fails the command
+ * without calling impl. Any error (or ESP_ERR_NOT_FINISHED, for deferred responses) from impl is
+ * returned as is.
+ *
+ * The response is encoded directly into the command response, using esp_rmaker_cmd_respond_encoded(),
+ * so nothing is allocated for it. free_on_return is not used, and the handler should be registered
+ * without ESP_RMAKER_CMD_FLAG_DATA_VIEW.
+ *
+ * @param[in] handler Name of the generated handler.
+ * @param[in] req_name Request schema name.
+ * @param[in] resp_name Response schema name.
+ * @param[in] impl Function implementing the command.
+ */
+#define ESP_RMAKER_CMD_SCHEMA_HANDLER(handler, req_name, resp_name, impl) \
+    static esp_err_t handler##_encode(const void *arg, void *buf, size_t buf_size, size_t *out_len) \
+    { \
+        return resp_name##_encode((const resp_name##_t *)arg, buf, buf_size, out_len); \
+    } \
+    \
+    static esp_err_t handler(const void *in_data, size_t in_len, void **out_data, size_t *out_len, \
+                             esp_rmaker_cmd_ctx_t *ctx, void *priv) \
+    { \
+        req_name##_t req; \
+        resp_name##_t resp; \
+        esp_err_t err = req_name##_decode(in_data, in_len, &req); \
+        if (err != ESP_OK) { \
+            return err; \
+        } \
+        memset(&resp, 0, sizeof(resp)); \
+        err = impl(&req, &resp, ctx, priv); \
+        if (err != ESP_OK) { \
+            return err; \
+        } \
+        size_t len = resp_name##_encoded_size(&resp); \
+        if (len == 0) { \
+            return ESP_OK; \
+        } \
+        return esp_rmaker_cmd_respond_encoded(ctx, len, handler##_encode, &resp); \
+    }
+
+#ifdef __cplusplus
+}
+#endif
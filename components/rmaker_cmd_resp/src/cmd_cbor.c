@@ -0,0 +1,598 @@
+/*
+ * SPDX-FileCopyrightText: 2026 Espressif Systems (Shanghai) CO LTD
+ *
+ * SPDX-License-Identifier: Apache-2.0
+ */
+
+#include <string.h>
+#include <math.h>
+#include <esp_rmaker_cmd_cbor.h>
+
+/* CBOR major types */
+#define CBOR_MAJOR_UINT     0
+#define CBOR_MAJOR_NEGINT   1
+#define CBOR_MAJOR_BYTES    2
+#define CBOR_MAJOR_TEXT     3
+#define CBOR_MAJOR_ARRAY    4
+#define CBOR_MAJOR_MAP      5
+#define CBOR_MAJOR_TAG      6
+#define CBOR_MAJOR_SIMPLE   7
+
+/* Additional information values */
+#define CBOR_AI_1BYTE       24
+#define CBOR_AI_8BYTES      27
+#define CBOR_AI_INDEFINITE  31
+
+/* Simple values */
+#define CBOR_FALSE          20
+#define CBOR_TRUE           21
+#define CBOR_NULL           22
+#define CBOR_HALF           25
+#define CBOR_SINGLE         26
+#define CBOR_DOUBLE         27
+
+/* Move to the next record, if the current one has been read completely */
+static void cbor_reader_fill(esp_rmaker_cmd_cbor_reader_t *reader)
+{
+    while (reader->seg_len == 0 && reader->remaining > 0) {
+        const void *segment;
+        if (!esp_rmaker_cmd_data_view_iter_next(&reader->iter, &segment, &reader->seg_len)) {
+            /* The view claims more data than the records have */
+            reader->remaining = 0;
+            return;
+        }
+        reader->seg = segment;
+    }
+}
+
+/* Copy (if buf is not NULL) and consume len bytes, which may span records */
+static esp_err_t cbor_reader_take(esp_rmaker_cmd_cbor_reader_t *reader, void *buf, size_t len)
+{
+    if (len > reader->remaining) {
+        return ESP_ERR_INVALID_SIZE;
+    }
+    uint8_t *out = buf;
+    while (len > 0) {
+        cbor_reader_fill(reader);
+        if (reader->seg_len == 0) {
+            return ESP_ERR_INVALID_SIZE;
+        }
+        size_t chunk = (len < reader->seg_len) ? len : reader->seg_len;
+        if (out) {
+            memcpy(out, reader->seg, chunk);
+            out += chunk;
+        }
+        reader->seg += chunk;
+        reader->seg_len -= chunk;
+        reader->remaining -= chunk;
+        len -= chunk;
+    }
+    return ESP_OK;
+}
+
+/* Read the initial byte and the argument of an item */
+static esp_err_t cbor_reader_head(esp_rmaker_cmd_cbor_reader_t *reader, uint8_t *major, uint8_t *ai, uint64_t *arg)
+{
+    uint8_t initial;
+    esp_err_t err = cbor_reader_take(reader, &initial, 1);
+    if (err != ESP_OK) {
+        return err;
+    }
+    *major = initial >> 5;
+    *ai = initial & 0x1f;
+    if (*ai < CBOR_AI_1BYTE) {
+        *arg = *ai;
+        return ESP_OK;
+    }
+    if (*ai == CBOR_AI_INDEFINITE) {
+        return ESP_ERR_NOT_SUPPORTED;
+    }
+    if (*ai > CBOR_AI_8BYTES) {
+        return ESP_ERR_INVALID_ARG;
+    }
+    uint8_t bytes[8];
+    size_t n = 1 << (*ai - CBOR_AI_1BYTE);
+    err = cbor_reader_take(reader, bytes, n);
+    if (err != ESP_OK) {
+        return err;
+    }
+    *arg = 0;
+    for (size_t i = 0; i < n; i++) {
+        *arg = (*arg << 8) | bytes[i];
+    }
+    return ESP_OK;
+}
+
+/* Read the head of an item of the given major type. The reader is restored on failure. */
+static esp_err_t cbor_reader_expect(esp_rmaker_cmd_cbor_reader_t *reader, uint8_t expected, uint8_t *ai, uint64_t *arg)
+{
+    esp_rmaker_cmd_cbor_reader_t saved = *reader;
+    uint8_t major;
+    uint8_t info;
+    esp_err_t err = cbor_reader_head(reader, &major, &info, arg);
+    if ((err == ESP_OK) && (major != expected)) {
+        err = ESP_ERR_INVALID_STATE;
+    }
+    if (err != ESP_OK) {
+        *reader = saved;
+        return err;
+    }
+    if (ai) {
+        *ai = info;
+    }
+    return ESP_OK;
+}
+
+esp_err_t esp_rmaker_cmd_cbor_reader_init(esp_rmaker_cmd_cbor_reader_t *reader, const esp_rmaker_cmd_data_view_t *view)
+{
+    if (!reader || !view) {
+        return ESP_ERR_INVALID_ARG;
+    }
+    memset(reader, 0, sizeof(*reader));
+    esp_rmaker_cmd_data_view_iter_init(view, &reader->iter);
+    reader->remaining = view->len;
+    return ESP_OK;
+}
+
+esp_err_t esp_rmaker_cmd_cbor_reader_init_buf(esp_rmaker_cmd_cbor_reader_t *reader, const void *data, size_t len)
+{
+    if (!reader || (!data && len)) {
+        return ESP_ERR_INVALID_ARG;
+    }
+    memset(reader, 0, sizeof(*reader));
+    reader->seg = data;
+    reader->seg_len = len;
+    reader->remaining = len;
+    return ESP_OK;
+}
+
+bool esp_rmaker_cmd_cbor_reader_at_end(const esp_rmaker_cmd_cbor_reader_t *reader)
+{
+    return !reader || (reader->remaining == 0);
+}
+
+esp_err_t esp_rmaker_cmd_cbor_peek_type(const esp_rmaker_cmd_cbor_reader_t *reader, esp_rmaker_cmd_cbor_type_t *type)
+{
+    if (!reader || !type) {
+        return ESP_ERR_INVALID_ARG;
+    }
+    esp_rmaker_cmd_cbor_reader_t copy = *reader;
+    cbor_reader_fill(&copy);
+    if (copy.seg_len == 0) {
+        return ESP_ERR_INVALID_SIZE;
+    }
+    uint8_t major = copy.seg[0] >> 5;
+    uint8_t ai = copy.seg[0] & 0x1f;
+    switch (major) {
+    case CBOR_MAJOR_UINT:
+    case CBOR_MAJOR_NEGINT:
+        *type = ESP_RMAKER_CMD_CBOR_TYPE_INT;
+        break;
+    case CBOR_MAJOR_BYTES:
+        *type = ESP_RMAKER_CMD_CBOR_TYPE_BYTES;
+        break;
+    case CBOR_MAJOR_TEXT:
+        *type = ESP_RMAKER_CMD_CBOR_TYPE_TEXT;
+        break;
+    case CBOR_MAJOR_ARRAY:
+        *type = ESP_RMAKER_CMD_CBOR_TYPE_ARRAY;
+        break;
+    case CBOR_MAJOR_MAP:
+        *type = ESP_RMAKER_CMD_CBOR_TYPE_MAP;
+        break;
+    case CBOR_MAJOR_TAG:
+        *type = ESP_RMAKER_CMD_CBOR_TYPE_TAG;
+        break;
+    default:
+        if (ai == CBOR_FALSE || ai == CBOR_TRUE) {
+            *type = ESP_RMAKER_CMD_CBOR_TYPE_BOOL;
+        } else if (ai == CBOR_NULL) {
+            *type = ESP_RMAKER_CMD_CBOR_TYPE_NULL;
+        } else if (ai >= CBOR_HALF && ai <= CBOR_DOUBLE) {
+            *type = ESP_RMAKER_CMD_CBOR_TYPE_FLOAT;
+        } else {
+            *type = ESP_RMAKER_CMD_CBOR_TYPE_OTHER;
+        }
+        break;
+    }
+    return ESP_OK;
+}
+
+esp_err_t esp_rmaker_cmd_cbor_read_uint(esp_rmaker_cmd_cbor_reader_t *reader, uint64_t *value)
+{
+    if (!reader || !value) {
+        return ESP_ERR_INVALID_ARG;
+    }
+    return cbor_reader_expect(reader, CBOR_MAJOR_UINT, NULL, value);
+}
+
+esp_err_t esp_rmaker_cmd_cbor_read_int(esp_rmaker_cmd_cbor_reader_t *reader, int64_t *value)
+{
+    if (!reader || !value) {
+        return ESP_ERR_INVALID_ARG;
+    }
+    esp_rmaker_cmd_cbor_reader_t saved = *reader;
+    uint8_t major;
+    uint8_t ai;
+    uint64_t arg;
+    esp_err_t err = cbor_reader_head(reader, &major, &ai, &arg);
+    if ((err == ESP_OK) && (major != CBOR_MAJOR_UINT) && (major != CBOR_MAJOR_NEGINT)) {
+        err = ESP_ERR_INVALID_STATE;
+    }
+    if ((err == ESP_OK) && (arg > INT64_MAX)) {
+        err = ESP_ERR_INVALID_SIZE;
+    }
+    if (err != ESP_OK) {
+        *reader = saved;
+        return err;
+    }
+    *value = (major == CBOR_MAJOR_UINT) ? (int64_t)arg : -1 - (int64_t)arg;
+    return ESP_OK;
+}
+
+esp_err_t esp_rmaker_cmd_cbor_read_bool(esp_rmaker_cmd_cbor_reader_t *reader, bool *value)
+{
+    if (!reader || !value) {
+        return ESP_ERR_INVALID_ARG;
+    }
+    esp_rmaker_cmd_cbor_reader_t saved = *reader;
+    uint8_t ai;
+    uint64_t arg;
+    esp_err_t err = cbor_reader_expect(reader, CBOR_MAJOR_SIMPLE, &ai, &arg);
+    if (err != ESP_OK) {
+        return err;
+    }
+    if (ai != CBOR_FALSE && ai != CBOR_TRUE) {
+        *reader = saved;
+        return ESP_ERR_INVALID_STATE;
+    }
+    *value = (ai == CBOR_TRUE);
+    return ESP_OK;
+}
+
+esp_err_t esp_rmaker_cmd_cbor_read_null(esp_rmaker_cmd_cbor_reader_t *reader)
+{
+    if (!reader) {
+        return ESP_ERR_INVALID_ARG;
+    }
+    esp_rmaker_cmd_cbor_reader_t saved = *reader;
+    uint8_t ai;
+    uint64_t arg;
+    esp_err_t err = cbor_reader_expect(reader, CBOR_MAJOR_SIMPLE, &ai, &arg);
+    if (err != ESP_OK) {
+        return err;
+    }
+    if (ai != CBOR_NULL) {
+        *reader = saved;
+        return ESP_ERR_INVALID_STATE;
+    }
+    return ESP_OK;
+}
+
+static double cbor_half_to_double(uint16_t half)
+{
+    int exp = (half >> 10) & 0x1f;
+    int mant = half & 0x3ff;
+    double value;
+    if (exp == 0) {
+        value = ldexp(mant, -24);
+    } else if (exp != 31) {
+        value = ldexp(mant + 1024, exp - 25);
+    } else {
+        value = (mant == 0) ? INFINITY : NAN;
+    }
+    return (half & 0x8000) ? -value : value;
+}
+
+esp_err_t esp_rmaker_cmd_cbor_read_double(esp_rmaker_cmd_cbor_reader_t *reader, double *value)
+{
+    if (!reader || !value) {
+        return ESP_ERR_INVALID_ARG;
+    }
+    esp_rmaker_cmd_cbor_type_t type;
+    esp_err_t err = esp_rmaker_cmd_cbor_peek_type(reader, &type);
+    if (err != ESP_OK) {
+        return err;
+    }
+    if (type == ESP_RMAKER_CMD_CBOR_TYPE_INT) {
+        int64_t int_value;
+        err = esp_rmaker_cmd_cbor_read_int(reader, &int_value);
+        if (err == ESP_OK) {
+            *value = (double)int_value;
+        }
+        return err;
+    }
+    if (type != ESP_RMAKER_CMD_CBOR_TYPE_FLOAT) {
+        return ESP_ERR_INVALID_STATE;
+    }
+    uint8_t ai;
+    uint64_t arg;
+    err = cbor_reader_expect(reader, CBOR_MAJOR_SIMPLE, &ai, &arg);
+    if (err != ESP_OK) {
+        return err;
+    }
+    if (ai == CBOR_HALF) {
+        *value = cbor_half_to_double((uint16_t)arg);
+    } else if (ai == CBOR_SINGLE) {
+        uint32_t bits = (uint32_t)arg;
+        float f;
+        memcpy(&f, &bits, sizeof(f));
+        *value = f;
+    } else {
+        memcpy(value, &arg, sizeof(*value));
+    }
+    return ESP_OK;
+}
+
+esp_err_t esp_rmaker_cmd_cbor_read_tag(esp_rmaker_cmd_cbor_reader_t *reader, uint64_t *tag)
+{
+    if (!reader || !tag) {
+        return ESP_ERR_INVALID_ARG;
+    }
+    return cbor_reader_expect(reader, CBOR_MAJOR_TAG, NULL, tag);
+}
+
+/* Read the head of an array or a map. Each entry takes at least a byte, which bounds the count. */
+static esp_err_t cbor_read_container(esp_rmaker_cmd_cbor_reader_t *reader, uint8_t major, size_t *count)
+{
+    if (!reader || !count) {
+        return ESP_ERR_INVALID_ARG;
+    }
+    esp_rmaker_cmd_cbor_reader_t saved = *reader;
+    uint64_t arg;
+    esp_err_t err = cbor_reader_expect(reader, major, NULL, &arg);
+    if (err != ESP_OK) {
+        return err;
+    }
+    if (arg > reader->remaining) {
+        *reader = saved;
+        return ESP_ERR_INVALID_SIZE;
+    }
+    *count = (size_t)arg;
+    return ESP_OK;
+}
+
+esp_err_t esp_rmaker_cmd_cbor_read_array(esp_rmaker_cmd_cbor_reader_t *reader, size_t *count)
+{
+    return cbor_read_container(reader, CBOR_MAJOR_ARRAY, count);
+}
+
+esp_err_t esp_rmaker_cmd_cbor_read_map(esp_rmaker_cmd_cbor_reader_t *reader, size_t *count)
+{
+    return cbor_read_container(reader, CBOR_MAJOR_MAP, count);
+}
+
+esp_err_t esp_rmaker_cmd_cbor_read_string(esp_rmaker_cmd_cbor_reader_t *reader, const void **value, size_t *len,
+                                          void *buf, size_t buf_size)
+{
+    if (!reader || !value || !len) {
+        return ESP_ERR_INVALID_ARG;
+    }
+    esp_rmaker_cmd_cbor_reader_t saved = *reader;
+    uint8_t major;
+    uint8_t ai;
+    uint64_t arg;
+    esp_err_t err = cbor_reader_head(reader, &major, &ai, &arg);
+    if ((err == ESP_OK) && (major != CBOR_MAJOR_BYTES) && (major != CBOR_MAJOR_TEXT)) {
+        err = ESP_ERR_INVALID_STATE;
+    }
+    if ((err == ESP_OK) && (arg > reader->remaining)) {
+        err = ESP_ERR_INVALID_SIZE;
+    }
+    if (err != ESP_OK) {
+        *reader = saved;
+        return err;
+    }
+    *len = (size_t)arg;
+    cbor_reader_fill(reader);
+    if (*len <= reader->seg_len) {
+        /* Within the current record, so no copy needed */
+        *value = reader->seg;
+        return cbor_reader_take(reader, NULL, *len);
+    }
+    if (!buf || (buf_size < *len)) {
+        *reader = saved;
+        return ESP_ERR_INVALID_SIZE;
+    }
+    err = cbor_reader_take(reader, buf, *len);
+    if (err != ESP_OK) {
+        *reader = saved;
+        return err;
+    }
+    *value = buf;
+    return ESP_OK;
+}
+
+esp_err_t esp_rmaker_cmd_cbor_skip(esp_rmaker_cmd_cbor_reader_t *reader)
+{
+    if (!reader) {
+        return ESP_ERR_INVALID_ARG;
+    }
+    esp_rmaker_cmd_cbor_reader_t saved = *reader;
+    /* Items left to skip. Nested items are counted instead of recursing, and since each takes at
+     * least a byte, this cannot exceed the data remaining. */
+    size_t pending = 1;
+    esp_err_t err = ESP_OK;
+    while (pending > 0 && err == ESP_OK) {
+        uint8_t major;
+        uint8_t ai;
+        uint64_t arg;
+        pending--;
+        err = cbor_reader_head(reader, &major, &ai, &arg);
+        if (err != ESP_OK) {
+            break;
+        }
+        switch (major) {
+        case CBOR_MAJOR_BYTES:
+        case CBOR_MAJOR_TEXT:
+            err = (arg > reader->remaining) ? ESP_ERR_INVALID_SIZE : cbor_reader_take(reader, NULL, (size_t)arg);
+            break;
+        case CBOR_MAJOR_ARRAY:
+        case CBOR_MAJOR_MAP:
+            if (arg > reader->remaining / ((major == CBOR_MAJOR_MAP) ? 2 : 1)) {
+                err = ESP_ERR_INVALID_SIZE;
+            } else {
+                pending += (size_t)arg * ((major == CBOR_MAJOR_MAP) ? 2 : 1);
+            }
+            break;
+        case CBOR_MAJOR_TAG:
+            pending++;
+            break;
+        default:
+            break;
+        }
+    }
+    if (err != ESP_OK) {
+        *reader = saved;
+    }
+    return err;
+}
+
+void esp_rmaker_cmd_cbor_writer_init(esp_rmaker_cmd_cbor_writer_t *writer, void *buf, size_t size)
+{
+    if (!writer) {
+        return;
+    }
+    writer->buf = buf;
+    writer->size = buf ? size : 0;
+    writer->len = 0;
+}
+
+static esp_err_t cbor_writer_put(esp_rmaker_cmd_cbor_writer_t *writer, const void *data, size_t len)
+{
+    if (writer->len <= writer->size && len <= (writer->size - writer->len)) {
+        if (len) {
+            memcpy(writer->buf + writer->len, data, len);
+        }
+        writer->len += len;
+        return ESP_OK;
+    }
+    writer->len += len;
+    return ESP_ERR_INVALID_SIZE;
+}
+
+/* Write the head of an item, with the shortest encoding of the argument */
+static esp_err_t cbor_writer_head(esp_rmaker_cmd_cbor_writer_t *writer, uint8_t major, uint64_t arg)
+{
+    if (!writer) {
+        return ESP_ERR_INVALID_ARG;
+    }
+    uint8_t head[9];
+    size_t n;
+    if (arg < CBOR_AI_1BYTE) {
+        head[0] = (major << 5) | (uint8_t)arg;
+        n = 0;
+    } else if (arg <= UINT8_MAX) {
+        head[0] = (major << 5) | CBOR_AI_1BYTE;
+        n = 1;
+    } else if (arg <= UINT16_MAX) {
+        head[0] = (major << 5) | (CBOR_AI_1BYTE + 1);
+        n = 2;
+    } else if (arg <= UINT32_MAX) {
+        head[0] = (major << 5) | (CBOR_AI_1BYTE + 2);
+        n = 4;
+    } else {
+        head[0] = (major << 5) | CBOR_AI_8BYTES;
+        n = 8;
+    }
+    for (size_t i = 0; i < n; i++) {
+        head[1 + i] = (uint8_t)(arg >> (8 * (n - 1 - i)));
+    }
+    return cbor_writer_put(writer, head, 1 + n);
+}
+
+esp_err_t esp_rmaker_cmd_cbor_write_uint(esp_rmaker_cmd_cbor_writer_t *writer, uint64_t value)
+{
+    return cbor_writer_head(writer, CBOR_MAJOR_UINT, value);
+}
+
+esp_err_t esp_rmaker_cmd_cbor_write_int(esp_rmaker_cmd_cbor_writer_t *writer, int64_t value)
+{
+    if (value < 0) {
+        /* -1 - value, without overflowing for INT64_MIN */
+        return cbor_writer_head(writer, CBOR_MAJOR_NEGINT, ~(uint64_t)value);
+    }
+    return cbor_writer_head(writer, CBOR_MAJOR_UINT, (uint64_t)value);
+}
+
+esp_err_t esp_rmaker_cmd_cbor_write_bool(esp_rmaker_cmd_cbor_writer_t *writer, bool value)
+{
+    return cbor_writer_head(writer, CBOR_MAJOR_SIMPLE, value ? CBOR_TRUE : CBOR_FALSE);
+}
+
+esp_err_t esp_rmaker_cmd_cbor_write_null(esp_rmaker_cmd_cbor_writer_t *writer)
+{
+    return cbor_writer_head(writer, CBOR_MAJOR_SIMPLE, CBOR_NULL);
+}
+
+esp_err_t esp_rmaker_cmd_cbor_write_double(esp_rmaker_cmd_cbor_writer_t *writer, double value)
+{
+    if (!writer) {
+        return ESP_ERR_INVALID_ARG;
+    }
+    uint8_t buf[9];
+    size_t n;
+    float f = (float)value;
+    if ((double)f == value || isnan(value)) {
+        uint32_t bits;
+        memcpy(&bits, &f, sizeof(bits));
+        buf[0] = (CBOR_MAJOR_SIMPLE << 5) | CBOR_SINGLE;
+        n = 4;
+        for (size_t i = 0; i < n; i++) {
+            buf[1 + i] = (uint8_t)(bits >> (8 * (n - 1 - i)));
+        }
+    } else {
+        uint64_t bits;
+        memcpy(&bits, &value, sizeof(bits));
+        buf[0] = (CBOR_MAJOR_SIMPLE << 5) | CBOR_DOUBLE;
+        n = 8;
+        for (size_t i = 0; i < n; i++) {
+            buf[1 + i] = (uint8_t)(bits >> (8 * (n - 1 - i)));
+        }
+    }
+    return cbor_writer_put(writer, buf, 1 + n);
+}
+
+esp_err_t esp_rmaker_cmd_cbor_write_tag(esp_rmaker_cmd_cbor_writer_t *writer, uint64_t tag)
+{
+    return cbor_writer_head(writer, CBOR_MAJOR_TAG, tag);
+}
+
+esp_err_t esp_rmaker_cmd_cbor_write_text(esp_rmaker_cmd_cbor_writer_t *writer, const char *text, size_t len)
+{
+    if (!text && len) {
+        return ESP_ERR_INVALID_ARG;
+    }
+    esp_err_t err = cbor_writer_head(writer, CBOR_MAJOR_TEXT, len);
+    esp_err_t put_err = writer ? cbor_writer_put(writer, text, len) : ESP_ERR_INVALID_ARG;
+    return (err != ESP_OK) ? err : put_err;
+}
+
+esp_err_t esp_rmaker_cmd_cbor_write_bytes(esp_rmaker_cmd_cbor_writer_t *writer, const void *data, size_t len)
+{
+    if (!data && len) {
+        return ESP_ERR_INVALID_ARG;
+    }
+    esp_err_t err = cbor_writer_head(writer, CBOR_MAJOR_BYTES, len);
+    esp_err_t put_err = writer ? cbor_writer_put(writer, data, len) : ESP_ERR_INVALID_ARG;
+    return (err != ESP_OK) ? err : put_err;
+}
+
+esp_err_t esp_rmaker_cmd_cbor_write_array(esp_rmaker_cmd_cbor_writer_t *writer, size_t count)
+{
+    return cbor_writer_head(writer, CBOR_MAJOR_ARRAY, count);
+}
+
+esp_err_t esp_rmaker_cmd_cbor_write_map(esp_rmaker_cmd_cbor_writer_t *writer, size_t count)
+{
+    return cbor_writer_head(writer, CBOR_MAJOR_MAP, count);
+}
+
+esp_err_t esp_rmaker_cmd_cbor_writer_finish(const esp_rmaker_cmd_cbor_writer_t *writer, size_t *len)
+{
+    if (!writer || !len) {
+        return ESP_ERR_INVALID_ARG;
+    }
+    *len = writer->len;
+    return (writer->len <= writer->size) && writer->buf ? ESP_OK : ESP_ERR_INVALID_SIZE;
+}
@@ -0,0 +1,578 @@
+/*
+ * SPDX-FileCopyrightText: 2026 Espressif Systems (Shanghai) CO LTD
+ *
+ * SPDX-License-Identifier: Apache-2.0
+ */
+
+#include <sdkconfig.h>
+#include <string.h>
+#include <stdlib.h>
+#include <inttypes.h>
+#include <stdbool.h>
+#include <errno.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <sys/select.h>
+#include <netinet/in.h>
+#include <esp_log.h>
+#include <freertos/FreeRTOS.h>
+#include <freertos/semphr.h>
+#include <freertos/task.h>
+#include <esp_random.h>
+#include <mbedtls/md.h>
+#include <esp_rmaker_cmd_resp.h>
+#include <esp_rmaker_cmd_local.h>
+
+static const char *TAG = "esp_rmaker_common_cmd_local";
+
+#define RMAKER_LOCAL_MAX_FRAME      CONFIG_ESP_RMAKER_CMD_LOCAL_MAX_FRAME
+#define RMAKER_LOCAL_MAX_CLIENTS    CONFIG_ESP_RMAKER_CMD_LOCAL_MAX_CLIENTS
+#define RMAKER_LOCAL_TASK_STACK     CONFIG_ESP_RMAKER_CMD_LOCAL_TASK_STACK
+#define RMAKER_LOCAL_TASK_PRIORITY  CONFIG_ESP_RMAKER_CMD_LOCAL_TASK_PRIORITY
+
+/* Length prefix of the frames over TCP */
+#define LOCAL_LEN_PREFIX    2
+/* Sequence numbers accepted out of order, behind the highest one seen */
+#define LOCAL_SEQ_WINDOW    64
+/* How often the task checks if it should stop */
+#define LOCAL_POLL_MS       100
+/* Time for which a TCP client may block a response, before it is disconnected */
+#define LOCAL_SEND_TIMEOUT_MS   1000
+
+typedef struct {
+    /* -1 if the slot is free */
+    int fd;
+    /* Bytes received, but not handled yet */
+    size_t len;
+    uint8_t *buf;
+} esp_rmaker_cmd_local_client_t;
+
+typedef struct {
+    esp_rmaker_cmd_local_config_t config;
+    int fd;
+    uint16_t port;
+    volatile bool running;
+    /* Given by the task when it exits */
+    SemaphoreHandle_t done;
+    /* Protects the keys, the nonce and the sequence window */
+    SemaphoreHandle_t lock;
+    /* Chosen afresh for every key, and given to the clients in HELLO frames */
+    uint8_t nonce[ESP_RMAKER_CMD_LOCAL_NONCE_LEN];
+    /* Derived from the key and the nonce, for the requests and their responses */
+    uint8_t session_key[ESP_RMAKER_CMD_LOCAL_KEY_LEN];
+    uint32_t last_seq;
+    uint64_t seq_window;
+    /* Frames received over UDP */
+    uint8_t *rx;
+    /* Response frames, after room for the TCP length prefix */
+    uint8_t *tx;
+    esp_rmaker_cmd_local_client_t clients[RMAKER_LOCAL_MAX_CLIENTS];
+} esp_rmaker_cmd_local_t;
+
+static esp_rmaker_cmd_local_t *s_local;
+/* Protects s_local. Created at the first start. */
+static SemaphoreHandle_t s_lock;
+
+static esp_err_t esp_rmaker_cmd_local_hmac(const uint8_t *key, const uint8_t *data, size_t len,
+                                           uint8_t tag[ESP_RMAKER_CMD_LOCAL_TAG_LEN])
+{
+    uint8_t hmac[32];
+    const mbedtls_md_info_t *md_info = mbedtls_md_info_from_type(MBEDTLS_MD_SHA256);
+    if (!md_info || mbedtls_md_hmac(md_info, key, ESP_RMAKER_CMD_LOCAL_KEY_LEN, data, len, hmac) != 0) {
+        return ESP_FAIL;
+    }
+    memcpy(tag, hmac, ESP_RMAKER_CMD_LOCAL_TAG_LEN);
+    return ESP_OK;
+}
+
+esp_err_t esp_rmaker_cmd_local_session_key(const uint8_t *key, const uint8_t *nonce, uint8_t *session_key)
+{
+    if (!key || !nonce || !session_key) {
+        return ESP_ERR_INVALID_ARG;
+    }
+    const mbedtls_md_info_t *md_info = mbedtls_md_info_from_type(MBEDTLS_MD_SHA256);
+    if (!md_info || mbedtls_md_hmac(md_info, key, ESP_RMAKER_CMD_LOCAL_KEY_LEN, nonce, ESP_RMAKER_CMD_LOCAL_NONCE_LEN,
+                                    session_key) != 0) {
+        return ESP_FAIL;
+    }
+    return ESP_OK;
+}
+
+/* Start a session with a key and a fresh nonce, so that the sequence numbers can start afresh without
+ * accepting frames from the earlier sessions, even with the same key. Once the task is running, this
+ * should be called with local->lock held.
+ */
+static esp_err_t esp_rmaker_cmd_local_new_session(esp_rmaker_cmd_local_t *local, const uint8_t *key)
+{
+    uint8_t nonce[ESP_RMAKER_CMD_LOCAL_NONCE_LEN];
+    uint8_t session_key[ESP_RMAKER_CMD_LOCAL_KEY_LEN];
+    esp_fill_random(nonce, sizeof(nonce));
+    if (esp_rmaker_cmd_local_session_key(key, nonce, session_key) != ESP_OK) {
+        ESP_LOGE(TAG, "Failed to derive the session key.");
+        return ESP_FAIL;
+    }
+    memcpy(local->config.key, key, ESP_RMAKER_CMD_LOCAL_KEY_LEN);
+    memcpy(local->nonce, nonce, sizeof(local->nonce));
+    memcpy(local->session_key, session_key, sizeof(local->session_key));
+    local->last_seq = 0;
+    local->seq_window = 0;
+    return ESP_OK;
+}
+
+esp_err_t esp_rmaker_cmd_local_frame_encode(const uint8_t *key, uint8_t type, uint32_t seq,
+                                            const void *payload, size_t payload_len,
+                                            void *frame, size_t frame_size, size_t *frame_len)
+{
+    if (!key || !frame || !frame_len || (payload_len && !payload)) {
+        return ESP_ERR_INVALID_ARG;
+    }
+    if (frame_size < payload_len + ESP_RMAKER_CMD_LOCAL_OVERHEAD) {
+        return ESP_ERR_INVALID_SIZE;
+    }
+    uint8_t *buf = frame;
+    /* The payload may already be in place */
+    if (payload_len) {
+        memmove(buf + ESP_RMAKER_CMD_LOCAL_HEADER_LEN, payload, payload_len);
+    }
+    buf[0] = ESP_RMAKER_CMD_LOCAL_VERSION;
+    buf[1] = type;
+    buf[2] = 0;
+    buf[3] = 0;
+    buf[4] = seq & 0xff;
+    buf[5] = (seq >> 8) & 0xff;
+    buf[6] = (seq >> 16) & 0xff;
+    buf[7] = (seq >> 24) & 0xff;
+    size_t len = ESP_RMAKER_CMD_LOCAL_HEADER_LEN + payload_len;
+    esp_err_t err = esp_rmaker_cmd_local_hmac(key, buf, len, buf + len);
+    if (err == ESP_OK) {
+        *frame_len = len + ESP_RMAKER_CMD_LOCAL_TAG_LEN;
+    }
+    return err;
+}
+
+esp_err_t esp_rmaker_cmd_local_frame_decode(const uint8_t *key, const void *frame, size_t frame_len,
+                                            uint8_t *type, uint32_t *seq, const void **payload, size_t *payload_len)
+{
+    if (!key || !frame || !type || !seq || !payload || !payload_len) {
+        return ESP_ERR_INVALID_ARG;
+    }
+    if (frame_len < ESP_RMAKER_CMD_LOCAL_OVERHEAD) {
+        return ESP_ERR_INVALID_SIZE;
+    }
+    const uint8_t *buf = frame;
+    if (buf[0] != ESP_RMAKER_CMD_LOCAL_VERSION) {
+        return ESP_ERR_NOT_SUPPORTED;
+    }
+    size_t len = frame_len - ESP_RMAKER_CMD_LOCAL_TAG_LEN;
+    uint8_t tag[ESP_RMAKER_CMD_LOCAL_TAG_LEN];
+    if (esp_rmaker_cmd_local_hmac(key, buf, len, tag) != ESP_OK) {
+        return ESP_FAIL;
+    }
+    /* Compare in constant time, so that the tag cannot be guessed byte by byte */
+    uint8_t diff = 0;
+    for (int i = 0; i < ESP_RMAKER_CMD_LOCAL_TAG_LEN; i++) {
+        diff |= tag[i] ^ buf[len + i];
+    }
+    if (diff) {
+        return ESP_ERR_INVALID_CRC;
+    }
+    *type = buf[1];
+    *seq = (uint32_t)buf[4] | ((uint32_t)buf[5] << 8) | ((uint32_t)buf[6] << 16) | ((uint32_t)buf[7] << 24);
+    *payload = buf + ESP_RMAKER_CMD_LOCAL_HEADER_LEN;
+    *payload_len = len - ESP_RMAKER_CMD_LOCAL_HEADER_LEN;
+    return ESP_OK;
+}
+
+/* Accept a sequence number if it is new, and within the window behind the highest one seen */
+static bool esp_rmaker_cmd_local_seq_accept(esp_rmaker_cmd_local_t *local, uint32_t seq)
+{
+    if (seq > local->last_seq) {
+        uint32_t shift = seq - local->last_seq;
+        local->seq_window = (shift < LOCAL_SEQ_WINDOW) ? (local->seq_window << shift) : 0;
+        local->seq_window |= 1;
+        local->last_seq = seq;
+        return true;
+    }
+    uint32_t age = local->last_seq - seq;
+    if ((age >= LOCAL_SEQ_WINDOW) || (local->seq_window & (1ULL << age))) {
+        return false;
+    }
+    local->seq_window |= (1ULL << age);
+    return true;
+}
+
+/* Authenticate a request and handle the commands in it, or give the nonce for a HELLO. Returns the
+ * length of the response frame built in local->tx, or 0 if there is nothing to send back.
+ */
+static size_t esp_rmaker_cmd_local_handle(esp_rmaker_cmd_local_t *local, const uint8_t *frame, size_t frame_len)
+{
+    uint8_t type;
+    uint32_t seq;
+    const void *payload;
+    size_t payload_len;
+    uint8_t key[ESP_RMAKER_CMD_LOCAL_KEY_LEN];
+    uint8_t nonce[ESP_RMAKER_CMD_LOCAL_NONCE_LEN];
+    /* The type is authenticated along with the rest, so it can pick the key */
+    bool hello = (frame_len > 1) && (frame[1] == ESP_RMAKER_CMD_LOCAL_FRAME_HELLO);
+
+    xSemaphoreTake(local->lock, portMAX_DELAY);
+    memcpy(key, hello ? local->config.key : local->session_key, sizeof(key));
+    memcpy(nonce, local->nonce, sizeof(nonce));
+    esp_err_t err = esp_rmaker_cmd_local_frame_decode(key, frame, frame_len, &type, &seq, &payload, &payload_len);
+    bool accepted = (err == ESP_OK) &&
+                    (hello || ((type == ESP_RMAKER_CMD_LOCAL_FRAME_REQUEST) && esp_rmaker_cmd_local_seq_accept(local, seq)));
+    xSemaphoreGive(local->lock);
+    if (!accepted) {
+        ESP_LOGD(TAG, "Dropping unauthenticated or replayed frame of length %d.", (int)frame_len);
+        return 0;
+    }
+
+    size_t resp_len = 0;
+    if (hello) {
+        /* Not checked for replays, since it only gives the nonce, which is not a secret */
+        if (esp_rmaker_cmd_local_frame_encode(key, ESP_RMAKER_CMD_LOCAL_FRAME_HELLO, seq, nonce, sizeof(nonce),
+                                              local->tx + LOCAL_LEN_PREFIX, RMAKER_LOCAL_MAX_FRAME, &resp_len) != ESP_OK) {
+            resp_len = 0;
+        }
+        return resp_len;
+    }
+
+    void *output = NULL;
+    size_t output_len = 0;
+    if (esp_rmaker_cmd_response_handler_with_role(payload, payload_len, local->config.user_role,
+                                                  &output, &output_len) != ESP_OK) {
+        ESP_LOGE(TAG, "Failed to handle command frame %" PRIu32 ".", seq);
+    }
+    if (output) {
+        if (esp_rmaker_cmd_local_frame_encode(key, ESP_RMAKER_CMD_LOCAL_FRAME_RESPONSE, seq, output, output_len,
+                                              local->tx + LOCAL_LEN_PREFIX, RMAKER_LOCAL_MAX_FRAME, &resp_len) != ESP_OK) {
+            ESP_LOGE(TAG, "Response of length %d for frame %" PRIu32 " does not fit in a frame.", (int)output_len, seq);
+            resp_len = 0;
+        }
+        free(output);
+    }
+    return resp_len;
+}
+
+static void esp_rmaker_cmd_local_handle_udp(esp_rmaker_cmd_local_t *local)
+{
+    struct sockaddr_storage src;
+    socklen_t src_len = sizeof(src);
+    int len = recvfrom(local->fd, local->rx, RMAKER_LOCAL_MAX_FRAME, 0, (struct sockaddr *)&src, &src_len);
+    if (len < 0) {
+        ESP_LOGE(TAG, "Failed to receive: errno %d.", errno);
+        return;
+    }
+    size_t resp_len = esp_rmaker_cmd_local_handle(local, local->rx, len);
+    if (resp_len && (sendto(local->fd, local->tx + LOCAL_LEN_PREFIX, resp_len, 0, (struct sockaddr *)&src, src_len) < 0)) {
+        ESP_LOGE(TAG, "Failed to send response: errno %d.", errno);
+    }
+}
+
+static void esp_rmaker_cmd_local_client_close(esp_rmaker_cmd_local_client_t *client)
+{
+    close(client->fd);
+    client->fd = -1;
+    free(client->buf);
+    client->buf = NULL;
+}
+
+static void esp_rmaker_cmd_local_accept(esp_rmaker_cmd_local_t *local)
+{
+    int fd = accept(local->fd, NULL, NULL);
+    if (fd < 0) {
+        ESP_LOGE(TAG, "Failed to accept connection: errno %d.", errno);
+        return;
+    }
+    for (int i = 0; i < RMAKER_LOCAL_MAX_CLIENTS; i++) {
+        esp_rmaker_cmd_local_client_t *client = &local->clients[i];
+        if (client->fd < 0) {
+            client->buf = malloc(LOCAL_LEN_PREFIX + RMAKER_LOCAL_MAX_FRAME);
+            if (!client->buf) {
+                break;
+            }
+            struct timeval timeout = {
+                .tv_sec = LOCAL_SEND_TIMEOUT_MS / 1000,
+                .tv_usec = (LOCAL_SEND_TIMEOUT_MS % 1000) * 1000,
+            };
+            setsockopt(fd, SOL_SOCKET, SO_SNDTIMEO, &timeout, sizeof(timeout));
+            client->fd = fd;
+            client->len = 0;
+            return;
+        }
+    }
+    ESP_LOGW(TAG, "No room for another client. Closing connection.");
+    close(fd);
+}
+
+static bool esp_rmaker_cmd_local_send_all(int fd, const uint8_t *data, size_t len)
+{
+    while (len) {
+        int sent = send(fd, data, len, 0);
+        if (sent <= 0) {
+            return false;
+        }
+        data += sent;
+        len -= sent;
+    }
+    return true;
+}
+
+/* Read from a TCP client and handle all the complete frames received */
+static void esp_rmaker_cmd_local_handle_tcp(esp_rmaker_cmd_local_t *local, esp_rmaker_cmd_local_client_t *client)
+{
+    int len = recv(client->fd, client->buf + client->len, LOCAL_LEN_PREFIX + RMAKER_LOCAL_MAX_FRAME - client->len, 0);
+    if (len <= 0) {
+        esp_rmaker_cmd_local_client_close(client);
+        return;
+    }
+    client->len += len;
+    size_t offset = 0;
+    while (client->len - offset >= LOCAL_LEN_PREFIX) {
+        size_t frame_len = client->buf[offset] | (client->buf[offset + 1] << 8);
+        if ((frame_len < ESP_RMAKER_CMD_LOCAL_OVERHEAD) || (frame_len > RMAKER_LOCAL_MAX_FRAME)) {
+            ESP_LOGW(TAG, "Invalid frame length %d. Closing connection.", (int)frame_len);
+            esp_rmaker_cmd_local_client_close(client);
+            return;
+        }
+        if (client->len - offset < LOCAL_LEN_PREFIX + frame_len) {
+            break;
+        }
+        size_t resp_len = esp_rmaker_cmd_local_handle(local, client->buf + offset + LOCAL_LEN_PREFIX, frame_len);
+        offset += LOCAL_LEN_PREFIX + frame_len;
+        if (resp_len) {
+            local->tx[0] = resp_len & 0xff;
+            local->tx[1] = resp_len >> 8;
+            if (!esp_rmaker_cmd_local_send_all(client->fd, local->tx, LOCAL_LEN_PREFIX + resp_len)) {
+                ESP_LOGW(TAG, "Failed to send response. Closing connection.");
+                esp_rmaker_cmd_local_client_close(client);
+                return;
+            }
+        }
+    }
+    /* Keep the partial frame, if any, for the next read */
+    client->len -= offset;
+    memmove(client->buf, client->buf + offset, client->len);
+}
+
+static void esp_rmaker_cmd_local_task(void *arg)
+{
+    esp_rmaker_cmd_local_t *local = arg;
+    bool tcp = (local->config.proto == ESP_RMAKER_CMD_LOCAL_TCP);
+    while (local->running) {
+        fd_set fds;
+        FD_ZERO(&fds);
+        FD_SET(local->fd, &fds);
+        int max_fd = local->fd;
+        for (int i = 0; i < RMAKER_LOCAL_MAX_CLIENTS; i++) {
+            if (local->clients[i].fd >= 0) {
+                FD_SET(local->clients[i].fd, &fds);
+                max_fd = (local->clients[i].fd > max_fd) ? local->clients[i].fd : max_fd;
+            }
+        }
+        struct timeval timeout = {
+            .tv_sec = 0,
+            .tv_usec = LOCAL_POLL_MS * 1000,
+        };
+        int ready = select(max_fd + 1, &fds, NULL, NULL, &timeout);
+        if (ready < 0) {
+            if (errno != EINTR) {
+                ESP_LOGE(TAG, "select() failed: errno %d.", errno);
+                vTaskDelay(pdMS_TO_TICKS(LOCAL_POLL_MS));
+            }
+            continue;
+        }
+        if (ready == 0) {
+            continue;
+        }
+        for (int i = 0; i < RMAKER_LOCAL_MAX_CLIENTS; i++) {
+            if ((local->clients[i].fd >= 0) && FD_ISSET(local->clients[i].fd, &fds)) {
+                esp_rmaker_cmd_local_handle_tcp(local, &local->clients[i]);
+            }
+        }
+        if (FD_ISSET(local->fd, &fds)) {
+            if (tcp) {
+                esp_rmaker_cmd_local_accept(local);
+            } else {
+                esp_rmaker_cmd_local_handle_udp(local);
+            }
+        }
+    }
+    for (int i = 0; i < RMAKER_LOCAL_MAX_CLIENTS; i++) {
+        if (local->clients[i].fd >= 0) {
+            esp_rmaker_cmd_local_client_close(&local->clients[i]);
+        }
+    }
+    close(local->fd);
+    xSemaphoreGive(local->done);
+    vTaskDelete(NULL);
+}
+
+static void esp_rmaker_cmd_local_free(esp_rmaker_cmd_local_t *local)
+{
+    if (local->fd >= 0) {
+        close(local->fd);
+    }
+    if (local->done) {
+        vSemaphoreDelete(local->done);
+    }
+    if (local->lock) {
+        vSemaphoreDelete(local->lock);
+    }
+    free(local->rx);
+    free(local->tx);
+    free(local);
+}
+
+static int esp_rmaker_cmd_local_open(esp_rmaker_cmd_local_t *local)
+{
+    bool tcp = (local->config.proto == ESP_RMAKER_CMD_LOCAL_TCP);
+    int fd = socket(AF_INET, tcp ? SOCK_STREAM : SOCK_DGRAM, 0);
+    if (fd < 0) {
+        ESP_LOGE(TAG, "Failed to create socket: errno %d.", errno);
+        return -1;
+    }
+    int reuse = 1;
+    setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &reuse, sizeof(reuse));
+    struct sockaddr_in addr = {
+        .sin_family = AF_INET,
+        .sin_port = htons(local->config.port),
+        .sin_addr.s_addr = htonl(INADDR_ANY),
+    };
+    socklen_t addr_len = sizeof(addr);
+    if ((bind(fd, (struct sockaddr *)&addr, sizeof(addr)) != 0) ||
+            (tcp && (listen(fd, RMAKER_LOCAL_MAX_CLIENTS) != 0)) ||
+            (getsockname(fd, (struct sockaddr *)&addr, &addr_len) != 0)) {
+        ESP_LOGE(TAG, "Failed to listen on port %d: errno %d.", local->config.port, errno);
+        close(fd);
+        return -1;
+    }
+    local->port = ntohs(addr.sin_port);
+    return fd;
+}
+
+/* Start the transport. Should be called with s_lock held. */
+static esp_err_t esp_rmaker_cmd_local_start_locked(const esp_rmaker_cmd_local_config_t *config)
+{
+    if (s_local) {
+        ESP_LOGE(TAG, "Local transport already started.");
+        return ESP_ERR_INVALID_STATE;
+    }
+    esp_rmaker_cmd_local_t *local = calloc(1, sizeof(esp_rmaker_cmd_local_t));
+    if (!local) {
+        ESP_LOGE(TAG, "Failed to allocate local transport.");
+        return ESP_ERR_NO_MEM;
+    }
+    local->config = *config;
+    local->fd = -1;
+    for (int i = 0; i < RMAKER_LOCAL_MAX_CLIENTS; i++) {
+        local->clients[i].fd = -1;
+    }
+    local->done = xSemaphoreCreateBinary();
+    local->lock = xSemaphoreCreateMutex();
+    local->rx = (config->proto == ESP_RMAKER_CMD_LOCAL_UDP) ? malloc(RMAKER_LOCAL_MAX_FRAME) : NULL;
+    local->tx = malloc(LOCAL_LEN_PREFIX + RMAKER_LOCAL_MAX_FRAME);
+    if (!local->done || !local->lock || !local->tx || ((config->proto == ESP_RMAKER_CMD_LOCAL_UDP) && !local->rx)) {
+        ESP_LOGE(TAG, "Failed to allocate local transport.");
+        esp_rmaker_cmd_local_free(local);
+        return ESP_ERR_NO_MEM;
+    }
+    if (esp_rmaker_cmd_local_new_session(local, config->key) != ESP_OK) {
+        esp_rmaker_cmd_local_free(local);
+        return ESP_FAIL;
+    }
+    local->fd = esp_rmaker_cmd_local_open(local);
+    if (local->fd < 0) {
+        esp_rmaker_cmd_local_free(local);
+        return ESP_FAIL;
+    }
+    local->running = true;
+    if (xTaskCreate(&esp_rmaker_cmd_local_task, "rmaker_cmd_local", RMAKER_LOCAL_TASK_STACK,
+                local, RMAKER_LOCAL_TASK_PRIORITY, NULL) != pdPASS) {
+        ESP_LOGE(TAG, "Couldn't create local transport task.");
+        esp_rmaker_cmd_local_free(local);
+        return ESP_FAIL;
+    }
+    s_local = local;
+    ESP_LOGI(TAG, "Local transport listening on %s port %d.",
+             (config->proto == ESP_RMAKER_CMD_LOCAL_TCP) ? "TCP" : "UDP", local->port);
+    return ESP_OK;
+}
+
+esp_err_t esp_rmaker_cmd_local_start(const esp_rmaker_cmd_local_config_t *config)
+{
+    if (!config || (config->proto > ESP_RMAKER_CMD_LOCAL_TCP) || !ESP_RMAKER_GET_USER_ROLE(config->user_role)) {
+        ESP_LOGE(TAG, "Invalid local transport configuration.");
+        return ESP_ERR_INVALID_ARG;
+    }
+    if (!s_lock) {
+        s_lock = xSemaphoreCreateMutex();
+        if (!s_lock) {
+            ESP_LOGE(TAG, "Failed to create local transport lock.");
+            return ESP_ERR_NO_MEM;
+        }
+    }
+    xSemaphoreTake(s_lock, portMAX_DELAY);
+    esp_err_t err = esp_rmaker_cmd_local_start_locked(config);
+    xSemaphoreGive(s_lock);
+    return err;
+}
+
+esp_err_t esp_rmaker_cmd_local_stop(void)
+{
+    if (!s_lock) {
+        return ESP_ERR_INVALID_STATE;
+    }
+    xSemaphoreTake(s_lock, portMAX_DELAY);
+    esp_rmaker_cmd_local_t *local = s_local;
+    s_local = NULL;
+    xSemaphoreGive(s_lock);
+    if (!local) {
+        return ESP_ERR_INVALID_STATE;
+    }
+    local->running = false;
+    xSemaphoreTake(local->done, portMAX_DELAY);
+    /* The task has closed all the sockets */
+    local->fd = -1;
+    esp_rmaker_cmd_local_free(local);
+    ESP_LOGI(TAG, "Local transport stopped.");
+    return ESP_OK;
+}
+
+esp_err_t esp_rmaker_cmd_local_set_key(const uint8_t *key)
+{
+    if (!key) {
+        return ESP_ERR_INVALID_ARG;
+    }
+    if (!s_lock) {
+        return ESP_ERR_INVALID_STATE;
+    }
+    esp_err_t err = ESP_ERR_INVALID_STATE;
+    xSemaphoreTake(s_lock, portMAX_DELAY);
+    esp_rmaker_cmd_local_t *local = s_local;
+    if (local) {
+        xSemaphoreTake(local->lock, portMAX_DELAY);
+        err = esp_rmaker_cmd_local_new_session(local, key);
+        xSemaphoreGive(local->lock);
+    }
+    xSemaphoreGive(s_lock);
+    return err;
+}
+
+esp_err_t esp_rmaker_cmd_local_get_port(uint16_t *port)
+{
+    if (!port) {
+        return ESP_ERR_INVALID_ARG;
+    }
+    if (!s_lock) {
+        return ESP_ERR_INVALID_STATE;
+    }
+    esp_err_t err = ESP_ERR_INVALID_STATE;
+    xSemaphoreTake(s_lock, portMAX_DELAY);
+    if (s_local) {
+        *port = s_local->port;
+        err = ESP_OK;
+    }
+    xSemaphoreGive(s_lock);
+    return err;
+}
@@ -9,10 +9,18 @@
 #include <inttypes.h>
 #include <esp_log.h>
 #include <esp_heap_caps.h>
+#include <esp_timer.h>
+#include <freertos/FreeRTOS.h>
+#include <freertos/semphr.h>
+#include <freertos/queue.h>
+#include <freertos/task.h>
+#include <freertos/timers.h>
+#include <esp_rmaker_work_queue.h>
 #include <esp_rmaker_cmd_resp.h>
 
 /* Payload buffers here can be large and allocated repeatedly, so prefer external RAM (SPIRAM)
- * when available, falling back to internal RAM. Only MEM_CALLOC_EXTRAM is used in this component. */
+ * when available, falling back to internal RAM. Only MEM_CALLOC_EXTRAM is used in this component,
+ * through CMD_CALLOC, which also accounts for it in the statistics. */
 #if ((CONFIG_SPIRAM || CONFIG_SPIRAM_SUPPORT) && \
         (CONFIG_SPIRAM_USE_CAPS_ALLOC || CONFIG_SPIRAM_USE_MALLOC))
 #define MEM_CALLOC_EXTRAM(num, size)   heap_caps_calloc_prefer(num, size, 2, MALLOC_CAP_DEFAULT | MALLOC_CAP_SPIRAM, MALLOC_CAP_DEFAULT | MALLOC_CAP_INTERNAL)
@@ -20,25 +28,251 @@
 #define MEM_CALLOC_EXTRAM(num, size)   calloc(num, size)
 #endif
 
+#if CONFIG_ESP_RMAKER_CMD_RESP_STATS
+/* Not protected by any lock, so only approximate if commands are handled in parallel */
+static esp_rmaker_cmd_resp_stats_t resp_stats;
+
+static inline void *esp_rmaker_cmd_stats_alloc(void *ptr)
+{
+    if (ptr) {
+        resp_stats.allocs++;
+    }
+    return ptr;
+}
+
+static inline void *esp_rmaker_cmd_stats_copy(void *dst, const void *src, size_t len)
+{
+    resp_stats.bytes_copied += len;
+    return memcpy(dst, src, len);
+}
+
+#define CMD_CALLOC(num, size)       esp_rmaker_cmd_stats_alloc(MEM_CALLOC_EXTRAM(num, size))
+#define CMD_MEMCPY(dst, src, len)   esp_rmaker_cmd_stats_copy(dst, src, len)
+#else
+#define CMD_CALLOC(num, size)       MEM_CALLOC_EXTRAM(num, size)
+#define CMD_MEMCPY(dst, src, len)   memcpy(dst, src, len)
+#endif /* CONFIG_ESP_RMAKER_CMD_RESP_STATS */
+
 #define RMAKER_MAX_CMD  CONFIG_ESP_RMAKER_MAX_COMMANDS
+#define RMAKER_MAX_BATCH_RECORDS    CONFIG_ESP_RMAKER_CMD_MAX_BATCH_RECORDS
+#define RMAKER_MAX_DEFERRED         CONFIG_ESP_RMAKER_CMD_MAX_DEFERRED
+#define RMAKER_DEFERRED_TIMEOUT_MS  (CONFIG_ESP_RMAKER_CMD_DEFERRED_TIMEOUT * 1000)
+#define RMAKER_CMD_WORKERS          CONFIG_ESP_RMAKER_CMD_WORKERS
+#define RMAKER_CMD_WORKER_QUEUE     CONFIG_ESP_RMAKER_CMD_WORKER_QUEUE_SIZE
+#define RMAKER_CMD_WORKER_STACK     CONFIG_ESP_RMAKER_CMD_WORKER_TASK_STACK
+#define RMAKER_CMD_WORKER_PRIORITY  CONFIG_ESP_RMAKER_CMD_WORKER_TASK_PRIORITY
+#define RMAKER_REPLAY_CACHE_SIZE    CONFIG_ESP_RMAKER_CMD_REPLAY_CACHE_SIZE
+#define RMAKER_REPLAY_CACHE_TTL_MS  (CONFIG_ESP_RMAKER_CMD_REPLAY_CACHE_TTL * 1000)
+#define RMAKER_REPLAY_CACHE_MAX_LEN CONFIG_ESP_RMAKER_CMD_REPLAY_CACHE_MAX_RESPONSE
+#define RMAKER_CACHE_TTL_MS         CONFIG_ESP_RMAKER_CMD_CACHE_TTL
+#define RMAKER_MAX_MIDDLEWARE       CONFIG_ESP_RMAKER_CMD_MAX_MIDDLEWARE
+#if CONFIG_ESP_RMAKER_CMD_TRACE
+#define RMAKER_TRACE_MAX_CMDS       CONFIG_ESP_RMAKER_CMD_TRACE_MAX_CMDS
+#endif
 
 static const char *TAG = "esp_rmaker_common_cmd_resp";
 
+/* Command to be run on the worker pool */
+typedef struct esp_rmaker_cmd_job {
+    struct esp_rmaker_cmd_job *next;
+    esp_rmaker_cmd_ctx_t ctx;
+    /* Priority of the user role. Higher priority jobs are run first. */
+    uint8_t priority;
+    /* Length of the command data */
+    size_t data_len;
+    /* Data TLVs, as received */
+    uint8_t tlv[];
+} esp_rmaker_cmd_job_t;
+
 typedef struct {
     uint16_t cmd;
     uint8_t access;
     bool free_on_return;
+    uint32_t flags;
     esp_rmaker_cmd_handler_t handler;
+    /* Set instead of handler for commands which take their data in chunks */
+    esp_rmaker_cmd_chunk_handler_t chunk_handler;
     void *priv;
+    /* Worker pool limits and state. max_active is 0 for commands handled by the caller itself. */
+    uint8_t max_active;
+    uint8_t max_queued;
+    uint8_t active;
+    uint8_t queued;
+    /* Jobs waiting for one of the active ones to finish */
+    esp_rmaker_cmd_job_t *pending;
+    /* Response cache, for commands with ESP_RMAKER_CMD_FLAG_CACHEABLE. The cache buffer holds the
+     * request data, followed by the encoded response without the request id.
+     */
+    uint32_t cache_ttl_ms;
+    TickType_t cache_tick;
+    uint8_t *cache;
+    /* User role, with the sub-role, of the request for which the response was cached */
+    uint8_t cache_role;
+    size_t cache_data_len;
+    size_t cache_resp_len;
+    /* Incremented on invalidation, so that responses prepared before it are not cached */
+    uint32_t cache_gen;
+    /* Number of middleware at registration. The chain is the first these many in the middleware table. */
+    uint8_t middleware_count;
 } esp_rmaker_cmd_info_t;
 
 typedef struct {
     uint8_t *bufptr;
     int bufsize;
     int curlen;
+    /* If set, the TLVs are passed to this instead of being added to bufptr */
+    esp_rmaker_cmd_write_t write;
+    void *priv;
 } esp_rmaker_tlv_data_t;
 
-static esp_rmaker_cmd_info_t *esp_rmaker_cmd_list[RMAKER_MAX_CMD];
+/* Location of a TLV in the buffer which was indexed */
+typedef struct {
+    int offset;     /* Offset of the first record. -1 if the type is not present. */
+    int len;        /* Length of the value, merged across continuation records */
+} esp_rmaker_tlv_field_t;
+
+/* Covers all the esp_rmaker_tlv_type_t values, with room for new ones */
+#define TLV_INDEX_SIZE  16
+
+typedef struct {
+    const uint8_t *buf;
+    esp_rmaker_tlv_field_t fields[TLV_INDEX_SIZE];
+} esp_rmaker_tlv_index_t;
+
+/* Command table.
+ *
+ * The command info is kept in a single array, which grows as commands get registered. Standard
+ * commands are looked up through a direct index, split into pages which are allocated on demand,
+ * and custom commands through an open addressing hash table. Both hold the position of the command
+ * in the array, plus one, so that 0 means not registered.
+ */
+#define CMD_STD_PAGE_BITS       6
+#define CMD_STD_PAGE_SIZE       (1 << CMD_STD_PAGE_BITS)
+#define CMD_STD_PAGES           ((ESP_RMAKER_CMD_STANDARD_LAST >> CMD_STD_PAGE_BITS) + 1)
+#define CMD_HASH_MIN_SIZE       8
+#define CMD_HASH_MAX_SIZE       0x8000
+#define CMD_ENTRIES_MIN_SIZE    4
+
+typedef struct {
+    esp_rmaker_cmd_info_t *entries;
+    uint16_t count;
+    uint16_t capacity;
+    uint16_t *std_pages[CMD_STD_PAGES];
+    uint16_t *hash;
+    uint16_t hash_size;     /* Power of 2 */
+    uint16_t hash_used;
+    /* Protects the table, and the ready list of the worker pool. Created at the first registration. */
+    SemaphoreHandle_t lock;
+} esp_rmaker_cmd_table_t;
+
+static esp_rmaker_cmd_table_t cmd_table;
+
+/* Deferred request, awaiting its response */
+typedef struct {
+    /* Token returned to the handler. 0 if the entry is free. */
+    uint32_t token;
+    uint16_t cmd;
+    char req_id[REQ_ID_LEN];
+    /* For the replay cache key. Requests with the role set by the transport are never deferred. */
+    uint8_t user_role;
+    TickType_t start_tick;
+    TickType_t timeout_ticks;
+    /* For tracing the time taken to complete */
+    int64_t start_us;
+} esp_rmaker_cmd_deferred_t;
+
+typedef struct {
+    esp_rmaker_cmd_deferred_t entries[RMAKER_MAX_DEFERRED];
+    SemaphoreHandle_t lock;
+    TimerHandle_t timer;
+    esp_rmaker_cmd_send_t send;
+    void *priv;
+    uint32_t next_token;
+    uint32_t completed;
+    uint32_t timed_out;
+    uint32_t rejected;
+} esp_rmaker_cmd_deferred_table_t;
+
+static esp_rmaker_cmd_deferred_table_t deferred_table;
+
+typedef struct {
+    /* Wakes up a worker for each job added to the ready list */
+    QueueHandle_t queue;
+    /* Jobs waiting for a worker, in priority order. Protected by the command table lock. */
+    esp_rmaker_cmd_job_t *ready;
+} esp_rmaker_cmd_worker_pool_t;
+
+static esp_rmaker_cmd_worker_pool_t worker_pool;
+
+/* Rate limits, per user role and sub-role. Sub-role 0 is for the role as a whole. */
+#define RMAKER_ROLES        4
+#define RMAKER_SUB_ROLES    5
+
+typedef struct {
+    esp_rmaker_cmd_role_limits_t limits;
+    bool configured;
+    /* Tokens available, in thousandths of a command */
+    uint32_t tokens;
+    TickType_t last_tick;
+    uint32_t throttled;
+} esp_rmaker_cmd_role_bucket_t;
+
+typedef struct {
+    esp_rmaker_cmd_role_bucket_t buckets[RMAKER_ROLES][RMAKER_SUB_ROLES];
+    /* Created when the limits are first set, so that there is no locking till then */
+    SemaphoreHandle_t lock;
+} esp_rmaker_cmd_role_table_t;
+
+static esp_rmaker_cmd_role_table_t role_table;
+
+/* Priorities of super admin, primary user, secondary user and node commands */
+static const uint8_t role_default_priority[RMAKER_ROLES] = {4, 3, 2, 1};
+
+/* Middleware are only appended, under the table lock, so a prefix of the table never changes */
+typedef struct {
+    esp_rmaker_cmd_middleware_t entries[RMAKER_MAX_MIDDLEWARE];
+    uint8_t count;
+} esp_rmaker_cmd_middleware_table_t;
+
+static esp_rmaker_cmd_middleware_table_t middleware_table;
+
+#if RMAKER_REPLAY_CACHE_SIZE > 0
+/* Response sent for a request, to be sent again if the request is received again */
+typedef struct {
+    /* Key. The role is part of it, so that a response is never sent to another user or transport. */
+    char req_id[REQ_ID_LEN];
+    uint16_t cmd;
+    uint8_t user_role;
+    bool transport_role;
+    TickType_t store_tick;
+    /* For LRU eviction */
+    uint32_t last_use;
+    /* Encoded response. NULL if the entry is free. */
+    uint8_t *response;
+    size_t response_len;
+} esp_rmaker_cmd_replay_entry_t;
+
+typedef struct {
+    esp_rmaker_cmd_replay_entry_t entries[RMAKER_REPLAY_CACHE_SIZE];
+    uint32_t use_count;
+    /* Created along with the command table lock */
+    SemaphoreHandle_t lock;
+} esp_rmaker_cmd_replay_cache_t;
+
+static esp_rmaker_cmd_replay_cache_t replay_cache;
+#endif /* RMAKER_REPLAY_CACHE_SIZE > 0 */
+
+#if CONFIG_ESP_RMAKER_CMD_TRACE
+/* Latency histograms and status counts, for the first RMAKER_TRACE_MAX_CMDS commands seen */
+typedef struct {
+    esp_rmaker_cmd_trace_t entries[RMAKER_TRACE_MAX_CMDS];
+    uint8_t count;
+    /* Created along with the command table lock */
+    SemaphoreHandle_t lock;
+} esp_rmaker_cmd_trace_table_t;
+
+static esp_rmaker_cmd_trace_table_t trace_table;
+#endif /* CONFIG_ESP_RMAKER_CMD_TRACE */
 
 /* Get uint16 from Little Endian data buffer */
 static uint16_t get_u16_le(const void *val_ptr)
@@ -67,92 +301,163 @@ static void esp_rmaker_tlv_data_init(esp_rmaker_tlv_data_t *tlv_data, uint8_t *b
     tlv_data->bufptr = buf;
     tlv_data->bufsize = buf_size;
     tlv_data->curlen = 0;
+    tlv_data->write = NULL;
+    tlv_data->priv = NULL;
 }
 
-/* Get length of data, for given type.
+/* Forward declaration — defined later in this file, near the other size/TLV helpers. */
+static size_t esp_rmaker_get_tlv_encoded_size(size_t len);
+
+/* Build the index of the TLVs in a buffer, in a single pass.
  *
- * Returns length of data on success and -1 if the TLV was not found
+ * For each type, the first occurrence is recorded. A value of 255 bytes or more is split
+ * into consecutive records of the same type, each 255 bytes long except the last, and these
+ * are merged into a single field. A truncated record ends the walk.
  */
-static int esp_rmaker_get_tlv_length(const uint8_t *buf, int buflen, uint8_t type)
+static void esp_rmaker_tlv_index_build(esp_rmaker_tlv_index_t *index, const uint8_t *buf, int buflen)
 {
-    if (!buf ) {
-        return -1;
+    for (int i = 0; i < TLV_INDEX_SIZE; i++) {
+        index->fields[i].offset = -1;
+        index->fields[i].len = 0;
+    }
+    index->buf = buf;
+    if (!buf) {
+        return;
     }
     int curlen = 0;
-    int val_len = 0;
-    bool found = false;
-    while (buflen > 0) {
-        if (buf[curlen] == type) {
-            uint8_t len = buf[curlen + 1];
-            if ((buflen - len) < 2) {
-                return -1;
+    /* Type for which a run of 255 byte records is in progress. 0 if none. */
+    uint8_t run_type = 0;
+    while ((buflen - curlen) >= 2) {
+        uint8_t type = buf[curlen];
+        uint8_t len = buf[curlen + 1];
+        if ((buflen - curlen - 2) < len) {
+            if (run_type && (type == run_type)) {
+                index->fields[type].offset = -1;
             }
-            val_len += len;
+            break;
+        }
+        if (run_type && (type == run_type)) {
+            index->fields[type].len += len;
             if (len < 255) {
-                return val_len;
-            } else {
-                found = true;
+                run_type = 0;
+            }
+        } else {
+            run_type = 0;
+            if ((type < TLV_INDEX_SIZE) && (index->fields[type].offset < 0)) {
+                index->fields[type].offset = curlen;
+                index->fields[type].len = len;
+                if (len == 255) {
+                    run_type = type;
+                }
             }
-
-        } else if (found) {
-            return val_len;
         }
-
-        /* buf[curlen +1] will give the Length */
-        buflen -= (2 + buf[curlen + 1]);
-        curlen += (2 + buf[curlen + 1]);
+        curlen += 2 + len;
     }
-    if (found) {
-        return val_len;
+}
+
+/* Get length of data, for given type.
+ *
+ * Returns length of data on success and -1 if the TLV was not found
+ */
+static int esp_rmaker_tlv_index_get_length(const esp_rmaker_tlv_index_t *index, uint8_t type)
+{
+    if ((type >= TLV_INDEX_SIZE) || (index->fields[type].offset < 0)) {
+        return -1;
     }
-    return -1;
+    return index->fields[type].len;
 }
 
 /* Get the value for the given type.
  *
  * Returns length of data on success and -1 if the TLV was not found
  */
-static int esp_rmaker_get_value_from_tlv(const uint8_t *buf, int buflen, uint8_t type, void *val, int val_size)
+static int esp_rmaker_tlv_index_get_value(const esp_rmaker_tlv_index_t *index, uint8_t type, void *val, int val_size)
 {
-    if (!buf || !val) {
+    int val_len = esp_rmaker_tlv_index_get_length(index, type);
+    if (!val || (val_len < 0) || (val_len > val_size)) {
         return -1;
     }
-    int curlen = 0;
-    int val_len = 0;
-    bool found = false;
-    while (buflen > 0) {
-        if (buf[curlen] == type) {
-            uint8_t len = buf[curlen + 1];
-            if ((val_size < len) || ((buflen - len) < 2)) {
-                return -1;
-            }
-            memcpy(val + val_len, &buf[curlen + 2], len);
-            val_len += len;
-            val_size -= len;
-            if (len < 255) {
-                return val_len;
-            } else {
-                found = true;
-            }
+    const uint8_t *src = index->buf + index->fields[type].offset;
+    uint8_t *dst = (uint8_t *)val;
+    int remaining = val_len;
+    /* All records in a run, except the last, carry 255 bytes */
+    do {
+        int len = src[1];
+        CMD_MEMCPY(dst, &src[2], len);
+        dst += len;
+        remaining -= len;
+        src += 2 + len;
+    } while (remaining > 0);
+    return val_len;
+}
 
-        } else if (found) {
-            return val_len;
-        }
+/* Get a view of the data for the given type, pointing into the indexed buffer */
+static void esp_rmaker_tlv_index_get_view(const esp_rmaker_tlv_index_t *index, uint8_t type, esp_rmaker_cmd_data_view_t *view)
+{
+    int len = esp_rmaker_tlv_index_get_length(index, type);
+    view->tlv = (len > 0) ? index->buf + index->fields[type].offset : NULL;
+    view->len = (len > 0) ? len : 0;
+}
+
+const void *esp_rmaker_cmd_data_view_get_ptr(const esp_rmaker_cmd_data_view_t *view)
+{
+    /* A single record carries less than 255 bytes. Exactly 255 bytes may be followed by an empty record. */
+    if (!view || !view->tlv || (view->len > 255)) {
+        return NULL;
+    }
+    return &view->tlv[2];
+}
+
+void esp_rmaker_cmd_data_view_iter_init(const esp_rmaker_cmd_data_view_t *view, esp_rmaker_cmd_data_iter_t *iter)
+{
+    if (!iter) {
+        return;
+    }
+    iter->next = view ? view->tlv : NULL;
+    iter->remaining = (view && view->tlv) ? view->len : 0;
+}
+
+bool esp_rmaker_cmd_data_view_iter_next(esp_rmaker_cmd_data_iter_t *iter, const void **segment, size_t *segment_len)
+{
+    if (!iter || !segment || !segment_len || !iter->next || (iter->remaining == 0)) {
+        return false;
+    }
+    size_t len = iter->next[1];
+    if (len > iter->remaining) {
+        len = iter->remaining;
+    }
+    *segment = &iter->next[2];
+    *segment_len = len;
+    iter->next += 2 + len;
+    iter->remaining -= len;
+    return true;
+}
 
-        /* buf[curlen +1] will give the Length */
-        buflen -= (2 + buf[curlen + 1]);
-        curlen += (2 + buf[curlen + 1]);
+size_t esp_rmaker_cmd_data_view_copy(const esp_rmaker_cmd_data_view_t *view, void *buf, size_t buf_size)
+{
+    if (!buf) {
+        return 0;
     }
-    if (found) {
-        return val_len;
+    esp_rmaker_cmd_data_iter_t iter;
+    esp_rmaker_cmd_data_view_iter_init(view, &iter);
+    const void *segment;
+    size_t segment_len;
+    size_t copied = 0;
+    while ((copied < buf_size) && esp_rmaker_cmd_data_view_iter_next(&iter, &segment, &segment_len)) {
+        if (segment_len > (buf_size - copied)) {
+            segment_len = buf_size - copied;
+        }
+        CMD_MEMCPY((uint8_t *)buf + copied, segment, segment_len);
+        copied += segment_len;
     }
-    return -1;
+    return copied;
 }
 
-/* Add a TLV to the TLV buffer */
+/* Add a TLV to the TLV buffer, or pass it to the writer */
 static int esp_rmaker_add_tlv(esp_rmaker_tlv_data_t *tlv_data, uint8_t type, int len, const void *val)
 {
-    if (!tlv_data->bufptr || ((len + 2) > (tlv_data->bufsize - tlv_data->curlen))) {
+    if (!tlv_data->write && (!tlv_data->bufptr ||
+            (esp_rmaker_get_tlv_encoded_size(len) > (tlv_data->bufsize - tlv_data->curlen)))) {
         return -1;
     }
     if (len > 0 && val == NULL) {
@@ -161,15 +466,26 @@ static int esp_rmaker_add_tlv(esp_rmaker_tlv_data_t *tlv_data, uint8_t type, int
     uint8_t *buf_ptr = (uint8_t *)val;
     int orig_len = tlv_data->curlen;
     do {
-        tlv_data->bufptr[tlv_data->curlen++] = type;
         int tmp_len;
         if (len > 255) {
             tmp_len = 255;
         } else {
             tmp_len = len;
         }
+        if (tlv_data->write) {
+            uint8_t header[2] = {type, tmp_len};
+            if ((tlv_data->write(header, sizeof(header), tlv_data->priv) != ESP_OK) ||
+                ((tmp_len > 0) && (tlv_data->write(buf_ptr, tmp_len, tlv_data->priv) != ESP_OK))) {
+                return -1;
+            }
+            tlv_data->curlen += 2 + tmp_len;
+            buf_ptr += tmp_len;
+            len -= tmp_len;
+            continue;
+        }
+        tlv_data->bufptr[tlv_data->curlen++] = type;
         tlv_data->bufptr[tlv_data->curlen++] = tmp_len;
-        memcpy(&tlv_data->bufptr[tlv_data->curlen], buf_ptr, tmp_len);
+        CMD_MEMCPY(&tlv_data->bufptr[tlv_data->curlen], buf_ptr, tmp_len);
         tlv_data->curlen += tmp_len;
         buf_ptr += tmp_len;
         len -= tmp_len;
@@ -177,6 +493,125 @@ static int esp_rmaker_add_tlv(esp_rmaker_tlv_data_t *tlv_data, uint8_t type, int
     return tlv_data->curlen - orig_len;
 }
 
+/* Get the encoded size of a batch record. Unlike other TLVs, a record whose length is a multiple
+ * of 255 is terminated by an empty TLV, so that it does not merge with the next record.
+ */
+static size_t esp_rmaker_get_record_encoded_size(size_t len)
+{
+    return (2 * ((len / 255) + 1)) + len;
+}
+
+/* Add a batch record to the TLV buffer */
+static int esp_rmaker_add_record(esp_rmaker_tlv_data_t *tlv_data, int len, const void *val)
+{
+    if (!tlv_data->bufptr || (esp_rmaker_get_record_encoded_size(len) > (tlv_data->bufsize - tlv_data->curlen))) {
+        return -1;
+    }
+    int orig_len = tlv_data->curlen;
+    if (esp_rmaker_add_tlv(tlv_data, ESP_RMAKER_TLV_TYPE_BATCH_RECORD, len, val) < 0) {
+        return -1;
+    }
+    if ((len > 0) && ((len % 255) == 0)) {
+        esp_rmaker_add_tlv(tlv_data, ESP_RMAKER_TLV_TYPE_BATCH_RECORD, 0, NULL);
+    }
+    return tlv_data->curlen - orig_len;
+}
+
+bool esp_rmaker_cmd_batch_get_next(const void *batch, size_t batch_len, size_t *offset, esp_rmaker_cmd_data_view_t *record)
+{
+    if (!batch || !offset || !record) {
+        return false;
+    }
+    const uint8_t *buf = (const uint8_t *)batch;
+    size_t curlen = *offset;
+    while ((curlen + 2) <= batch_len) {
+        uint8_t type = buf[curlen];
+        uint8_t len = buf[curlen + 1];
+        if ((batch_len - curlen - 2) < len) {
+            break;
+        }
+        if (type != ESP_RMAKER_TLV_TYPE_BATCH_RECORD) {
+            /* Skip any other TLVs, for forward compatibility */
+            curlen += 2 + len;
+            continue;
+        }
+        record->tlv = &buf[curlen];
+        record->len = 0;
+        /* A record of 255 bytes continues in the next record TLV */
+        while (true) {
+            record->len += len;
+            curlen += 2 + len;
+            if ((len < 255) || ((curlen + 2) > batch_len) || (buf[curlen] != ESP_RMAKER_TLV_TYPE_BATCH_RECORD)) {
+                break;
+            }
+            len = buf[curlen + 1];
+            if ((batch_len - curlen - 2) < len) {
+                break;
+            }
+        }
+        if (record->len == 0) {
+            record->tlv = NULL;
+        }
+        *offset = curlen;
+        return true;
+    }
+    *offset = batch_len;
+    return false;
+}
+
+esp_err_t esp_rmaker_cmd_parse_response(const void *response, size_t response_len, esp_rmaker_cmd_response_t *parsed)
+{
+    if (!response || !parsed) {
+        return ESP_ERR_INVALID_ARG;
+    }
+    memset(parsed, 0, sizeof(*parsed));
+    esp_rmaker_tlv_index_t index;
+    esp_rmaker_tlv_index_build(&index, response, response_len);
+
+    if ((esp_rmaker_tlv_index_get_length(&index, ESP_RMAKER_TLV_TYPE_CMD) < 0) &&
+            (esp_rmaker_tlv_index_get_length(&index, ESP_RMAKER_TLV_TYPE_BATCH_RECORD) >= 0)) {
+        return ESP_ERR_NOT_SUPPORTED;
+    }
+    uint8_t cmd_buf[2];
+    if ((esp_rmaker_tlv_index_get_value(&index, ESP_RMAKER_TLV_TYPE_CMD, cmd_buf, sizeof(cmd_buf)) != sizeof(cmd_buf)) ||
+            (esp_rmaker_tlv_index_get_value(&index, ESP_RMAKER_TLV_TYPE_STATUS, &parsed->status,
+                                            sizeof(parsed->status)) != sizeof(parsed->status))) {
+        return ESP_ERR_INVALID_RESPONSE;
+    }
+    parsed->cmd = get_u16_le(cmd_buf);
+    if ((esp_rmaker_tlv_index_get_length(&index, ESP_RMAKER_TLV_TYPE_REQ_ID) >= 0) &&
+            (esp_rmaker_tlv_index_get_value(&index, ESP_RMAKER_TLV_TYPE_REQ_ID, parsed->req_id,
+                                            sizeof(parsed->req_id) - 1) < 0)) {
+        return ESP_ERR_INVALID_RESPONSE;
+    }
+    if ((esp_rmaker_tlv_index_get_length(&index, ESP_RMAKER_TLV_TYPE_CONTENT_TYPE) >= 0) &&
+            (esp_rmaker_tlv_index_get_value(&index, ESP_RMAKER_TLV_TYPE_CONTENT_TYPE, &parsed->content_type,
+                                            sizeof(parsed->content_type)) != sizeof(parsed->content_type))) {
+        return ESP_ERR_INVALID_RESPONSE;
+    }
+    esp_rmaker_tlv_index_get_view(&index, ESP_RMAKER_TLV_TYPE_DATA, &parsed->data);
+    return ESP_OK;
+}
+
+esp_err_t esp_rmaker_cmd_batch_add(void *batch, size_t batch_size, size_t *batch_len, const void *payload, size_t payload_len)
+{
+    if (!batch || !batch_len || !payload || (payload_len == 0)) {
+        return ESP_ERR_INVALID_ARG;
+    }
+    if ((*batch_len > batch_size) ||
+            (esp_rmaker_get_record_encoded_size(payload_len) > (batch_size - *batch_len))) {
+        return ESP_ERR_INVALID_SIZE;
+    }
+    esp_rmaker_tlv_data_t tlv_data;
+    esp_rmaker_tlv_data_init(&tlv_data, batch, batch_size);
+    tlv_data.curlen = *batch_len;
+    if (esp_rmaker_add_record(&tlv_data, payload_len, payload) < 0) {
+        return ESP_FAIL;
+    }
+    *batch_len = tlv_data.curlen;
+    return ESP_OK;
+}
+
 /* Get user role string from flag. Useful for printing */
 const char *esp_rmaker_get_user_role_string(uint8_t user_role)
 {
@@ -194,18 +629,10 @@ const char *esp_rmaker_get_user_role_string(uint8_t user_role)
     }
 }
 
-/* Forward declaration — defined later in this file, near the other size/TLV helpers. */
-static size_t esp_rmaker_get_tlv_encoded_size(size_t len);
-
-esp_err_t esp_rmaker_cmd_prepare_payload(const char *req_id, uint8_t role, uint8_t status,
-                                         uint16_t cmd,
-                                         const void *data, size_t data_size,
-                                         void **output, size_t *output_len)
+/* Get the size of the payload generated by esp_rmaker_cmd_encode() */
+static size_t esp_rmaker_cmd_get_payload_size(const char *req_id, uint8_t role, uint8_t status,
+                                              uint16_t cmd, uint8_t content_type, const void *data, size_t data_size)
 {
-    if (!output || !output_len) {
-        return ESP_ERR_INVALID_ARG;
-    }
-
     size_t payload_size = 0;
     if (req_id) {
         payload_size += esp_rmaker_get_tlv_encoded_size(strlen(req_id));
@@ -215,48 +642,56 @@ esp_err_t esp_rmaker_cmd_prepare_payload(const char *req_id, uint8_t role, uint8
     }
     payload_size += esp_rmaker_get_tlv_encoded_size(sizeof(status));
     payload_size += esp_rmaker_get_tlv_encoded_size(sizeof(cmd));
+    if (content_type != 0) {
+        payload_size += esp_rmaker_get_tlv_encoded_size(sizeof(content_type));
+    }
     if (data != NULL && data_size != 0) {
         payload_size += esp_rmaker_get_tlv_encoded_size(data_size);
     }
+    return payload_size;
+}
 
-    uint8_t *payload_buffer = MEM_CALLOC_EXTRAM(1, payload_size);
-    if (!payload_buffer) {
-        ESP_LOGE(TAG, "Failed to allocate buffer of size %zu for payload.", payload_size);
-        return ESP_ERR_NO_MEM;
-    }
-
-    esp_rmaker_tlv_data_t tlv_data;
-    esp_rmaker_tlv_data_init(&tlv_data, payload_buffer, payload_size);
-
+/* Encode the payload TLVs, as per the rules of esp_rmaker_cmd_prepare_payload() */
+static esp_err_t esp_rmaker_cmd_encode(esp_rmaker_tlv_data_t *tlv_data, const char *req_id, uint8_t role,
+                                       uint8_t status, uint16_t cmd, uint8_t content_type,
+                                       const void *data, size_t data_size)
+{
     int encoded_len = 0;
     if (req_id) {
-        encoded_len = esp_rmaker_add_tlv(&tlv_data, ESP_RMAKER_TLV_TYPE_REQ_ID, strlen(req_id), req_id);
+        encoded_len = esp_rmaker_add_tlv(tlv_data, ESP_RMAKER_TLV_TYPE_REQ_ID, strlen(req_id), req_id);
         if (encoded_len < 0) {
             ESP_LOGE(TAG, "Failed to add TLV for Request Id.");
             goto exit;
         }
     }
     if (role != 0) {
-        encoded_len = esp_rmaker_add_tlv(&tlv_data, ESP_RMAKER_TLV_TYPE_USER_ROLE, sizeof(role), &role);
+        encoded_len = esp_rmaker_add_tlv(tlv_data, ESP_RMAKER_TLV_TYPE_USER_ROLE, sizeof(role), &role);
         if (encoded_len < 0) {
             ESP_LOGE(TAG, "Failed to add TLV for User Role.");
             goto exit;
         }
     }
-    encoded_len = esp_rmaker_add_tlv(&tlv_data, ESP_RMAKER_TLV_TYPE_STATUS, sizeof(status), &status);
+    encoded_len = esp_rmaker_add_tlv(tlv_data, ESP_RMAKER_TLV_TYPE_STATUS, sizeof(status), &status);
     if (encoded_len < 0) {
         ESP_LOGE(TAG, "Failed to add TLV for Status.");
         goto exit;
     }
     uint8_t cmd_buf[2];
     put_u16_le(cmd_buf, cmd);
-    encoded_len = esp_rmaker_add_tlv(&tlv_data, ESP_RMAKER_TLV_TYPE_CMD, sizeof(cmd_buf), cmd_buf);
+    encoded_len = esp_rmaker_add_tlv(tlv_data, ESP_RMAKER_TLV_TYPE_CMD, sizeof(cmd_buf), cmd_buf);
     if (encoded_len < 0) {
         ESP_LOGE(TAG, "Failed to add TLV for Command.");
         goto exit;
     }
+    if (content_type != 0) {
+        encoded_len = esp_rmaker_add_tlv(tlv_data, ESP_RMAKER_TLV_TYPE_CONTENT_TYPE, sizeof(content_type), &content_type);
+        if (encoded_len < 0) {
+            ESP_LOGE(TAG, "Failed to add TLV for Content Type.");
+            goto exit;
+        }
+    }
     if (data != NULL && data_size != 0) {
-        encoded_len = esp_rmaker_add_tlv(&tlv_data, ESP_RMAKER_TLV_TYPE_DATA, data_size, data);
+        encoded_len = esp_rmaker_add_tlv(tlv_data, ESP_RMAKER_TLV_TYPE_DATA, data_size, data);
         if (encoded_len < 0) {
             ESP_LOGE(TAG, "Failed to add TLV for Data.");
             goto exit;
@@ -265,108 +700,1320 @@ esp_err_t esp_rmaker_cmd_prepare_payload(const char *req_id, uint8_t role, uint8
 
 exit:
     if (encoded_len < 0) {
-        free(payload_buffer);
         return ESP_FAIL;
     }
+    ESP_LOGD(TAG, "Generated payload of size %d for cmd %d", tlv_data->curlen, cmd);
+    return ESP_OK;
+}
+
+esp_err_t esp_rmaker_cmd_encode_payload(const char *req_id, uint8_t role, uint8_t status,
+                                        uint16_t cmd,
+                                        const void *data, size_t data_size,
+                                        void *buf, size_t buf_size, size_t *output_len)
+{
+    if (!output_len) {
+        return ESP_ERR_INVALID_ARG;
+    }
+    size_t payload_size = esp_rmaker_cmd_get_payload_size(req_id, role, status, cmd, 0, data, data_size);
+    if (!buf || (buf_size < payload_size)) {
+        *output_len = payload_size;
+        return ESP_ERR_INVALID_SIZE;
+    }
+    esp_rmaker_tlv_data_t tlv_data;
+    esp_rmaker_tlv_data_init(&tlv_data, buf, payload_size);
+    esp_err_t err = esp_rmaker_cmd_encode(&tlv_data, req_id, role, status, cmd, 0, data, data_size);
+    if (err != ESP_OK) {
+        return err;
+    }
+    *output_len = tlv_data.curlen;
+    return ESP_OK;
+}
+
+esp_err_t esp_rmaker_cmd_encode_payload_to_writer(const char *req_id, uint8_t role, uint8_t status,
+                                                  uint16_t cmd,
+                                                  const void *data, size_t data_size,
+                                                  esp_rmaker_cmd_write_t write, void *priv, size_t *output_len)
+{
+    if (!write) {
+        return ESP_ERR_INVALID_ARG;
+    }
+    esp_rmaker_tlv_data_t tlv_data;
+    esp_rmaker_tlv_data_init(&tlv_data, NULL, 0);
+    tlv_data.write = write;
+    tlv_data.priv = priv;
+    esp_err_t err = esp_rmaker_cmd_encode(&tlv_data, req_id, role, status, cmd, 0, data, data_size);
+    if (err != ESP_OK) {
+        return err;
+    }
+    if (output_len) {
+        *output_len = tlv_data.curlen;
+    }
+    return ESP_OK;
+}
+
+esp_err_t esp_rmaker_cmd_prepare_payload_with_type(const char *req_id, uint8_t role, uint8_t status,
+                                                   uint16_t cmd, uint8_t content_type,
+                                                   const void *data, size_t data_size,
+                                                   void **output, size_t *output_len)
+{
+    if (!output || !output_len) {
+        return ESP_ERR_INVALID_ARG;
+    }
 
+    size_t payload_size = esp_rmaker_cmd_get_payload_size(req_id, role, status, cmd, content_type, data, data_size);
+    uint8_t *payload_buffer = CMD_CALLOC(1, payload_size);
+    if (!payload_buffer) {
+        ESP_LOGE(TAG, "Failed to allocate buffer of size %zu for payload.", payload_size);
+        return ESP_ERR_NO_MEM;
+    }
+    esp_rmaker_tlv_data_t tlv_data;
+    esp_rmaker_tlv_data_init(&tlv_data, payload_buffer, payload_size);
+    esp_err_t err = esp_rmaker_cmd_encode(&tlv_data, req_id, role, status, cmd, content_type, data, data_size);
+    if (err != ESP_OK) {
+        free(payload_buffer);
+        return err;
+    }
     *output = payload_buffer;
     *output_len = tlv_data.curlen;
-    ESP_LOGD(TAG, "Generated payload of size %d for cmd %d", tlv_data.curlen, cmd);
     return ESP_OK;
 }
 
+esp_err_t esp_rmaker_cmd_prepare_payload(const char *req_id, uint8_t role, uint8_t status,
+                                         uint16_t cmd,
+                                         const void *data, size_t data_size,
+                                         void **output, size_t *output_len)
+{
+    return esp_rmaker_cmd_prepare_payload_with_type(req_id, role, status, cmd, 0, data, data_size, output, output_len);
+}
+
 esp_err_t esp_rmaker_cmd_prepare_empty_response(void **output, size_t *output_len)
 {
     /* Empty req_id TLV + CMD = 0. Used to poll the cloud for pending commands. */
     return esp_rmaker_cmd_prepare_payload("", 0, 0, 0, NULL, 0, output, output_len);
 }
 
-/* Register a new command with its handler
+static inline bool esp_rmaker_cmd_is_standard(uint16_t cmd)
+{
+    return cmd <= ESP_RMAKER_CMD_STANDARD_LAST;
+}
+
+static inline uint16_t esp_rmaker_cmd_hash_home(uint16_t cmd)
+{
+    return (uint16_t)(((uint32_t)cmd * 2654435761U) >> 16) & (cmd_table.hash_size - 1);
+}
+
+/* Get the index slot for a command. If create is true, the standard command page is
+ * allocated if required, else NULL is returned if there is no slot.
+ * For custom commands, the hash table should have room for the command.
  */
-esp_err_t esp_rmaker_cmd_register(uint16_t cmd, uint8_t access, esp_rmaker_cmd_handler_t handler, bool free_on_return, void *priv)
+static uint16_t *esp_rmaker_cmd_table_slot(uint16_t cmd, bool create)
 {
-    int i;
-    for (i = 0; i < RMAKER_MAX_CMD; i++) {
-        if (esp_rmaker_cmd_list[i] && (esp_rmaker_cmd_list[i]->cmd == cmd)) {
-            ESP_LOGE(TAG, "Handler for command %d already exists.", cmd);
-            return ESP_FAIL;
-        }
-    }
-    for (i = 0; i < RMAKER_MAX_CMD; i++) {
-        if (!esp_rmaker_cmd_list[i]) {
-            esp_rmaker_cmd_info_t *cmd_info = calloc(1, sizeof(esp_rmaker_cmd_info_t));
-            if (!cmd_info) {
-                ESP_LOGE(TAG, "Could not allocate memory for cmd %d", cmd);
-                return ESP_ERR_NO_MEM;
+    if (esp_rmaker_cmd_is_standard(cmd)) {
+        uint16_t **page = &cmd_table.std_pages[cmd >> CMD_STD_PAGE_BITS];
+        if (!*page) {
+            if (!create) {
+                return NULL;
+            }
+            *page = calloc(CMD_STD_PAGE_SIZE, sizeof(uint16_t));
+            if (!*page) {
+                return NULL;
             }
-            cmd_info->cmd = cmd;
-            cmd_info->access = access;
-            cmd_info->free_on_return = free_on_return;
-            cmd_info->handler = handler;
-            cmd_info->priv = priv;
-            esp_rmaker_cmd_list[i] = cmd_info;
-            ESP_LOGI(TAG, "Registered command: cmd=%d, access=%d", cmd, access);
-            return ESP_OK;
         }
+        return &(*page)[cmd & (CMD_STD_PAGE_SIZE - 1)];
+    }
+    if (!cmd_table.hash) {
+        return NULL;
     }
-    ESP_LOGE(TAG, "No space to add command %d", cmd);
-    return ESP_ERR_NO_MEM;
+    uint16_t pos = esp_rmaker_cmd_hash_home(cmd);
+    while (cmd_table.hash[pos] && (cmd_table.entries[cmd_table.hash[pos] - 1].cmd != cmd)) {
+        pos = (pos + 1) & (cmd_table.hash_size - 1);
+    }
+    if (!create && !cmd_table.hash[pos]) {
+        return NULL;
+    }
+    return &cmd_table.hash[pos];
 }
 
-/* Find the command infor for given command
- *
- * Returns pointer to the info if found and NULL on error
- */
-static esp_rmaker_cmd_info_t *esp_rmaker_get_cmd_info(uint16_t cmd)
+/* Rebuild the hash table with the given size */
+static esp_err_t esp_rmaker_cmd_hash_resize(uint16_t size)
 {
-    int i;
-    for (i = 0; i < RMAKER_MAX_CMD; i++) {
-        if (esp_rmaker_cmd_list[i] && (esp_rmaker_cmd_list[i]->cmd == cmd)) {
-            ESP_LOGI(TAG, "Handler found for command %d.", cmd);
-            return esp_rmaker_cmd_list[i];
+    uint16_t *hash = calloc(size, sizeof(uint16_t));
+    if (!hash) {
+        return ESP_ERR_NO_MEM;
+    }
+    free(cmd_table.hash);
+    cmd_table.hash = hash;
+    cmd_table.hash_size = size;
+    for (int i = 0; i < cmd_table.count; i++) {
+        if (!esp_rmaker_cmd_is_standard(cmd_table.entries[i].cmd)) {
+            *esp_rmaker_cmd_table_slot(cmd_table.entries[i].cmd, true) = i + 1;
         }
     }
-    ESP_LOGE(TAG, "No handler found for command %d.", cmd);
-    return NULL;
+    return ESP_OK;
 }
 
-/* De-register given command */
-esp_err_t esp_rmaker_cmd_deregister(uint16_t cmd)
+/* Remove a custom command from the hash table. The following entries of the same
+ * probe sequence are moved back, so that lookups need no tombstones.
+ */
+static void esp_rmaker_cmd_hash_remove(uint16_t *slot)
 {
-    int i;
-    for (i = 0; i < RMAKER_MAX_CMD; i++) {
-        if (esp_rmaker_cmd_list[i] && (esp_rmaker_cmd_list[i]->cmd == cmd)) {
-            free(esp_rmaker_cmd_list[i]);
-            esp_rmaker_cmd_list[i] = NULL;
-            return ESP_OK;
+    uint16_t mask = cmd_table.hash_size - 1;
+    uint16_t hole = slot - cmd_table.hash;
+    uint16_t pos = hole;
+    cmd_table.hash[hole] = 0;
+    while (true) {
+        pos = (pos + 1) & mask;
+        if (!cmd_table.hash[pos]) {
+            break;
+        }
+        uint16_t home = esp_rmaker_cmd_hash_home(cmd_table.entries[cmd_table.hash[pos] - 1].cmd);
+        /* Move the entry only if the hole lies cyclically between its home and its current position */
+        if (((pos - home) & mask) >= ((pos - hole) & mask)) {
+            cmd_table.hash[hole] = cmd_table.hash[pos];
+            cmd_table.hash[pos] = 0;
+            hole = pos;
         }
     }
-    ESP_LOGE(TAG, "Cannot unregister command %d as it wasn't registered.", cmd);
-    return ESP_ERR_INVALID_ARG;
+    cmd_table.hash_used--;
 }
 
-/* Main command response handling function.
+/* Free the command table once no commands are registered */
+static void esp_rmaker_cmd_table_free(void)
+{
+    free(cmd_table.entries);
+    free(cmd_table.hash);
+    for (int i = 0; i < CMD_STD_PAGES; i++) {
+        free(cmd_table.std_pages[i]);
+    }
+    /* The lock is held by the caller, and so, is kept */
+    SemaphoreHandle_t lock = cmd_table.lock;
+    memset(&cmd_table, 0, sizeof(cmd_table));
+    cmd_table.lock = lock;
+}
+
+/* Create the table, replay cache and trace locks, if not already done. Till then, there are no commands
+ * to protect, and no command can be handled.
+ */
+static esp_err_t esp_rmaker_cmd_table_lock_init(void)
+{
+    if (!cmd_table.lock) {
+        cmd_table.lock = xSemaphoreCreateMutex();
+        if (!cmd_table.lock) {
+            ESP_LOGE(TAG, "Failed to create command table lock.");
+            return ESP_ERR_NO_MEM;
+        }
+    }
+#if RMAKER_REPLAY_CACHE_SIZE > 0
+    if (!replay_cache.lock) {
+        replay_cache.lock = xSemaphoreCreateMutex();
+        if (!replay_cache.lock) {
+            ESP_LOGE(TAG, "Failed to create replay cache lock.");
+            return ESP_ERR_NO_MEM;
+        }
+    }
+#endif
+#if CONFIG_ESP_RMAKER_CMD_TRACE
+    if (!trace_table.lock) {
+        trace_table.lock = xSemaphoreCreateMutex();
+        if (!trace_table.lock) {
+            ESP_LOGE(TAG, "Failed to create command trace lock.");
+            return ESP_ERR_NO_MEM;
+        }
+    }
+#endif
+    return ESP_OK;
+}
+
+static void esp_rmaker_cmd_table_lock(void)
+{
+    if (cmd_table.lock) {
+        xSemaphoreTake(cmd_table.lock, portMAX_DELAY);
+    }
+}
+
+static void esp_rmaker_cmd_table_unlock(void)
+{
+    if (cmd_table.lock) {
+        xSemaphoreGive(cmd_table.lock);
+    }
+}
+
+/* Register a new command with its handler
+ */
+static esp_err_t esp_rmaker_cmd_table_add(uint16_t cmd, uint8_t access, esp_rmaker_cmd_handler_t handler,
+                                          esp_rmaker_cmd_chunk_handler_t chunk_handler,
+                                          bool free_on_return, uint32_t flags, void *priv)
+{
+    uint16_t *slot = esp_rmaker_cmd_table_slot(cmd, false);
+    if (slot && *slot) {
+        ESP_LOGE(TAG, "Handler for command %d already exists.", cmd);
+        return ESP_FAIL;
+    }
+#if RMAKER_MAX_CMD > 0
+    if (cmd_table.count >= RMAKER_MAX_CMD) {
+        ESP_LOGE(TAG, "No space to add command %d", cmd);
+        return ESP_ERR_NO_MEM;
+    }
+#endif
+    if (cmd_table.count == UINT16_MAX) {
+        ESP_LOGE(TAG, "No space to add command %d", cmd);
+        return ESP_ERR_NO_MEM;
+    }
+    if (cmd_table.count == cmd_table.capacity) {
+        /* Doubled, but not beyond what the uint16_t count and index slots can hold */
+        uint32_t capacity = cmd_table.capacity ? (uint32_t)cmd_table.capacity * 2 : CMD_ENTRIES_MIN_SIZE;
+        if (capacity > UINT16_MAX) {
+            capacity = UINT16_MAX;
+        }
+        esp_rmaker_cmd_info_t *entries = realloc(cmd_table.entries, capacity * sizeof(esp_rmaker_cmd_info_t));
+        if (!entries) {
+            ESP_LOGE(TAG, "Could not allocate memory for cmd %d", cmd);
+            return ESP_ERR_NO_MEM;
+        }
+        cmd_table.entries = entries;
+        cmd_table.capacity = capacity;
+    }
+    if (!esp_rmaker_cmd_is_standard(cmd)) {
+        /* Keep the load factor of the hash table under 3/4 */
+        if (((cmd_table.hash_used + 1) * 4) > (cmd_table.hash_size * 3)) {
+            uint32_t size = cmd_table.hash_size ? (uint32_t)cmd_table.hash_size * 2 : CMD_HASH_MIN_SIZE;
+            /* The size is a power of 2, so 32768 is the largest which fits in uint16_t */
+            if (size > CMD_HASH_MAX_SIZE) {
+                ESP_LOGE(TAG, "No space to add custom command %d", cmd);
+                return ESP_ERR_NO_MEM;
+            }
+            if (esp_rmaker_cmd_hash_resize(size) != ESP_OK) {
+                ESP_LOGE(TAG, "Could not allocate memory for cmd %d", cmd);
+                return ESP_ERR_NO_MEM;
+            }
+        }
+    }
+    slot = esp_rmaker_cmd_table_slot(cmd, true);
+    if (!slot) {
+        ESP_LOGE(TAG, "Could not allocate memory for cmd %d", cmd);
+        return ESP_ERR_NO_MEM;
+    }
+    esp_rmaker_cmd_info_t *cmd_info = &cmd_table.entries[cmd_table.count];
+    memset(cmd_info, 0, sizeof(esp_rmaker_cmd_info_t));
+    cmd_info->cmd = cmd;
+    cmd_info->access = access;
+    cmd_info->free_on_return = free_on_return;
+    cmd_info->flags = flags;
+    cmd_info->handler = handler;
+    cmd_info->chunk_handler = chunk_handler;
+    cmd_info->priv = priv;
+    cmd_info->cache_ttl_ms = RMAKER_CACHE_TTL_MS;
+    cmd_info->middleware_count = middleware_table.count;
+    *slot = ++cmd_table.count;
+    if (!esp_rmaker_cmd_is_standard(cmd)) {
+        cmd_table.hash_used++;
+    }
+    ESP_LOGI(TAG, "Registered command: cmd=%d, access=%d", cmd, access);
+    return ESP_OK;
+}
+
+esp_err_t esp_rmaker_cmd_register_with_flags(uint16_t cmd, uint8_t access, esp_rmaker_cmd_handler_t handler,
+                                             bool free_on_return, uint32_t flags, void *priv)
+{
+    if (!handler) {
+        ESP_LOGE(TAG, "Handler for command %d cannot be NULL.", cmd);
+        return ESP_ERR_INVALID_ARG;
+    }
+    if (esp_rmaker_cmd_table_lock_init() != ESP_OK) {
+        return ESP_ERR_NO_MEM;
+    }
+    esp_rmaker_cmd_table_lock();
+    esp_err_t err = esp_rmaker_cmd_table_add(cmd, access, handler, NULL, free_on_return, flags, priv);
+    esp_rmaker_cmd_table_unlock();
+    return err;
+}
+
+esp_err_t esp_rmaker_cmd_register_chunked(uint16_t cmd, uint8_t access, esp_rmaker_cmd_chunk_handler_t handler,
+                                          bool free_on_return, void *priv)
+{
+    if (!handler) {
+        ESP_LOGE(TAG, "Handler for command %d cannot be NULL.", cmd);
+        return ESP_ERR_INVALID_ARG;
+    }
+    if (esp_rmaker_cmd_table_lock_init() != ESP_OK) {
+        return ESP_ERR_NO_MEM;
+    }
+    esp_rmaker_cmd_table_lock();
+    esp_err_t err = esp_rmaker_cmd_table_add(cmd, access, NULL, handler, free_on_return, 0, priv);
+    esp_rmaker_cmd_table_unlock();
+    return err;
+}
+
+esp_err_t esp_rmaker_cmd_register(uint16_t cmd, uint8_t access, esp_rmaker_cmd_handler_t handler, bool free_on_return, void *priv)
+{
+    return esp_rmaker_cmd_register_with_flags(cmd, access, handler, free_on_return, 0, priv);
+}
+
+/* Find the command infor for given command
  *
- * It parses the rceived data to find the command and other metadata and
- * prepares the response to be sent
+ * Returns pointer to the info if found and NULL on error
+ */
+static esp_rmaker_cmd_info_t *esp_rmaker_get_cmd_info(uint16_t cmd)
+{
+    uint16_t *slot = esp_rmaker_cmd_table_slot(cmd, false);
+    if (slot && *slot) {
+        ESP_LOGI(TAG, "Handler found for command %d.", cmd);
+        return &cmd_table.entries[*slot - 1];
+    }
+    ESP_LOGE(TAG, "No handler found for command %d.", cmd);
+    return NULL;
+}
+
+/* Send the response for a job of the worker pool */
+static void esp_rmaker_cmd_job_send(const esp_rmaker_cmd_job_t *job, const void *output, size_t output_len)
+{
+    xSemaphoreTake(deferred_table.lock, portMAX_DELAY);
+    esp_rmaker_cmd_send_t send = deferred_table.send;
+    void *priv = deferred_table.priv;
+    xSemaphoreGive(deferred_table.lock);
+    if (send(output, output_len, priv) != ESP_OK) {
+        ESP_LOGE(TAG, "Failed to send response for Req. Id %s.", job->ctx.req_id);
+    }
+}
+
+/* Remove a command from the table. The jobs which have not started yet are returned in dropped, so that
+ * their responses can be sent once the table is unlocked.
+ */
+static esp_err_t esp_rmaker_cmd_table_remove(uint16_t cmd, esp_rmaker_cmd_job_t **dropped)
+{
+    uint16_t *slot = esp_rmaker_cmd_table_slot(cmd, false);
+    if (!slot || !*slot) {
+        ESP_LOGE(TAG, "Cannot unregister command %d as it wasn't registered.", cmd);
+        return ESP_ERR_INVALID_ARG;
+    }
+    uint16_t index = *slot - 1;
+    free(cmd_table.entries[index].cache);
+    /* Drop the jobs which have not started yet. The active ones will find the command gone. */
+    *dropped = cmd_table.entries[index].pending;
+    if (esp_rmaker_cmd_is_standard(cmd)) {
+        *slot = 0;
+    } else {
+        esp_rmaker_cmd_hash_remove(slot);
+    }
+    /* Move the last entry into the free position, to keep the array compact */
+    cmd_table.count--;
+    if (index != cmd_table.count) {
+        cmd_table.entries[index] = cmd_table.entries[cmd_table.count];
+        *esp_rmaker_cmd_table_slot(cmd_table.entries[index].cmd, false) = index + 1;
+    }
+    if (cmd_table.count == 0) {
+        esp_rmaker_cmd_table_free();
+    }
+    return ESP_OK;
+}
+
+/* De-register given command */
+esp_err_t esp_rmaker_cmd_deregister(uint16_t cmd)
+{
+    esp_rmaker_cmd_job_t *dropped = NULL;
+    esp_rmaker_cmd_table_lock();
+    esp_err_t err = esp_rmaker_cmd_table_remove(cmd, &dropped);
+    esp_rmaker_cmd_table_unlock();
+    while (dropped) {
+        esp_rmaker_cmd_job_t *next = dropped->next;
+        ESP_LOGW(TAG, "Dropping queued Req. Id %s for cmd %d.", dropped->ctx.req_id, cmd);
+        void *output = NULL;
+        size_t output_len = 0;
+        if (esp_rmaker_cmd_prepare_payload(dropped->ctx.req_id, 0, ESP_RMAKER_CMD_STATUS_FAILED, cmd, NULL, 0,
+                                           &output, &output_len) == ESP_OK) {
+            esp_rmaker_cmd_job_send(dropped, output, output_len);
+            free(output);
+        }
+        free(dropped);
+        dropped = next;
+    }
+    return err;
+}
+
+#if RMAKER_REPLAY_CACHE_SIZE > 0
+static void esp_rmaker_cmd_replay_lock(void)
+{
+    if (replay_cache.lock) {
+        xSemaphoreTake(replay_cache.lock, portMAX_DELAY);
+    }
+}
+
+static void esp_rmaker_cmd_replay_unlock(void)
+{
+    if (replay_cache.lock) {
+        xSemaphoreGive(replay_cache.lock);
+    }
+}
+
+static void esp_rmaker_cmd_replay_free(esp_rmaker_cmd_replay_entry_t *entry)
+{
+    free(entry->response);
+    memset(entry, 0, sizeof(esp_rmaker_cmd_replay_entry_t));
+}
+
+/* Check if an entry is for the same request, from the same user and transport */
+static bool esp_rmaker_cmd_replay_match(const esp_rmaker_cmd_replay_entry_t *entry, const char *req_id, uint16_t cmd,
+                                        uint8_t user_role, bool transport_role)
+{
+    return (entry->cmd == cmd) && (entry->user_role == user_role) && (entry->transport_role == transport_role) &&
+           (strncmp(entry->req_id, req_id, sizeof(entry->req_id)) == 0);
+}
+
+/* Get a copy of the cached response for a request, if any */
+static bool esp_rmaker_cmd_replay_lookup(const esp_rmaker_cmd_ctx_t *cmd_ctx, void **output, size_t *output_len)
+{
+    bool found = false;
+    esp_rmaker_cmd_replay_lock();
+    TickType_t now = xTaskGetTickCount();
+    for (int i = 0; i < RMAKER_REPLAY_CACHE_SIZE; i++) {
+        esp_rmaker_cmd_replay_entry_t *entry = &replay_cache.entries[i];
+        if (!entry->response) {
+            continue;
+        }
+        if ((now - entry->store_tick) >= pdMS_TO_TICKS(RMAKER_REPLAY_CACHE_TTL_MS)) {
+            esp_rmaker_cmd_replay_free(entry);
+            continue;
+        }
+        if (esp_rmaker_cmd_replay_match(entry, cmd_ctx->req_id, cmd_ctx->cmd, cmd_ctx->user_role, cmd_ctx->transport_role)) {
+            *output = CMD_CALLOC(1, entry->response_len);
+            if (*output) {
+                CMD_MEMCPY(*output, entry->response, entry->response_len);
+                *output_len = entry->response_len;
+                entry->last_use = ++replay_cache.use_count;
+                found = true;
+            }
+            break;
+        }
+    }
+    esp_rmaker_cmd_replay_unlock();
+    return found;
+}
+
+/* Save a response, replacing a free, expired or the least recently used entry */
+static void esp_rmaker_cmd_replay_store(const char *req_id, uint16_t cmd, uint8_t user_role, bool transport_role,
+                                        const void *response, size_t response_len)
+{
+    if (response_len > RMAKER_REPLAY_CACHE_MAX_LEN) {
+        ESP_LOGD(TAG, "Not caching the %d byte response for Req. Id %s.", (int)response_len, req_id);
+        return;
+    }
+    uint8_t *copy = CMD_CALLOC(1, response_len);
+    if (!copy) {
+        ESP_LOGW(TAG, "Failed to allocate memory to cache the response for Req. Id %s.", req_id);
+        return;
+    }
+    CMD_MEMCPY(copy, response, response_len);
+    esp_rmaker_cmd_replay_lock();
+    TickType_t now = xTaskGetTickCount();
+    esp_rmaker_cmd_replay_entry_t *victim = &replay_cache.entries[0];
+    for (int i = 0; i < RMAKER_REPLAY_CACHE_SIZE; i++) {
+        esp_rmaker_cmd_replay_entry_t *entry = &replay_cache.entries[i];
+        if (!entry->response || ((now - entry->store_tick) >= pdMS_TO_TICKS(RMAKER_REPLAY_CACHE_TTL_MS))) {
+            victim = entry;
+            break;
+        }
+        if (entry->last_use < victim->last_use) {
+            victim = entry;
+        }
+    }
+    esp_rmaker_cmd_replay_free(victim);
+    memcpy(victim->req_id, req_id, sizeof(victim->req_id));
+    victim->req_id[sizeof(victim->req_id) - 1] = '\0';
+    victim->cmd = cmd;
+    victim->user_role = user_role;
+    victim->transport_role = transport_role;
+    victim->store_tick = now;
+    victim->last_use = ++replay_cache.use_count;
+    victim->response = copy;
+    victim->response_len = response_len;
+    esp_rmaker_cmd_replay_unlock();
+}
+
+/* Whether a response of this length would be cached */
+static bool esp_rmaker_cmd_replay_fits(size_t response_len)
+{
+    return response_len <= RMAKER_REPLAY_CACHE_MAX_LEN;
+}
+
+esp_err_t esp_rmaker_cmd_replay_cache_clear(void)
+{
+    esp_rmaker_cmd_replay_lock();
+    for (int i = 0; i < RMAKER_REPLAY_CACHE_SIZE; i++) {
+        esp_rmaker_cmd_replay_free(&replay_cache.entries[i]);
+    }
+    esp_rmaker_cmd_replay_unlock();
+    return ESP_OK;
+}
+#else
+static bool esp_rmaker_cmd_replay_lookup(const esp_rmaker_cmd_ctx_t *cmd_ctx, void **output, size_t *output_len)
+{
+    return false;
+}
+
+static void esp_rmaker_cmd_replay_store(const char *req_id, uint16_t cmd, uint8_t user_role, bool transport_role,
+                                        const void *response, size_t response_len)
+{
+}
+
+static bool esp_rmaker_cmd_replay_fits(size_t response_len)
+{
+    return false;
+}
+
+esp_err_t esp_rmaker_cmd_replay_cache_clear(void)
+{
+    return ESP_OK;
+}
+#endif /* RMAKER_REPLAY_CACHE_SIZE > 0 */
+
+/* Get the command info without logging, unlike esp_rmaker_get_cmd_info() */
+static esp_rmaker_cmd_info_t *esp_rmaker_cmd_table_find(uint16_t cmd)
+{
+    uint16_t *slot = esp_rmaker_cmd_table_slot(cmd, false);
+    return (slot && *slot) ? &cmd_table.entries[*slot - 1] : NULL;
+}
+
+static void esp_rmaker_cmd_cache_free(esp_rmaker_cmd_info_t *cmd_info)
+{
+    free(cmd_info->cache);
+    cmd_info->cache = NULL;
+    cmd_info->cache_gen++;
+}
+
+/* Build a response from a cached one, by adding the request id in front of it */
+static esp_err_t esp_rmaker_cmd_cache_build(const char *req_id, const uint8_t *response, size_t response_len,
+                                            void **output, size_t *output_len)
+{
+    size_t id_len = esp_rmaker_get_tlv_encoded_size(strlen(req_id));
+    uint8_t *buf = CMD_CALLOC(1, id_len + response_len);
+    if (!buf) {
+        ESP_LOGE(TAG, "Failed to allocate buffer of size %d for cached response.", (int)(id_len + response_len));
+        return ESP_ERR_NO_MEM;
+    }
+    esp_rmaker_tlv_data_t tlv_data;
+    esp_rmaker_tlv_data_init(&tlv_data, buf, id_len);
+    esp_rmaker_add_tlv(&tlv_data, ESP_RMAKER_TLV_TYPE_REQ_ID, strlen(req_id), req_id);
+    CMD_MEMCPY(buf + id_len, response, response_len);
+    *output = buf;
+    *output_len = id_len + response_len;
+    return ESP_OK;
+}
+
+/* Check if the data in a view matches a buffer of the same length */
+static bool esp_rmaker_cmd_data_view_equal(const esp_rmaker_cmd_data_view_t *view, const uint8_t *data)
+{
+    esp_rmaker_cmd_data_iter_t iter;
+    const void *segment;
+    size_t segment_len;
+    esp_rmaker_cmd_data_view_iter_init(view, &iter);
+    while (esp_rmaker_cmd_data_view_iter_next(&iter, &segment, &segment_len)) {
+        if (memcmp(segment, data, segment_len) != 0) {
+            return false;
+        }
+        data += segment_len;
+    }
+    return true;
+}
+
+/* Get the cached response for a request, if there is one for the same data */
+static bool esp_rmaker_cmd_cache_lookup(const esp_rmaker_cmd_ctx_t *cmd_ctx, const esp_rmaker_cmd_data_view_t *view,
+                                        void **output, size_t *output_len)
+{
+    bool found = false;
+    esp_rmaker_cmd_table_lock();
+    esp_rmaker_cmd_info_t *cmd_info = esp_rmaker_cmd_table_find(cmd_ctx->cmd);
+    if (cmd_info && cmd_info->cache) {
+        if ((xTaskGetTickCount() - cmd_info->cache_tick) >= pdMS_TO_TICKS(cmd_info->cache_ttl_ms)) {
+            esp_rmaker_cmd_cache_free(cmd_info);
+        } else if ((cmd_info->cache_role == cmd_ctx->user_role) && (cmd_info->cache_data_len == view->len) &&
+                   esp_rmaker_cmd_data_view_equal(view, cmd_info->cache)) {
+            found = (esp_rmaker_cmd_cache_build(cmd_ctx->req_id, cmd_info->cache + cmd_info->cache_data_len,
+                                                cmd_info->cache_resp_len, output, output_len) == ESP_OK);
+        }
+    }
+    esp_rmaker_cmd_table_unlock();
+    return found;
+}
+
+/* Encode a successful response into the cache of the command, and build the response from it.
+ * cmd_info is the copy taken before the handler was called.
+ */
+static esp_err_t esp_rmaker_cmd_cache_store(const esp_rmaker_cmd_info_t *cmd_info, const esp_rmaker_cmd_data_view_t *view,
+                                            const esp_rmaker_cmd_ctx_t *cmd_ctx, const void *response, size_t response_size,
+                                            void **output, size_t *output_len)
+{
+    size_t resp_len = esp_rmaker_cmd_get_payload_size(NULL, 0, ESP_RMAKER_CMD_STATUS_SUCCESS, cmd_ctx->cmd,
+                                                       cmd_ctx->resp_content_type, response, response_size);
+    uint8_t *cache = CMD_CALLOC(1, view->len + resp_len);
+    if (!cache) {
+        ESP_LOGW(TAG, "Failed to allocate memory to cache the response for cmd %d.", cmd_ctx->cmd);
+        return esp_rmaker_cmd_prepare_payload_with_type(cmd_ctx->req_id, 0, ESP_RMAKER_CMD_STATUS_SUCCESS, cmd_ctx->cmd,
+                                                        cmd_ctx->resp_content_type, response, response_size,
+                                                        output, output_len);
+    }
+    esp_rmaker_cmd_data_view_copy(view, cache, view->len);
+    esp_rmaker_tlv_data_t tlv_data;
+    esp_rmaker_tlv_data_init(&tlv_data, cache + view->len, resp_len);
+    esp_err_t err = esp_rmaker_cmd_encode(&tlv_data, NULL, 0, ESP_RMAKER_CMD_STATUS_SUCCESS, cmd_ctx->cmd,
+                                          cmd_ctx->resp_content_type, response, response_size);
+    if (err == ESP_OK) {
+        err = esp_rmaker_cmd_cache_build(cmd_ctx->req_id, cache + view->len, resp_len, output, output_len);
+    }
+    if (err == ESP_OK) {
+        esp_rmaker_cmd_table_lock();
+        esp_rmaker_cmd_info_t *info = esp_rmaker_cmd_table_find(cmd_ctx->cmd);
+        if (info && (info->flags & ESP_RMAKER_CMD_FLAG_CACHEABLE) && (info->cache_gen == cmd_info->cache_gen)) {
+            esp_rmaker_cmd_cache_free(info);
+            info->cache = cache;
+            info->cache_role = cmd_ctx->user_role;
+            info->cache_data_len = view->len;
+            info->cache_resp_len = resp_len;
+            info->cache_tick = xTaskGetTickCount();
+            cache = NULL;
+        }
+        esp_rmaker_cmd_table_unlock();
+    }
+    free(cache);
+    return err;
+}
+
+esp_err_t esp_rmaker_cmd_set_cache_ttl(uint16_t cmd, uint32_t ttl_ms)
+{
+    esp_err_t err = ESP_OK;
+    esp_rmaker_cmd_table_lock();
+    esp_rmaker_cmd_info_t *cmd_info = esp_rmaker_cmd_table_find(cmd);
+    if (cmd_info) {
+        if (ttl_ms) {
+            cmd_info->flags |= ESP_RMAKER_CMD_FLAG_CACHEABLE;
+            cmd_info->cache_ttl_ms = ttl_ms;
+        } else {
+            cmd_info->flags &= ~ESP_RMAKER_CMD_FLAG_CACHEABLE;
+            esp_rmaker_cmd_cache_free(cmd_info);
+        }
+    } else {
+        err = ESP_ERR_INVALID_ARG;
+    }
+    esp_rmaker_cmd_table_unlock();
+    return err;
+}
+
+esp_err_t esp_rmaker_cmd_cache_invalidate(uint16_t cmd)
+{
+    esp_err_t err = ESP_OK;
+    esp_rmaker_cmd_table_lock();
+    if (cmd == 0) {
+        for (int i = 0; i < cmd_table.count; i++) {
+            esp_rmaker_cmd_cache_free(&cmd_table.entries[i]);
+        }
+    } else {
+        esp_rmaker_cmd_info_t *cmd_info = esp_rmaker_cmd_table_find(cmd);
+        if (cmd_info) {
+            esp_rmaker_cmd_cache_free(cmd_info);
+        } else {
+            err = ESP_ERR_INVALID_ARG;
+        }
+    }
+    esp_rmaker_cmd_table_unlock();
+    return err;
+}
+
+#if CONFIG_ESP_RMAKER_CMD_TRACE
+static inline int64_t esp_rmaker_cmd_trace_now(void)
+{
+    return esp_timer_get_time();
+}
+
+static void esp_rmaker_cmd_trace_lock(void)
+{
+    if (trace_table.lock) {
+        xSemaphoreTake(trace_table.lock, portMAX_DELAY);
+    }
+}
+
+static void esp_rmaker_cmd_trace_unlock(void)
+{
+    if (trace_table.lock) {
+        xSemaphoreGive(trace_table.lock);
+    }
+}
+
+/* Find the trace for a command, adding it if there is space. Should be called with the lock held. */
+static esp_rmaker_cmd_trace_t *esp_rmaker_cmd_trace_find(uint16_t cmd, bool add)
+{
+    for (int i = 0; i < trace_table.count; i++) {
+        if (trace_table.entries[i].cmd == cmd) {
+            return &trace_table.entries[i];
+        }
+    }
+    if (!add || trace_table.count >= RMAKER_TRACE_MAX_CMDS) {
+        return NULL;
+    }
+    esp_rmaker_cmd_trace_t *trace = &trace_table.entries[trace_table.count++];
+    memset(trace, 0, sizeof(esp_rmaker_cmd_trace_t));
+    trace->cmd = cmd;
+    return trace;
+}
+
+static int esp_rmaker_cmd_trace_bucket(uint32_t time_us)
+{
+    if (time_us < ESP_RMAKER_CMD_TRACE_BUCKET_LIMIT_US(0)) {
+        return 0;
+    }
+    /* Bucket i >= 1 covers [2^(i+5), 2^(i+6)) us */
+    int bucket = (31 - __builtin_clz(time_us)) - 5;
+    return (bucket < ESP_RMAKER_CMD_TRACE_BUCKETS) ? bucket : (ESP_RMAKER_CMD_TRACE_BUCKETS - 1);
+}
+
+/* Record the time taken by a phase, since start_us */
+static void esp_rmaker_cmd_trace_time(uint16_t cmd, esp_rmaker_cmd_trace_phase_t phase, int64_t start_us)
+{
+    int64_t elapsed = esp_rmaker_cmd_trace_now() - start_us;
+    uint32_t time_us = (elapsed < 0) ? 0 : ((elapsed > UINT32_MAX) ? UINT32_MAX : (uint32_t)elapsed);
+    esp_rmaker_cmd_trace_lock();
+    esp_rmaker_cmd_trace_t *trace = esp_rmaker_cmd_trace_find(cmd, true);
+    if (trace) {
+        esp_rmaker_cmd_histogram_t *hist = &trace->phases[phase];
+        hist->count++;
+        hist->total_us += time_us;
+        if (time_us > hist->max_us) {
+            hist->max_us = time_us;
+        }
+        hist->buckets[esp_rmaker_cmd_trace_bucket(time_us)]++;
+    }
+    esp_rmaker_cmd_trace_unlock();
+}
+
+static void esp_rmaker_cmd_trace_status(uint16_t cmd, uint8_t status)
+{
+    if (status >= ESP_RMAKER_CMD_STATUS_MAX) {
+        return;
+    }
+    esp_rmaker_cmd_trace_lock();
+    esp_rmaker_cmd_trace_t *trace = esp_rmaker_cmd_trace_find(cmd, true);
+    if (trace) {
+        trace->status[status]++;
+    }
+    esp_rmaker_cmd_trace_unlock();
+}
+#else
+static inline int64_t esp_rmaker_cmd_trace_now(void)
+{
+    return 0;
+}
+
+static inline void esp_rmaker_cmd_trace_time(uint16_t cmd, esp_rmaker_cmd_trace_phase_t phase, int64_t start_us)
+{
+}
+
+static inline void esp_rmaker_cmd_trace_status(uint16_t cmd, uint8_t status)
+{
+}
+#endif /* CONFIG_ESP_RMAKER_CMD_TRACE */
+
+/* Get the role index, from 0 for super admin to 3 for node. -1 if no role is set. */
+static inline int esp_rmaker_cmd_role_index(uint8_t user_role)
+{
+    return __builtin_ffs(ESP_RMAKER_GET_USER_ROLE(user_role)) - 1;
+}
+
+/* Check a command against the rate limit for the user role, and get its priority.
+ * Returns true if the command should be throttled.
+ */
+static bool esp_rmaker_cmd_role_throttle(uint8_t user_role, uint8_t *priority)
+{
+    int role = esp_rmaker_cmd_role_index(user_role);
+    if (role < 0) {
+        *priority = 0;
+        return false;
+    }
+    *priority = role_default_priority[role];
+    if (!role_table.lock) {
+        /* No limits set */
+        return false;
+    }
+    bool throttled = false;
+    xSemaphoreTake(role_table.lock, portMAX_DELAY);
+    esp_rmaker_cmd_role_bucket_t *bucket = &role_table.buckets[role][ESP_RMAKER_GET_USER_SUB_ROLE(user_role)];
+    if (!bucket->configured) {
+        bucket = &role_table.buckets[role][0];
+    }
+    if (bucket->configured) {
+        if (bucket->limits.priority) {
+            *priority = bucket->limits.priority;
+        }
+        if (bucket->limits.rate) {
+            /* Refill for the time since the last command, up to the burst size */
+            TickType_t now = xTaskGetTickCount();
+            uint64_t refill = (uint64_t)(now - bucket->last_tick) * portTICK_PERIOD_MS * bucket->limits.rate;
+            uint32_t max_tokens = (uint32_t)bucket->limits.burst * 1000;
+            bucket->tokens = (refill >= max_tokens - bucket->tokens) ? max_tokens : bucket->tokens + (uint32_t)refill;
+            bucket->last_tick = now;
+            if (bucket->tokens >= 1000) {
+                bucket->tokens -= 1000;
+            } else {
+                bucket->throttled++;
+                throttled = true;
+            }
+        }
+    }
+    xSemaphoreGive(role_table.lock);
+    return throttled;
+}
+
+/* Get the bucket for a role, with an optional sub-role. NULL if the role is invalid. */
+static esp_rmaker_cmd_role_bucket_t *esp_rmaker_cmd_role_bucket(uint8_t user_role)
+{
+    uint8_t role_flags = ESP_RMAKER_GET_USER_ROLE(user_role);
+    uint8_t sub_role_flags = user_role & ESP_RMAKER_USER_SUB_ROLE_MASK;
+    /* Exactly one role flag, and at most one sub-role flag */
+    if (!role_flags || (role_flags & (role_flags - 1)) || (sub_role_flags & (sub_role_flags - 1))) {
+        return NULL;
+    }
+    return &role_table.buckets[esp_rmaker_cmd_role_index(user_role)][ESP_RMAKER_GET_USER_SUB_ROLE(user_role)];
+}
+
+esp_err_t esp_rmaker_cmd_set_role_limits(uint8_t user_role, const esp_rmaker_cmd_role_limits_t *limits)
+{
+    esp_rmaker_cmd_role_bucket_t *bucket = esp_rmaker_cmd_role_bucket(user_role);
+    if (!bucket || (limits && limits->rate && !limits->burst)) {
+        ESP_LOGE(TAG, "Invalid role 0x%02x or limits.", user_role);
+        return ESP_ERR_INVALID_ARG;
+    }
+    if (!role_table.lock) {
+        role_table.lock = xSemaphoreCreateMutex();
+        if (!role_table.lock) {
+            ESP_LOGE(TAG, "Failed to create role limits lock.");
+            return ESP_ERR_NO_MEM;
+        }
+    }
+    xSemaphoreTake(role_table.lock, portMAX_DELAY);
+    if (limits) {
+        bucket->limits = *limits;
+        bucket->configured = true;
+        /* Start with a full bucket */
+        bucket->tokens = (uint32_t)limits->burst * 1000;
+        bucket->last_tick = xTaskGetTickCount();
+    } else {
+        bucket->configured = false;
+    }
+    xSemaphoreGive(role_table.lock);
+    return ESP_OK;
+}
+
+esp_err_t esp_rmaker_cmd_get_throttled_count(uint8_t user_role, uint32_t *count)
+{
+    esp_rmaker_cmd_role_bucket_t *bucket = esp_rmaker_cmd_role_bucket(user_role);
+    if (!bucket || !count) {
+        return ESP_ERR_INVALID_ARG;
+    }
+    if (!role_table.lock) {
+        /* No limits ever set */
+        *count = 0;
+        return ESP_OK;
+    }
+    xSemaphoreTake(role_table.lock, portMAX_DELAY);
+    *count = bucket->throttled;
+    xSemaphoreGive(role_table.lock);
+    return ESP_OK;
+}
+
+esp_err_t esp_rmaker_cmd_middleware_add(const esp_rmaker_cmd_middleware_t *middleware)
+{
+    if (!middleware || (!middleware->pre && !middleware->post)) {
+        return ESP_ERR_INVALID_ARG;
+    }
+    if (esp_rmaker_cmd_table_lock_init() != ESP_OK) {
+        return ESP_ERR_NO_MEM;
+    }
+    esp_err_t err = ESP_OK;
+    esp_rmaker_cmd_table_lock();
+    if (middleware_table.count < RMAKER_MAX_MIDDLEWARE) {
+        middleware_table.entries[middleware_table.count] = *middleware;
+        middleware_table.count++;
+    } else {
+        ESP_LOGE(TAG, "No space to add middleware.");
+        err = ESP_ERR_NO_MEM;
+    }
+    esp_rmaker_cmd_table_unlock();
+    return err;
+}
+
+/* Run the pre hooks of the first count middleware, till one of them rejects the command.
+ * Returns the status, with the number of middleware whose post hooks should run in *ran.
+ */
+static uint8_t esp_rmaker_cmd_middleware_pre(uint8_t count, const esp_rmaker_cmd_data_view_t *view,
+                                             esp_rmaker_cmd_ctx_t *cmd_ctx, uint8_t *ran)
+{
+    for (uint8_t i = 0; i < count; i++) {
+        const esp_rmaker_cmd_middleware_t *middleware = &middleware_table.entries[i];
+        esp_rmaker_cmd_status_t status = middleware->pre ?
+                                         middleware->pre(view, cmd_ctx, middleware->priv) : ESP_RMAKER_CMD_STATUS_SUCCESS;
+        if (status != ESP_RMAKER_CMD_STATUS_SUCCESS) {
+            *ran = i + 1;
+            return status;
+        }
+    }
+    *ran = count;
+    return ESP_RMAKER_CMD_STATUS_SUCCESS;
+}
+
+/* Run the post hooks of the first count middleware, in reverse order */
+static void esp_rmaker_cmd_middleware_post(uint8_t count, const esp_rmaker_cmd_data_view_t *view,
+                                           const esp_rmaker_cmd_ctx_t *cmd_ctx, uint8_t status)
+{
+    while (count > 0) {
+        const esp_rmaker_cmd_middleware_t *middleware = &middleware_table.entries[--count];
+        if (middleware->post) {
+            middleware->post(view, cmd_ctx, status, middleware->priv);
+        }
+    }
+}
+
+/* Pass the data to a chunked handler, one record at a time. Only the last call can respond. */
+static esp_err_t esp_rmaker_cmd_call_chunked(const esp_rmaker_cmd_info_t *cmd_info, const esp_rmaker_cmd_data_view_t *view,
+                                             esp_rmaker_cmd_ctx_t *cmd_ctx, void **response, size_t *response_size)
+{
+    esp_rmaker_cmd_data_iter_t iter;
+    const void *chunk = NULL;
+    size_t chunk_len = 0;
+    size_t offset = 0;
+    esp_rmaker_cmd_data_view_iter_init(view, &iter);
+    bool more = esp_rmaker_cmd_data_view_iter_next(&iter, &chunk, &chunk_len);
+    do {
+        const void *next_chunk = NULL;
+        size_t next_len = 0;
+        bool last = !(more && esp_rmaker_cmd_data_view_iter_next(&iter, &next_chunk, &next_len));
+        esp_err_t err = cmd_info->chunk_handler(chunk, chunk_len, offset, view->len, last,
+                                                last ? response : NULL, last ? response_size : NULL,
+                                                cmd_ctx, cmd_info->priv);
+        if (last || err != ESP_OK) {
+            return err;
+        }
+        offset += chunk_len;
+        chunk = next_chunk;
+        chunk_len = next_len;
+    } while (true);
+}
+
+/* Writer given to esp_rmaker_cmd_response_handler_to_writer() */
+typedef struct {
+    esp_rmaker_cmd_write_t write;
+    void *priv;
+    /* Length written so far */
+    size_t len;
+} esp_rmaker_cmd_resp_writer_t;
+
+/* Encode a successful response through the writer, instead of into an allocated buffer */
+static esp_err_t esp_rmaker_cmd_resp_write(esp_rmaker_cmd_resp_writer_t *writer, const esp_rmaker_cmd_ctx_t *cmd_ctx,
+                                           const void *response, size_t response_size)
+{
+    esp_rmaker_tlv_data_t tlv_data;
+    esp_rmaker_tlv_data_init(&tlv_data, NULL, 0);
+    tlv_data.write = writer->write;
+    tlv_data.priv = writer->priv;
+    esp_err_t err = esp_rmaker_cmd_encode(&tlv_data, cmd_ctx->req_id, 0, ESP_RMAKER_CMD_STATUS_SUCCESS, cmd_ctx->cmd,
+                                          cmd_ctx->resp_content_type, response, response_size);
+    writer->len += tlv_data.curlen;
+    return err;
+}
+
+/* Response prepared by the handler itself, using esp_rmaker_cmd_respond_encoded() */
+typedef struct {
+    /* Whether the data can be encoded into the response buffer. Not for cached responses, which need the data. */
+    bool in_place;
+    /* The whole response, if the data was encoded in place */
+    void *output;
+    size_t output_len;
+    /* The data alone, otherwise */
+    void *data;
+    size_t data_len;
+} esp_rmaker_cmd_resp_state_t;
+
+esp_err_t esp_rmaker_cmd_respond_encoded(esp_rmaker_cmd_ctx_t *ctx, size_t data_size,
+                                         esp_rmaker_cmd_resp_encode_t encode, const void *arg)
+{
+    if (!ctx || !encode) {
+        return ESP_ERR_INVALID_ARG;
+    }
+    esp_rmaker_cmd_resp_state_t *state = (esp_rmaker_cmd_resp_state_t *)ctx->resp_state;
+    if (!state || state->output || state->data) {
+        return ESP_ERR_INVALID_STATE;
+    }
+    /* Data of more than 255 bytes is split across TLVs, and so, cannot be encoded in place */
+    if (!state->in_place || (data_size == 0) || (data_size > 255)) {
+        uint8_t *data = CMD_CALLOC(1, data_size ? data_size : 1);
+        if (!data) {
+            ESP_LOGE(TAG, "Failed to allocate buffer of size %d for the response.", (int)data_size);
+            return ESP_ERR_NO_MEM;
+        }
+        esp_err_t err = encode(arg, data, data_size, &state->data_len);
+        if (err != ESP_OK) {
+            free(data);
+            return err;
+        }
+        state->data = data;
+        return ESP_OK;
+    }
+    size_t payload_size = esp_rmaker_cmd_get_payload_size(ctx->req_id, 0, ESP_RMAKER_CMD_STATUS_SUCCESS, ctx->cmd,
+                                                          ctx->resp_content_type, NULL, 0);
+    payload_size += esp_rmaker_get_tlv_encoded_size(data_size);
+    uint8_t *payload = CMD_CALLOC(1, payload_size);
+    if (!payload) {
+        ESP_LOGE(TAG, "Failed to allocate buffer of size %d for payload.", (int)payload_size);
+        return ESP_ERR_NO_MEM;
+    }
+    esp_rmaker_tlv_data_t tlv_data;
+    esp_rmaker_tlv_data_init(&tlv_data, payload, payload_size);
+    esp_err_t err = esp_rmaker_cmd_encode(&tlv_data, ctx->req_id, 0, ESP_RMAKER_CMD_STATUS_SUCCESS, ctx->cmd,
+                                          ctx->resp_content_type, NULL, 0);
+    size_t data_len = 0;
+    if (err == ESP_OK) {
+        err = encode(arg, &payload[tlv_data.curlen + 2], data_size, &data_len);
+    }
+    if ((err == ESP_OK) && (data_len > data_size)) {
+        err = ESP_ERR_INVALID_SIZE;
+    }
+    if (err != ESP_OK) {
+        free(payload);
+        return err;
+    }
+    /* Empty data is left out, like in esp_rmaker_cmd_prepare_payload() */
+    if (data_len > 0) {
+        payload[tlv_data.curlen] = ESP_RMAKER_TLV_TYPE_DATA;
+        payload[tlv_data.curlen + 1] = data_len;
+        tlv_data.curlen += 2 + data_len;
+    }
+    state->output = payload;
+    state->output_len = tlv_data.curlen;
+    return ESP_OK;
+}
+
+/* Run the handler for a command and prepare its response. If writer is not NULL, a successful response
+ * which would not go to the replay cache is passed to it, and output is set to NULL.
+ */
+static esp_err_t esp_rmaker_cmd_execute(const esp_rmaker_cmd_info_t *cmd_info, const esp_rmaker_cmd_data_view_t *view,
+                                        esp_rmaker_cmd_ctx_t *cmd_ctx, esp_rmaker_cmd_resp_writer_t *writer,
+                                        void **output, size_t *output_len)
+{
+    /* Data in a single record is passed directly from the input. Only the data split
+     * across records needs to be copied, unless the handler takes a data view.
+     */
+    const void *in_data = esp_rmaker_cmd_data_view_get_ptr(view);
+    void *data = NULL;
+    if (view->len == 0) {
+        /* It is not mandatory to have data for a given command. So, just throwing a warning */
+        ESP_LOGW(TAG, "No data received for the command.");
+    }
+    if (cmd_info->chunk_handler || (cmd_info->flags & ESP_RMAKER_CMD_FLAG_DATA_VIEW)) {
+        in_data = view;
+    } else if (view->len > 0 && !in_data) {
+        data = CMD_CALLOC(1, view->len);
+        if (!data) {
+            ESP_LOGE(TAG, "Failed to allocate buffer of size %d for data.", (int)view->len);
+            esp_rmaker_cmd_middleware_post(cmd_info->middleware_count, view, cmd_ctx, ESP_RMAKER_CMD_STATUS_FAILED);
+            return ESP_ERR_NO_MEM;
+        }
+        esp_rmaker_cmd_data_view_copy(view, data, view->len);
+        in_data = data;
+    }
+    void *response = NULL;
+    size_t response_size = 0;
+    esp_err_t err;
+    esp_rmaker_cmd_resp_state_t resp_state = {
+        .in_place = !(cmd_info->flags & ESP_RMAKER_CMD_FLAG_CACHEABLE),
+    };
+    cmd_ctx->resp_state = &resp_state;
+    int64_t start = esp_rmaker_cmd_trace_now();
+    if (cmd_info->chunk_handler) {
+        err = esp_rmaker_cmd_call_chunked(cmd_info, view, cmd_ctx, &response, &response_size);
+    } else {
+        err = cmd_info->handler(in_data, view->len, &response, &response_size, cmd_ctx, cmd_info->priv);
+    }
+    cmd_ctx->resp_state = NULL;
+    if (resp_state.data) {
+        response = resp_state.data;
+        response_size = resp_state.data_len;
+    }
+    esp_rmaker_cmd_trace_time(cmd_ctx->cmd, ESP_RMAKER_CMD_TRACE_HANDLER, start);
+    if ((err == ESP_ERR_NOT_FINISHED) && cmd_ctx->transport_role) {
+        /* A later response could only go through the deferred send function, which does not reach
+         * the transport. So, fail it now rather than leave the client without a response.
+         */
+        ESP_LOGE(TAG, "Req. Id %s from a transport with its own role cannot be deferred.", cmd_ctx->req_id);
+        err = ESP_ERR_NOT_SUPPORTED;
+    }
+    start = esp_rmaker_cmd_trace_now();
+    uint8_t status = (err == ESP_OK) ? ESP_RMAKER_CMD_STATUS_SUCCESS : ESP_RMAKER_CMD_STATUS_FAILED;
+    if (err == ESP_ERR_NOT_FINISHED) {
+        /* Handler deferred the response. It will call esp_rmaker_cmd_prepare_payload() later. */
+        *output = NULL;
+        *output_len = 0;
+        err = ESP_OK;
+        status = ESP_RMAKER_CMD_STATUS_MAX;
+    } else if ((err == ESP_OK) && resp_state.output) {
+        /* Already encoded by the handler */
+        *output = resp_state.output;
+        *output_len = resp_state.output_len;
+        resp_state.output = NULL;
+        esp_rmaker_cmd_trace_time(cmd_ctx->cmd, ESP_RMAKER_CMD_TRACE_ENCODE, start);
+        esp_rmaker_cmd_trace_status(cmd_ctx->cmd, ESP_RMAKER_CMD_STATUS_SUCCESS);
+    } else if ((err == ESP_OK) && (cmd_info->flags & ESP_RMAKER_CMD_FLAG_CACHEABLE)) {
+        err = esp_rmaker_cmd_cache_store(cmd_info, view, cmd_ctx, response, response_size, output, output_len);
+        esp_rmaker_cmd_trace_time(cmd_ctx->cmd, ESP_RMAKER_CMD_TRACE_ENCODE, start);
+        esp_rmaker_cmd_trace_status(cmd_ctx->cmd, ESP_RMAKER_CMD_STATUS_SUCCESS);
+    } else if ((err == ESP_OK) && writer &&
+               !esp_rmaker_cmd_replay_fits(esp_rmaker_cmd_get_payload_size(cmd_ctx->req_id, 0, ESP_RMAKER_CMD_STATUS_SUCCESS,
+                                                                           cmd_ctx->cmd, cmd_ctx->resp_content_type,
+                                                                           response, response_size))) {
+        *output = NULL;
+        *output_len = 0;
+        err = esp_rmaker_cmd_resp_write(writer, cmd_ctx, response, response_size);
+        esp_rmaker_cmd_trace_time(cmd_ctx->cmd, ESP_RMAKER_CMD_TRACE_ENCODE, start);
+        esp_rmaker_cmd_trace_status(cmd_ctx->cmd, ESP_RMAKER_CMD_STATUS_SUCCESS);
+    } else if (err == ESP_OK) {
+        err = esp_rmaker_cmd_prepare_payload_with_type(cmd_ctx->req_id, 0, ESP_RMAKER_CMD_STATUS_SUCCESS, cmd_ctx->cmd,
+                                                       cmd_ctx->resp_content_type, response, response_size,
+                                                       output, output_len);
+        esp_rmaker_cmd_trace_time(cmd_ctx->cmd, ESP_RMAKER_CMD_TRACE_ENCODE, start);
+        esp_rmaker_cmd_trace_status(cmd_ctx->cmd, ESP_RMAKER_CMD_STATUS_SUCCESS);
+    } else {
+        err = esp_rmaker_cmd_prepare_payload(cmd_ctx->req_id, 0, ESP_RMAKER_CMD_STATUS_FAILED, cmd_ctx->cmd, NULL, 0, output, output_len);
+        esp_rmaker_cmd_trace_time(cmd_ctx->cmd, ESP_RMAKER_CMD_TRACE_ENCODE, start);
+        esp_rmaker_cmd_trace_status(cmd_ctx->cmd, ESP_RMAKER_CMD_STATUS_FAILED);
+    }
+    /* A response prepared by the handler is dropped if it then failed */
+    free(resp_state.output);
+    if (resp_state.data) {
+        free(resp_state.data);
+    } else if (response && cmd_info->free_on_return) {
+        ESP_LOGI(TAG, "Freeing response buffer.");
+        free(response);
+    }
+    if (data) {
+        free(data);
+    }
+    esp_rmaker_cmd_middleware_post(cmd_info->middleware_count, view, cmd_ctx, status);
+    return err;
+}
+
+/* Insert a job in a list, after the jobs with the same or higher priority */
+static void esp_rmaker_cmd_job_insert(esp_rmaker_cmd_job_t **list, esp_rmaker_cmd_job_t *job)
+{
+    while (*list && ((*list)->priority >= job->priority)) {
+        list = &(*list)->next;
+    }
+    job->next = *list;
+    *list = job;
+}
+
+/* Queue a command on the worker pool, if it is within its limits */
+static esp_err_t esp_rmaker_cmd_worker_submit(const esp_rmaker_cmd_data_view_t *view, const esp_rmaker_cmd_ctx_t *cmd_ctx,
+                                              uint8_t priority, void **output, size_t *output_len)
+{
+    size_t tlv_len = view->len ? esp_rmaker_get_tlv_encoded_size(view->len) : 0;
+    esp_rmaker_cmd_job_t *job = CMD_CALLOC(1, sizeof(esp_rmaker_cmd_job_t) + tlv_len);
+    if (!job) {
+        ESP_LOGE(TAG, "Failed to allocate job for cmd %d.", cmd_ctx->cmd);
+        esp_rmaker_cmd_trace_status(cmd_ctx->cmd, ESP_RMAKER_CMD_STATUS_FAILED);
+        return esp_rmaker_cmd_prepare_payload(cmd_ctx->req_id, 0, ESP_RMAKER_CMD_STATUS_FAILED, cmd_ctx->cmd, NULL, 0, output, output_len);
+    }
+    job->ctx = *cmd_ctx;
+    job->priority = priority;
+    job->data_len = view->len;
+    if (tlv_len) {
+        CMD_MEMCPY(job->tlv, view->tlv, tlv_len);
+    }
+    bool accepted = false;
+    esp_rmaker_cmd_table_lock();
+    esp_rmaker_cmd_info_t *cmd_info = esp_rmaker_get_cmd_info(cmd_ctx->cmd);
+    if (cmd_info && (cmd_info->active < cmd_info->max_active)) {
+        /* The queue only wakes up a worker, which then takes the first job from the ready list. If it is
+         * full, all the workers are busy, and will find this job once they are done with their current ones.
+         */
+        uint8_t wake = 0;
+        xQueueSend(worker_pool.queue, &wake, 0);
+        esp_rmaker_cmd_job_insert(&worker_pool.ready, job);
+        cmd_info->active++;
+        accepted = true;
+    } else if (cmd_info && (cmd_info->queued < cmd_info->max_queued)) {
+        esp_rmaker_cmd_job_insert(&cmd_info->pending, job);
+        cmd_info->queued++;
+        accepted = true;
+    }
+    esp_rmaker_cmd_table_unlock();
+    if (!accepted) {
+        ESP_LOGW(TAG, "Cmd %d is busy. Rejecting Req. Id %s.", cmd_ctx->cmd, cmd_ctx->req_id);
+        free(job);
+        esp_rmaker_cmd_trace_status(cmd_ctx->cmd, ESP_RMAKER_CMD_STATUS_FAILED);
+        return esp_rmaker_cmd_prepare_payload(cmd_ctx->req_id, 0, ESP_RMAKER_CMD_STATUS_FAILED, cmd_ctx->cmd, NULL, 0, output, output_len);
+    }
+    /* The response will be sent by the worker */
+    *output = NULL;
+    *output_len = 0;
+    return ESP_OK;
+}
+
+/* Take a running instance of a command, for running it in the calling task rather than on a worker */
+static bool esp_rmaker_cmd_worker_claim(uint16_t cmd)
+{
+    bool claimed = false;
+    esp_rmaker_cmd_table_lock();
+    esp_rmaker_cmd_info_t *cmd_info = esp_rmaker_get_cmd_info(cmd);
+    if (cmd_info && (cmd_info->active < cmd_info->max_active)) {
+        cmd_info->active++;
+        claimed = true;
+    }
+    esp_rmaker_cmd_table_unlock();
+    return claimed;
+}
+
+/* Release an instance taken by esp_rmaker_cmd_worker_claim(). The next queued job, if any, gets it on a worker. */
+static void esp_rmaker_cmd_worker_release(uint16_t cmd)
+{
+    esp_rmaker_cmd_table_lock();
+    esp_rmaker_cmd_info_t *cmd_info = esp_rmaker_get_cmd_info(cmd);
+    if (cmd_info && cmd_info->pending) {
+        esp_rmaker_cmd_job_t *job = cmd_info->pending;
+        cmd_info->pending = job->next;
+        cmd_info->queued--;
+        uint8_t wake = 0;
+        xQueueSend(worker_pool.queue, &wake, 0);
+        esp_rmaker_cmd_job_insert(&worker_pool.ready, job);
+    } else if (cmd_info && cmd_info->active) {
+        cmd_info->active--;
+    }
+    esp_rmaker_cmd_table_unlock();
+}
+
+/* Handle a single command, with all the fields read from the index. Parsing started at parse_start.
+ * If user_role is not 0, it is used instead of the role in the command. The writer, if not NULL, is
+ * passed on to esp_rmaker_cmd_execute().
  */
-esp_err_t esp_rmaker_cmd_response_handler(const void *input, size_t input_len, void **output, size_t *output_len)
+static esp_err_t esp_rmaker_cmd_handle(const esp_rmaker_tlv_index_t *index, uint8_t user_role, int64_t parse_start,
+                                       esp_rmaker_cmd_resp_writer_t *writer, void **output, size_t *output_len)
 {
     esp_rmaker_cmd_ctx_t cmd_ctx = {0};
 
     /* Read request id, user role and command, since these are mandatory fields */
-    esp_rmaker_get_value_from_tlv(input, input_len, ESP_RMAKER_TLV_TYPE_REQ_ID, &cmd_ctx.req_id, sizeof(cmd_ctx.req_id));
-    esp_rmaker_get_value_from_tlv(input, input_len, ESP_RMAKER_TLV_TYPE_USER_ROLE, &cmd_ctx.user_role, sizeof(cmd_ctx.user_role));
+    esp_rmaker_tlv_index_get_value(index, ESP_RMAKER_TLV_TYPE_REQ_ID, &cmd_ctx.req_id, sizeof(cmd_ctx.req_id) - 1);
+    esp_rmaker_tlv_index_get_value(index, ESP_RMAKER_TLV_TYPE_USER_ROLE, &cmd_ctx.user_role, sizeof(cmd_ctx.user_role));
+    if (user_role) {
+        cmd_ctx.user_role = user_role;
+        cmd_ctx.transport_role = true;
+    }
     uint8_t cmd_buf[2] = {0};
-    esp_rmaker_get_value_from_tlv(input, input_len, ESP_RMAKER_TLV_TYPE_CMD, cmd_buf, sizeof(cmd_buf));
+    esp_rmaker_tlv_index_get_value(index, ESP_RMAKER_TLV_TYPE_CMD, cmd_buf, sizeof(cmd_buf));
     cmd_ctx.cmd = get_u16_le(cmd_buf);
 
     /* Timestamp is optional. Parse it if present. */
     uint8_t ts_buf[4] = {0};
-    if (esp_rmaker_get_value_from_tlv(input, input_len, ESP_RMAKER_TLV_TYPE_TIMESTAMP, ts_buf, sizeof(ts_buf)) == sizeof(ts_buf)) {
+    if (esp_rmaker_tlv_index_get_value(index, ESP_RMAKER_TLV_TYPE_TIMESTAMP, ts_buf, sizeof(ts_buf)) == sizeof(ts_buf)) {
         cmd_ctx.timestamp = (uint32_t)ts_buf[0] | ((uint32_t)ts_buf[1] << 8) |
                             ((uint32_t)ts_buf[2] << 16) | ((uint32_t)ts_buf[3] << 24);
     }
+    /* Content type is optional too. It stays 0 (unspecified) if absent. */
+    esp_rmaker_tlv_index_get_value(index, ESP_RMAKER_TLV_TYPE_CONTENT_TYPE, &cmd_ctx.content_type,
+                                   sizeof(cmd_ctx.content_type));
 
     if (strlen(cmd_ctx.req_id) == 0 || cmd_ctx.user_role == 0 || cmd_ctx.cmd == 0) {
         ESP_LOGE(TAG, "Request id, user role or command id cannot be 0");
@@ -375,54 +2022,748 @@ esp_err_t esp_rmaker_cmd_response_handler(const void *input, size_t input_len, v
     ESP_LOGI(TAG, "Got Req. Id: %s, Role = %s, Sub-Role = %d, Cmd = %d, Timestamp = %" PRIu32, cmd_ctx.req_id,
              esp_rmaker_get_user_role_string(cmd_ctx.user_role),
              ESP_RMAKER_GET_USER_SUB_ROLE(cmd_ctx.user_role), cmd_ctx.cmd, cmd_ctx.timestamp);
+    esp_rmaker_cmd_trace_time(cmd_ctx.cmd, ESP_RMAKER_CMD_TRACE_PARSE, parse_start);
+
+    /* Throttle before doing any work for the command, so that a flood of commands stays cheap */
+    uint8_t priority;
+    if (esp_rmaker_cmd_role_throttle(cmd_ctx.user_role, &priority)) {
+        /* Sent as a plain failure, like a busy worker pool. The counts are available from
+         * esp_rmaker_cmd_get_throttled_count().
+         */
+        ESP_LOGD(TAG, "Rate limit exceeded. Throttling Req. Id %s.", cmd_ctx.req_id);
+        esp_rmaker_cmd_trace_status(cmd_ctx.cmd, ESP_RMAKER_CMD_STATUS_FAILED);
+        return esp_rmaker_cmd_prepare_payload(cmd_ctx.req_id, 0, ESP_RMAKER_CMD_STATUS_FAILED, cmd_ctx.cmd, NULL, 0, output, output_len);
+    }
 
-    /* Search for the command info and handle it if found */
+    /* Search for the command info and handle it if found. A copy is used, since the handler, or
+     * other tasks, may register or deregister commands, which can move the entries.
+     */
+    esp_rmaker_cmd_info_t cmd_info_copy;
+    esp_rmaker_cmd_table_lock();
     esp_rmaker_cmd_info_t *cmd_info = esp_rmaker_get_cmd_info(cmd_ctx.cmd);
+    if (cmd_info) {
+        cmd_info_copy = *cmd_info;
+        cmd_info = &cmd_info_copy;
+    }
+    esp_rmaker_cmd_table_unlock();
     if (cmd_info) {
         if (cmd_info->access & ESP_RMAKER_GET_USER_ROLE(cmd_ctx.user_role)) {
-            void *data = NULL;
-            int data_size = esp_rmaker_get_tlv_length(input, input_len, ESP_RMAKER_TLV_TYPE_DATA);
-            if (data_size > 0) {
-                /* TODO: If data size < 255, can just use the pointer to input */
-                data = MEM_CALLOC_EXTRAM(1, data_size);
-                if (!data) {
-                    ESP_LOGE(TAG, "Failed to allocate buffer of size %d for data.", data_size);
-                    return ESP_ERR_NO_MEM;
-                }
-                esp_rmaker_get_value_from_tlv(input, input_len, ESP_RMAKER_TLV_TYPE_DATA, data, data_size);
-            } else {
-                /* It is not mandatory to have data for a given command. So, just throwing a warning */
-                ESP_LOGW(TAG, "No data received for the command.");
-                data_size = 0;
+            /* Requests received again, like on cloud retries, are not executed again. The middleware
+             * have already seen the request the first time.
+             */
+            if (esp_rmaker_cmd_replay_lookup(&cmd_ctx, output, output_len)) {
+                ESP_LOGW(TAG, "Req. Id %s already handled. Sending the same response again.", cmd_ctx.req_id);
+                return ESP_OK;
             }
-            void *response = NULL;
-            size_t response_size = 0;
-            esp_err_t err = cmd_info->handler(data, data_size, &response, &response_size, &cmd_ctx, cmd_info->priv);
-            if (err == ESP_ERR_NOT_FINISHED) {
-                /* Handler deferred the response. It will call esp_rmaker_cmd_prepare_payload() later. */
-                *output = NULL;
-                *output_len = 0;
-                err = ESP_OK;
-            } else if (err == ESP_OK) {
-                err = esp_rmaker_cmd_prepare_payload(cmd_ctx.req_id, 0, ESP_RMAKER_CMD_STATUS_SUCCESS, cmd_ctx.cmd, response, response_size, output, output_len);
-            } else {
-                err = esp_rmaker_cmd_prepare_payload(cmd_ctx.req_id, 0, ESP_RMAKER_CMD_STATUS_FAILED, cmd_ctx.cmd, NULL, 0, output, output_len);
+            esp_rmaker_cmd_data_view_t view;
+            esp_rmaker_tlv_index_get_view(index, ESP_RMAKER_TLV_TYPE_DATA, &view);
+            uint8_t ran = 0;
+            uint8_t status = esp_rmaker_cmd_middleware_pre(cmd_info->middleware_count, &view, &cmd_ctx, &ran);
+            if (status != ESP_RMAKER_CMD_STATUS_SUCCESS) {
+                ESP_LOGW(TAG, "Req. Id %s rejected by middleware with status %d.", cmd_ctx.req_id, status);
+                esp_rmaker_cmd_middleware_post(ran, &view, &cmd_ctx, status);
+                esp_rmaker_cmd_trace_status(cmd_ctx.cmd, status);
+                return esp_rmaker_cmd_prepare_payload(cmd_ctx.req_id, 0, status, cmd_ctx.cmd, NULL, 0, output, output_len);
+            }
+            if ((cmd_info->flags & ESP_RMAKER_CMD_FLAG_CACHEABLE) &&
+                    esp_rmaker_cmd_cache_lookup(&cmd_ctx, &view, output, output_len)) {
+                ESP_LOGD(TAG, "Sending cached response for Req. Id %s.", cmd_ctx.req_id);
+                esp_rmaker_cmd_middleware_post(ran, &view, &cmd_ctx, ESP_RMAKER_CMD_STATUS_SUCCESS);
+                esp_rmaker_cmd_trace_status(cmd_ctx.cmd, ESP_RMAKER_CMD_STATUS_SUCCESS);
+                return ESP_OK;
+            }
+            bool claimed = false;
+            if ((cmd_info->max_active > 0) && !cmd_ctx.transport_role) {
+                esp_err_t err = esp_rmaker_cmd_worker_submit(&view, &cmd_ctx, priority, output, output_len);
+                if (*output) {
+                    /* Rejected right away, so no worker will run the post hooks */
+                    esp_rmaker_cmd_middleware_post(ran, &view, &cmd_ctx, ESP_RMAKER_CMD_STATUS_FAILED);
+                }
+                return err;
+            } else if (cmd_info->max_active > 0) {
+                /* A worker could only respond through the deferred send function, which does not reach
+                 * the transport. So, the command runs right here, but still within its limits.
+                 */
+                if (!esp_rmaker_cmd_worker_claim(cmd_ctx.cmd)) {
+                    ESP_LOGW(TAG, "Cmd %d is busy. Rejecting Req. Id %s.", cmd_ctx.cmd, cmd_ctx.req_id);
+                    esp_rmaker_cmd_middleware_post(ran, &view, &cmd_ctx, ESP_RMAKER_CMD_STATUS_FAILED);
+                    esp_rmaker_cmd_trace_status(cmd_ctx.cmd, ESP_RMAKER_CMD_STATUS_FAILED);
+                    return esp_rmaker_cmd_prepare_payload(cmd_ctx.req_id, 0, ESP_RMAKER_CMD_STATUS_FAILED, cmd_ctx.cmd,
+                                                          NULL, 0, output, output_len);
+                }
+                claimed = true;
             }
-            if (response && cmd_info->free_on_return) {
-                ESP_LOGI(TAG, "Freeing response buffer.");
-                free(response);
+            esp_err_t err = esp_rmaker_cmd_execute(cmd_info, &view, &cmd_ctx, writer, output, output_len);
+            if (claimed) {
+                esp_rmaker_cmd_worker_release(cmd_ctx.cmd);
             }
-            if (data) {
-                free(data);
+            if ((err == ESP_OK) && *output) {
+                esp_rmaker_cmd_replay_store(cmd_ctx.req_id, cmd_ctx.cmd, cmd_ctx.user_role, cmd_ctx.transport_role,
+                                            *output, *output_len);
             }
             return err;
         } else {
+            esp_rmaker_cmd_trace_status(cmd_ctx.cmd, ESP_RMAKER_CMD_STATUS_AUTH_FAIL);
             return esp_rmaker_cmd_prepare_payload(cmd_ctx.req_id, 0, ESP_RMAKER_CMD_STATUS_AUTH_FAIL, cmd_ctx.cmd, NULL, 0, output, output_len);
         }
     }
+    esp_rmaker_cmd_trace_status(cmd_ctx.cmd, ESP_RMAKER_CMD_STATUS_NOT_FOUND);
     return esp_rmaker_cmd_prepare_payload(cmd_ctx.req_id, 0, ESP_RMAKER_CMD_STATUS_NOT_FOUND, cmd_ctx.cmd, NULL, 0, output, output_len);
 }
 
+typedef struct {
+    void *data;
+    size_t len;
+} esp_rmaker_cmd_batch_resp_t;
+
+/* Prepare a FAILED response for a batch record which could not be handled. The request id and command
+ * are read from the first segment of the record, since the record could not be reassembled.
+ */
+static esp_err_t esp_rmaker_cmd_batch_record_failed(const esp_rmaker_cmd_data_view_t *record,
+                                                    void **output, size_t *output_len)
+{
+    char req_id[REQ_ID_LEN] = {0};
+    uint8_t cmd_buf[2] = {0};
+    esp_rmaker_cmd_data_iter_t iter;
+    const void *segment;
+    size_t segment_len;
+    esp_rmaker_cmd_data_view_iter_init(record, &iter);
+    if (esp_rmaker_cmd_data_view_iter_next(&iter, &segment, &segment_len)) {
+        esp_rmaker_tlv_index_t index;
+        esp_rmaker_tlv_index_build(&index, segment, segment_len);
+        esp_rmaker_tlv_index_get_value(&index, ESP_RMAKER_TLV_TYPE_REQ_ID, req_id, sizeof(req_id) - 1);
+        esp_rmaker_tlv_index_get_value(&index, ESP_RMAKER_TLV_TYPE_CMD, cmd_buf, sizeof(cmd_buf));
+    }
+    uint16_t cmd = get_u16_le(cmd_buf);
+    esp_rmaker_cmd_trace_status(cmd, ESP_RMAKER_CMD_STATUS_FAILED);
+    return esp_rmaker_cmd_prepare_payload(req_id, 0, ESP_RMAKER_CMD_STATUS_FAILED, cmd, NULL, 0, output, output_len);
+}
+
+/* Handle a batch of commands, in order, and aggregate the responses into a single batch */
+static esp_err_t esp_rmaker_cmd_handle_batch(const void *input, size_t input_len, uint8_t user_role,
+                                             void **output, size_t *output_len)
+{
+    size_t offset = 0;
+    esp_rmaker_cmd_data_view_t record;
+    int num_records = 0;
+    while (esp_rmaker_cmd_batch_get_next(input, input_len, &offset, &record)) {
+        num_records++;
+    }
+    if ((num_records == 0) || (num_records > RMAKER_MAX_BATCH_RECORDS)) {
+        ESP_LOGE(TAG, "Invalid batch of %d commands. Max allowed is %d.", num_records, RMAKER_MAX_BATCH_RECORDS);
+        return esp_rmaker_cmd_prepare_payload(NULL, 0, ESP_RMAKER_CMD_STATUS_CMD_INVALID, 0, NULL, 0, output, output_len);
+    }
+    ESP_LOGI(TAG, "Got a batch of %d commands.", num_records);
+    esp_rmaker_cmd_batch_resp_t *responses = CMD_CALLOC(num_records, sizeof(esp_rmaker_cmd_batch_resp_t));
+    if (!responses) {
+        ESP_LOGE(TAG, "Failed to allocate responses for the batch.");
+        return ESP_ERR_NO_MEM;
+    }
+    size_t batch_size = 0;
+    offset = 0;
+    for (int i = 0; (i < num_records) && esp_rmaker_cmd_batch_get_next(input, input_len, &offset, &record); i++) {
+        /* A record split across multiple TLVs needs to be reassembled before it can be parsed */
+        const void *cmd = esp_rmaker_cmd_data_view_get_ptr(&record);
+        void *cmd_copy = NULL;
+        if (!cmd && (record.len > 0)) {
+            cmd_copy = CMD_CALLOC(1, record.len);
+            if (!cmd_copy) {
+                ESP_LOGE(TAG, "Failed to allocate buffer of size %d for command %d of the batch.", (int)record.len, i);
+                if (esp_rmaker_cmd_batch_record_failed(&record, &responses[i].data, &responses[i].len) == ESP_OK) {
+                    batch_size += esp_rmaker_get_record_encoded_size(responses[i].len);
+                }
+                continue;
+            }
+            esp_rmaker_cmd_data_view_copy(&record, cmd_copy, record.len);
+            cmd = cmd_copy;
+        }
+        esp_rmaker_tlv_index_t index;
+        int64_t start = esp_rmaker_cmd_trace_now();
+        esp_rmaker_tlv_index_build(&index, cmd, record.len);
+        if (esp_rmaker_cmd_handle(&index, user_role, start, NULL, &responses[i].data, &responses[i].len) != ESP_OK) {
+            ESP_LOGE(TAG, "Failed to handle command %d of the batch.", i);
+        }
+        if (cmd_copy) {
+            free(cmd_copy);
+        }
+        /* Deferred responses are sent separately, and so, are not part of the aggregated response */
+        if (responses[i].data) {
+            batch_size += esp_rmaker_get_record_encoded_size(responses[i].len);
+        }
+    }
+
+    esp_err_t err = ESP_OK;
+    *output = NULL;
+    *output_len = 0;
+    if (batch_size > 0) {
+        uint8_t *batch = CMD_CALLOC(1, batch_size);
+        if (batch) {
+            esp_rmaker_tlv_data_t tlv_data;
+            esp_rmaker_tlv_data_init(&tlv_data, batch, batch_size);
+            for (int i = 0; i < num_records; i++) {
+                if (responses[i].data) {
+                    esp_rmaker_add_record(&tlv_data, responses[i].len, responses[i].data);
+                }
+            }
+            *output = batch;
+            *output_len = tlv_data.curlen;
+            ESP_LOGD(TAG, "Generated batch response of size %d", tlv_data.curlen);
+        } else {
+            ESP_LOGE(TAG, "Failed to allocate buffer of size %zu for batch response.", batch_size);
+            err = ESP_ERR_NO_MEM;
+        }
+    }
+    for (int i = 0; i < num_records; i++) {
+        if (responses[i].data) {
+            free(responses[i].data);
+        }
+    }
+    free(responses);
+    return err;
+}
+
+/* Main command response handling function.
+ *
+ * It parses the rceived data to find the command and other metadata and
+ * prepares the response to be sent
+ */
+esp_err_t esp_rmaker_cmd_response_handler_with_role(const void *input, size_t input_len, uint8_t user_role,
+                                                    void **output, size_t *output_len)
+{
+    /* Walk the input only once. All the fields are then read from the index. */
+    int64_t start = esp_rmaker_cmd_trace_now();
+    esp_rmaker_tlv_index_t index;
+    esp_rmaker_tlv_index_build(&index, input, input_len);
+
+    /* A batch carries command records instead of a command */
+    if ((esp_rmaker_tlv_index_get_length(&index, ESP_RMAKER_TLV_TYPE_CMD) < 0) &&
+            (esp_rmaker_tlv_index_get_length(&index, ESP_RMAKER_TLV_TYPE_BATCH_RECORD) >= 0)) {
+        return esp_rmaker_cmd_handle_batch(input, input_len, user_role, output, output_len);
+    }
+    return esp_rmaker_cmd_handle(&index, user_role, start, NULL, output, output_len);
+}
+
+esp_err_t esp_rmaker_cmd_response_handler(const void *input, size_t input_len, void **output, size_t *output_len)
+{
+    return esp_rmaker_cmd_response_handler_with_role(input, input_len, 0, output, output_len);
+}
+
+esp_err_t esp_rmaker_cmd_response_handler_to_writer(const void *input, size_t input_len, uint8_t user_role,
+                                                    esp_rmaker_cmd_write_t write, void *priv, size_t *output_len)
+{
+    if (!input || !write) {
+        return ESP_ERR_INVALID_ARG;
+    }
+    int64_t start = esp_rmaker_cmd_trace_now();
+    esp_rmaker_tlv_index_t index;
+    esp_rmaker_tlv_index_build(&index, input, input_len);
+
+    esp_rmaker_cmd_resp_writer_t writer = {
+        .write = write,
+        .priv = priv,
+    };
+    void *output = NULL;
+    size_t len = 0;
+    esp_err_t err;
+    /* Batches need the length of each response before it can be added, so they are still aggregated */
+    if ((esp_rmaker_tlv_index_get_length(&index, ESP_RMAKER_TLV_TYPE_CMD) < 0) &&
+            (esp_rmaker_tlv_index_get_length(&index, ESP_RMAKER_TLV_TYPE_BATCH_RECORD) >= 0)) {
+        err = esp_rmaker_cmd_handle_batch(input, input_len, user_role, &output, &len);
+    } else {
+        err = esp_rmaker_cmd_handle(&index, user_role, start, &writer, &output, &len);
+    }
+    /* Responses which were not written already, like failures or replays, are written as is */
+    if ((err == ESP_OK) && output) {
+        err = write(output, len, priv);
+        writer.len += len;
+    }
+    free(output);
+    if (output_len) {
+        *output_len = writer.len;
+    }
+    return err;
+}
+
+/****************************************** Deferred Responses ******************************************/
+/* Build the response for a deferred request and send it */
+static esp_err_t esp_rmaker_cmd_deferred_send(const esp_rmaker_cmd_deferred_t *entry, uint8_t status,
+                                              const void *data, size_t data_size, bool cache,
+                                              esp_rmaker_cmd_send_t send, void *priv)
+{
+    void *output = NULL;
+    size_t output_len = 0;
+    esp_rmaker_cmd_trace_time(entry->cmd, ESP_RMAKER_CMD_TRACE_DEFERRED, entry->start_us);
+    esp_rmaker_cmd_trace_status(entry->cmd, status);
+    esp_err_t err = esp_rmaker_cmd_prepare_payload(entry->req_id, 0, status, entry->cmd, data, data_size,
+                                                   &output, &output_len);
+    if (err != ESP_OK) {
+        ESP_LOGE(TAG, "Failed to prepare response for Req. Id %s.", entry->req_id);
+        return err;
+    }
+    if (cache) {
+        esp_rmaker_cmd_replay_store(entry->req_id, entry->cmd, entry->user_role, false, output, output_len);
+    }
+    err = send(output, output_len, priv);
+    if (err != ESP_OK) {
+        ESP_LOGE(TAG, "Failed to send response for Req. Id %s.", entry->req_id);
+    }
+    free(output);
+    return err;
+}
+
+/* Restart the timer for the earliest timeout. Should be called with the lock held. */
+static void esp_rmaker_cmd_deferred_timer_update(void)
+{
+    TickType_t now = xTaskGetTickCount();
+    TickType_t next = portMAX_DELAY;
+    for (int i = 0; i < RMAKER_MAX_DEFERRED; i++) {
+        esp_rmaker_cmd_deferred_t *entry = &deferred_table.entries[i];
+        if (entry->token) {
+            TickType_t elapsed = now - entry->start_tick;
+            TickType_t remaining = (elapsed < entry->timeout_ticks) ? (entry->timeout_ticks - elapsed) : 0;
+            if (remaining < next) {
+                next = remaining;
+            }
+        }
+    }
+    if (next == portMAX_DELAY) {
+        xTimerStop(deferred_table.timer, 0);
+    } else {
+        xTimerChangePeriod(deferred_table.timer, next ? next : 1, 0);
+    }
+}
+
+/* Send a FAILED response for all the requests that timed out */
+static void esp_rmaker_cmd_deferred_expire(void *priv_data)
+{
+    while (true) {
+        esp_rmaker_cmd_deferred_t expired = {0};
+        xSemaphoreTake(deferred_table.lock, portMAX_DELAY);
+        TickType_t now = xTaskGetTickCount();
+        for (int i = 0; i < RMAKER_MAX_DEFERRED; i++) {
+            esp_rmaker_cmd_deferred_t *entry = &deferred_table.entries[i];
+            if (entry->token && ((now - entry->start_tick) >= entry->timeout_ticks)) {
+                expired = *entry;
+                entry->token = 0;
+                deferred_table.timed_out++;
+                break;
+            }
+        }
+        if (!expired.token) {
+            esp_rmaker_cmd_deferred_timer_update();
+        }
+        esp_rmaker_cmd_send_t send = deferred_table.send;
+        void *priv = deferred_table.priv;
+        xSemaphoreGive(deferred_table.lock);
+        if (!expired.token) {
+            break;
+        }
+        ESP_LOGW(TAG, "Deferred response for Req. Id %s, Cmd %d timed out.", expired.req_id, expired.cmd);
+        esp_rmaker_cmd_deferred_send(&expired, ESP_RMAKER_CMD_STATUS_FAILED, NULL, 0, false, send, priv);
+    }
+}
+
+static void esp_rmaker_cmd_deferred_timer_cb(TimerHandle_t handle)
+{
+    /* Responses are not sent from the timer task, as that may block */
+    if (esp_rmaker_work_queue_add_task(esp_rmaker_cmd_deferred_expire, NULL) != ESP_OK) {
+        ESP_LOGE(TAG, "Failed to queue deferred response timeout.");
+    }
+}
+
+esp_err_t esp_rmaker_cmd_deferred_init(esp_rmaker_cmd_send_t send, void *priv)
+{
+    if (!send) {
+        return ESP_ERR_INVALID_ARG;
+    }
+    if (!deferred_table.lock) {
+        deferred_table.lock = xSemaphoreCreateMutex();
+        if (!deferred_table.lock) {
+            ESP_LOGE(TAG, "Failed to create deferred response lock.");
+            return ESP_ERR_NO_MEM;
+        }
+    }
+    if (!deferred_table.timer) {
+        deferred_table.timer = xTimerCreate("rmaker_cmd_tm", 1, pdFALSE, NULL, esp_rmaker_cmd_deferred_timer_cb);
+        if (!deferred_table.timer) {
+            ESP_LOGE(TAG, "Failed to create deferred response timer.");
+            return ESP_ERR_NO_MEM;
+        }
+    }
+    xSemaphoreTake(deferred_table.lock, portMAX_DELAY);
+    deferred_table.send = send;
+    deferred_table.priv = priv;
+    xSemaphoreGive(deferred_table.lock);
+    return ESP_OK;
+}
+
+esp_err_t esp_rmaker_cmd_deferred_register(const esp_rmaker_cmd_ctx_t *ctx, uint32_t timeout_ms, uint32_t *token)
+{
+    if (!ctx || !token) {
+        return ESP_ERR_INVALID_ARG;
+    }
+    if (!deferred_table.lock) {
+        ESP_LOGE(TAG, "Deferred responses not initialised.");
+        return ESP_ERR_INVALID_STATE;
+    }
+    if (ctx->transport_role) {
+        /* The response would go through the deferred send function, which does not reach the transport */
+        ESP_LOGE(TAG, "Req. Id %s from a transport with its own role cannot be deferred.", ctx->req_id);
+        return ESP_ERR_NOT_SUPPORTED;
+    }
+    if (timeout_ms == 0) {
+        timeout_ms = RMAKER_DEFERRED_TIMEOUT_MS;
+    }
+    xSemaphoreTake(deferred_table.lock, portMAX_DELAY);
+    esp_rmaker_cmd_deferred_t *entry = NULL;
+    for (int i = 0; i < RMAKER_MAX_DEFERRED; i++) {
+        if (!deferred_table.entries[i].token) {
+            entry = &deferred_table.entries[i];
+            break;
+        }
+    }
+    if (!entry) {
+        deferred_table.rejected++;
+        xSemaphoreGive(deferred_table.lock);
+        ESP_LOGE(TAG, "Max deferred requests limit (%d) reached.", RMAKER_MAX_DEFERRED);
+        return ESP_ERR_NO_MEM;
+    }
+    /* 0 is reserved for free entries */
+    if (++deferred_table.next_token == 0) {
+        deferred_table.next_token = 1;
+    }
+    entry->token = deferred_table.next_token;
+    entry->cmd = ctx->cmd;
+    memcpy(entry->req_id, ctx->req_id, sizeof(entry->req_id));
+    entry->req_id[sizeof(entry->req_id) - 1] = '\0';
+    entry->user_role = ctx->user_role;
+    entry->start_tick = xTaskGetTickCount();
+    entry->start_us = esp_rmaker_cmd_trace_now();
+    entry->timeout_ticks = pdMS_TO_TICKS(timeout_ms);
+    if (entry->timeout_ticks == 0) {
+        entry->timeout_ticks = 1;
+    }
+    *token = entry->token;
+    esp_rmaker_cmd_deferred_timer_update();
+    xSemaphoreGive(deferred_table.lock);
+    ESP_LOGD(TAG, "Deferred Req. Id %s, Cmd %d with token %" PRIu32, ctx->req_id, ctx->cmd, *token);
+    return ESP_OK;
+}
+
+esp_err_t esp_rmaker_cmd_deferred_complete(uint32_t token, uint8_t status, const void *data, size_t data_size)
+{
+    if (token == 0) {
+        return ESP_ERR_INVALID_ARG;
+    }
+    if (!deferred_table.lock) {
+        return ESP_ERR_INVALID_STATE;
+    }
+    esp_rmaker_cmd_deferred_t completed = {0};
+    xSemaphoreTake(deferred_table.lock, portMAX_DELAY);
+    for (int i = 0; i < RMAKER_MAX_DEFERRED; i++) {
+        esp_rmaker_cmd_deferred_t *entry = &deferred_table.entries[i];
+        if (entry->token == token) {
+            completed = *entry;
+            entry->token = 0;
+            deferred_table.completed++;
+            esp_rmaker_cmd_deferred_timer_update();
+            break;
+        }
+    }
+    esp_rmaker_cmd_send_t send = deferred_table.send;
+    void *priv = deferred_table.priv;
+    xSemaphoreGive(deferred_table.lock);
+    if (!completed.token) {
+        ESP_LOGE(TAG, "No deferred request found for token %" PRIu32 ". It may have timed out.", token);
+        return ESP_ERR_NOT_FOUND;
+    }
+    return esp_rmaker_cmd_deferred_send(&completed, status, data, data_size, true, send, priv);
+}
+
+esp_err_t esp_rmaker_cmd_deferred_get_age(uint32_t token, uint32_t *age_ms)
+{
+    if ((token == 0) || !age_ms) {
+        return ESP_ERR_INVALID_ARG;
+    }
+    if (!deferred_table.lock) {
+        return ESP_ERR_INVALID_STATE;
+    }
+    esp_err_t err = ESP_ERR_NOT_FOUND;
+    xSemaphoreTake(deferred_table.lock, portMAX_DELAY);
+    for (int i = 0; i < RMAKER_MAX_DEFERRED; i++) {
+        esp_rmaker_cmd_deferred_t *entry = &deferred_table.entries[i];
+        if (entry->token == token) {
+            *age_ms = (xTaskGetTickCount() - entry->start_tick) * portTICK_PERIOD_MS;
+            err = ESP_OK;
+            break;
+        }
+    }
+    xSemaphoreGive(deferred_table.lock);
+    return err;
+}
+
+esp_err_t esp_rmaker_cmd_deferred_get_stats(esp_rmaker_cmd_deferred_stats_t *stats)
+{
+    if (!stats) {
+        return ESP_ERR_INVALID_ARG;
+    }
+    memset(stats, 0, sizeof(esp_rmaker_cmd_deferred_stats_t));
+    stats->max_pending = RMAKER_MAX_DEFERRED;
+    if (!deferred_table.lock) {
+        return ESP_OK;
+    }
+    xSemaphoreTake(deferred_table.lock, portMAX_DELAY);
+    TickType_t now = xTaskGetTickCount();
+    for (int i = 0; i < RMAKER_MAX_DEFERRED; i++) {
+        esp_rmaker_cmd_deferred_t *entry = &deferred_table.entries[i];
+        if (entry->token) {
+            uint32_t age_ms = (now - entry->start_tick) * portTICK_PERIOD_MS;
+            if (age_ms > stats->oldest_age_ms) {
+                stats->oldest_age_ms = age_ms;
+            }
+            stats->pending++;
+        }
+    }
+    stats->completed = deferred_table.completed;
+    stats->timed_out = deferred_table.timed_out;
+    stats->rejected = deferred_table.rejected;
+    xSemaphoreGive(deferred_table.lock);
+    return ESP_OK;
+}
+
+/****************************************** Worker Pool ******************************************/
+/* Run a job and then, the jobs queued behind it for the same command */
+static void esp_rmaker_cmd_worker_run(esp_rmaker_cmd_job_t *job)
+{
+    while (job) {
+        uint16_t cmd = job->ctx.cmd;
+        esp_rmaker_cmd_info_t cmd_info;
+        esp_rmaker_cmd_table_lock();
+        esp_rmaker_cmd_info_t *info = esp_rmaker_get_cmd_info(cmd);
+        if (info) {
+            cmd_info = *info;
+        }
+        esp_rmaker_cmd_table_unlock();
+
+        void *output = NULL;
+        size_t output_len = 0;
+        if (info) {
+            esp_rmaker_cmd_data_view_t view = {
+                .tlv = job->data_len ? job->tlv : NULL,
+                .len = job->data_len,
+            };
+            if ((esp_rmaker_cmd_execute(&cmd_info, &view, &job->ctx, NULL, &output, &output_len) == ESP_OK) && output) {
+                esp_rmaker_cmd_replay_store(job->ctx.req_id, cmd, job->ctx.user_role, job->ctx.transport_role,
+                                            output, output_len);
+            }
+        } else {
+            esp_rmaker_cmd_prepare_payload(job->ctx.req_id, 0, ESP_RMAKER_CMD_STATUS_NOT_FOUND, cmd, NULL, 0, &output, &output_len);
+        }
+        if (output) {
+            esp_rmaker_cmd_job_send(job, output, output_len);
+            free(output);
+        }
+        free(job);
+
+        /* Continue with the next queued job, if any, so that the command stays within its limit */
+        job = NULL;
+        esp_rmaker_cmd_table_lock();
+        info = esp_rmaker_get_cmd_info(cmd);
+        if (info && info->pending) {
+            job = info->pending;
+            info->pending = job->next;
+            info->queued--;
+        } else if (info && info->active) {
+            info->active--;
+        }
+        esp_rmaker_cmd_table_unlock();
+    }
+}
+
+static void esp_rmaker_cmd_worker_task(void *arg)
+{
+    uint8_t wake;
+    while (true) {
+        if (xQueueReceive(worker_pool.queue, &wake, portMAX_DELAY) == pdTRUE) {
+            /* Jobs added while the queue was full have no wake up of their own, so run till none is left */
+            while (true) {
+                esp_rmaker_cmd_table_lock();
+                esp_rmaker_cmd_job_t *job = worker_pool.ready;
+                if (job) {
+                    worker_pool.ready = job->next;
+                }
+                esp_rmaker_cmd_table_unlock();
+                if (!job) {
+                    break;
+                }
+                esp_rmaker_cmd_worker_run(job);
+            }
+        }
+    }
+}
+
+esp_err_t esp_rmaker_cmd_worker_pool_init(void)
+{
+    if (worker_pool.queue) {
+        return ESP_OK;
+    }
+    if (!deferred_table.send) {
+        ESP_LOGE(TAG, "esp_rmaker_cmd_deferred_init() should be called before starting the worker pool.");
+        return ESP_ERR_INVALID_STATE;
+    }
+    if (esp_rmaker_cmd_table_lock_init() != ESP_OK) {
+        return ESP_ERR_NO_MEM;
+    }
+    QueueHandle_t queue = xQueueCreate(RMAKER_CMD_WORKER_QUEUE, sizeof(uint8_t));
+    if (!queue) {
+        ESP_LOGE(TAG, "Failed to create worker pool queue.");
+        return ESP_ERR_NO_MEM;
+    }
+    worker_pool.queue = queue;
+    for (int i = 0; i < RMAKER_CMD_WORKERS; i++) {
+        if (xTaskCreate(&esp_rmaker_cmd_worker_task, "rmaker_cmd_worker", RMAKER_CMD_WORKER_STACK,
+                    NULL, RMAKER_CMD_WORKER_PRIORITY, NULL) != pdPASS) {
+            ESP_LOGE(TAG, "Couldn't create command worker %d.", i);
+            return ESP_FAIL;
+        }
+    }
+    ESP_LOGI(TAG, "Command worker pool started with %d workers.", RMAKER_CMD_WORKERS);
+    return ESP_OK;
+}
+
+esp_err_t esp_rmaker_cmd_set_worker_limits(uint16_t cmd, uint8_t max_concurrency, uint8_t max_queued)
+{
+    if (max_concurrency && !worker_pool.queue) {
+        ESP_LOGE(TAG, "Worker pool not started.");
+        return ESP_ERR_INVALID_STATE;
+    }
+    esp_err_t err = ESP_OK;
+    esp_rmaker_cmd_table_lock();
+    esp_rmaker_cmd_info_t *cmd_info = esp_rmaker_get_cmd_info(cmd);
+    if (cmd_info) {
+        cmd_info->max_active = max_concurrency;
+        cmd_info->max_queued = max_queued;
+    } else {
+        err = ESP_ERR_INVALID_ARG;
+    }
+    esp_rmaker_cmd_table_unlock();
+    return err;
+}
+
+esp_err_t esp_rmaker_cmd_resp_get_stats(esp_rmaker_cmd_resp_stats_t *stats)
+{
+    if (!stats) {
+        return ESP_ERR_INVALID_ARG;
+    }
+#if CONFIG_ESP_RMAKER_CMD_RESP_STATS
+    *stats = resp_stats;
+    return ESP_OK;
+#else
+    memset(stats, 0, sizeof(esp_rmaker_cmd_resp_stats_t));
+    return ESP_ERR_NOT_SUPPORTED;
+#endif
+}
+
+void esp_rmaker_cmd_resp_reset_stats(void)
+{
+#if CONFIG_ESP_RMAKER_CMD_RESP_STATS
+    memset(&resp_stats, 0, sizeof(resp_stats));
+#endif
+}
+
+esp_err_t esp_rmaker_cmd_trace_get(uint16_t cmd, esp_rmaker_cmd_trace_t *trace)
+{
+    if (!trace) {
+        return ESP_ERR_INVALID_ARG;
+    }
+#if CONFIG_ESP_RMAKER_CMD_TRACE
+    esp_err_t err = ESP_ERR_NOT_FOUND;
+    esp_rmaker_cmd_trace_lock();
+    esp_rmaker_cmd_trace_t *entry = esp_rmaker_cmd_trace_find(cmd, false);
+    if (entry) {
+        *trace = *entry;
+        err = ESP_OK;
+    }
+    esp_rmaker_cmd_trace_unlock();
+    return err;
+#else
+    return ESP_ERR_NOT_SUPPORTED;
+#endif
+}
+
+esp_err_t esp_rmaker_cmd_trace_get_all(esp_rmaker_cmd_trace_t *traces, size_t max_traces, size_t *count)
+{
+    if (!count || (!traces && max_traces)) {
+        return ESP_ERR_INVALID_ARG;
+    }
+#if CONFIG_ESP_RMAKER_CMD_TRACE
+    esp_rmaker_cmd_trace_lock();
+    *count = (trace_table.count < max_traces) ? trace_table.count : max_traces;
+    if (*count) {
+        memcpy(traces, trace_table.entries, *count * sizeof(esp_rmaker_cmd_trace_t));
+    }
+    esp_rmaker_cmd_trace_unlock();
+    return ESP_OK;
+#else
+    *count = 0;
+    return ESP_ERR_NOT_SUPPORTED;
+#endif
+}
+
+void esp_rmaker_cmd_trace_reset(void)
+{
+#if CONFIG_ESP_RMAKER_CMD_TRACE
+    esp_rmaker_cmd_trace_lock();
+    trace_table.count = 0;
+    esp_rmaker_cmd_trace_unlock();
+#endif
+}
+
+uint32_t esp_rmaker_cmd_trace_get_percentile(const esp_rmaker_cmd_histogram_t *hist, uint8_t percentile)
+{
+    if (!hist || hist->count == 0) {
+        return 0;
+    }
+    uint64_t target = ((uint64_t)hist->count * (percentile > 100 ? 100 : percentile) + 99) / 100;
+    uint64_t seen = 0;
+    for (int i = 0; i < ESP_RMAKER_CMD_TRACE_BUCKETS - 1; i++) {
+        seen += hist->buckets[i];
+        if (seen >= target && seen > 0) {
+            /* The bucket limit, unless the maximum is lower */
+            uint32_t limit = ESP_RMAKER_CMD_TRACE_BUCKET_LIMIT_US(i);
+            return (hist->max_us < limit) ? hist->max_us : limit;
+        }
+    }
+    return hist->max_us;
+}
+
+void esp_rmaker_cmd_trace_log(void)
+{
+#if CONFIG_ESP_RMAKER_CMD_TRACE
+    static const char *phases[ESP_RMAKER_CMD_TRACE_PHASE_MAX] = {"parse", "handler", "encode", "deferred"};
+    esp_rmaker_cmd_trace_lock();
+    for (int i = 0; i < trace_table.count; i++) {
+        const esp_rmaker_cmd_trace_t *trace = &trace_table.entries[i];
+        ESP_LOGI(TAG, "Cmd %d: success %" PRIu32 ", failed %" PRIu32 ", invalid %" PRIu32 ", auth fail %" PRIu32
+                 ", not found %" PRIu32, trace->cmd,
+                 trace->status[ESP_RMAKER_CMD_STATUS_SUCCESS], trace->status[ESP_RMAKER_CMD_STATUS_FAILED],
+                 trace->status[ESP_RMAKER_CMD_STATUS_CMD_INVALID], trace->status[ESP_RMAKER_CMD_STATUS_AUTH_FAIL],
+                 trace->status[ESP_RMAKER_CMD_STATUS_NOT_FOUND]);
+        for (int p = 0; p < ESP_RMAKER_CMD_TRACE_PHASE_MAX; p++) {
+            const esp_rmaker_cmd_histogram_t *hist = &trace->phases[p];
+            if (hist->count == 0) {
+                continue;
+            }
+            ESP_LOGI(TAG, "    %-8s count %" PRIu32 ", avg %" PRIu32 " us, p50 <= %" PRIu32 " us, p99 <= %" PRIu32
+                     " us, max %" PRIu32 " us", phases[p], hist->count, (uint32_t)(hist->total_us / hist->count),
+                     esp_rmaker_cmd_trace_get_percentile(hist, 50), esp_rmaker_cmd_trace_get_percentile(hist, 99),
+                     hist->max_us);
+        }
+    }
+    esp_rmaker_cmd_trace_unlock();
+#endif
+}
+
 /****************************************** Testing Functions ******************************************/
 static const char *cmd_status[] = {
     [ESP_RMAKER_CMD_STATUS_SUCCESS] = "Success",
@@ -440,9 +2781,20 @@ esp_err_t esp_rmaker_cmd_resp_test_send(const char *req_id, uint8_t role, uint16
         ESP_LOGE(TAG, "No callback to trigger the command.");
         return ESP_ERR_INVALID_ARG;
     }
-    uint8_t cmd_data[200];
+    size_t cmd_size = esp_rmaker_get_tlv_encoded_size(sizeof(role)) + esp_rmaker_get_tlv_encoded_size(sizeof(uint16_t));
+    if (req_id) {
+        cmd_size += esp_rmaker_get_tlv_encoded_size(strlen(req_id));
+    }
+    if (data != NULL && data_size != 0) {
+        cmd_size += esp_rmaker_get_tlv_encoded_size(data_size);
+    }
+    uint8_t *cmd_data = CMD_CALLOC(1, cmd_size);
+    if (!cmd_data) {
+        ESP_LOGE(TAG, "Failed to allocate %d bytes for the command.", (int)cmd_size);
+        return ESP_ERR_NO_MEM;
+    }
     esp_rmaker_tlv_data_t tlv_data;
-    esp_rmaker_tlv_data_init(&tlv_data, cmd_data, sizeof(cmd_data));
+    esp_rmaker_tlv_data_init(&tlv_data, cmd_data, cmd_size);
     if (req_id) {
         esp_rmaker_add_tlv(&tlv_data, ESP_RMAKER_TLV_TYPE_REQ_ID, strlen(req_id), req_id);
     }
@@ -454,7 +2806,9 @@ esp_err_t esp_rmaker_cmd_resp_test_send(const char *req_id, uint8_t role, uint16
         esp_rmaker_add_tlv(&tlv_data, ESP_RMAKER_TLV_TYPE_DATA, data_size, data);
     }
     ESP_LOGI(TAG, "Sending command of size %d for cmd %d", tlv_data.curlen, cmd);
-    return cmd_send(cmd_data, tlv_data.curlen, priv_data);
+    esp_err_t err = cmd_send(cmd_data, tlv_data.curlen, priv_data);
+    free(cmd_data);
+    return err;
 }
 
 // Calculate size of TLV payload for a given length of data.
@@ -477,12 +2831,15 @@ static size_t esp_rmaker_get_tlv_encoded_size(size_t len)
     // ...
     // T -> 1 byte
     // L -> 1 bytes
-    // V -> len % 255 bytes
+    // V -> remaining (1 to 255) bytes
+    //
+    // A zero length value still needs a single T and L.
 
-    size_t required_packets = (len / 255) + 1;
-    size_t TL_size = (2 * required_packets);
-    size_t V_size = ((required_packets - 1) * 255) + (len % 255);
-    return (TL_size + V_size);
+    size_t required_packets = (len + 254) / 255;
+    if (required_packets == 0) {
+        required_packets = 1;
+    }
+    return (2 * required_packets) + len;
 }
 
 /* Parse response */
@@ -492,28 +2849,43 @@ esp_err_t esp_rmaker_cmd_resp_parse_response(const void *response, size_t respon
         ESP_LOGE(TAG, "NULL response. Cannot parse.");
         return ESP_ERR_INVALID_ARG;
     }
-    char req_id[REQ_ID_LEN] = {0};
-    if (esp_rmaker_get_value_from_tlv(response, response_len, ESP_RMAKER_TLV_TYPE_REQ_ID, req_id, sizeof(req_id)) > 0) {
-        ESP_LOGI(TAG, "RESP: Request Id: %s", req_id);
-    }
+    esp_rmaker_tlv_index_t index;
+    esp_rmaker_tlv_index_build(&index, response, response_len);
 
-    uint16_t cmd;
-    uint8_t cmd_buf[2];
-    if (esp_rmaker_get_value_from_tlv(response, response_len, ESP_RMAKER_TLV_TYPE_CMD, cmd_buf, sizeof(cmd_buf)) > 0) {
-        cmd = get_u16_le(cmd_buf);
-        ESP_LOGI(TAG, "RESP: Command: %" PRIu16, cmd);
+    if ((esp_rmaker_tlv_index_get_length(&index, ESP_RMAKER_TLV_TYPE_CMD) < 0) &&
+            (esp_rmaker_tlv_index_get_length(&index, ESP_RMAKER_TLV_TYPE_BATCH_RECORD) >= 0)) {
+        size_t offset = 0;
+        esp_rmaker_cmd_data_view_t record;
+        while (esp_rmaker_cmd_batch_get_next(response, response_len, &offset, &record)) {
+            uint8_t *buf = CMD_CALLOC(1, record.len);
+            if (buf) {
+                esp_rmaker_cmd_data_view_copy(&record, buf, record.len);
+                esp_rmaker_cmd_resp_parse_response(buf, record.len, priv_data);
+                free(buf);
+            }
+        }
+        return ESP_OK;
     }
 
-    uint8_t status;
-    if (esp_rmaker_get_value_from_tlv(response, response_len, ESP_RMAKER_TLV_TYPE_STATUS, &status, sizeof(status)) > 0) {
-        ESP_LOGI(TAG, "RESP: Status: %" PRIu8 ": %s", status, cmd_status[status]);
+    esp_rmaker_cmd_response_t parsed;
+    esp_err_t err = esp_rmaker_cmd_parse_response(response, response_len, &parsed);
+    if (err != ESP_OK) {
+        ESP_LOGE(TAG, "Failed to parse the response: 0x%x", err);
+        return err;
+    }
+    if (parsed.req_id[0]) {
+        ESP_LOGI(TAG, "RESP: Request Id: %s", parsed.req_id);
     }
+    ESP_LOGI(TAG, "RESP: Command: %" PRIu16, parsed.cmd);
+    ESP_LOGI(TAG, "RESP: Status: %" PRIu8 ": %s", parsed.status,
+             (parsed.status < ESP_RMAKER_CMD_STATUS_MAX) ? cmd_status[parsed.status] : "Unknown");
 
-    char resp_data[200];
-    int resp_size = esp_rmaker_get_value_from_tlv(response, response_len, ESP_RMAKER_TLV_TYPE_DATA, resp_data, sizeof(resp_data));
-    if (resp_size > 0) {
-        resp_data[resp_size] = 0;
-        ESP_LOGI(TAG, "RESP: Data: %s", resp_data);
+    esp_rmaker_cmd_data_iter_t iter;
+    const void *segment;
+    size_t segment_len;
+    esp_rmaker_cmd_data_view_iter_init(&parsed.data, &iter);
+    while (esp_rmaker_cmd_data_view_iter_next(&iter, &segment, &segment_len)) {
+        ESP_LOGI(TAG, "RESP: Data: %.*s", (int)segment_len, (const char *)segment);
     }
     return ESP_OK;
 }
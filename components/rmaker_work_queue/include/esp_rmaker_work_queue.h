@@ -6,7 +6,9 @@
 
 #pragma once
 #include <stdint.h>
+#include <stdbool.h>
 #include <esp_err.h>
+#include <freertos/FreeRTOS.h>
 
 #ifdef __cplusplus
 extern "C"
@@ -18,6 +20,19 @@ extern "C"
  */
 typedef void (*esp_rmaker_work_fn_t)(void *priv_data);
 
+/** Maximum number of Work Queue workers */
+#define ESP_RMAKER_WORK_QUEUE_MAX_WORKERS   8
+
+/** Work Queue configuration */
+typedef struct {
+    /** Number of worker tasks, up to ESP_RMAKER_WORK_QUEUE_MAX_WORKERS.
+     * 0 for CONFIG_ESP_RMAKER_WORK_QUEUE_WORKERS.
+     */
+    uint8_t workers;
+    /** Pin the workers to the cores in turn, on multi-core targets. Ignored on single-core ones. */
+    bool pin_to_cores;
+} esp_rmaker_work_queue_config_t;
+
 /** Initializes the Work Queue
  *
  * This initializes the work queue, which is basically a mechanism to run
@@ -30,6 +45,24 @@ typedef void (*esp_rmaker_work_fn_t)(void *priv_data);
  */
 esp_err_t esp_rmaker_work_queue_init(void);
 
+/** Initializes the Work Queue with a configuration
+ *
+ * Same as esp_rmaker_work_queue_init(), but with the given number of workers and core
+ * affinity, instead of those from the Kconfig options.
+ *
+ * With a single worker, the work functions run one by one, in the order queued. With more,
+ * each worker has its own queue, and work is queued to the least loaded one. A worker whose
+ * queue is empty takes work from the others. So, independent work functions run in parallel,
+ * and a long one does not hold up the rest, but they may not run in the order queued.
+ *
+ * @param[in] config Work Queue configuration. NULL for the Kconfig defaults.
+ *
+ * @return ESP_OK on success.
+ * @return ESP_ERR_INVALID_ARG for an invalid configuration.
+ * @return error in case of failure.
+ */
+esp_err_t esp_rmaker_work_queue_init_with_config(const esp_rmaker_work_queue_config_t *config);
+
 /** De-initialize the Work Queue
  *
  * This de-initializes the work queue. Note that the work queue needs to
@@ -42,7 +75,7 @@ esp_err_t esp_rmaker_work_queue_deinit(void);
 
 /** Start the Work Queue
  *
- * This starts the Work Queue thread which then starts executing the tasks queued.
+ * This starts the Work Queue thread(s) which then start executing the tasks queued.
  *
  * @return ESP_OK on success.
  * @return error in case of failure.
@@ -61,6 +94,7 @@ esp_err_t esp_rmaker_work_queue_stop(void);
 /** Queue execution of a function in the Work Queue's context
  *
  * This API queues a work function for execution in the Work Queue Task's context.
+ * If the Work Queue has multiple workers, it may run in parallel with other work functions.
  *
  * @param[in] work_fn The Work function to be queued.
  * @param[in] priv_data Private data to be passed to the work function.
@@ -70,6 +104,45 @@ esp_err_t esp_rmaker_work_queue_stop(void);
  */
 esp_err_t esp_rmaker_work_queue_add_task(esp_rmaker_work_fn_t work_fn, void *priv_data);
 
+/** Queue execution of a function in the Work Queue's context, after a delay
+ *
+ * This API returns right away. The work function is kept in a timer wheel, which the Work
+ * Queue checks as it runs, and is queued for execution once the delay has passed. So, it
+ * does not need a FreeRTOS timer, and adding it or running it costs the same, irrespective
+ * of the number of delayed work functions pending. It runs only once the Work Queue has
+ * been started, and is dropped if the Work Queue is de-initialized before that.
+ *
+ * The delay is rounded up to CONFIG_ESP_RMAKER_WORK_QUEUE_TIMER_RESOLUTION, so the work
+ * function does not run earlier than asked, but can run up to that much later.
+ *
+ * @param[in] work_fn The Work function to be queued.
+ * @param[in] priv_data Private data to be passed to the work function.
+ * @param[in] delay_ms Delay in milliseconds. 0 to queue it right away.
+ *
+ * @return ESP_OK on success.
+ * @return ESP_ERR_INVALID_STATE if the Work Queue hasn't been initialized.
+ * @return ESP_ERR_NO_MEM if memory could not be allocated.
+ * @return error in case of failure.
+ */
+esp_err_t esp_rmaker_work_queue_add_delayed_task(esp_rmaker_work_fn_t work_fn, void *priv_data, uint32_t delay_ms);
+
+/** Queue execution of a function in the Work Queue's context, at a deadline
+ *
+ * Same as esp_rmaker_work_queue_add_delayed_task(), but with the time at which the work function
+ * should run, as a tick count, e.g. xTaskGetTickCount() + pdMS_TO_TICKS(100). A deadline which has
+ * already passed queues it right away.
+ *
+ * @param[in] work_fn The Work function to be queued.
+ * @param[in] priv_data Private data to be passed to the work function.
+ * @param[in] deadline Tick count at which the work function should run.
+ *
+ * @return ESP_OK on success.
+ * @return ESP_ERR_INVALID_STATE if the Work Queue hasn't been initialized.
+ * @return ESP_ERR_NO_MEM if memory could not be allocated.
+ * @return error in case of failure.
+ */
+esp_err_t esp_rmaker_work_queue_add_task_at(esp_rmaker_work_fn_t work_fn, void *priv_data, TickType_t deadline);
+
 #ifdef __cplusplus
 }
 #endif
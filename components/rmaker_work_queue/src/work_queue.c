@@ -7,6 +7,9 @@
 #include <freertos/FreeRTOS.h>
 #include <freertos/task.h>
 #include <freertos/queue.h>
+#include <freertos/semphr.h>
+#include <stdlib.h>
+#include <string.h>
 #include <esp_err.h>
 #include <esp_log.h>
 
@@ -15,6 +18,18 @@
 #define ESP_RMAKER_TASK_QUEUE_SIZE           8
 #define ESP_RMAKER_TASK_STACK       CONFIG_ESP_RMAKER_WORK_QUEUE_TASK_STACK
 #define ESP_RMAKER_TASK_PRIORITY    CONFIG_ESP_RMAKER_WORK_QUEUE_TASK_PRIORITY
+#define ESP_RMAKER_TASK_WORKERS     CONFIG_ESP_RMAKER_WORK_QUEUE_WORKERS
+#ifdef CONFIG_ESP_RMAKER_WORK_QUEUE_PIN_TO_CORES
+#define ESP_RMAKER_TASK_PIN_TO_CORES    true
+#else
+#define ESP_RMAKER_TASK_PIN_TO_CORES    false
+#endif
+#define ESP_RMAKER_TIMER_SLOTS      CONFIG_ESP_RMAKER_WORK_QUEUE_TIMER_SLOTS
+/* Ticks per step of the timer wheel */
+#define ESP_RMAKER_TIMER_STEP       ((pdMS_TO_TICKS(CONFIG_ESP_RMAKER_WORK_QUEUE_TIMER_RESOLUTION) > 0) ? \
+                                     pdMS_TO_TICKS(CONFIG_ESP_RMAKER_WORK_QUEUE_TIMER_RESOLUTION) : 1)
+/* Maximum time for which a worker waits, before checking for a stop request */
+#define ESP_RMAKER_TASK_WAIT        (2000 / portTICK_PERIOD_MS)
 
 static const char *TAG = "esp_rmaker_work_queue";
 
@@ -30,34 +45,157 @@ typedef struct {
     void *priv_data;
 } esp_rmaker_work_queue_entry_t;
 
-static QueueHandle_t work_queue;
+/* Delayed work, waiting in a slot of the timer wheel */
+typedef struct esp_rmaker_work_timer {
+    struct esp_rmaker_work_timer *next;
+    esp_rmaker_work_fn_t work_fn;
+    void *priv_data;
+    /* Full turns of the wheel left, before the work is due */
+    uint32_t rounds;
+} esp_rmaker_work_timer_t;
+
+/* Hashed timer wheel. Work due n steps after the current one waits in the nth slot after it, with
+ * the number of turns left, so that adding it and handling it when due cost the same for any number
+ * of timers. Ticks are only compared by their difference, so that they can wrap around.
+ */
+typedef struct {
+    esp_rmaker_work_timer_t *slots[ESP_RMAKER_TIMER_SLOTS];
+    /* Slot and tick of the last step handled */
+    uint32_t slot;
+    TickType_t tick;
+    uint32_t count;
+    /* Tick at which the idle workers will wake up next, if there are timers */
+    TickType_t wake_tick;
+    /* A worker has been woken up to handle a new timer, which is due earlier than wake_tick */
+    bool wake_pending;
+} esp_rmaker_work_wheel_t;
+
+/* Each worker has its own queue, and takes work from the others when its own is empty. The pending
+ * semaphore counts the work queued across all of them, so that an idle worker wakes up for any work.
+ * It can also have one more count, just to wake up a worker for the timer wheel.
+ */
+typedef struct {
+    QueueHandle_t queues[ESP_RMAKER_WORK_QUEUE_MAX_WORKERS];
+    uint8_t workers;
+    bool pin_to_cores;
+    SemaphoreHandle_t pending;
+    /* Protects running and the timer wheel */
+    SemaphoreHandle_t lock;
+    uint8_t running;
+    esp_rmaker_work_wheel_t wheel;
+} esp_rmaker_work_pool_t;
+
+static esp_rmaker_work_pool_t work_pool;
 static esp_rmaker_work_queue_state_t queue_state;
 
-static void esp_rmaker_handle_work_queue(void)
+/* Run one work function, from the queue of the worker if it has any, else from another one */
+static void esp_rmaker_handle_work_queue(uint8_t worker)
 {
     esp_rmaker_work_queue_entry_t work_queue_entry;
-    /* 2 sec delay to prevent spinning */
-    BaseType_t ret = xQueueReceive(work_queue, &work_queue_entry, 2000 / portTICK_PERIOD_MS);
-    while (ret == pdTRUE) {
-        work_queue_entry.work_fn(work_queue_entry.priv_data);
-        ret = xQueueReceive(work_queue, &work_queue_entry, 0);
+    for (uint8_t i = 0; i < work_pool.workers; i++) {
+        QueueHandle_t queue = work_pool.queues[(worker + i) % work_pool.workers];
+        if (xQueueReceive(queue, &work_queue_entry, 0) == pdTRUE) {
+            work_queue_entry.work_fn(work_queue_entry.priv_data);
+            return;
+        }
+    }
+}
+
+/* Handle the steps of the timer wheel till now, and queue the work which is due.
+ * Returns the time to wait for, till the next step having timers.
+ */
+static TickType_t esp_rmaker_work_timer_advance(void)
+{
+    esp_rmaker_work_wheel_t *wheel = &work_pool.wheel;
+    esp_rmaker_work_timer_t *due = NULL;
+    esp_rmaker_work_timer_t **due_tail = &due;
+    TickType_t wait = ESP_RMAKER_TASK_WAIT;
+
+    xSemaphoreTake(work_pool.lock, portMAX_DELAY);
+    TickType_t now = xTaskGetTickCount();
+    wheel->wake_pending = false;
+    while ((wheel->count > 0) && ((TickType_t)(now - wheel->tick) >= ESP_RMAKER_TIMER_STEP)) {
+        wheel->tick += ESP_RMAKER_TIMER_STEP;
+        wheel->slot = (wheel->slot + 1) % ESP_RMAKER_TIMER_SLOTS;
+        esp_rmaker_work_timer_t **prev = &wheel->slots[wheel->slot];
+        while (*prev) {
+            esp_rmaker_work_timer_t *timer = *prev;
+            if (timer->rounds > 0) {
+                timer->rounds--;
+                prev = &timer->next;
+                continue;
+            }
+            *prev = timer->next;
+            timer->next = NULL;
+            *due_tail = timer;
+            due_tail = &timer->next;
+            wheel->count--;
+        }
     }
+    if (wheel->count == 0) {
+        /* Nothing to wait for, so the steps in between need not be handled */
+        wheel->tick = now;
+    } else {
+        for (uint32_t i = 1; i <= ESP_RMAKER_TIMER_SLOTS; i++) {
+            if (wheel->slots[(wheel->slot + i) % ESP_RMAKER_TIMER_SLOTS]) {
+                wheel->wake_tick = wheel->tick + (i * ESP_RMAKER_TIMER_STEP);
+                TickType_t wake_wait = wheel->wake_tick - now;
+                if (wake_wait < wait) {
+                    wait = wake_wait;
+                }
+                break;
+            }
+        }
+    }
+    xSemaphoreGive(work_pool.lock);
+
+    while (due) {
+        esp_rmaker_work_timer_t *timer = due;
+        due = timer->next;
+        /* Run it right away if the queues are full, rather than delaying it further */
+        if (esp_rmaker_work_queue_add_task(timer->work_fn, timer->priv_data) != ESP_OK) {
+            timer->work_fn(timer->priv_data);
+        }
+        free(timer);
+    }
+    return wait;
+}
+
+static void esp_rmaker_work_timer_free_all(void)
+{
+    for (uint32_t i = 0; i < ESP_RMAKER_TIMER_SLOTS; i++) {
+        while (work_pool.wheel.slots[i]) {
+            esp_rmaker_work_timer_t *timer = work_pool.wheel.slots[i];
+            work_pool.wheel.slots[i] = timer->next;
+            free(timer);
+        }
+    }
+    work_pool.wheel.count = 0;
 }
 
 static void esp_rmaker_work_queue_task(void *param)
 {
-    ESP_LOGI(TAG, "RainMaker Work Queue task started.");
+    uint8_t worker = (uint8_t)(uintptr_t)param;
+    ESP_LOGI(TAG, "RainMaker Work Queue task %d started.", worker);
     while (queue_state != WORK_QUEUE_STATE_STOP_REQUESTED) {
-        esp_rmaker_handle_work_queue();
+        /* Wait till the next timer is due, or for at most 2 sec, to prevent spinning */
+        TickType_t wait = esp_rmaker_work_timer_advance();
+        if (xSemaphoreTake(work_pool.pending, wait) == pdTRUE) {
+            esp_rmaker_handle_work_queue(worker);
+        }
     }
-    ESP_LOGI(TAG, "Stopping Work Queue task");
-    queue_state = WORK_QUEUE_STATE_INIT_DONE;
+    ESP_LOGI(TAG, "Stopping Work Queue task %d", worker);
+    xSemaphoreTake(work_pool.lock, portMAX_DELAY);
+    if (--work_pool.running == 0) {
+        queue_state = WORK_QUEUE_STATE_INIT_DONE;
+    }
+    xSemaphoreGive(work_pool.lock);
     vTaskDelete(NULL);
 }
 
 esp_err_t esp_rmaker_work_queue_add_task(esp_rmaker_work_fn_t work_fn, void *priv_data)
 {
-    if (!work_queue) {
+    if (!work_pool.workers) {
         ESP_LOGE(TAG, "Cannot enqueue function as Work Queue hasn't been created.");
         return ESP_ERR_INVALID_STATE;
     }
@@ -65,28 +203,133 @@ esp_err_t esp_rmaker_work_queue_add_task(esp_rmaker_work_fn_t work_fn, void *pri
         .work_fn = work_fn,
         .priv_data = priv_data,
     };
-    if (xQueueSend(work_queue, &work_queue_entry, 0) == pdTRUE) {
-        return ESP_OK;
+    /* Start with the least loaded queue, and try the others if it gets full meanwhile */
+    uint8_t first = 0;
+    UBaseType_t least = ESP_RMAKER_TASK_QUEUE_SIZE;
+    for (uint8_t i = 0; i < work_pool.workers; i++) {
+        UBaseType_t waiting = uxQueueMessagesWaiting(work_pool.queues[i]);
+        if (waiting < least) {
+            least = waiting;
+            first = i;
+        }
+    }
+    for (uint8_t i = 0; i < work_pool.workers; i++) {
+        if (xQueueSend(work_pool.queues[(first + i) % work_pool.workers], &work_queue_entry, 0) == pdTRUE) {
+            xSemaphoreGive(work_pool.pending);
+            return ESP_OK;
+        }
     }
     return ESP_FAIL;
 }
 
-esp_err_t esp_rmaker_work_queue_init(void)
+esp_err_t esp_rmaker_work_queue_add_task_at(esp_rmaker_work_fn_t work_fn, void *priv_data, TickType_t deadline)
+{
+    if (!work_pool.workers) {
+        ESP_LOGE(TAG, "Cannot enqueue function as Work Queue hasn't been created.");
+        return ESP_ERR_INVALID_STATE;
+    }
+    if (!work_fn) {
+        return ESP_ERR_INVALID_ARG;
+    }
+    TickType_t now = xTaskGetTickCount();
+    if ((int32_t)(deadline - now) <= 0) {
+        return esp_rmaker_work_queue_add_task(work_fn, priv_data);
+    }
+    esp_rmaker_work_timer_t *timer = calloc(1, sizeof(esp_rmaker_work_timer_t));
+    if (!timer) {
+        ESP_LOGE(TAG, "Failed to allocate delayed work.");
+        return ESP_ERR_NO_MEM;
+    }
+    timer->work_fn = work_fn;
+    timer->priv_data = priv_data;
+
+    esp_rmaker_work_wheel_t *wheel = &work_pool.wheel;
+    bool wake = false;
+    xSemaphoreTake(work_pool.lock, portMAX_DELAY);
+    if (wheel->count == 0) {
+        wheel->tick = now;
+    }
+    /* Steps after the last one handled, rounded up, so that the work does not run before the deadline */
+    uint32_t steps = ((TickType_t)(deadline - wheel->tick) + ESP_RMAKER_TIMER_STEP - 1) / ESP_RMAKER_TIMER_STEP;
+    timer->rounds = (steps - 1) / ESP_RMAKER_TIMER_SLOTS;
+    esp_rmaker_work_timer_t **slot = &wheel->slots[(wheel->slot + steps) % ESP_RMAKER_TIMER_SLOTS];
+    timer->next = *slot;
+    *slot = timer;
+    /* The idle workers may be waiting for a later step, or for the default time if there were no timers */
+    TickType_t due_tick = wheel->tick + (steps * ESP_RMAKER_TIMER_STEP);
+    if (!wheel->wake_pending && ((wheel->count == 0) || ((int32_t)(due_tick - wheel->wake_tick) < 0))) {
+        wheel->wake_pending = true;
+        wheel->wake_tick = due_tick;
+        wake = true;
+    }
+    wheel->count++;
+    xSemaphoreGive(work_pool.lock);
+    if (wake) {
+        xSemaphoreGive(work_pool.pending);
+    }
+    return ESP_OK;
+}
+
+esp_err_t esp_rmaker_work_queue_add_delayed_task(esp_rmaker_work_fn_t work_fn, void *priv_data, uint32_t delay_ms)
+{
+    /* Rounded up, so that the work does not run before the delay */
+    TickType_t delay = (TickType_t)(((uint64_t)delay_ms * configTICK_RATE_HZ + 999) / 1000);
+    return esp_rmaker_work_queue_add_task_at(work_fn, priv_data, xTaskGetTickCount() + delay);
+}
+
+static void esp_rmaker_work_pool_delete(void)
+{
+    for (uint8_t i = 0; i < work_pool.workers; i++) {
+        vQueueDelete(work_pool.queues[i]);
+    }
+    esp_rmaker_work_timer_free_all();
+    if (work_pool.pending) {
+        vSemaphoreDelete(work_pool.pending);
+    }
+    if (work_pool.lock) {
+        vSemaphoreDelete(work_pool.lock);
+    }
+    memset(&work_pool, 0, sizeof(work_pool));
+}
+
+esp_err_t esp_rmaker_work_queue_init_with_config(const esp_rmaker_work_queue_config_t *config)
 {
     if (queue_state != WORK_QUEUE_STATE_DEINIT) {
         ESP_LOGW(TAG, "Work Queue already initialiased/started.");
         return ESP_OK;
     }
-    work_queue = xQueueCreate(ESP_RMAKER_TASK_QUEUE_SIZE, sizeof(esp_rmaker_work_queue_entry_t));
-    if (!work_queue) {
+    uint8_t workers = (config && config->workers) ? config->workers : ESP_RMAKER_TASK_WORKERS;
+    if (workers > ESP_RMAKER_WORK_QUEUE_MAX_WORKERS) {
+        ESP_LOGE(TAG, "Invalid number of workers %d.", workers);
+        return ESP_ERR_INVALID_ARG;
+    }
+    work_pool.pin_to_cores = config ? config->pin_to_cores : ESP_RMAKER_TASK_PIN_TO_CORES;
+    work_pool.pending = xSemaphoreCreateCounting((workers * ESP_RMAKER_TASK_QUEUE_SIZE) + 1, 0);
+    work_pool.lock = xSemaphoreCreateMutex();
+    if (!work_pool.pending || !work_pool.lock) {
         ESP_LOGE(TAG, "Failed to create Work Queue.");
+        esp_rmaker_work_pool_delete();
         return ESP_FAIL;
     }
-    ESP_LOGI(TAG, "Work Queue created.");
+    for (uint8_t i = 0; i < workers; i++) {
+        work_pool.queues[i] = xQueueCreate(ESP_RMAKER_TASK_QUEUE_SIZE, sizeof(esp_rmaker_work_queue_entry_t));
+        if (!work_pool.queues[i]) {
+            ESP_LOGE(TAG, "Failed to create Work Queue.");
+            esp_rmaker_work_pool_delete();
+            return ESP_FAIL;
+        }
+        work_pool.workers++;
+    }
+    ESP_LOGI(TAG, "Work Queue created, with %d worker(s).", workers);
     queue_state = WORK_QUEUE_STATE_INIT_DONE;
     return ESP_OK;
 }
 
+esp_err_t esp_rmaker_work_queue_init(void)
+{
+    return esp_rmaker_work_queue_init_with_config(NULL);
+}
+
 esp_err_t esp_rmaker_work_queue_deinit(void)
 {
     if (queue_state != WORK_QUEUE_STATE_STOP_REQUESTED) {
@@ -104,8 +347,7 @@ esp_err_t esp_rmaker_work_queue_deinit(void)
         ESP_LOGE(TAG, "Cannot deinitialize Work Queue as the task is still running.");
         return ESP_ERR_INVALID_STATE;
     } else {
-        vQueueDelete(work_queue);
-        work_queue = NULL;
+        esp_rmaker_work_pool_delete();
         queue_state = WORK_QUEUE_STATE_DEINIT;
     }
     ESP_LOGI(TAG, "esp_rmaker_work_queue was successfully deinitialized");
@@ -122,12 +364,35 @@ esp_err_t esp_rmaker_work_queue_start(void)
         ESP_LOGE(TAG, "Failed to start Work Queue as it wasn't initialized.");
         return ESP_ERR_INVALID_STATE;
     }
-    if (xTaskCreate(&esp_rmaker_work_queue_task, "rmaker_queue_task", ESP_RMAKER_TASK_STACK,
-                NULL, ESP_RMAKER_TASK_PRIORITY, NULL) != pdPASS) {
-        ESP_LOGE(TAG, "Couldn't create RainMaker work queue task");
-        return ESP_FAIL;
-    }
+    /* Set before creating the workers, since they exit if the state is not running */
     queue_state = WORK_QUEUE_STATE_RUNNING;
+    for (uint8_t i = 0; i < work_pool.workers; i++) {
+        /* Counted before creating the worker, in case it exits right away on a stop request */
+        xSemaphoreTake(work_pool.lock, portMAX_DELAY);
+        work_pool.running++;
+        xSemaphoreGive(work_pool.lock);
+        BaseType_t ret;
+#if !CONFIG_FREERTOS_UNICORE && (portNUM_PROCESSORS > 1)
+        if (work_pool.pin_to_cores) {
+            ret = xTaskCreatePinnedToCore(&esp_rmaker_work_queue_task, "rmaker_queue_task", ESP_RMAKER_TASK_STACK,
+                    (void *)(uintptr_t)i, ESP_RMAKER_TASK_PRIORITY, NULL, i % portNUM_PROCESSORS);
+        } else
+#endif
+        {
+            ret = xTaskCreate(&esp_rmaker_work_queue_task, "rmaker_queue_task", ESP_RMAKER_TASK_STACK,
+                    (void *)(uintptr_t)i, ESP_RMAKER_TASK_PRIORITY, NULL);
+        }
+        if (ret != pdPASS) {
+            /* The workers started already take the work from all the queues, so carry on with them */
+            ESP_LOGE(TAG, "Couldn't create RainMaker work queue task %d", i);
+            xSemaphoreTake(work_pool.lock, portMAX_DELAY);
+            if (--work_pool.running == 0) {
+                queue_state = WORK_QUEUE_STATE_INIT_DONE;
+            }
+            xSemaphoreGive(work_pool.lock);
+            return (i == 0) ? ESP_FAIL : ESP_OK;
+        }
+    }
     return ESP_OK;
 }
 
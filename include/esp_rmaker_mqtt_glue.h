@@ -116,13 +116,20 @@ typedef esp_err_t (*esp_rmaker_mqtt_disconnect_t)(void);
  * @param[in] data_len Length of the data.
  * @param[in] qos Quality of service for the message.
  * @param[out] msg_id If a non NULL pointer is passed, the id of the published message will be returned in this.
+ * It is set to -1 if the message is queued by a rate limit, since the id is known only once it is published.
  *
  * @return ESP_OK on success.
- * @return error in case of any error.
+ * @return ESP_ERR_NOT_FINISHED if the message was queued by a rate limit, to be published later.
+ * @return ESP_ERR_NOT_ALLOWED if the message was dropped by a rate limit.
+ * @return error in case of any other error.
  */
 typedef esp_err_t (*esp_rmaker_mqtt_publish_t)(const char *topic, void *data, size_t data_len, uint8_t qos, int *msg_id);
 
 /** MQTT Subscribe function prototype
+ *
+ * The topic can contain the MQTT single-level ('+') and multi-level ('#') wildcards. Topics which are
+ * already delivered through an overlapping wildcard subscription are not subscribed to separately,
+ * so one wildcard subscription can replace several exact ones.
  *
  * @param[in] topic The topic to be subscribed to.
  * @param[in] cb The callback to be invoked when a message is received on the given topic.
@@ -179,6 +186,80 @@ typedef struct {
     esp_rmaker_mqtt_update_config_t update_config;
 } esp_rmaker_mqtt_config_t;
 
+/** MQTT Subscription states */
+typedef enum {
+    /** Not subscribed */
+    ESP_RMAKER_MQTT_SUB_STATE_NONE = 0,
+    /** Subscription request sent, waiting for SUBACK */
+    ESP_RMAKER_MQTT_SUB_STATE_REQUESTED,
+    /** SUBACK received, subscription active */
+    ESP_RMAKER_MQTT_SUB_STATE_ACKNOWLEDGED,
+    /** Subscription failed. Will be retried after a backoff. */
+    ESP_RMAKER_MQTT_SUB_STATE_FAILED,
+} esp_rmaker_mqtt_sub_state_t;
+
+/** MQTT Subscription information */
+typedef struct {
+    /** Current state of the subscription */
+    esp_rmaker_mqtt_sub_state_t state;
+    /** QoS requested for the subscription */
+    uint8_t qos;
+    /** Whether the topic is delivered through an overlapping wildcard subscription */
+    bool covered;
+    /** Number of consecutive failed subscription attempts */
+    uint8_t retries;
+    /** Time between the last SUBSCRIBE and its SUBACK. 0 if not acknowledged yet. */
+    uint32_t latency_ms;
+} esp_rmaker_mqtt_sub_info_t;
+
+/** MQTT Publish rate limit policies, for messages beyond the allowed rate */
+typedef enum {
+    /** Drop the message. Publish fails with ESP_ERR_NOT_ALLOWED. */
+    ESP_RMAKER_MQTT_RATE_LIMIT_DROP = 0,
+    /** Queue the message and publish it once allowed by the rate limit. Publish returns ESP_ERR_NOT_FINISHED,
+     * or ESP_ERR_NOT_ALLOWED if the queue is full.
+     */
+    ESP_RMAKER_MQTT_RATE_LIMIT_DELAY,
+    /** Like ESP_RMAKER_MQTT_RATE_LIMIT_DELAY, but a queued message is replaced by
+     * a newer one on the same topic, so that only the latest value gets published.
+     */
+    ESP_RMAKER_MQTT_RATE_LIMIT_COALESCE,
+} esp_rmaker_mqtt_rate_limit_policy_t;
+
+/** MQTT Publish rate limit configuration
+ *
+ * A token bucket which holds up to burst tokens, and gets one token added every refill_interval_ms.
+ * Each message published on a matching topic consumes a token.
+ */
+typedef struct {
+    /** Topic, or topic prefix, to which the rate limit applies. If multiple rate limits match
+     * a topic, the one with the longest prefix is used. An empty string matches all the topics.
+     */
+    const char *topic_prefix;
+    /** Maximum number of messages that can be published back to back */
+    uint16_t burst;
+    /** Time after which one more message is allowed */
+    uint32_t refill_interval_ms;
+    /** Policy for the messages beyond the allowed rate */
+    esp_rmaker_mqtt_rate_limit_policy_t policy;
+    /** Maximum number of messages queued by the delay and coalesce policies. Further messages are dropped. */
+    uint16_t max_pending;
+} esp_rmaker_mqtt_rate_limit_config_t;
+
+/** MQTT Publish rate limit counters */
+typedef struct {
+    /** Messages published without being throttled */
+    uint32_t passed;
+    /** Messages queued to be published later */
+    uint32_t delayed;
+    /** Queued messages replaced by a newer message on the same topic */
+    uint32_t coalesced;
+    /** Messages dropped */
+    uint32_t dropped;
+    /** Messages currently in the queue */
+    uint16_t pending;
+} esp_rmaker_mqtt_rate_limit_stats_t;
+
 /** Setup MQTT Glue
  *
  * This function initializes MQTT glue layer with all the default functions.
@@ -190,6 +271,63 @@ typedef struct {
  */
 esp_err_t esp_rmaker_mqtt_glue_setup(esp_rmaker_mqtt_config_t *mqtt_config);
 
+/** Get MQTT Subscription information
+ *
+ * @param[in] topic The topic that was subscribed to.
+ * @param[out] info Pointer to a structure to be filled with the subscription information.
+ *
+ * @return ESP_OK on success.
+ * @return ESP_ERR_NOT_FOUND if there is no subscription for the topic.
+ * @return error in case of any other error.
+ */
+esp_err_t esp_rmaker_mqtt_glue_get_subscription_info(const char *topic, esp_rmaker_mqtt_sub_info_t *info);
+
+/** Reconcile MQTT Subscriptions
+ *
+ * Failed and unacknowledged subscriptions are retried periodically (as per
+ * CONFIG_ESP_RMAKER_MQTT_SUBSCRIPTION_RECONCILE_INTERVAL) and after every (re)connection,
+ * in batched SUBSCRIBE packets with an exponential backoff. This function triggers
+ * the same reconciliation immediately. Subscriptions still within their retry backoff are skipped.
+ *
+ * @return ESP_OK on success.
+ * @return ESP_ERR_INVALID_STATE if MQTT is not connected.
+ */
+esp_err_t esp_rmaker_mqtt_glue_reconcile_subscriptions(void);
+
+/** Set an MQTT Publish rate limit
+ *
+ * Adds a rate limit for the messages published on the given topic (or topic prefix), or updates it if it
+ * already exists. The rate limits apply to the publish function of the MQTT glue.
+ *
+ * @param[in] config Pointer to the rate limit configuration. The topic prefix is copied internally.
+ *
+ * @return ESP_OK on success.
+ * @return ESP_ERR_INVALID_ARG if the configuration is invalid.
+ * @return ESP_ERR_NO_MEM if there is no space for a new rate limit.
+ */
+esp_err_t esp_rmaker_mqtt_glue_set_rate_limit(const esp_rmaker_mqtt_rate_limit_config_t *config);
+
+/** Remove an MQTT Publish rate limit
+ *
+ * Any messages queued for the rate limit are discarded.
+ *
+ * @param[in] topic_prefix The topic prefix used while setting the rate limit.
+ *
+ * @return ESP_OK on success.
+ * @return ESP_ERR_NOT_FOUND if there is no rate limit for the prefix.
+ */
+esp_err_t esp_rmaker_mqtt_glue_remove_rate_limit(const char *topic_prefix);
+
+/** Get MQTT Publish rate limit counters
+ *
+ * @param[in] topic_prefix The topic prefix used while setting the rate limit.
+ * @param[out] stats Pointer to a structure to be filled with the counters.
+ *
+ * @return ESP_OK on success.
+ * @return ESP_ERR_NOT_FOUND if there is no rate limit for the prefix.
+ */
+esp_err_t esp_rmaker_mqtt_glue_get_rate_limit_stats(const char *topic_prefix, esp_rmaker_mqtt_rate_limit_stats_t *stats);
+
 /* Get the ESP AWS PPI String
  *
  * @return pointer to a NULL terminated PPI string on success.
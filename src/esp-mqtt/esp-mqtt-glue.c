@@ -7,9 +7,12 @@
 #include <stdio.h>
 #include <string.h>
 #include <stdbool.h>
+#include <inttypes.h>
 #include <sdkconfig.h>
 #include <freertos/FreeRTOS.h>
 #include <freertos/task.h>
+#include <freertos/timers.h>
+#include <freertos/semphr.h>
 #include <esp_log.h>
 #include <mqtt_client.h>
 #include <esp_event.h>
@@ -17,6 +20,7 @@
 #include <esp_rmaker_mqtt_glue.h>
 #include <esp_idf_version.h>
 #include <esp_rmaker_utils.h>
+#include <esp_rmaker_work_queue.h>
 #ifdef CONFIG_ESP_RMAKER_MQTT_PORT_443
 #define ESP_RMAKER_MQTT_USE_PORT_443
 #endif
@@ -29,45 +33,147 @@
 static const char *TAG = "esp_mqtt_glue";
 
 #define MAX_MQTT_SUBSCRIPTIONS      CONFIG_ESP_RMAKER_MAX_MQTT_SUBSCRIPTIONS
-
-/* Subscription states for tracking subscription lifecycle */
-typedef enum {
-    MQTT_SUB_STATE_NONE = 0,        /* Not subscribed */
-    MQTT_SUB_STATE_REQUESTED,       /* Subscription request sent, waiting for SUBACK */
-    MQTT_SUB_STATE_ACKNOWLEDGED,    /* SUBACK received, subscription active */
-    MQTT_SUB_STATE_FAILED           /* Subscription failed */
-} mqtt_subscription_state_t;
+#define TOPIC_POOL_BUCKETS          16      /* Must be a power of 2 */
+#define MQTT_SUBSCRIBE_BATCH_SIZE   CONFIG_ESP_RMAKER_MQTT_SUBSCRIBE_BATCH_SIZE
+#define MQTT_SUBSCRIBE_BATCH_BYTES  768     /* Keeps a batched SUBSCRIBE within the default MQTT buffer */
+#define MQTT_SUBACK_TIMEOUT_MS      (15 * 1000)
+#define MQTT_SUB_RETRY_MIN_MS       (2 * 1000)
+#define MQTT_SUB_RETRY_MAX_MS       (5 * 60 * 1000)
+#define MQTT_SUBACK_FAILURE         0x80
+#define MAX_MQTT_RATE_LIMITS        CONFIG_ESP_RMAKER_MAX_MQTT_RATE_LIMITS
+
+/* Interned topic string. Each unique topic is stored once, shared by all the subscriptions
+ * for it, so topics can be compared by pointer.
+ */
+typedef struct esp_mqtt_glue_topic {
+    struct esp_mqtt_glue_topic *next;   /* Next topic in the same pool bucket */
+    uint32_t hash;
+    uint16_t len;
+    uint16_t ref_count;
+    bool has_wildcard;
+    char str[];
+} esp_mqtt_glue_topic_t;
 
 typedef struct {
-    char *topic;
+    esp_mqtt_glue_topic_t *topic;
     esp_rmaker_mqtt_subscribe_cb_t cb;
     void *priv;
-    mqtt_subscription_state_t state;
+    esp_rmaker_mqtt_sub_state_t state;
     int msg_id;                     /* Message ID from last subscribe request */
     uint8_t qos;                    /* QoS level for this subscription */
+    bool covered;                   /* Delivered through an overlapping wildcard subscription,
+                                     * so there is no broker subscription for this topic itself */
+    uint8_t sub_index;              /* Position of the topic in the (batched) SUBSCRIBE packet */
+    uint8_t retries;                /* Consecutive failed attempts, for the retry backoff */
+    TickType_t request_tick;        /* When the last subscribe request was sent */
+    TickType_t next_retry_tick;     /* When a failed subscription can be retried */
+    uint32_t latency_ms;            /* SUBSCRIBE to SUBACK time of the last acknowledged request */
 } esp_mqtt_glue_subscription_t;
 
 typedef struct {
     esp_mqtt_client_handle_t mqtt_client;
     esp_rmaker_mqtt_conn_params_t *conn_params;
     esp_mqtt_glue_subscription_t *subscriptions[MAX_MQTT_SUBSCRIPTIONS];
+    esp_mqtt_glue_topic_t *topic_pool[TOPIC_POOL_BUCKETS];
+    /* Topics whose UNSUBSCRIBE could not be sent, to be retried by the reconciler */
+    esp_mqtt_glue_topic_t *pending_unsubscriptions[MAX_MQTT_SUBSCRIPTIONS];
+    TimerHandle_t reconcile_timer;
+    bool connected;
+    uint8_t client_calls;           /* Calls into the client made with glue_lock released */
 } esp_mqtt_glue_data_t;
 esp_mqtt_glue_data_t *mqtt_data;
 
+/* Protects the subscription database, the pending unsubscriptions and the topic pool, which are
+ * used from the API calls, the MQTT event handler and the reconcile work. It is recursive, since the
+ * subscription callbacks run with it held and may subscribe or unsubscribe.
+ *
+ * The client holds its own lock while delivering events to mqtt_event_handler(), so glue_lock is
+ * released around the calls which send SUBSCRIBE and UNSUBSCRIBE packets. Unlike mqtt_data, it is
+ * never freed, so that reconcile work still queued after a deinit can find out that it has nothing to do.
+ */
+static SemaphoreHandle_t glue_lock;
+
 typedef struct {
     char *data;
     char *topic;
 } esp_mqtt_glue_long_data_t;
 
+/* Message held back by a publish rate limit */
+typedef struct esp_mqtt_glue_pending_publish {
+    struct esp_mqtt_glue_pending_publish *next;
+    char *topic;
+    void *data;
+    size_t data_len;
+    uint8_t qos;
+} esp_mqtt_glue_pending_publish_t;
+
+typedef struct {
+    char *topic_prefix;
+    size_t prefix_len;
+    esp_rmaker_mqtt_rate_limit_config_t config;
+    uint16_t tokens;
+    TickType_t last_refill_tick;
+    esp_mqtt_glue_pending_publish_t *pending_head;
+    esp_mqtt_glue_pending_publish_t *pending_tail;
+    esp_rmaker_mqtt_rate_limit_stats_t stats;
+} esp_mqtt_glue_rate_limit_t;
+
+/* The rate limits are independent of the MQTT client, so that they can be set at any time.
+ * Since publishing can happen from any task, they are protected by a lock, which is never
+ * held while calling into the MQTT client.
+ */
+static esp_mqtt_glue_rate_limit_t *rate_limits[MAX_MQTT_RATE_LIMITS];
+static SemaphoreHandle_t rate_limit_lock;
+static TimerHandle_t rate_limit_timer;
+static TickType_t rate_limit_flush_tick;   /* When rate_limit_timer expires, if active */
+
 static void esp_mqtt_glue_deinit(void);
 
+/* Take glue_lock, if MQTT is initialised */
+static bool esp_mqtt_glue_lock(void)
+{
+    if (!glue_lock) {
+        return false;
+    }
+    xSemaphoreTakeRecursive(glue_lock, portMAX_DELAY);
+    if (!mqtt_data) {
+        xSemaphoreGiveRecursive(glue_lock);
+        return false;
+    }
+    return true;
+}
+
+static void esp_mqtt_glue_unlock(void)
+{
+    xSemaphoreGiveRecursive(glue_lock);
+}
+
+/* Release glue_lock around a call into the client. Deinit waits for such calls to complete,
+ * so mqtt_data stays valid till esp_mqtt_glue_relock_after_client().
+ */
+static void esp_mqtt_glue_unlock_for_client(void)
+{
+    mqtt_data->client_calls++;
+    xSemaphoreGiveRecursive(glue_lock);
+}
+
+static void esp_mqtt_glue_relock_after_client(void)
+{
+    xSemaphoreTakeRecursive(glue_lock, portMAX_DELAY);
+    mqtt_data->client_calls--;
+}
+
 /**
  * @brief Check if an MQTT topic matches a subscription pattern with wildcards
  * 
- * Supports MQTT single-level wildcard:
+ * Supports MQTT wildcards:
  * - '+' matches a single level (e.g., "node/+/params" matches "node/device1/params")
+ * - '#' matches any number of levels, including the parent level
+ *   (e.g., "node/#" matches "node", "node/device1" and "node/device1/params")
+ *
+ * As per the MQTT spec, wildcards at the first level do not match topics starting with '$'.
  * 
- * @param topic_filter The subscription pattern (may contain '+' wildcards)
+ * @param topic_filter The subscription pattern (may contain '+' and '#' wildcards)
  * @param topic_name The actual topic name to match
  * @param topic_len Length of the topic name
  * @return true if the topic matches the filter, false otherwise
@@ -78,19 +184,29 @@ static bool mqtt_topic_matches(const char *topic_filter, const char *topic_name,
     const char *topic_pos = topic_name;
     int topic_consumed = 0;
 
-    while (*filter_pos && topic_consumed < topic_len) {
-        if (*filter_pos == '+') {
+    if (topic_len > 0 && *topic_name == '$' && (*topic_filter == '+' || *topic_filter == '#')) {
+        return false;
+    }
+
+    while (*filter_pos) {
+        if (*filter_pos == '#') {
+            // Multi-level wildcard - matches everything from this level onwards
+            return true;
+        } else if (*filter_pos == '+') {
             // Single-level wildcard - skip to next '/' or end of topic
             while (topic_consumed < topic_len && *topic_pos != '/') {
                 topic_pos++;
                 topic_consumed++;
             }
             filter_pos++;
-        } else if (*filter_pos == *topic_pos) {
+        } else if (topic_consumed < topic_len && *filter_pos == *topic_pos) {
             // Characters match, advance both
             filter_pos++;
             topic_pos++;
             topic_consumed++;
+        } else if (topic_consumed == topic_len && strcmp(filter_pos, "/#") == 0) {
+            // "a/#" also matches the parent level "a"
+            return true;
         } else {
             // Characters don't match
             return false;
@@ -98,7 +214,147 @@ static bool mqtt_topic_matches(const char *topic_filter, const char *topic_name,
     }
 
     // Both strings must be fully consumed
-    return (*filter_pos == '\0' && topic_consumed == topic_len);
+    return (topic_consumed == topic_len);
+}
+
+/**
+ * @brief Validate the wildcard usage in a topic filter
+ *
+ * '+' and '#' must occupy an entire level, and '#' must be the last level.
+ *
+ * @param topic_filter The subscription pattern
+ * @return true if the filter is valid, false otherwise
+ */
+static bool mqtt_topic_filter_is_valid(const char *topic_filter)
+{
+    if (*topic_filter == '\0') {
+        return false;
+    }
+    for (const char *pos = topic_filter; *pos; pos++) {
+        if (*pos != '+' && *pos != '#') {
+            continue;
+        }
+        bool level_start = (pos == topic_filter) || (pos[-1] == '/');
+        bool level_end = (pos[1] == '\0') || (pos[1] == '/');
+        if (!level_start || !level_end || (*pos == '#' && pos[1] != '\0')) {
+            return false;
+        }
+    }
+    return true;
+}
+
+/**
+ * @brief Check if one topic filter covers another
+ *
+ * A filter covers another if every topic matched by the latter is also matched by the former.
+ * For example, "node/#" covers "node/+/params", which in turn covers "node/device1/params".
+ * Used to avoid sending SUBSCRIBE for topics that the broker already delivers through an
+ * overlapping wildcard subscription (which would also result in duplicate deliveries).
+ *
+ * @param filter The (wider) subscription pattern
+ * @param other The subscription pattern to check
+ * @return true if filter covers other, false otherwise
+ */
+static bool mqtt_topic_filter_covers(const char *filter, const char *other)
+{
+    if (*other == '$' && (*filter == '+' || *filter == '#')) {
+        return false;
+    }
+    while (true) {
+        if (*filter == '#') {
+            return true;
+        }
+        if (*other == '#') {
+            return false;
+        }
+        size_t filter_level_len = strcspn(filter, "/");
+        size_t other_level_len = strcspn(other, "/");
+        if (!(filter_level_len == 1 && *filter == '+')) {
+            if (other_level_len == 1 && *other == '+') {
+                return false;
+            }
+            if (filter_level_len != other_level_len || strncmp(filter, other, filter_level_len) != 0) {
+                return false;
+            }
+        }
+        filter += filter_level_len;
+        other += other_level_len;
+        if (*other == '\0') {
+            return (*filter == '\0') || (strcmp(filter, "/#") == 0);
+        }
+        if (*filter == '\0') {
+            return false;
+        }
+        /* Skip the '/' separators */
+        filter++;
+        other++;
+    }
+}
+
+/* FNV-1a hash of the topic string */
+static uint32_t esp_mqtt_glue_topic_hash(const char *topic, size_t len)
+{
+    uint32_t hash = 2166136261u;
+    for (size_t i = 0; i < len; i++) {
+        hash ^= (uint8_t)topic[i];
+        hash *= 16777619u;
+    }
+    return hash;
+}
+
+/* Find the interned copy of a topic. Returns NULL if the topic is not in the pool. */
+static esp_mqtt_glue_topic_t *esp_mqtt_glue_topic_lookup(const char *topic, size_t len, uint32_t hash)
+{
+    esp_mqtt_glue_topic_t *entry = mqtt_data->topic_pool[hash & (TOPIC_POOL_BUCKETS - 1)];
+    for (; entry; entry = entry->next) {
+        if (entry->hash == hash && entry->len == len && memcmp(entry->str, topic, len) == 0) {
+            return entry;
+        }
+    }
+    return NULL;
+}
+
+/* Get a reference to the interned copy of a topic, adding it to the pool if required */
+static esp_mqtt_glue_topic_t *esp_mqtt_glue_topic_intern(const char *topic)
+{
+    size_t len = strlen(topic);
+    if (len > UINT16_MAX) {
+        return NULL;
+    }
+    uint32_t hash = esp_mqtt_glue_topic_hash(topic, len);
+    esp_mqtt_glue_topic_t *entry = esp_mqtt_glue_topic_lookup(topic, len, hash);
+    if (entry) {
+        entry->ref_count++;
+        return entry;
+    }
+    entry = calloc(1, sizeof(esp_mqtt_glue_topic_t) + len + 1);
+    if (!entry) {
+        return NULL;
+    }
+    memcpy(entry->str, topic, len);
+    entry->hash = hash;
+    entry->len = len;
+    entry->ref_count = 1;
+    entry->has_wildcard = (strpbrk(entry->str, "+#") != NULL);
+    entry->next = mqtt_data->topic_pool[hash & (TOPIC_POOL_BUCKETS - 1)];
+    mqtt_data->topic_pool[hash & (TOPIC_POOL_BUCKETS - 1)] = entry;
+    return entry;
+}
+
+/* Release a reference to an interned topic, freeing it once unused */
+static void esp_mqtt_glue_topic_release(esp_mqtt_glue_topic_t *topic)
+{
+    if (--topic->ref_count > 0) {
+        return;
+    }
+    esp_mqtt_glue_topic_t **prev = &mqtt_data->topic_pool[topic->hash & (TOPIC_POOL_BUCKETS - 1)];
+    while (*prev && *prev != topic) {
+        prev = &(*prev)->next;
+    }
+    if (*prev) {
+        *prev = topic->next;
+    }
+    free(topic);
 }
 
 /* Helper function to reset all subscription states */
@@ -106,29 +362,97 @@ static void esp_mqtt_glue_reset_subscription_states(void)
 {
     for (int i = 0; i < MAX_MQTT_SUBSCRIPTIONS; i++) {
         if (mqtt_data->subscriptions[i]) {
-            mqtt_data->subscriptions[i]->state = MQTT_SUB_STATE_NONE;
+            mqtt_data->subscriptions[i]->state = ESP_RMAKER_MQTT_SUB_STATE_NONE;
+            mqtt_data->subscriptions[i]->msg_id = -1;
+            mqtt_data->subscriptions[i]->retries = 0;
+        }
+    }
+}
+
+/* Get the QoS with which the broker should be subscribed to a topic,
+ * i.e. the highest QoS requested by any of the entries for it.
+ */
+static uint8_t esp_mqtt_glue_get_topic_qos(const esp_mqtt_glue_topic_t *topic)
+{
+    uint8_t max_qos = 0;
+    for (int i = 0; i < MAX_MQTT_SUBSCRIPTIONS; i++) {
+        if (mqtt_data->subscriptions[i] &&
+            mqtt_data->subscriptions[i]->topic == topic &&
+            mqtt_data->subscriptions[i]->qos > max_qos) {
+            max_qos = mqtt_data->subscriptions[i]->qos;
+        }
+    }
+    return max_qos;
+}
+
+/* Find a subscription with its own broker subscription (requested or acknowledged) whose
+ * filter covers the given topic with at least the given QoS.
+ *
+ * Filters which cover each other (equivalent filters written differently) are not treated as
+ * covering, so that there is always at least one of them subscribed at the broker.
+ */
+static esp_mqtt_glue_subscription_t *esp_mqtt_glue_find_cover(const esp_mqtt_glue_topic_t *topic, uint8_t qos,
+        bool acknowledged_only)
+{
+    for (int i = 0; i < MAX_MQTT_SUBSCRIPTIONS; i++) {
+        esp_mqtt_glue_subscription_t *entry = mqtt_data->subscriptions[i];
+        /* Only wildcard filters can cover other topics */
+        if (!entry || entry->covered || !entry->topic->has_wildcard || entry->qos < qos || entry->topic == topic) {
+            continue;
+        }
+        if (entry->state != ESP_RMAKER_MQTT_SUB_STATE_ACKNOWLEDGED &&
+            (acknowledged_only || entry->state != ESP_RMAKER_MQTT_SUB_STATE_REQUESTED)) {
+            continue;
+        }
+        if (mqtt_topic_filter_covers(entry->topic->str, topic->str) &&
+            !mqtt_topic_filter_covers(topic->str, entry->topic->str)) {
+            return entry;
+        }
+    }
+    return NULL;
+}
+
+/* Mark all entries for the given topic as riding on the cover's broker subscription */
+static void esp_mqtt_glue_set_covered(const esp_mqtt_glue_topic_t *topic, esp_mqtt_glue_subscription_t *cover)
+{
+    for (int i = 0; i < MAX_MQTT_SUBSCRIPTIONS; i++) {
+        if (mqtt_data->subscriptions[i] && mqtt_data->subscriptions[i]->topic == topic) {
+            mqtt_data->subscriptions[i]->covered = true;
+            mqtt_data->subscriptions[i]->state = cover->state;
+            mqtt_data->subscriptions[i]->msg_id = cover->msg_id;
+            mqtt_data->subscriptions[i]->sub_index = cover->sub_index;
+            mqtt_data->subscriptions[i]->request_tick = cover->request_tick;
+            mqtt_data->subscriptions[i]->retries = 0;
         }
     }
 }
 
 static void esp_mqtt_glue_subscribe_callback(const char *topic, int topic_len, const char *data, int data_len)
 {
+    if (!esp_mqtt_glue_lock()) {
+        return;
+    }
     esp_mqtt_glue_subscription_t **subscriptions = mqtt_data->subscriptions;
+    char *actual_topic = NULL;
     int i;
     for (i = 0; i < MAX_MQTT_SUBSCRIPTIONS; i++) {
         if (subscriptions[i]) {
-            if ((mqtt_topic_matches(subscriptions[i]->topic, topic, topic_len))) {
-                char *actual_topic = strndup(topic, topic_len);
+            if ((mqtt_topic_matches(subscriptions[i]->topic->str, topic, topic_len))) {
+                /* The NULL terminated copy is shared by all the callbacks for this message */
                 if (!actual_topic) {
-                    ESP_LOGE(TAG, "Failed to allocate memory for actual topic");
-                    return;
+                    actual_topic = strndup(topic, topic_len);
+                    if (!actual_topic) {
+                        ESP_LOGE(TAG, "Failed to allocate memory for actual topic");
+                        break;
+                    }
                 }
                 /* send the actual topic to the callback */
                 subscriptions[i]->cb(actual_topic, (void *)data, data_len, subscriptions[i]->priv);
-                free(actual_topic);
             }
         }
     }
+    esp_mqtt_glue_unlock();
+    free(actual_topic);
 }
 
 /*
@@ -146,28 +470,328 @@ static inline int _esp_mqtt_client_subscribe(esp_mqtt_client_handle_t client, co
 #endif
 }
 
-static esp_err_t esp_mqtt_glue_subscribe(const char *topic, esp_rmaker_mqtt_subscribe_cb_t cb, uint8_t qos, void *priv_data)
+/* Mark all entries for a topic as failed, scheduling the retry with an exponential backoff */
+static void esp_mqtt_glue_set_topic_failed(const esp_mqtt_glue_topic_t *topic, TickType_t now)
 {
-    if (!mqtt_data || !topic || !cb) {
-        return ESP_FAIL;
+    for (int i = 0; i < MAX_MQTT_SUBSCRIPTIONS; i++) {
+        esp_mqtt_glue_subscription_t *entry = mqtt_data->subscriptions[i];
+        if (!entry || entry->topic != topic) {
+            continue;
+        }
+        if (entry->retries < UINT8_MAX) {
+            entry->retries++;
+        }
+        uint32_t backoff_ms = MQTT_SUB_RETRY_MAX_MS;
+        if (entry->retries <= 8) {
+            backoff_ms = MQTT_SUB_RETRY_MIN_MS << (entry->retries - 1);
+            if (backoff_ms > MQTT_SUB_RETRY_MAX_MS) {
+                backoff_ms = MQTT_SUB_RETRY_MAX_MS;
+            }
+        }
+        entry->state = ESP_RMAKER_MQTT_SUB_STATE_FAILED;
+        entry->msg_id = -1;
+        entry->next_retry_tick = now + pdMS_TO_TICKS(backoff_ms);
+    }
+}
+
+/* Update all entries for a topic as per the result of a subscribe request */
+static void esp_mqtt_glue_set_topic_requested(const esp_mqtt_glue_topic_t *topic, int msg_id, uint8_t sub_index)
+{
+    TickType_t now = xTaskGetTickCount();
+    if (msg_id < 0) {
+        esp_mqtt_glue_set_topic_failed(topic, now);
+        return;
+    }
+    for (int i = 0; i < MAX_MQTT_SUBSCRIPTIONS; i++) {
+        esp_mqtt_glue_subscription_t *entry = mqtt_data->subscriptions[i];
+        if (entry && entry->topic == topic) {
+            entry->covered = false;
+            entry->state = ESP_RMAKER_MQTT_SUB_STATE_REQUESTED;
+            entry->msg_id = msg_id;
+            entry->sub_index = sub_index;
+            entry->request_tick = now;
+        }
+    }
+}
+
+/* Check if a failed subscription is due for a retry */
+static bool esp_mqtt_glue_retry_due(const esp_mqtt_glue_subscription_t *entry, TickType_t now)
+{
+    return (entry->state == ESP_RMAKER_MQTT_SUB_STATE_FAILED) && ((int32_t)(now - entry->next_retry_tick) >= 0);
+}
+
+/* Queue an UNSUBSCRIBE for a topic, to be sent by the reconciler with glue_lock released */
+static void esp_mqtt_glue_unsubscribe_topic(esp_mqtt_glue_topic_t *topic)
+{
+    for (int i = 0; i < MAX_MQTT_SUBSCRIPTIONS; i++) {
+        if (mqtt_data->pending_unsubscriptions[i] == topic) {
+            return;
+        }
+    }
+    for (int i = 0; i < MAX_MQTT_SUBSCRIPTIONS; i++) {
+        if (!mqtt_data->pending_unsubscriptions[i]) {
+            topic->ref_count++;
+            mqtt_data->pending_unsubscriptions[i] = topic;
+            return;
+        }
+    }
+    ESP_LOGW(TAG, "No space to queue the unsubscribe for topic: %s", topic->str);
+}
+
+/* Release the pending UNSUBSCRIBE for the given topic, or for all the topics if NULL */
+static void esp_mqtt_glue_clear_pending_unsubscriptions(const esp_mqtt_glue_topic_t *topic)
+{
+    for (int i = 0; i < MAX_MQTT_SUBSCRIPTIONS; i++) {
+        if (mqtt_data->pending_unsubscriptions[i] && (!topic || mqtt_data->pending_unsubscriptions[i] == topic)) {
+            esp_mqtt_glue_topic_release(mqtt_data->pending_unsubscriptions[i]);
+            mqtt_data->pending_unsubscriptions[i] = NULL;
+        }
+    }
+}
+
+/* Topics to be sent in a single SUBSCRIBE packet. Holds a reference to each of the topics. */
+typedef struct {
+    esp_mqtt_topic_t list[MQTT_SUBSCRIBE_BATCH_SIZE];
+    esp_mqtt_glue_topic_t *topics[MQTT_SUBSCRIBE_BATCH_SIZE];
+    int msg_ids[MQTT_SUBSCRIBE_BATCH_SIZE];
+    int count;
+    size_t bytes;
+} esp_mqtt_glue_subscribe_batch_t;
+
+/* Send the topics collected in the batch as a single SUBSCRIBE packet.
+ * A SUBACK handled before the message ID gets recorded is caught by the SUBACK timeout.
+ */
+static void esp_mqtt_glue_flush_subscribe_batch(esp_mqtt_glue_subscribe_batch_t *batch)
+{
+    if (batch->count == 0) {
+        return;
+    }
+    esp_mqtt_client_handle_t client = mqtt_data->mqtt_client;
+    esp_mqtt_glue_unlock_for_client();
+#if ESP_IDF_VERSION >= ESP_IDF_VERSION_VAL(5, 1, 2)
+    int ret = esp_mqtt_client_subscribe_multiple(client, batch->list, batch->count);
+    for (int i = 0; i < batch->count; i++) {
+        batch->msg_ids[i] = ret;
+    }
+    ESP_LOGD(TAG, "Subscribed to %d topics (msg_id: %d)", batch->count, ret);
+#else
+    for (int i = 0; i < batch->count; i++) {
+        batch->msg_ids[i] = _esp_mqtt_client_subscribe(client, batch->list[i].filter, batch->list[i].qos);
+    }
+#endif
+    esp_mqtt_glue_relock_after_client();
+    for (int i = 0; i < batch->count; i++) {
+#if ESP_IDF_VERSION >= ESP_IDF_VERSION_VAL(5, 1, 2)
+        esp_mqtt_glue_set_topic_requested(batch->topics[i], batch->msg_ids[i], i);
+#else
+        esp_mqtt_glue_set_topic_requested(batch->topics[i], batch->msg_ids[i], 0);
+#endif
+        esp_mqtt_glue_topic_release(batch->topics[i]);
+    }
+    batch->count = 0;
+    batch->bytes = 0;
+}
+
+/* Covered entries follow the state of their wildcard subscription. If there is none any more,
+ * they need to be subscribed on their own. Returns true if any such entries were found.
+ */
+static bool esp_mqtt_glue_sync_covered_topics(void)
+{
+    bool uncovered = false;
+    for (int i = 0; i < MAX_MQTT_SUBSCRIPTIONS; i++) {
+        esp_mqtt_glue_subscription_t *entry = mqtt_data->subscriptions[i];
+        if (!entry || !entry->covered) {
+            continue;
+        }
+        esp_mqtt_glue_subscription_t *cover = esp_mqtt_glue_find_cover(entry->topic,
+                esp_mqtt_glue_get_topic_qos(entry->topic), false);
+        if (cover) {
+            esp_mqtt_glue_set_covered(entry->topic, cover);
+        } else {
+            entry->covered = false;
+            entry->msg_id = -1;
+            entry->state = ESP_RMAKER_MQTT_SUB_STATE_NONE;
+            uncovered = true;
+        }
+    }
+    return uncovered;
+}
+
+/* Collect the topics due for a SUBSCRIBE, as many as fit in a single packet.
+ *
+ * Topics never requested since the (re)connection and failed ones whose retry backoff has elapsed
+ * are due. Requests which did not get a SUBACK in time are treated as failed. The collected topics are
+ * marked as requested right away, so that a concurrent reconciliation does not pick them up again.
+ */
+static void esp_mqtt_glue_collect_subscribe_batch(esp_mqtt_glue_subscribe_batch_t *batch)
+{
+    TickType_t now = xTaskGetTickCount();
+    for (int i = 0; i < MAX_MQTT_SUBSCRIPTIONS && batch->count < MQTT_SUBSCRIBE_BATCH_SIZE; i++) {
+        esp_mqtt_glue_subscription_t *entry = mqtt_data->subscriptions[i];
+        if (!entry || entry->covered) {
+            continue;
+        }
+        /* All the entries for a topic share the same state, so handle a topic only once */
+        bool topic_already_processed = false;
+        for (int j = 0; j < i; j++) {
+            if (mqtt_data->subscriptions[j] && mqtt_data->subscriptions[j]->topic == entry->topic) {
+                topic_already_processed = true;
+                break;
+            }
+        }
+        if (topic_already_processed) {
+            continue;
+        }
+        if (entry->state == ESP_RMAKER_MQTT_SUB_STATE_REQUESTED &&
+            (now - entry->request_tick) > pdMS_TO_TICKS(MQTT_SUBACK_TIMEOUT_MS)) {
+            ESP_LOGW(TAG, "No SUBACK received for topic: %s", entry->topic->str);
+            esp_mqtt_glue_set_topic_failed(entry->topic, now);
+        }
+        if (entry->state != ESP_RMAKER_MQTT_SUB_STATE_NONE && !esp_mqtt_glue_retry_due(entry, now)) {
+            continue;
+        }
+        /* Topic filter, along with its 2 byte length and the QoS byte */
+        size_t bytes = entry->topic->len + 3;
+        if (batch->count > 0 && (batch->bytes + bytes) > MQTT_SUBSCRIBE_BATCH_BYTES) {
+            break;
+        }
+        entry->topic->ref_count++;
+        batch->list[batch->count].filter = entry->topic->str;
+        batch->list[batch->count].qos = esp_mqtt_glue_get_topic_qos(entry->topic);
+        batch->topics[batch->count] = entry->topic;
+        /* Message ID 0 is never used for a SUBSCRIBE, so no SUBACK matches it till the actual one is set */
+        esp_mqtt_glue_set_topic_requested(entry->topic, 0, batch->count);
+        batch->count++;
+        batch->bytes += bytes;
+    }
+}
+
+/* Send the pending UNSUBSCRIBE requests, keeping the ones which could not be sent for a retry */
+static void esp_mqtt_glue_flush_pending_unsubscriptions(void)
+{
+    esp_mqtt_glue_topic_t *topics[MAX_MQTT_SUBSCRIPTIONS];
+    bool sent[MAX_MQTT_SUBSCRIPTIONS];
+    int count = 0;
+    for (int i = 0; i < MAX_MQTT_SUBSCRIPTIONS; i++) {
+        esp_mqtt_glue_topic_t *topic = mqtt_data->pending_unsubscriptions[i];
+        if (!topic) {
+            continue;
+        }
+        mqtt_data->pending_unsubscriptions[i] = NULL;
+        /* Subscribed again in the meantime. Nothing to do. */
+        bool resubscribed = false;
+        for (int j = 0; j < MAX_MQTT_SUBSCRIPTIONS; j++) {
+            if (mqtt_data->subscriptions[j] && mqtt_data->subscriptions[j]->topic == topic &&
+                !mqtt_data->subscriptions[j]->covered) {
+                resubscribed = true;
+                break;
+            }
+        }
+        if (resubscribed) {
+            esp_mqtt_glue_topic_release(topic);
+        } else {
+            /* The reference moves over from the pending list */
+            topics[count++] = topic;
+        }
+    }
+    if (count == 0) {
+        return;
+    }
+    /* The esp-mqtt client has no API for batched UNSUBSCRIBE, so these are sent one by one */
+    esp_mqtt_client_handle_t client = mqtt_data->mqtt_client;
+    esp_mqtt_glue_unlock_for_client();
+    for (int i = 0; i < count; i++) {
+        sent[i] = (esp_mqtt_client_unsubscribe(client, topics[i]->str) >= 0);
+    }
+    esp_mqtt_glue_relock_after_client();
+    for (int i = 0; i < count; i++) {
+        if (sent[i]) {
+            ESP_LOGD(TAG, "Unsubscribed from topic: %s", topics[i]->str);
+        } else {
+            ESP_LOGW(TAG, "Could not unsubscribe from topic: %s", topics[i]->str);
+            esp_mqtt_glue_unsubscribe_topic(topics[i]);
+        }
+        esp_mqtt_glue_topic_release(topics[i]);
+    }
+}
+
+/* Bring the broker subscriptions in line with the subscription database.
+ *
+ * The due topics are subscribed, batching as many topics per SUBSCRIBE packet as allowed, and the
+ * pending UNSUBSCRIBE requests are sent. This is the only place which sends these packets, as it
+ * releases glue_lock around the calls into the client.
+ */
+static void esp_mqtt_glue_reconcile(void)
+{
+    if (!esp_mqtt_glue_lock()) {
+        return;
+    }
+    while (mqtt_data->connected) {
+        esp_mqtt_glue_subscribe_batch_t batch = {0};
+        esp_mqtt_glue_collect_subscribe_batch(&batch);
+        /* Once all the topics are requested, the covered ones may need to be subscribed on their own */
+        if (batch.count == 0 && !esp_mqtt_glue_sync_covered_topics()) {
+            break;
+        }
+        esp_mqtt_glue_flush_subscribe_batch(&batch);
     }
+    if (mqtt_data->connected) {
+        esp_mqtt_glue_flush_pending_unsubscriptions();
+    }
+    esp_mqtt_glue_unlock();
+}
 
+static void esp_mqtt_glue_reconcile_work(void *priv_data)
+{
+    /* Does nothing if MQTT got deinitialised after this was queued */
+    esp_mqtt_glue_reconcile();
+}
+
+static void esp_mqtt_glue_reconcile_timer_cb(TimerHandle_t handle)
+{
+    /* The reconciliation sends MQTT packets, which needs more stack than the timer task may have */
+    esp_rmaker_work_queue_add_task(esp_mqtt_glue_reconcile_work, NULL);
+}
+
+/* Mark all entries for a topic to be subscribed afresh by the reconciler */
+static void esp_mqtt_glue_set_topic_unrequested(const esp_mqtt_glue_topic_t *topic)
+{
+    for (int i = 0; i < MAX_MQTT_SUBSCRIPTIONS; i++) {
+        esp_mqtt_glue_subscription_t *entry = mqtt_data->subscriptions[i];
+        if (entry && entry->topic == topic) {
+            entry->covered = false;
+            entry->state = ESP_RMAKER_MQTT_SUB_STATE_NONE;
+            entry->msg_id = -1;
+        }
+    }
+}
+
+/* Add or update an entry in the subscription database. Needs glue_lock.
+ * Sets *send to true if the topic needs a SUBSCRIBE.
+ */
+static esp_err_t esp_mqtt_glue_add_subscription(const char *topic, esp_rmaker_mqtt_subscribe_cb_t cb, uint8_t qos,
+        void *priv_data, bool *send)
+{
     esp_mqtt_glue_subscription_t *existing_entry = NULL;
-    bool topic_has_active_subscription = false;
+    esp_mqtt_glue_subscription_t *active_entry = NULL;
     int empty_slot = -1;
+    /* If the topic is not in the pool, there are no subscriptions for it yet */
+    size_t topic_len = strlen(topic);
+    esp_mqtt_glue_topic_t *interned_topic = esp_mqtt_glue_topic_lookup(topic, topic_len,
+            esp_mqtt_glue_topic_hash(topic, topic_len));
 
     /* Single pass: gather all the info we need */
     for (int i = 0; i < MAX_MQTT_SUBSCRIPTIONS; i++) {
         if (mqtt_data->subscriptions[i]) {
-            if (strcmp(topic, mqtt_data->subscriptions[i]->topic) == 0) {
+            if (interned_topic && mqtt_data->subscriptions[i]->topic == interned_topic) {
                 /* Same topic found */
                 if (cb == mqtt_data->subscriptions[i]->cb) {
                     /* Same callback too - this is an update */
                     existing_entry = mqtt_data->subscriptions[i];
                 }
                 /* Check if this topic has an active subscription */
-                if (mqtt_data->subscriptions[i]->state == MQTT_SUB_STATE_ACKNOWLEDGED) {
-                    topic_has_active_subscription = true;
+                if (mqtt_data->subscriptions[i]->state == ESP_RMAKER_MQTT_SUB_STATE_ACKNOWLEDGED) {
+                    active_entry = mqtt_data->subscriptions[i];
                 }
             }
         } else if (empty_slot == -1) {
@@ -181,8 +805,11 @@ static esp_err_t esp_mqtt_glue_subscribe(const char *topic, esp_rmaker_mqtt_subs
 
         bool need_resubscribe = false;
 
-        if (existing_entry->state != MQTT_SUB_STATE_ACKNOWLEDGED) {
-            /* Not acknowledged yet, need to re-subscribe */
+        if (existing_entry->state == ESP_RMAKER_MQTT_SUB_STATE_NONE ||
+            esp_mqtt_glue_retry_due(existing_entry, xTaskGetTickCount())) {
+            /* Not requested yet, or failed and due for a retry. Requests still in flight are
+             * left to the reconciler, which retries them if the SUBACK does not arrive in time.
+             */
             need_resubscribe = true;
         } else if (existing_entry->qos < qos) {
             /* QoS upgrade needed, re-subscribe */
@@ -191,16 +818,18 @@ static esp_err_t esp_mqtt_glue_subscribe(const char *topic, esp_rmaker_mqtt_subs
         }
 
         if (need_resubscribe) {
-            int ret = _esp_mqtt_client_subscribe(mqtt_data->mqtt_client, topic, qos);
-            if (ret >= 0) {
-                existing_entry->msg_id = ret;
-                existing_entry->state = MQTT_SUB_STATE_REQUESTED;
+            esp_mqtt_glue_subscription_t *cover = esp_mqtt_glue_find_cover(interned_topic, qos, false);
+            if (cover) {
+                /* An overlapping wildcard subscription already delivers this topic */
                 existing_entry->qos = qos;
-                ESP_LOGD(TAG, "Re-subscribing to topic: %s (msg_id: %d, QoS: %d)", topic, ret, qos);
-            } else {
-                existing_entry->state = MQTT_SUB_STATE_FAILED;
-                ESP_LOGW(TAG, "Failed to re-subscribe to topic: %s", topic);
+                esp_mqtt_glue_set_covered(interned_topic, cover);
+                ESP_LOGD(TAG, "Topic %s is covered by wildcard subscription %s", topic, cover->topic->str);
+                return ESP_OK;
             }
+            existing_entry->qos = qos;
+            esp_mqtt_glue_set_topic_unrequested(interned_topic);
+            *send = true;
+            ESP_LOGD(TAG, "Re-subscribing to topic: %s (QoS: %d)", topic, qos);
         }
         return ESP_OK;
     }
@@ -218,7 +847,7 @@ static esp_err_t esp_mqtt_glue_subscribe(const char *topic, esp_rmaker_mqtt_subs
         return ESP_FAIL;
     }
 
-    subscription->topic = strdup(topic);
+    subscription->topic = esp_mqtt_glue_topic_intern(topic);
     if (!subscription->topic) {
         free(subscription);
         ESP_LOGE(TAG, "Failed to allocate memory for topic string");
@@ -228,84 +857,173 @@ static esp_err_t esp_mqtt_glue_subscribe(const char *topic, esp_rmaker_mqtt_subs
     subscription->priv = priv_data;
     subscription->cb = cb;
     subscription->qos = qos;
-    subscription->state = topic_has_active_subscription ? MQTT_SUB_STATE_ACKNOWLEDGED : MQTT_SUB_STATE_NONE;
+    subscription->state = active_entry ? ESP_RMAKER_MQTT_SUB_STATE_ACKNOWLEDGED : ESP_RMAKER_MQTT_SUB_STATE_NONE;
+    subscription->covered = active_entry ? active_entry->covered : false;
 
     /* Add to database first */
     mqtt_data->subscriptions[empty_slot] = subscription;
+    /* An unsubscribe which is yet to be sent for this topic is no longer required */
+    esp_mqtt_glue_clear_pending_unsubscriptions(subscription->topic);
 
     /* Send MQTT subscribe only if needed */
-    if (!topic_has_active_subscription) {
-        int ret = _esp_mqtt_client_subscribe(mqtt_data->mqtt_client, topic, qos);
-        if (ret >= 0) {
-            subscription->msg_id = ret;
-            subscription->state = MQTT_SUB_STATE_REQUESTED;
-            ESP_LOGD(TAG, "Subscribed to topic: %s (msg_id: %d)", topic, ret);
-        } else {
-            subscription->state = MQTT_SUB_STATE_FAILED;
-            ESP_LOGW(TAG, "MQTT subscribe failed for topic: %s, keeping in DB for retry", topic);
-        }
-    } else {
+    if (active_entry) {
         ESP_LOGD(TAG, "Added callback for already-subscribed topic: %s", topic);
+        return ESP_OK;
     }
-
+    esp_mqtt_glue_subscription_t *cover = esp_mqtt_glue_find_cover(subscription->topic, qos, false);
+    if (cover) {
+        esp_mqtt_glue_set_covered(subscription->topic, cover);
+        ESP_LOGD(TAG, "Topic %s is covered by wildcard subscription %s", topic, cover->topic->str);
+        return ESP_OK;
+    }
+    /* Other entries for the topic may be in any state, so subscribe it afresh for all of them */
+    esp_mqtt_glue_set_topic_unrequested(subscription->topic);
+    *send = true;
     return ESP_OK;
 }
 
+static esp_err_t esp_mqtt_glue_subscribe(const char *topic, esp_rmaker_mqtt_subscribe_cb_t cb, uint8_t qos, void *priv_data)
+{
+    if (!topic || !cb) {
+        return ESP_FAIL;
+    }
+    if (!mqtt_topic_filter_is_valid(topic)) {
+        ESP_LOGE(TAG, "Invalid topic filter: %s", topic);
+        return ESP_ERR_INVALID_ARG;
+    }
+    if (!esp_mqtt_glue_lock()) {
+        return ESP_FAIL;
+    }
+    bool send = false;
+    esp_err_t err = esp_mqtt_glue_add_subscription(topic, cb, qos, priv_data, &send);
+    esp_mqtt_glue_unlock();
+    /* The SUBSCRIBE is sent before returning, rather than left for the reconcile timer, so that
+     * a publish which expects a response on this topic does not go out before it. If it could not
+     * be sent, the entry is kept in the database for a retry.
+     */
+    if (send) {
+        esp_mqtt_glue_reconcile();
+    }
+    return err;
+}
+
+/* Work out which topics are covered by another topic in the database, irrespective of
+ * subscription states. Used on reconnection, when all the topics need to be subscribed afresh.
+ */
+static void esp_mqtt_glue_compute_covered_topics(void)
+{
+    for (int i = 0; i < MAX_MQTT_SUBSCRIPTIONS; i++) {
+        esp_mqtt_glue_subscription_t *entry = mqtt_data->subscriptions[i];
+        if (!entry) continue;
+        entry->covered = false;
+        uint8_t qos = esp_mqtt_glue_get_topic_qos(entry->topic);
+        for (int j = 0; j < MAX_MQTT_SUBSCRIPTIONS; j++) {
+            esp_mqtt_glue_subscription_t *other = mqtt_data->subscriptions[j];
+            if (other && other->topic != entry->topic && other->topic->has_wildcard &&
+                mqtt_topic_filter_covers(other->topic->str, entry->topic->str) &&
+                !mqtt_topic_filter_covers(entry->topic->str, other->topic->str) &&
+                esp_mqtt_glue_get_topic_qos(other->topic) >= qos) {
+                entry->covered = true;
+                break;
+            }
+        }
+    }
+}
+
+/* Once a wildcard subscription is acknowledged, drop the broker subscriptions for topics
+ * that it covers. The entries stay in the database for dispatch.
+ */
+static void esp_mqtt_glue_release_covered_topics(void)
+{
+    for (int i = 0; i < MAX_MQTT_SUBSCRIPTIONS; i++) {
+        esp_mqtt_glue_subscription_t *entry = mqtt_data->subscriptions[i];
+        if (!entry || entry->covered || entry->state == ESP_RMAKER_MQTT_SUB_STATE_NONE) {
+            continue;
+        }
+        esp_mqtt_glue_subscription_t *cover = esp_mqtt_glue_find_cover(entry->topic,
+                esp_mqtt_glue_get_topic_qos(entry->topic), true);
+        if (!cover) {
+            continue;
+        }
+        if (entry->state != ESP_RMAKER_MQTT_SUB_STATE_FAILED) {
+            esp_mqtt_glue_unsubscribe_topic(entry->topic);
+        }
+        ESP_LOGD(TAG, "Topic %s is now covered by wildcard subscription %s", entry->topic->str, cover->topic->str);
+        esp_mqtt_glue_set_covered(entry->topic, cover);
+    }
+}
+
 static void unsubscribe_helper(esp_mqtt_glue_subscription_t **subscription)
 {
     if (subscription && *subscription) {
+        esp_mqtt_glue_topic_t *topic = (*subscription)->topic;
         /* Only send MQTT unsubscribe if this is the last subscription for this topic */
         bool other_subscription_exists = false;
         for (int i = 0; i < MAX_MQTT_SUBSCRIPTIONS; i++) {
-            if (mqtt_data->subscriptions[i] &&
-                mqtt_data->subscriptions[i] != *subscription &&
-                strcmp(mqtt_data->subscriptions[i]->topic, (*subscription)->topic) == 0) {
+            if (mqtt_data->subscriptions[i] && mqtt_data->subscriptions[i] != *subscription &&
+                mqtt_data->subscriptions[i]->topic == topic) {
                 other_subscription_exists = true;
                 break;
             }
         }
 
-        if (!other_subscription_exists) {
-            if (esp_mqtt_client_unsubscribe(mqtt_data->mqtt_client, (*subscription)->topic) < 0) {
-                ESP_LOGW(TAG, "Could not unsubscribe from topic: %s", (*subscription)->topic);
-            } else {
-                ESP_LOGD(TAG, "Unsubscribed from topic: %s", (*subscription)->topic);
-            }
+        if ((*subscription)->covered) {
+            ESP_LOGD(TAG, "Not unsubscribing from topic %s - covered by a wildcard subscription", topic->str);
+        } else if (!other_subscription_exists) {
+            /* The topics covered only by this one get subscribed on their own by the reconciler */
+            esp_mqtt_glue_unsubscribe_topic(topic);
         } else {
-            ESP_LOGD(TAG, "Not unsubscribing from topic %s - other callbacks still exist", (*subscription)->topic);
+            ESP_LOGD(TAG, "Not unsubscribing from topic %s - other callbacks still exist", topic->str);
         }
 
-        free((*subscription)->topic);
         free(*subscription);
         *subscription = NULL;
+        esp_mqtt_glue_topic_release(topic);
     }
 }
 
 static esp_err_t esp_mqtt_glue_unsubscribe(const char *topic)
 {
-    if (!mqtt_data || !topic) {
+    if (!topic || !esp_mqtt_glue_lock()) {
         return ESP_FAIL;
     }
+    esp_err_t err = ESP_FAIL;
+    size_t topic_len = strlen(topic);
+    esp_mqtt_glue_topic_t *interned_topic = esp_mqtt_glue_topic_lookup(topic, topic_len,
+            esp_mqtt_glue_topic_hash(topic, topic_len));
     esp_mqtt_glue_subscription_t **subscriptions = mqtt_data->subscriptions;
     int i;
-    for (i = 0; i < MAX_MQTT_SUBSCRIPTIONS; i++) {
+    for (i = 0; interned_topic && i < MAX_MQTT_SUBSCRIPTIONS; i++) {
         if (subscriptions[i]) {
-            if (strncmp(topic, subscriptions[i]->topic, strlen(topic)) == 0) {
+            if (subscriptions[i]->topic == interned_topic) {
                 unsubscribe_helper(&subscriptions[i]);
-                return ESP_OK;
+                err = ESP_OK;
+                break;
             }
         }
     }
-    return ESP_FAIL;
+    esp_mqtt_glue_unlock();
+    if (err == ESP_OK) {
+        esp_mqtt_glue_reconcile();
+    }
+    return err;
 }
 
-static esp_err_t esp_mqtt_glue_publish(const char *topic, void *data, size_t data_len, uint8_t qos, int *msg_id)
+/* Publish through the client with glue_lock released for the call, like the reconciler does for
+ * SUBSCRIBE, so that a deinit waits for it to complete. The rate limit flush work publishes queued
+ * messages through this too, and may be running when MQTT gets deinitialised.
+ */
+static esp_err_t esp_mqtt_glue_publish_now(const char *topic, void *data, size_t data_len, uint8_t qos, int *msg_id)
 {
-    if (!mqtt_data || !topic || !data) {
+    if (!esp_mqtt_glue_lock()) {
         return ESP_FAIL;
     }
     ESP_LOGD(TAG, "Publishing to %s", topic);
-    int ret = esp_mqtt_client_publish(mqtt_data->mqtt_client, topic, data, data_len, qos, 0);
+    esp_mqtt_client_handle_t client = mqtt_data->mqtt_client;
+    esp_mqtt_glue_unlock_for_client();
+    int ret = esp_mqtt_client_publish(client, topic, data, data_len, qos, 0);
+    esp_mqtt_glue_relock_after_client();
+    esp_mqtt_glue_unlock();
     if (ret < 0) {
         ESP_LOGE(TAG, "MQTT Publish failed");
         return ESP_FAIL;
@@ -316,6 +1034,257 @@ static esp_err_t esp_mqtt_glue_publish(const char *topic, void *data, size_t dat
     return ESP_OK;
 }
 
+static esp_mqtt_glue_pending_publish_t *esp_mqtt_glue_free_pending_publish(esp_mqtt_glue_pending_publish_t *pending)
+{
+    esp_mqtt_glue_pending_publish_t *next = pending->next;
+    free(pending->topic);
+    free(pending->data);
+    free(pending);
+    return next;
+}
+
+/* Get the rate limit with the longest prefix matching the topic. Needs rate_limit_lock. */
+static esp_mqtt_glue_rate_limit_t *esp_mqtt_glue_find_rate_limit(const char *topic)
+{
+    esp_mqtt_glue_rate_limit_t *match = NULL;
+    for (int i = 0; i < MAX_MQTT_RATE_LIMITS; i++) {
+        esp_mqtt_glue_rate_limit_t *rate_limit = rate_limits[i];
+        if (rate_limit && strncmp(topic, rate_limit->topic_prefix, rate_limit->prefix_len) == 0 &&
+            (!match || rate_limit->prefix_len > match->prefix_len)) {
+            match = rate_limit;
+        }
+    }
+    return match;
+}
+
+/* Add the tokens accumulated since the last refill. Needs rate_limit_lock. */
+static void esp_mqtt_glue_refill_tokens(esp_mqtt_glue_rate_limit_t *rate_limit, TickType_t now)
+{
+    TickType_t interval = pdMS_TO_TICKS(rate_limit->config.refill_interval_ms);
+    if (interval == 0) {
+        interval = 1;
+    }
+    uint32_t new_tokens = (now - rate_limit->last_refill_tick) / interval;
+    if (new_tokens == 0) {
+        return;
+    }
+    rate_limit->last_refill_tick += new_tokens * interval;
+    if ((rate_limit->tokens + new_tokens) >= rate_limit->config.burst) {
+        rate_limit->tokens = rate_limit->config.burst;
+        rate_limit->last_refill_tick = now;
+    } else {
+        rate_limit->tokens += new_tokens;
+    }
+}
+
+/* Ticks after which a rate limit will have a token available. Needs rate_limit_lock. */
+static TickType_t esp_mqtt_glue_ticks_to_next_token(esp_mqtt_glue_rate_limit_t *rate_limit, TickType_t now)
+{
+    if (rate_limit->tokens > 0) {
+        return 0;
+    }
+    TickType_t interval = pdMS_TO_TICKS(rate_limit->config.refill_interval_ms);
+    TickType_t elapsed = now - rate_limit->last_refill_tick;
+    return (elapsed < interval) ? (interval - elapsed) : 0;
+}
+
+/* Schedule a flush after the given ticks, unless one is already due earlier. Needs rate_limit_lock. */
+static void esp_mqtt_glue_schedule_rate_limit_flush(TickType_t ticks)
+{
+    if (!rate_limit_timer) {
+        return;
+    }
+    TickType_t flush_tick = xTaskGetTickCount() + (ticks ? ticks : 1);
+    if (xTimerIsTimerActive(rate_limit_timer) && (int32_t)(rate_limit_flush_tick - flush_tick) <= 0) {
+        return;
+    }
+    /* Changing the period restarts the timer from now */
+    if (xTimerChangePeriod(rate_limit_timer, ticks ? ticks : 1, 0) == pdPASS) {
+        rate_limit_flush_tick = flush_tick;
+    }
+}
+
+/* Drop the messages queued by a rate limit, counting them as dropped. Needs rate_limit_lock,
+ * unless the rate limit is no longer in rate_limits.
+ */
+static void esp_mqtt_glue_drop_queue(esp_mqtt_glue_rate_limit_t *rate_limit)
+{
+    if (!rate_limit->pending_head) {
+        return;
+    }
+    ESP_LOGW(TAG, "Dropping %u rate limited messages for %s", (unsigned int)rate_limit->stats.pending,
+            rate_limit->topic_prefix);
+    esp_mqtt_glue_pending_publish_t *pending = rate_limit->pending_head;
+    while (pending) {
+        pending = esp_mqtt_glue_free_pending_publish(pending);
+    }
+    rate_limit->pending_head = NULL;
+    rate_limit->pending_tail = NULL;
+    rate_limit->stats.dropped += rate_limit->stats.pending;
+    rate_limit->stats.pending = 0;
+}
+
+/* Drop the messages held back by the rate limits, since they cannot be published once the client is gone */
+static void esp_mqtt_glue_drop_pending_publishes(void)
+{
+    if (!rate_limit_lock) {
+        return;
+    }
+    xSemaphoreTake(rate_limit_lock, portMAX_DELAY);
+    if (rate_limit_timer) {
+        xTimerStop(rate_limit_timer, 0);
+    }
+    for (int i = 0; i < MAX_MQTT_RATE_LIMITS; i++) {
+        if (rate_limits[i]) {
+            esp_mqtt_glue_drop_queue(rate_limits[i]);
+        }
+    }
+    xSemaphoreGive(rate_limit_lock);
+}
+
+/* Publish the queued messages allowed by their rate limits, and schedule the next run if any are left */
+static void esp_mqtt_glue_flush_rate_limits(void *priv_data)
+{
+    xSemaphoreTake(rate_limit_lock, portMAX_DELAY);
+    TickType_t next_flush = portMAX_DELAY;
+    for (int i = 0; i < MAX_MQTT_RATE_LIMITS; i++) {
+        esp_mqtt_glue_rate_limit_t *rate_limit = rate_limits[i];
+        while (rate_limit && rate_limit->pending_head) {
+            TickType_t now = xTaskGetTickCount();
+            esp_mqtt_glue_refill_tokens(rate_limit, now);
+            if (rate_limit->tokens == 0) {
+                TickType_t ticks = esp_mqtt_glue_ticks_to_next_token(rate_limit, now);
+                if (ticks < next_flush) {
+                    next_flush = ticks;
+                }
+                break;
+            }
+            esp_mqtt_glue_pending_publish_t *pending = rate_limit->pending_head;
+            rate_limit->pending_head = pending->next;
+            if (!rate_limit->pending_head) {
+                rate_limit->pending_tail = NULL;
+            }
+            rate_limit->stats.pending--;
+            rate_limit->tokens--;
+            pending->next = NULL;
+            /* The lock is not held while publishing, so the rate limit may get removed meanwhile */
+            xSemaphoreGive(rate_limit_lock);
+            if (esp_mqtt_glue_publish_now(pending->topic, pending->data, pending->data_len,
+                        pending->qos, NULL) != ESP_OK) {
+                ESP_LOGW(TAG, "Dropping rate limited message on %s", pending->topic);
+            }
+            esp_mqtt_glue_free_pending_publish(pending);
+            xSemaphoreTake(rate_limit_lock, portMAX_DELAY);
+            rate_limit = rate_limits[i];
+        }
+    }
+    if (next_flush != portMAX_DELAY) {
+        esp_mqtt_glue_schedule_rate_limit_flush(next_flush);
+    }
+    xSemaphoreGive(rate_limit_lock);
+}
+
+static void esp_mqtt_glue_rate_limit_timer_cb(TimerHandle_t handle)
+{
+    esp_rmaker_work_queue_add_task(esp_mqtt_glue_flush_rate_limits, NULL);
+}
+
+/* Queue a message held back by its rate limit. Needs rate_limit_lock. */
+static esp_err_t esp_mqtt_glue_queue_publish(esp_mqtt_glue_rate_limit_t *rate_limit, const char *topic,
+        void *data, size_t data_len, uint8_t qos)
+{
+    if (rate_limit->config.policy == ESP_RMAKER_MQTT_RATE_LIMIT_COALESCE) {
+        for (esp_mqtt_glue_pending_publish_t *pending = rate_limit->pending_head; pending; pending = pending->next) {
+            if (strcmp(pending->topic, topic) != 0) {
+                continue;
+            }
+            void *new_data = MEM_ALLOC_EXTRAM(data_len ? data_len : 1);
+            if (!new_data) {
+                return ESP_ERR_NO_MEM;
+            }
+            memcpy(new_data, data, data_len);
+            free(pending->data);
+            pending->data = new_data;
+            pending->data_len = data_len;
+            if (qos > pending->qos) {
+                pending->qos = qos;
+            }
+            rate_limit->stats.coalesced++;
+            return ESP_OK;
+        }
+    }
+    if (rate_limit->stats.pending >= rate_limit->config.max_pending) {
+        return ESP_ERR_NOT_ALLOWED;
+    }
+    esp_mqtt_glue_pending_publish_t *pending = calloc(1, sizeof(esp_mqtt_glue_pending_publish_t));
+    if (!pending) {
+        return ESP_ERR_NO_MEM;
+    }
+    pending->topic = strdup(topic);
+    pending->data = MEM_ALLOC_EXTRAM(data_len ? data_len : 1);
+    if (!pending->topic || !pending->data) {
+        esp_mqtt_glue_free_pending_publish(pending);
+        return ESP_ERR_NO_MEM;
+    }
+    memcpy(pending->data, data, data_len);
+    pending->data_len = data_len;
+    pending->qos = qos;
+    if (rate_limit->pending_tail) {
+        rate_limit->pending_tail->next = pending;
+    } else {
+        rate_limit->pending_head = pending;
+    }
+    rate_limit->pending_tail = pending;
+    rate_limit->stats.pending++;
+    rate_limit->stats.delayed++;
+    return ESP_OK;
+}
+
+static esp_err_t esp_mqtt_glue_publish(const char *topic, void *data, size_t data_len, uint8_t qos, int *msg_id)
+{
+    if (!topic || !data || !esp_mqtt_glue_lock()) {
+        return ESP_FAIL;
+    }
+    esp_mqtt_glue_unlock();
+    if (!rate_limit_lock) {
+        return esp_mqtt_glue_publish_now(topic, data, data_len, qos, msg_id);
+    }
+    xSemaphoreTake(rate_limit_lock, portMAX_DELAY);
+    esp_mqtt_glue_rate_limit_t *rate_limit = esp_mqtt_glue_find_rate_limit(topic);
+    if (!rate_limit) {
+        xSemaphoreGive(rate_limit_lock);
+        return esp_mqtt_glue_publish_now(topic, data, data_len, qos, msg_id);
+    }
+    TickType_t now = xTaskGetTickCount();
+    esp_mqtt_glue_refill_tokens(rate_limit, now);
+    /* Messages already queued go first, to retain the order */
+    if (rate_limit->tokens > 0 && !rate_limit->pending_head) {
+        rate_limit->tokens--;
+        rate_limit->stats.passed++;
+        xSemaphoreGive(rate_limit_lock);
+        return esp_mqtt_glue_publish_now(topic, data, data_len, qos, msg_id);
+    }
+    esp_err_t err = ESP_ERR_NOT_ALLOWED;
+    if (rate_limit->config.policy != ESP_RMAKER_MQTT_RATE_LIMIT_DROP) {
+        err = esp_mqtt_glue_queue_publish(rate_limit, topic, data, data_len, qos);
+    }
+    if (err != ESP_OK) {
+        rate_limit->stats.dropped++;
+        ESP_LOGW(TAG, "Publish to %s dropped by rate limit", topic);
+    } else {
+        /* The message id is known only once the message is actually published */
+        if (msg_id) {
+            *msg_id = -1;
+        }
+        err = ESP_ERR_NOT_FINISHED;
+    }
+    if (rate_limit->pending_head) {
+        esp_mqtt_glue_schedule_rate_limit_flush(esp_mqtt_glue_ticks_to_next_token(rate_limit, now));
+    }
+    xSemaphoreGive(rate_limit_lock);
+    return err;
+}
+
 static esp_mqtt_glue_long_data_t *esp_mqtt_glue_free_long_data(esp_mqtt_glue_long_data_t *long_data)
 {
     if (long_data) {
@@ -371,74 +1340,79 @@ static void mqtt_event_handler(void *handler_args, esp_event_base_t base, int32_
     switch (event_id) {
         case MQTT_EVENT_CONNECTED:
             ESP_LOGI(TAG, "MQTT Connected");
+            if (!esp_mqtt_glue_lock()) {
+                break;
+            }
             /* Reset all subscription states on reconnection */
             esp_mqtt_glue_reset_subscription_states();
 
-            /* Re-subscribe to unique topics only */
-            for (int i = 0; i < MAX_MQTT_SUBSCRIPTIONS; i++) {
-                if (!mqtt_data->subscriptions[i]) continue;
-
-                /* Skip if we already processed this topic */
-                bool topic_already_processed = false;
-                for (int j = 0; j < i; j++) {
-                    if (mqtt_data->subscriptions[j] &&
-                        strcmp(mqtt_data->subscriptions[i]->topic, mqtt_data->subscriptions[j]->topic) == 0) {
-                        topic_already_processed = true;
-                        break;
-                    }
-                }
-                if (topic_already_processed) continue;
-
-                /* Find highest QoS for this topic */
-                uint8_t max_qos = mqtt_data->subscriptions[i]->qos;
-                for (int j = i + 1; j < MAX_MQTT_SUBSCRIPTIONS; j++) {
-                    if (mqtt_data->subscriptions[j] &&
-                        strcmp(mqtt_data->subscriptions[i]->topic, mqtt_data->subscriptions[j]->topic) == 0 &&
-                        mqtt_data->subscriptions[j]->qos > max_qos) {
-                        max_qos = mqtt_data->subscriptions[j]->qos;
-                    }
-                }
-
-                /* Subscribe once with highest QoS */
-                int ret = _esp_mqtt_client_subscribe(event->client, mqtt_data->subscriptions[i]->topic, max_qos);
-                mqtt_subscription_state_t new_state = (ret >= 0) ? MQTT_SUB_STATE_REQUESTED : MQTT_SUB_STATE_FAILED;
+            /* Topics covered by an overlapping wildcard subscription need not be subscribed on their own */
+            esp_mqtt_glue_compute_covered_topics();
 
-                /* Update all subscriptions for this topic */
-                for (int j = i; j < MAX_MQTT_SUBSCRIPTIONS; j++) {
-                    if (mqtt_data->subscriptions[j] &&
-                        strcmp(mqtt_data->subscriptions[i]->topic, mqtt_data->subscriptions[j]->topic) == 0) {
-                        mqtt_data->subscriptions[j]->msg_id = (ret >= 0) ? ret : -1;
-                        mqtt_data->subscriptions[j]->state = new_state;
-                    }
-                }
-
-                if (ret >= 0) {
-                    ESP_LOGD(TAG, "Reconnect: Subscribed to %s (msg_id: %d, QoS: %d)",
-                             mqtt_data->subscriptions[i]->topic, ret, max_qos);
-                } else {
-                    ESP_LOGW(TAG, "Reconnect: Failed to subscribe to %s", mqtt_data->subscriptions[i]->topic);
-                }
+            /* Re-subscribe to unique topics, batched as per CONFIG_ESP_RMAKER_MQTT_SUBSCRIBE_BATCH_SIZE.
+             * Covered topics get acknowledged along with their wildcard subscription.
+             */
+            mqtt_data->connected = true;
+            if (mqtt_data->reconcile_timer) {
+                xTimerStart(mqtt_data->reconcile_timer, 0);
             }
+            esp_mqtt_glue_unlock();
+            esp_mqtt_glue_reconcile();
             esp_event_post(RMAKER_COMMON_EVENT, RMAKER_MQTT_EVENT_CONNECTED, NULL, 0, portMAX_DELAY);
             break;
         case MQTT_EVENT_DISCONNECTED:
             ESP_LOGW(TAG, "MQTT Disconnected. Will try reconnecting in a while...");
-            /* Mark all subscriptions as disconnected - they'll need re-acknowledgment */
-            esp_mqtt_glue_reset_subscription_states();
+            if (esp_mqtt_glue_lock()) {
+                /* Mark all subscriptions as disconnected - they'll need re-acknowledgment */
+                mqtt_data->connected = false;
+                if (mqtt_data->reconcile_timer) {
+                    xTimerStop(mqtt_data->reconcile_timer, 0);
+                }
+                esp_mqtt_glue_reset_subscription_states();
+                esp_mqtt_glue_unlock();
+            }
             esp_event_post(RMAKER_COMMON_EVENT, RMAKER_MQTT_EVENT_DISCONNECTED, NULL, 0, portMAX_DELAY);
             break;
 
-        case MQTT_EVENT_SUBSCRIBED:
+        case MQTT_EVENT_SUBSCRIBED: {
             ESP_LOGD(TAG, "MQTT_EVENT_SUBSCRIBED, msg_id=%d", event->msg_id);
-            /* Mark matching subscriptions as acknowledged */
+            if (!esp_mqtt_glue_lock()) {
+                break;
+            }
+            bool wildcard_acknowledged = false;
+            TickType_t now = xTaskGetTickCount();
+            /* Mark matching subscriptions as acknowledged, or failed, as per the SUBACK return code
+             * at the position of the topic in the SUBSCRIBE packet.
+             */
             for (int i = 0; i < MAX_MQTT_SUBSCRIPTIONS; i++) {
-                if (mqtt_data->subscriptions[i] &&
-                    mqtt_data->subscriptions[i]->msg_id == event->msg_id) {
-                    mqtt_data->subscriptions[i]->state = MQTT_SUB_STATE_ACKNOWLEDGED;
-                    ESP_LOGD(TAG, "Subscription acknowledged for topic: %s", mqtt_data->subscriptions[i]->topic);
+                esp_mqtt_glue_subscription_t *entry = mqtt_data->subscriptions[i];
+                if (!entry || entry->state != ESP_RMAKER_MQTT_SUB_STATE_REQUESTED || entry->msg_id != event->msg_id) {
+                    continue;
+                }
+                if (event->data && entry->sub_index < event->data_len &&
+                    (uint8_t)event->data[entry->sub_index] == MQTT_SUBACK_FAILURE) {
+                    ESP_LOGW(TAG, "Subscription rejected for topic: %s", entry->topic->str);
+                    esp_mqtt_glue_set_topic_failed(entry->topic, now);
+                    continue;
                 }
+                entry->state = ESP_RMAKER_MQTT_SUB_STATE_ACKNOWLEDGED;
+                entry->retries = 0;
+                entry->latency_ms = (now - entry->request_tick) * portTICK_PERIOD_MS;
+                ESP_LOGD(TAG, "Subscription acknowledged for topic: %s", entry->topic->str);
+                if (!entry->covered && entry->topic->has_wildcard) {
+                    wildcard_acknowledged = true;
+                }
+            }
+            /* A new wildcard subscription may make some of the existing ones redundant */
+            if (wildcard_acknowledged) {
+                esp_mqtt_glue_release_covered_topics();
+            }
+            esp_mqtt_glue_unlock();
+            if (wildcard_acknowledged) {
+                esp_mqtt_glue_reconcile();
             }
             break;
+        }
         case MQTT_EVENT_UNSUBSCRIBED:
             ESP_LOGD(TAG, "MQTT_EVENT_UNSUBSCRIBED, msg_id=%d", event->msg_id);
             break;
@@ -498,15 +1472,43 @@ static esp_err_t esp_mqtt_glue_connect(void)
 
 static void esp_mqtt_glue_unsubscribe_all(void)
 {
-    if (!mqtt_data) {
+    if (!esp_mqtt_glue_lock()) {
         return;
     }
     int i;
+    /* Remove the covered entries first, so that removing the wildcard subscriptions
+     * does not trigger subscriptions to the topics they covered.
+     */
+    for (i = 0; i < MAX_MQTT_SUBSCRIPTIONS; i++) {
+        if (mqtt_data->subscriptions[i] && mqtt_data->subscriptions[i]->covered) {
+            unsubscribe_helper(&(mqtt_data->subscriptions[i]));
+        }
+    }
     for (i = 0; i < MAX_MQTT_SUBSCRIPTIONS; i++) {
         if (mqtt_data->subscriptions[i]) {
             unsubscribe_helper(&(mqtt_data->subscriptions[i]));
         }
     }
+    esp_mqtt_glue_unlock();
+    /* Send the UNSUBSCRIBE requests, dropping the ones which could not be sent */
+    esp_mqtt_glue_reconcile();
+    if (esp_mqtt_glue_lock()) {
+        esp_mqtt_glue_clear_pending_unsubscriptions(NULL);
+        esp_mqtt_glue_unlock();
+    }
+}
+
+/* Stop reconciling the subscriptions till the client connects again */
+static void esp_mqtt_glue_stop_reconcile(void)
+{
+    if (!esp_mqtt_glue_lock()) {
+        return;
+    }
+    mqtt_data->connected = false;
+    if (mqtt_data->reconcile_timer) {
+        xTimerStop(mqtt_data->reconcile_timer, 0);
+    }
+    esp_mqtt_glue_unlock();
 }
 
 static esp_err_t esp_mqtt_glue_disconnect(void)
@@ -515,6 +1517,7 @@ static esp_err_t esp_mqtt_glue_disconnect(void)
         return ESP_FAIL;
     }
     esp_mqtt_glue_unsubscribe_all();
+    esp_mqtt_glue_stop_reconcile();
     esp_err_t err = esp_mqtt_client_stop(mqtt_data->mqtt_client);
     if (err != ESP_OK) {
         ESP_LOGE(TAG, "Failed to disconnect from MQTT");
@@ -627,6 +1630,13 @@ static esp_err_t esp_mqtt_glue_init(esp_rmaker_mqtt_conn_params_t *conn_params)
         return ESP_FAIL;
     }
     ESP_LOGI(TAG, "Initialising MQTT");
+    if (!glue_lock) {
+        glue_lock = xSemaphoreCreateRecursiveMutex();
+        if (!glue_lock) {
+            ESP_LOGE(TAG, "Failed to create the MQTT glue lock");
+            return ESP_ERR_NO_MEM;
+        }
+    }
     mqtt_data = calloc(1, sizeof(esp_mqtt_glue_data_t));
     if (!mqtt_data) {
         ESP_LOGE(TAG, "Failed to allocate memory for esp_mqtt_glue_data_t");
@@ -644,19 +1654,43 @@ static esp_err_t esp_mqtt_glue_init(esp_rmaker_mqtt_conn_params_t *conn_params)
         return ESP_FAIL;
     }
     esp_mqtt_client_register_event(mqtt_data->mqtt_client , ESP_EVENT_ANY_ID, mqtt_event_handler, NULL);
+#if CONFIG_ESP_RMAKER_MQTT_SUBSCRIPTION_RECONCILE_INTERVAL > 0
+    mqtt_data->reconcile_timer = xTimerCreate("mqtt_reconcile",
+            pdMS_TO_TICKS(CONFIG_ESP_RMAKER_MQTT_SUBSCRIPTION_RECONCILE_INTERVAL * 1000),
+            pdTRUE, NULL, esp_mqtt_glue_reconcile_timer_cb);
+    if (!mqtt_data->reconcile_timer) {
+        ESP_LOGW(TAG, "Could not create subscription reconcile timer. Subscriptions will be retried only on reconnection.");
+    }
+#endif
     return ESP_OK;
 }
 
 static void esp_mqtt_glue_deinit(void)
 {
     esp_mqtt_glue_unsubscribe_all();
-    if (mqtt_data && mqtt_data->mqtt_client) {
-        esp_mqtt_client_destroy(mqtt_data->mqtt_client);
+    esp_mqtt_glue_drop_pending_publishes();
+    if (!esp_mqtt_glue_lock()) {
+        return;
     }
-    if (mqtt_data) {
-        free(mqtt_data);
-        mqtt_data = NULL;
+    /* Stop reconciling, and wait for the calls into the client made with glue_lock released */
+    mqtt_data->connected = false;
+    while (mqtt_data->client_calls > 0) {
+        esp_mqtt_glue_unlock();
+        vTaskDelay(1);
+        xSemaphoreTakeRecursive(glue_lock, portMAX_DELAY);
     }
+    /* The event handler and the reconcile work still queued find mqtt_data NULL, and do nothing */
+    esp_mqtt_glue_data_t *data = mqtt_data;
+    mqtt_data = NULL;
+    esp_mqtt_glue_unlock();
+
+    if (data->mqtt_client) {
+        esp_mqtt_client_destroy(data->mqtt_client);
+    }
+    if (data->reconcile_timer) {
+        xTimerDelete(data->reconcile_timer, portMAX_DELAY);
+    }
+    free(data);
 }
 
 /* Update MQTT config (including LWT) and reconnect.
@@ -675,7 +1709,8 @@ static esp_err_t esp_mqtt_glue_update_config(esp_rmaker_mqtt_conn_params_t *conn
 
     ESP_LOGI(TAG, "Updating MQTT config and reconnecting");
 
-    /* Stop the MQTT client (disconnect) */
+    /* Stop the MQTT client (disconnect). The reconciliation resumes on MQTT_EVENT_CONNECTED. */
+    esp_mqtt_glue_stop_reconcile();
     esp_err_t err = esp_mqtt_client_stop(mqtt_data->mqtt_client);
     if (err != ESP_OK) {
         ESP_LOGW(TAG, "Failed to stop MQTT client: %d", err);
@@ -707,6 +1742,150 @@ static esp_err_t esp_mqtt_glue_update_config(esp_rmaker_mqtt_conn_params_t *conn
     return ESP_OK;
 }
 
+esp_err_t esp_rmaker_mqtt_glue_get_subscription_info(const char *topic, esp_rmaker_mqtt_sub_info_t *info)
+{
+    if (!topic || !info) {
+        return ESP_ERR_INVALID_ARG;
+    }
+    if (!esp_mqtt_glue_lock()) {
+        return ESP_ERR_INVALID_STATE;
+    }
+    /* Not found if not in the pool, or only referenced by a pending unsubscribe */
+    esp_err_t err = ESP_ERR_NOT_FOUND;
+    size_t topic_len = strlen(topic);
+    esp_mqtt_glue_topic_t *interned_topic = esp_mqtt_glue_topic_lookup(topic, topic_len,
+            esp_mqtt_glue_topic_hash(topic, topic_len));
+    for (int i = 0; interned_topic && i < MAX_MQTT_SUBSCRIPTIONS; i++) {
+        esp_mqtt_glue_subscription_t *entry = mqtt_data->subscriptions[i];
+        if (entry && entry->topic == interned_topic) {
+            info->state = entry->state;
+            info->qos = esp_mqtt_glue_get_topic_qos(interned_topic);
+            info->covered = entry->covered;
+            info->retries = entry->retries;
+            info->latency_ms = entry->latency_ms;
+            err = ESP_OK;
+            break;
+        }
+    }
+    esp_mqtt_glue_unlock();
+    return err;
+}
+
+esp_err_t esp_rmaker_mqtt_glue_reconcile_subscriptions(void)
+{
+    if (!esp_mqtt_glue_lock()) {
+        return ESP_ERR_INVALID_STATE;
+    }
+    bool connected = mqtt_data->connected;
+    esp_mqtt_glue_unlock();
+    if (!connected) {
+        return ESP_ERR_INVALID_STATE;
+    }
+    esp_mqtt_glue_reconcile();
+    return ESP_OK;
+}
+
+esp_err_t esp_rmaker_mqtt_glue_set_rate_limit(const esp_rmaker_mqtt_rate_limit_config_t *config)
+{
+    if (!config || !config->topic_prefix || config->burst == 0 || config->refill_interval_ms == 0 ||
+        config->policy > ESP_RMAKER_MQTT_RATE_LIMIT_COALESCE) {
+        return ESP_ERR_INVALID_ARG;
+    }
+    if (!rate_limit_lock) {
+        rate_limit_lock = xSemaphoreCreateMutex();
+        if (!rate_limit_lock) {
+            return ESP_ERR_NO_MEM;
+        }
+    }
+    if (!rate_limit_timer) {
+        rate_limit_timer = xTimerCreate("mqtt_rate_limit", 1, pdFALSE, NULL, esp_mqtt_glue_rate_limit_timer_cb);
+        if (!rate_limit_timer) {
+            return ESP_ERR_NO_MEM;
+        }
+    }
+    esp_err_t err = ESP_OK;
+    xSemaphoreTake(rate_limit_lock, portMAX_DELAY);
+    esp_mqtt_glue_rate_limit_t *rate_limit = NULL;
+    int empty_slot = -1;
+    for (int i = 0; i < MAX_MQTT_RATE_LIMITS; i++) {
+        if (rate_limits[i] && strcmp(rate_limits[i]->topic_prefix, config->topic_prefix) == 0) {
+            rate_limit = rate_limits[i];
+            break;
+        } else if (!rate_limits[i] && empty_slot == -1) {
+            empty_slot = i;
+        }
+    }
+    if (!rate_limit) {
+        if (empty_slot == -1) {
+            ESP_LOGE(TAG, "No space for new rate limit for %s", config->topic_prefix);
+            err = ESP_ERR_NO_MEM;
+            goto end;
+        }
+        rate_limit = calloc(1, sizeof(esp_mqtt_glue_rate_limit_t));
+        if (!rate_limit || !(rate_limit->topic_prefix = strdup(config->topic_prefix))) {
+            free(rate_limit);
+            err = ESP_ERR_NO_MEM;
+            goto end;
+        }
+        rate_limit->prefix_len = strlen(rate_limit->topic_prefix);
+        rate_limits[empty_slot] = rate_limit;
+    }
+    rate_limit->config = *config;
+    rate_limit->config.topic_prefix = rate_limit->topic_prefix;
+    rate_limit->tokens = config->burst;
+    rate_limit->last_refill_tick = xTaskGetTickCount();
+    ESP_LOGI(TAG, "Rate limit for %s set to %d messages, refilled every %"PRIu32" ms", rate_limit->topic_prefix,
+            config->burst, config->refill_interval_ms);
+end:
+    xSemaphoreGive(rate_limit_lock);
+    return err;
+}
+
+esp_err_t esp_rmaker_mqtt_glue_remove_rate_limit(const char *topic_prefix)
+{
+    if (!topic_prefix) {
+        return ESP_ERR_INVALID_ARG;
+    }
+    if (!rate_limit_lock) {
+        return ESP_ERR_NOT_FOUND;
+    }
+    xSemaphoreTake(rate_limit_lock, portMAX_DELAY);
+    for (int i = 0; i < MAX_MQTT_RATE_LIMITS; i++) {
+        esp_mqtt_glue_rate_limit_t *rate_limit = rate_limits[i];
+        if (rate_limit && strcmp(rate_limit->topic_prefix, topic_prefix) == 0) {
+            rate_limits[i] = NULL;
+            xSemaphoreGive(rate_limit_lock);
+            esp_mqtt_glue_drop_queue(rate_limit);
+            free(rate_limit->topic_prefix);
+            free(rate_limit);
+            return ESP_OK;
+        }
+    }
+    xSemaphoreGive(rate_limit_lock);
+    return ESP_ERR_NOT_FOUND;
+}
+
+esp_err_t esp_rmaker_mqtt_glue_get_rate_limit_stats(const char *topic_prefix, esp_rmaker_mqtt_rate_limit_stats_t *stats)
+{
+    if (!topic_prefix || !stats) {
+        return ESP_ERR_INVALID_ARG;
+    }
+    if (!rate_limit_lock) {
+        return ESP_ERR_NOT_FOUND;
+    }
+    esp_err_t err = ESP_ERR_NOT_FOUND;
+    xSemaphoreTake(rate_limit_lock, portMAX_DELAY);
+    for (int i = 0; i < MAX_MQTT_RATE_LIMITS; i++) {
+        if (rate_limits[i] && strcmp(rate_limits[i]->topic_prefix, topic_prefix) == 0) {
+            *stats = rate_limits[i]->stats;
+            err = ESP_OK;
+            break;
+        }
+    }
+    xSemaphoreGive(rate_limit_lock);
+    return err;
+}
+
 esp_err_t esp_rmaker_mqtt_glue_setup(esp_rmaker_mqtt_config_t *mqtt_config)
 {
     mqtt_config->init           = esp_mqtt_glue_init;
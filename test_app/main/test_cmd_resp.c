@@ -0,0 +1,1941 @@
+/*
+ * SPDX-FileCopyrightText: 2026 Espressif Systems (Shanghai) CO LTD
+ *
+ * SPDX-License-Identifier: Apache-2.0
+ */
+
+#include <stdio.h>
+#include <string.h>
+#include <stdlib.h>
+#include "sdkconfig.h"
+#include "unity.h"
+#include "freertos/FreeRTOS.h"
+#include "freertos/task.h"
+#include "freertos/semphr.h"
+#include "esp_timer.h"
+#include "esp_rmaker_cmd_resp.h"
+#include "esp_rmaker_cmd_schema.h"
+#include "esp_rmaker_cmd_cbor.h"
+#include "esp_rmaker_work_queue.h"
+#if CONFIG_ESP_RMAKER_CMD_LOCAL
+#include <unistd.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include "esp_rmaker_cmd_local.h"
+#endif
+
+#define TEST_CMD_ECHO   (ESP_RMAKER_CMD_CUSTOM_START + 20U)
+#define TEST_CMD_VIEW   (ESP_RMAKER_CMD_CUSTOM_START + 21U)
+
+/* Append a TLV, splitting values of 255 bytes or more into continuation records */
+static size_t test_tlv_add(uint8_t *buf, size_t offset, uint8_t type, const void *val, size_t len)
+{
+    const uint8_t *p = (const uint8_t *)val;
+    do {
+        size_t chunk = len > 255 ? 255 : len;
+        buf[offset++] = type;
+        buf[offset++] = (uint8_t)chunk;
+        memcpy(&buf[offset], p, chunk);
+        offset += chunk;
+        p += chunk;
+        len -= chunk;
+    } while (len);
+    return offset;
+}
+
+/* Get the merged value of a TLV from a response */
+static int test_tlv_get(const uint8_t *buf, size_t len, uint8_t type, uint8_t *val, size_t val_size)
+{
+    size_t offset = 0;
+    int val_len = -1;
+    while ((len - offset) >= 2) {
+        uint8_t l = buf[offset + 1];
+        if (buf[offset] == type) {
+            if (val_len < 0) {
+                val_len = 0;
+            }
+            TEST_ASSERT_TRUE(val_len + l <= val_size);
+            memcpy(&val[val_len], &buf[offset + 2], l);
+            val_len += l;
+            if (l < 255) {
+                break;
+            }
+        } else if (val_len >= 0) {
+            break;
+        }
+        offset += 2 + l;
+    }
+    return val_len;
+}
+
+static uint8_t s_echo_data[1024];
+static size_t s_echo_len;
+static esp_rmaker_cmd_ctx_t s_echo_ctx;
+
+static esp_err_t test_cmd_echo_handler(const void *in_data, size_t in_len, void **out_data, size_t *out_len,
+                                       esp_rmaker_cmd_ctx_t *ctx, void *priv)
+{
+    TEST_ASSERT_TRUE(in_len <= sizeof(s_echo_data));
+    if (in_len) {
+        memcpy(s_echo_data, in_data, in_len);
+    }
+    s_echo_len = in_len;
+    memcpy(&s_echo_ctx, ctx, sizeof(s_echo_ctx));
+    *out_data = (void *)in_data;
+    *out_len = in_len;
+    return ESP_OK;
+}
+
+TEST_CASE("ESP RainMaker Command TLV Parsing", "[rmaker_cmd_resp]")
+{
+    static uint8_t input[1200];
+    static uint8_t data[600];
+    static uint8_t resp_data[700];
+    for (int i = 0; i < sizeof(data); i++) {
+        data[i] = (uint8_t)i;
+    }
+    TEST_ASSERT_EQUAL(ESP_OK, esp_rmaker_cmd_register(TEST_CMD_ECHO, ESP_RMAKER_USER_ROLE_PRIMARY_USER,
+                                                      test_cmd_echo_handler, false, NULL));
+
+    /* Fields in an arbitrary order, with the data split across 3 records */
+    uint8_t role = ESP_RMAKER_USER_ROLE_PRIMARY_USER;
+    uint8_t cmd_buf[2] = {TEST_CMD_ECHO & 0xff, TEST_CMD_ECHO >> 8};
+    uint8_t ts_buf[4] = {0x78, 0x56, 0x34, 0x12};
+    size_t len = 0;
+    len = test_tlv_add(input, len, ESP_RMAKER_TLV_TYPE_DATA, data, sizeof(data));
+    len = test_tlv_add(input, len, ESP_RMAKER_TLV_TYPE_CMD, cmd_buf, sizeof(cmd_buf));
+    len = test_tlv_add(input, len, ESP_RMAKER_TLV_TYPE_TIMESTAMP, ts_buf, sizeof(ts_buf));
+    len = test_tlv_add(input, len, ESP_RMAKER_TLV_TYPE_USER_ROLE, &role, sizeof(role));
+    len = test_tlv_add(input, len, ESP_RMAKER_TLV_TYPE_REQ_ID, "tlv_req", strlen("tlv_req"));
+
+    void *output = NULL;
+    size_t output_len = 0;
+    s_echo_len = 0;
+    TEST_ASSERT_EQUAL(ESP_OK, esp_rmaker_cmd_response_handler(input, len, &output, &output_len));
+    TEST_ASSERT_EQUAL(sizeof(data), s_echo_len);
+    TEST_ASSERT_EQUAL_MEMORY(data, s_echo_data, sizeof(data));
+    TEST_ASSERT_EQUAL_STRING("tlv_req", s_echo_ctx.req_id);
+    TEST_ASSERT_EQUAL(0x12345678, s_echo_ctx.timestamp);
+    TEST_ASSERT_EQUAL(TEST_CMD_ECHO, s_echo_ctx.cmd);
+
+    /* The response data also gets split into continuation records */
+    TEST_ASSERT_NOT_NULL(output);
+    TEST_ASSERT_EQUAL(sizeof(data), test_tlv_get(output, output_len, ESP_RMAKER_TLV_TYPE_DATA, resp_data, sizeof(resp_data)));
+    TEST_ASSERT_EQUAL_MEMORY(data, resp_data, sizeof(data));
+    free(output);
+
+    /* Data of exactly 255 bytes is followed by a different type, which ends the value */
+    len = 0;
+    len = test_tlv_add(input, len, ESP_RMAKER_TLV_TYPE_REQ_ID, "tlv_req_2", strlen("tlv_req_2"));
+    len = test_tlv_add(input, len, ESP_RMAKER_TLV_TYPE_USER_ROLE, &role, sizeof(role));
+    len = test_tlv_add(input, len, ESP_RMAKER_TLV_TYPE_DATA, data, 255);
+    len = test_tlv_add(input, len, ESP_RMAKER_TLV_TYPE_CMD, cmd_buf, sizeof(cmd_buf));
+    TEST_ASSERT_EQUAL(ESP_OK, esp_rmaker_cmd_response_handler(input, len, &output, &output_len));
+    TEST_ASSERT_EQUAL(255, s_echo_len);
+    TEST_ASSERT_EQUAL(0, s_echo_ctx.timestamp);
+    free(output);
+
+    /* Truncated data record. The fields before it are still valid. */
+    len = 0;
+    len = test_tlv_add(input, len, ESP_RMAKER_TLV_TYPE_REQ_ID, "tlv_req_3", strlen("tlv_req_3"));
+    len = test_tlv_add(input, len, ESP_RMAKER_TLV_TYPE_USER_ROLE, &role, sizeof(role));
+    len = test_tlv_add(input, len, ESP_RMAKER_TLV_TYPE_CMD, cmd_buf, sizeof(cmd_buf));
+    len = test_tlv_add(input, len, ESP_RMAKER_TLV_TYPE_DATA, data, 300);
+    s_echo_len = 1;
+    TEST_ASSERT_EQUAL(ESP_OK, esp_rmaker_cmd_response_handler(input, len - 10, &output, &output_len));
+    TEST_ASSERT_EQUAL(0, s_echo_len);
+    free(output);
+
+    TEST_ASSERT_EQUAL(ESP_OK, esp_rmaker_cmd_deregister(TEST_CMD_ECHO));
+}
+
+static int s_view_segments;
+static const void *s_view_ptr;
+
+static esp_err_t test_cmd_view_handler(const void *in_data, size_t in_len, void **out_data, size_t *out_len,
+                                       esp_rmaker_cmd_ctx_t *ctx, void *priv)
+{
+    const esp_rmaker_cmd_data_view_t *view = in_data;
+    TEST_ASSERT_NOT_NULL(view);
+    TEST_ASSERT_EQUAL(in_len, view->len);
+    s_view_ptr = esp_rmaker_cmd_data_view_get_ptr(view);
+    s_view_segments = 0;
+    s_echo_len = 0;
+    esp_rmaker_cmd_data_iter_t iter;
+    const void *segment;
+    size_t segment_len;
+    esp_rmaker_cmd_data_view_iter_init(view, &iter);
+    while (esp_rmaker_cmd_data_view_iter_next(&iter, &segment, &segment_len)) {
+        memcpy(&s_echo_data[s_echo_len], segment, segment_len);
+        s_echo_len += segment_len;
+        s_view_segments++;
+    }
+    return ESP_OK;
+}
+
+TEST_CASE("ESP RainMaker Command Data View", "[rmaker_cmd_resp]")
+{
+    static uint8_t input[1200];
+    static uint8_t data[600];
+    for (int i = 0; i < sizeof(data); i++) {
+        data[i] = (uint8_t)(i * 7);
+    }
+    TEST_ASSERT_EQUAL(ESP_OK, esp_rmaker_cmd_register_with_flags(TEST_CMD_VIEW, ESP_RMAKER_USER_ROLE_PRIMARY_USER,
+                                                                 test_cmd_view_handler, false,
+                                                                 ESP_RMAKER_CMD_FLAG_DATA_VIEW, NULL));
+    uint8_t role = ESP_RMAKER_USER_ROLE_PRIMARY_USER;
+    uint8_t cmd_buf[2] = {TEST_CMD_VIEW & 0xff, TEST_CMD_VIEW >> 8};
+    void *output = NULL;
+    size_t output_len = 0;
+
+    /* Single record: the view points into the input */
+    size_t len = 0;
+    len = test_tlv_add(input, len, ESP_RMAKER_TLV_TYPE_REQ_ID, "view_req", strlen("view_req"));
+    len = test_tlv_add(input, len, ESP_RMAKER_TLV_TYPE_USER_ROLE, &role, sizeof(role));
+    len = test_tlv_add(input, len, ESP_RMAKER_TLV_TYPE_CMD, cmd_buf, sizeof(cmd_buf));
+    size_t data_offset = len + 2;
+    len = test_tlv_add(input, len, ESP_RMAKER_TLV_TYPE_DATA, data, 100);
+    TEST_ASSERT_EQUAL(ESP_OK, esp_rmaker_cmd_response_handler(input, len, &output, &output_len));
+    TEST_ASSERT_EQUAL_PTR(&input[data_offset], s_view_ptr);
+    TEST_ASSERT_EQUAL(1, s_view_segments);
+    TEST_ASSERT_EQUAL(100, s_echo_len);
+    TEST_ASSERT_EQUAL_MEMORY(data, s_echo_data, 100);
+    free(output);
+
+    /* Multiple records: iterated segment by segment */
+    len = 0;
+    len = test_tlv_add(input, len, ESP_RMAKER_TLV_TYPE_REQ_ID, "view_req_2", strlen("view_req_2"));
+    len = test_tlv_add(input, len, ESP_RMAKER_TLV_TYPE_USER_ROLE, &role, sizeof(role));
+    len = test_tlv_add(input, len, ESP_RMAKER_TLV_TYPE_CMD, cmd_buf, sizeof(cmd_buf));
+    len = test_tlv_add(input, len, ESP_RMAKER_TLV_TYPE_DATA, data, sizeof(data));
+    TEST_ASSERT_EQUAL(ESP_OK, esp_rmaker_cmd_response_handler(input, len, &output, &output_len));
+    TEST_ASSERT_NULL(s_view_ptr);
+    TEST_ASSERT_EQUAL(3, s_view_segments);
+    TEST_ASSERT_EQUAL(sizeof(data), s_echo_len);
+    TEST_ASSERT_EQUAL_MEMORY(data, s_echo_data, sizeof(data));
+    free(output);
+
+    TEST_ASSERT_EQUAL(ESP_OK, esp_rmaker_cmd_deregister(TEST_CMD_VIEW));
+}
+
+static intptr_t s_table_priv;
+
+static esp_err_t test_cmd_table_handler(const void *in_data, size_t in_len, void **out_data, size_t *out_len,
+                                        esp_rmaker_cmd_ctx_t *ctx, void *priv)
+{
+    s_table_priv = (intptr_t)priv;
+    return ESP_OK;
+}
+
+/* Status returned by test_cmd_dispatch() if the response is not sent right away */
+#define TEST_NO_RESPONSE    0xff
+
+/* Response read by test_cmd_dispatch() */
+typedef struct {
+    uint8_t content_type;
+    /* Response data. data_len is -1 if there is no data. */
+    uint8_t data[16];
+    int data_len;
+    /* The whole response */
+    uint8_t raw[128];
+    size_t raw_len;
+} test_cmd_resp_t;
+
+/* Dispatch a command and get the response status, with the rest of the response in resp, if not NULL.
+ * A new request id is used if req_id is NULL, so that the response is not from the replay cache.
+ * data can be NULL or empty for no data. If transport_role is not 0, it is given to
+ * esp_rmaker_cmd_response_handler_with_role().
+ */
+static uint8_t test_cmd_dispatch_with_role(const char *req_id, uint8_t role, uint8_t transport_role, uint16_t cmd,
+                                           const char *data, test_cmd_resp_t *resp)
+{
+    static int req_count;
+    char new_req_id[REQ_ID_LEN];
+    uint8_t input[128];
+    uint8_t cmd_buf[2] = {cmd & 0xff, cmd >> 8};
+    size_t len = 0;
+    if (!req_id) {
+        snprintf(new_req_id, sizeof(new_req_id), "test_req_%d", ++req_count);
+        req_id = new_req_id;
+    }
+    len = test_tlv_add(input, len, ESP_RMAKER_TLV_TYPE_REQ_ID, req_id, strlen(req_id));
+    len = test_tlv_add(input, len, ESP_RMAKER_TLV_TYPE_USER_ROLE, &role, sizeof(role));
+    len = test_tlv_add(input, len, ESP_RMAKER_TLV_TYPE_CMD, cmd_buf, sizeof(cmd_buf));
+    if (data && strlen(data)) {
+        TEST_ASSERT_TRUE(strlen(data) <= 64);
+        len = test_tlv_add(input, len, ESP_RMAKER_TLV_TYPE_DATA, data, strlen(data));
+    }
+    void *output = NULL;
+    size_t output_len = 0;
+    uint8_t status = TEST_NO_RESPONSE;
+    if (transport_role) {
+        TEST_ASSERT_EQUAL(ESP_OK, esp_rmaker_cmd_response_handler_with_role(input, len, transport_role,
+                                                                            &output, &output_len));
+    } else {
+        TEST_ASSERT_EQUAL(ESP_OK, esp_rmaker_cmd_response_handler(input, len, &output, &output_len));
+    }
+    if (resp) {
+        memset(resp, 0, sizeof(test_cmd_resp_t));
+        resp->data_len = -1;
+    }
+    if (output) {
+        TEST_ASSERT_EQUAL(1, test_tlv_get(output, output_len, ESP_RMAKER_TLV_TYPE_STATUS, &status, sizeof(status)));
+        if (resp) {
+            test_tlv_get(output, output_len, ESP_RMAKER_TLV_TYPE_CONTENT_TYPE, &resp->content_type,
+                         sizeof(resp->content_type));
+            resp->data_len = test_tlv_get(output, output_len, ESP_RMAKER_TLV_TYPE_DATA, resp->data, sizeof(resp->data));
+            TEST_ASSERT_TRUE(output_len <= sizeof(resp->raw));
+            memcpy(resp->raw, output, output_len);
+            resp->raw_len = output_len;
+        }
+        free(output);
+    }
+    return status;
+}
+
+static uint8_t test_cmd_dispatch(const char *req_id, uint8_t role, uint16_t cmd, const char *data,
+                                 test_cmd_resp_t *resp)
+{
+    return test_cmd_dispatch_with_role(req_id, role, 0, cmd, data, resp);
+}
+
+TEST_CASE("ESP RainMaker Command Table", "[rmaker_cmd_resp]")
+{
+    const uint8_t primary = ESP_RMAKER_USER_ROLE_PRIMARY_USER;
+    /* Custom commands which share hash buckets, along with standard ones */
+    const uint16_t cmds[] = {
+        ESP_RMAKER_CMD_TYPE_SET_PARAMS, ESP_RMAKER_CMD_STANDARD_LAST,
+        0x1000, 0x1008, 0x1010, 0x1018, 0x2000, 0x4000, 0x8000, 0xffff,
+    };
+    const int num_cmds = sizeof(cmds) / sizeof(cmds[0]);
+    for (int i = 0; i < num_cmds; i++) {
+        TEST_ASSERT_EQUAL(ESP_OK, esp_rmaker_cmd_register(cmds[i], ESP_RMAKER_USER_ROLE_PRIMARY_USER,
+                                                          test_cmd_table_handler, false, (void *)(intptr_t)(i + 1)));
+    }
+    TEST_ASSERT_EQUAL(ESP_FAIL, esp_rmaker_cmd_register(0x1008, ESP_RMAKER_USER_ROLE_PRIMARY_USER,
+                                                        test_cmd_table_handler, false, NULL));
+#if CONFIG_ESP_RMAKER_MAX_COMMANDS == 10
+    TEST_ASSERT_EQUAL(ESP_ERR_NO_MEM, esp_rmaker_cmd_register(0x1001, ESP_RMAKER_USER_ROLE_PRIMARY_USER,
+                                                              test_cmd_table_handler, false, NULL));
+#endif
+    for (int i = 0; i < num_cmds; i++) {
+        s_table_priv = 0;
+        TEST_ASSERT_EQUAL(ESP_RMAKER_CMD_STATUS_SUCCESS, test_cmd_dispatch(NULL, primary, cmds[i], NULL, NULL));
+        TEST_ASSERT_EQUAL(i + 1, s_table_priv);
+    }
+    TEST_ASSERT_EQUAL(ESP_RMAKER_CMD_STATUS_NOT_FOUND, test_cmd_dispatch(NULL, primary, 0x1001, NULL, NULL));
+    TEST_ASSERT_EQUAL(ESP_RMAKER_CMD_STATUS_NOT_FOUND, test_cmd_dispatch(NULL, primary, 2, NULL, NULL));
+
+    /* Remove every other command. The rest should still be found. */
+    for (int i = 0; i < num_cmds; i += 2) {
+        TEST_ASSERT_EQUAL(ESP_OK, esp_rmaker_cmd_deregister(cmds[i]));
+    }
+    TEST_ASSERT_EQUAL(ESP_ERR_INVALID_ARG, esp_rmaker_cmd_deregister(cmds[0]));
+    for (int i = 0; i < num_cmds; i++) {
+        s_table_priv = 0;
+        if (i % 2) {
+            TEST_ASSERT_EQUAL(ESP_RMAKER_CMD_STATUS_SUCCESS, test_cmd_dispatch(NULL, primary, cmds[i], NULL, NULL));
+            TEST_ASSERT_EQUAL(i + 1, s_table_priv);
+        } else {
+            TEST_ASSERT_EQUAL(ESP_RMAKER_CMD_STATUS_NOT_FOUND, test_cmd_dispatch(NULL, primary, cmds[i], NULL, NULL));
+        }
+    }
+    for (int i = 1; i < num_cmds; i += 2) {
+        TEST_ASSERT_EQUAL(ESP_OK, esp_rmaker_cmd_deregister(cmds[i]));
+    }
+}
+
+typedef struct {
+    uint8_t buf[1024];
+    size_t len;
+    int calls;
+} test_writer_t;
+
+static esp_err_t test_cmd_writer(const void *data, size_t len, void *priv)
+{
+    test_writer_t *writer = (test_writer_t *)priv;
+    if (writer->len + len > sizeof(writer->buf)) {
+        return ESP_FAIL;
+    }
+    memcpy(&writer->buf[writer->len], data, len);
+    writer->len += len;
+    writer->calls++;
+    return ESP_OK;
+}
+
+TEST_CASE("ESP RainMaker Command Payload Encoding", "[rmaker_cmd_resp]")
+{
+    static uint8_t data[600];
+    static uint8_t buf[700];
+    static test_writer_t writer;
+    for (size_t i = 0; i < sizeof(data); i++) {
+        data[i] = i & 0xff;
+    }
+    /* Include exact multiples of 255, which need no extra record */
+    const size_t data_sizes[] = {0, 1, 254, 255, 256, 510, 600};
+    for (size_t i = 0; i < sizeof(data_sizes) / sizeof(data_sizes[0]); i++) {
+        void *output = NULL;
+        size_t output_len = 0;
+        TEST_ASSERT_EQUAL(ESP_OK, esp_rmaker_cmd_prepare_payload("req-1", ESP_RMAKER_USER_ROLE_PRIMARY_USER,
+                                                                 ESP_RMAKER_CMD_STATUS_SUCCESS, 0x1000,
+                                                                 data, data_sizes[i], &output, &output_len));
+
+        /* Querying the size should report exactly what prepare_payload generated */
+        size_t required = 0;
+        TEST_ASSERT_EQUAL(ESP_ERR_INVALID_SIZE, esp_rmaker_cmd_encode_payload("req-1", ESP_RMAKER_USER_ROLE_PRIMARY_USER,
+                                                                              ESP_RMAKER_CMD_STATUS_SUCCESS, 0x1000,
+                                                                              data, data_sizes[i], NULL, 0, &required));
+        TEST_ASSERT_EQUAL(output_len, required);
+        TEST_ASSERT_EQUAL(ESP_ERR_INVALID_SIZE, esp_rmaker_cmd_encode_payload("req-1", ESP_RMAKER_USER_ROLE_PRIMARY_USER,
+                                                                              ESP_RMAKER_CMD_STATUS_SUCCESS, 0x1000,
+                                                                              data, data_sizes[i], buf, required - 1, &required));
+        TEST_ASSERT_EQUAL(output_len, required);
+
+        size_t encoded_len = 0;
+        memset(buf, 0xa5, sizeof(buf));
+        TEST_ASSERT_EQUAL(ESP_OK, esp_rmaker_cmd_encode_payload("req-1", ESP_RMAKER_USER_ROLE_PRIMARY_USER,
+                                                                ESP_RMAKER_CMD_STATUS_SUCCESS, 0x1000,
+                                                                data, data_sizes[i], buf, sizeof(buf), &encoded_len));
+        TEST_ASSERT_EQUAL(output_len, encoded_len);
+        TEST_ASSERT_EQUAL_MEMORY(output, buf, output_len);
+        TEST_ASSERT_EQUAL_HEX8(0xa5, buf[encoded_len]);
+
+        memset(&writer, 0, sizeof(writer));
+        encoded_len = 0;
+        TEST_ASSERT_EQUAL(ESP_OK, esp_rmaker_cmd_encode_payload_to_writer("req-1", ESP_RMAKER_USER_ROLE_PRIMARY_USER,
+                                                                          ESP_RMAKER_CMD_STATUS_SUCCESS, 0x1000,
+                                                                          data, data_sizes[i], test_cmd_writer, &writer,
+                                                                          &encoded_len));
+        TEST_ASSERT_EQUAL(output_len, encoded_len);
+        TEST_ASSERT_EQUAL(output_len, writer.len);
+        TEST_ASSERT_EQUAL_MEMORY(output, writer.buf, output_len);
+        free(output);
+    }
+
+    /* A failing writer should abort the encoding */
+    TEST_ASSERT_EQUAL(ESP_ERR_INVALID_ARG, esp_rmaker_cmd_encode_payload_to_writer(NULL, 0, 0, 0x1000, NULL, 0,
+                                                                                   NULL, NULL, NULL));
+    memset(&writer, 0, sizeof(writer));
+    writer.len = sizeof(writer.buf) - 8;
+    TEST_ASSERT_NOT_EQUAL(ESP_OK, esp_rmaker_cmd_encode_payload_to_writer("req-1", 0, ESP_RMAKER_CMD_STATUS_SUCCESS,
+                                                                          0x1000, data, sizeof(data),
+                                                                          test_cmd_writer, &writer, NULL));
+}
+
+TEST_CASE("ESP RainMaker Command Batch", "[rmaker_cmd_resp]")
+{
+    static uint8_t batch[1500];
+    static uint8_t data[300];
+    static uint8_t record_buf[400];
+    static uint8_t val[400];
+    for (size_t i = 0; i < sizeof(data); i++) {
+        data[i] = (uint8_t)(i * 7);
+    }
+    TEST_ASSERT_EQUAL(ESP_OK, esp_rmaker_cmd_register(TEST_CMD_ECHO, ESP_RMAKER_USER_ROLE_PRIMARY_USER,
+                                                      test_cmd_echo_handler, false, NULL));
+
+    /* Echo with small data, an unknown command and echo with data which needs a multi-TLV record */
+    const char *req_ids[] = {"batch_a", "batch_b", "batch_c"};
+    const uint16_t cmds[] = {TEST_CMD_ECHO, ESP_RMAKER_CMD_CUSTOM_START + 0x7ff, TEST_CMD_ECHO};
+    const size_t data_sizes[] = {10, 0, sizeof(data)};
+    const uint8_t statuses[] = {ESP_RMAKER_CMD_STATUS_SUCCESS, ESP_RMAKER_CMD_STATUS_NOT_FOUND, ESP_RMAKER_CMD_STATUS_SUCCESS};
+    size_t batch_len = 0;
+    for (int i = 0; i < 3; i++) {
+        void *payload = NULL;
+        size_t payload_len = 0;
+        TEST_ASSERT_EQUAL(ESP_OK, esp_rmaker_cmd_prepare_payload(req_ids[i], ESP_RMAKER_USER_ROLE_PRIMARY_USER, 0, cmds[i],
+                                                                 data, data_sizes[i], &payload, &payload_len));
+        TEST_ASSERT_EQUAL(ESP_OK, esp_rmaker_cmd_batch_add(batch, sizeof(batch), &batch_len, payload, payload_len));
+        /* No room for another copy in a buffer just big enough */
+        size_t tmp_len = batch_len;
+        TEST_ASSERT_EQUAL(ESP_ERR_INVALID_SIZE, esp_rmaker_cmd_batch_add(batch, batch_len, &tmp_len, payload, payload_len));
+        TEST_ASSERT_EQUAL(batch_len, tmp_len);
+        free(payload);
+    }
+
+    void *output = NULL;
+    size_t output_len = 0;
+    TEST_ASSERT_EQUAL(ESP_OK, esp_rmaker_cmd_response_handler(batch, batch_len, &output, &output_len));
+    TEST_ASSERT_NOT_NULL(output);
+
+    /* The responses are in the same order as the commands */
+    size_t offset = 0;
+    esp_rmaker_cmd_data_view_t record;
+    int num_records = 0;
+    while (esp_rmaker_cmd_batch_get_next(output, output_len, &offset, &record)) {
+        TEST_ASSERT_TRUE(num_records < 3);
+        TEST_ASSERT_TRUE(record.len <= sizeof(record_buf));
+        TEST_ASSERT_EQUAL(record.len, esp_rmaker_cmd_data_view_copy(&record, record_buf, sizeof(record_buf)));
+        TEST_ASSERT_EQUAL(strlen(req_ids[num_records]),
+                          test_tlv_get(record_buf, record.len, ESP_RMAKER_TLV_TYPE_REQ_ID, val, sizeof(val)));
+        TEST_ASSERT_EQUAL_MEMORY(req_ids[num_records], val, strlen(req_ids[num_records]));
+        TEST_ASSERT_EQUAL(1, test_tlv_get(record_buf, record.len, ESP_RMAKER_TLV_TYPE_STATUS, val, sizeof(val)));
+        TEST_ASSERT_EQUAL(statuses[num_records], val[0]);
+        if (data_sizes[num_records]) {
+            TEST_ASSERT_EQUAL(data_sizes[num_records],
+                              test_tlv_get(record_buf, record.len, ESP_RMAKER_TLV_TYPE_DATA, val, sizeof(val)));
+            TEST_ASSERT_EQUAL_MEMORY(data, val, data_sizes[num_records]);
+        }
+        num_records++;
+    }
+    TEST_ASSERT_EQUAL(3, num_records);
+    TEST_ASSERT_EQUAL(output_len, offset);
+    free(output);
+
+    /* A batch larger than the limit is rejected as a whole */
+    void *payload = NULL;
+    size_t payload_len = 0;
+    TEST_ASSERT_EQUAL(ESP_OK, esp_rmaker_cmd_prepare_payload("batch_d", ESP_RMAKER_USER_ROLE_PRIMARY_USER, 0, TEST_CMD_ECHO,
+                                                             NULL, 0, &payload, &payload_len));
+    batch_len = 0;
+    for (int i = 0; i <= CONFIG_ESP_RMAKER_CMD_MAX_BATCH_RECORDS; i++) {
+        TEST_ASSERT_EQUAL(ESP_OK, esp_rmaker_cmd_batch_add(batch, sizeof(batch), &batch_len, payload, payload_len));
+    }
+    free(payload);
+    TEST_ASSERT_EQUAL(ESP_OK, esp_rmaker_cmd_response_handler(batch, batch_len, &output, &output_len));
+    TEST_ASSERT_EQUAL(1, test_tlv_get(output, output_len, ESP_RMAKER_TLV_TYPE_STATUS, val, sizeof(val)));
+    TEST_ASSERT_EQUAL(ESP_RMAKER_CMD_STATUS_CMD_INVALID, val[0]);
+    free(output);
+    TEST_ASSERT_EQUAL(ESP_OK, esp_rmaker_cmd_deregister(TEST_CMD_ECHO));
+}
+
+TEST_CASE("ESP RainMaker Command Response Writer", "[rmaker_cmd_resp]")
+{
+    static uint8_t input[400];
+    static uint8_t data[300];
+    static test_writer_t writer;
+    for (size_t i = 0; i < sizeof(data); i++) {
+        data[i] = (uint8_t)(i * 5);
+    }
+    TEST_ASSERT_EQUAL(ESP_OK, esp_rmaker_cmd_register(TEST_CMD_ECHO, ESP_RMAKER_USER_ROLE_PRIMARY_USER,
+                                                      test_cmd_echo_handler, false, NULL));
+
+    /* Small and large responses, the latter of which are encoded straight from the handler's buffer */
+    const char *req_ids[] = {"writer_a", "writer_b", "writer_c"};
+    const size_t data_sizes[] = {0, 16, 250};
+    for (int i = 0; i < 3; i++) {
+        size_t input_len = 0;
+        TEST_ASSERT_EQUAL(ESP_OK, esp_rmaker_cmd_encode_payload(req_ids[i], ESP_RMAKER_USER_ROLE_PRIMARY_USER, 0,
+                                                                TEST_CMD_ECHO, data, data_sizes[i],
+                                                                input, sizeof(input), &input_len));
+        memset(&writer, 0, sizeof(writer));
+        size_t written = 0;
+#if CONFIG_ESP_RMAKER_CMD_RESP_STATS
+        esp_rmaker_cmd_resp_reset_stats();
+#endif
+        TEST_ASSERT_EQUAL(ESP_OK, esp_rmaker_cmd_response_handler_to_writer(input, input_len, 0, test_cmd_writer,
+                                                                            &writer, &written));
+#if CONFIG_ESP_RMAKER_CMD_RESP_STATS
+        esp_rmaker_cmd_resp_stats_t stats;
+        TEST_ASSERT_EQUAL(ESP_OK, esp_rmaker_cmd_resp_get_stats(&stats));
+        if (data_sizes[i] > 240) {
+            TEST_ASSERT_EQUAL(0, stats.allocs);
+        }
+#endif
+        void *expected = NULL;
+        size_t expected_len = 0;
+        TEST_ASSERT_EQUAL(ESP_OK, esp_rmaker_cmd_prepare_payload(req_ids[i], 0, ESP_RMAKER_CMD_STATUS_SUCCESS,
+                                                                 TEST_CMD_ECHO, data, data_sizes[i],
+                                                                 &expected, &expected_len));
+        TEST_ASSERT_EQUAL(expected_len, written);
+        TEST_ASSERT_EQUAL(expected_len, writer.len);
+        TEST_ASSERT_EQUAL_MEMORY(expected, writer.buf, expected_len);
+        free(expected);
+    }
+
+    /* Failures are written too, and a failing writer is reported */
+    size_t input_len = 0;
+    TEST_ASSERT_EQUAL(ESP_OK, esp_rmaker_cmd_encode_payload("writer_d", ESP_RMAKER_USER_ROLE_PRIMARY_USER, 0,
+                                                            ESP_RMAKER_CMD_CUSTOM_START + 0x7ff, NULL, 0,
+                                                            input, sizeof(input), &input_len));
+    memset(&writer, 0, sizeof(writer));
+    TEST_ASSERT_EQUAL(ESP_OK, esp_rmaker_cmd_response_handler_to_writer(input, input_len, 0, test_cmd_writer,
+                                                                        &writer, NULL));
+    uint8_t status = 0;
+    TEST_ASSERT_EQUAL(1, test_tlv_get(writer.buf, writer.len, ESP_RMAKER_TLV_TYPE_STATUS, &status, sizeof(status)));
+    TEST_ASSERT_EQUAL(ESP_RMAKER_CMD_STATUS_NOT_FOUND, status);
+    TEST_ASSERT_EQUAL(ESP_OK, esp_rmaker_cmd_encode_payload("writer_e", ESP_RMAKER_USER_ROLE_PRIMARY_USER, 0,
+                                                            TEST_CMD_ECHO, data, 250, input, sizeof(input), &input_len));
+    memset(&writer, 0, sizeof(writer));
+    writer.len = sizeof(writer.buf) - 8;
+    TEST_ASSERT_NOT_EQUAL(ESP_OK, esp_rmaker_cmd_response_handler_to_writer(input, input_len, 0, test_cmd_writer,
+                                                                            &writer, NULL));
+    TEST_ASSERT_EQUAL(ESP_ERR_INVALID_ARG, esp_rmaker_cmd_response_handler_to_writer(input, input_len, 0, NULL,
+                                                                                     NULL, NULL));
+    TEST_ASSERT_EQUAL(ESP_OK, esp_rmaker_cmd_deregister(TEST_CMD_ECHO));
+}
+
+#define TEST_CMD_DEFER  (ESP_RMAKER_CMD_CUSTOM_START + 22U)
+
+static uint8_t s_sent_data[256];
+static size_t s_sent_len;
+static volatile int s_sent_count;
+static uint32_t s_defer_token;
+static uint32_t s_defer_timeout_ms;
+
+static esp_err_t test_cmd_deferred_send(const void *data, size_t data_len, void *priv)
+{
+    TEST_ASSERT_TRUE(data_len <= sizeof(s_sent_data));
+    memcpy(s_sent_data, data, data_len);
+    s_sent_len = data_len;
+    s_sent_count++;
+    return ESP_OK;
+}
+
+static esp_err_t test_cmd_defer_handler(const void *in_data, size_t in_len, void **out_data, size_t *out_len,
+                                        esp_rmaker_cmd_ctx_t *ctx, void *priv)
+{
+    esp_err_t err = esp_rmaker_cmd_deferred_register(ctx, s_defer_timeout_ms, &s_defer_token);
+    return (err == ESP_OK) ? ESP_ERR_NOT_FINISHED : err;
+}
+
+TEST_CASE("ESP RainMaker Command Deferred Responses", "[rmaker_cmd_resp]")
+{
+    const uint8_t primary = ESP_RMAKER_USER_ROLE_PRIMARY_USER;
+    uint8_t val[32];
+    esp_rmaker_cmd_deferred_stats_t before, stats;
+    TEST_ASSERT_EQUAL(ESP_OK, esp_rmaker_work_queue_init());
+    TEST_ASSERT_EQUAL(ESP_OK, esp_rmaker_work_queue_start());
+    TEST_ASSERT_EQUAL(ESP_OK, esp_rmaker_cmd_deferred_init(test_cmd_deferred_send, NULL));
+    TEST_ASSERT_EQUAL(ESP_OK, esp_rmaker_cmd_register(TEST_CMD_DEFER, ESP_RMAKER_USER_ROLE_PRIMARY_USER,
+                                                      test_cmd_defer_handler, false, NULL));
+    TEST_ASSERT_EQUAL(ESP_OK, esp_rmaker_cmd_deferred_get_stats(&before));
+    TEST_ASSERT_EQUAL(0, before.pending);
+
+    /* Completed by token */
+    s_defer_timeout_ms = 0;
+    s_sent_count = 0;
+    s_defer_token = 0;
+    TEST_ASSERT_EQUAL(TEST_NO_RESPONSE, test_cmd_dispatch("defer_a", primary, TEST_CMD_DEFER, NULL, NULL));
+    TEST_ASSERT_NOT_EQUAL(0, s_defer_token);
+    uint32_t token = s_defer_token;
+    uint32_t age_ms = UINT32_MAX;
+    TEST_ASSERT_EQUAL(ESP_OK, esp_rmaker_cmd_deferred_get_age(token, &age_ms));
+    TEST_ASSERT_TRUE(age_ms < 1000);
+    TEST_ASSERT_EQUAL(ESP_OK, esp_rmaker_cmd_deferred_get_stats(&stats));
+    TEST_ASSERT_EQUAL(1, stats.pending);
+    TEST_ASSERT_EQUAL(0, s_sent_count);
+    TEST_ASSERT_EQUAL(ESP_OK, esp_rmaker_cmd_deferred_complete(token, ESP_RMAKER_CMD_STATUS_SUCCESS, "done", 4));
+    TEST_ASSERT_EQUAL(1, s_sent_count);
+    TEST_ASSERT_EQUAL(7, test_tlv_get(s_sent_data, s_sent_len, ESP_RMAKER_TLV_TYPE_REQ_ID, val, sizeof(val)));
+    TEST_ASSERT_EQUAL_MEMORY("defer_a", val, 7);
+    TEST_ASSERT_EQUAL(1, test_tlv_get(s_sent_data, s_sent_len, ESP_RMAKER_TLV_TYPE_STATUS, val, sizeof(val)));
+    TEST_ASSERT_EQUAL(ESP_RMAKER_CMD_STATUS_SUCCESS, val[0]);
+    TEST_ASSERT_EQUAL(4, test_tlv_get(s_sent_data, s_sent_len, ESP_RMAKER_TLV_TYPE_DATA, val, sizeof(val)));
+    TEST_ASSERT_EQUAL_MEMORY("done", val, 4);
+    TEST_ASSERT_EQUAL(ESP_ERR_NOT_FOUND, esp_rmaker_cmd_deferred_complete(token, ESP_RMAKER_CMD_STATUS_SUCCESS, NULL, 0));
+    TEST_ASSERT_EQUAL(ESP_ERR_NOT_FOUND, esp_rmaker_cmd_deferred_get_age(token, &age_ms));
+
+    /* Timed out, with a FAILED response */
+    s_defer_timeout_ms = 100;
+    s_sent_count = 0;
+    s_defer_token = 0;
+    TEST_ASSERT_EQUAL(TEST_NO_RESPONSE, test_cmd_dispatch("defer_b", primary, TEST_CMD_DEFER, NULL, NULL));
+    TEST_ASSERT_NOT_EQUAL(0, s_defer_token);
+    token = s_defer_token;
+    for (int i = 0; (i < 50) && (s_sent_count == 0); i++) {
+        vTaskDelay(pdMS_TO_TICKS(20));
+    }
+    TEST_ASSERT_EQUAL(1, s_sent_count);
+    TEST_ASSERT_EQUAL(7, test_tlv_get(s_sent_data, s_sent_len, ESP_RMAKER_TLV_TYPE_REQ_ID, val, sizeof(val)));
+    TEST_ASSERT_EQUAL_MEMORY("defer_b", val, 7);
+    TEST_ASSERT_EQUAL(1, test_tlv_get(s_sent_data, s_sent_len, ESP_RMAKER_TLV_TYPE_STATUS, val, sizeof(val)));
+    TEST_ASSERT_EQUAL(ESP_RMAKER_CMD_STATUS_FAILED, val[0]);
+    TEST_ASSERT_EQUAL(ESP_ERR_NOT_FOUND, esp_rmaker_cmd_deferred_complete(token, ESP_RMAKER_CMD_STATUS_SUCCESS, NULL, 0));
+
+    /* Not deferred for a transport with its own role, since the response would not reach it */
+    s_defer_timeout_ms = 0;
+    s_sent_count = 0;
+    s_defer_token = 0;
+    TEST_ASSERT_EQUAL(ESP_RMAKER_CMD_STATUS_FAILED, test_cmd_dispatch_with_role("defer_l", primary, primary,
+                                                                                TEST_CMD_DEFER, NULL, NULL));
+    TEST_ASSERT_EQUAL(0, s_defer_token);
+    TEST_ASSERT_EQUAL(0, s_sent_count);
+
+    /* The table is bounded */
+    esp_rmaker_cmd_ctx_t ctx = {.cmd = TEST_CMD_DEFER, .req_id = "defer_c"};
+    uint32_t tokens[CONFIG_ESP_RMAKER_CMD_MAX_DEFERRED];
+    for (int i = 0; i < CONFIG_ESP_RMAKER_CMD_MAX_DEFERRED; i++) {
+        TEST_ASSERT_EQUAL(ESP_OK, esp_rmaker_cmd_deferred_register(&ctx, 0, &tokens[i]));
+    }
+    TEST_ASSERT_EQUAL(ESP_ERR_NO_MEM, esp_rmaker_cmd_deferred_register(&ctx, 0, &token));
+    TEST_ASSERT_EQUAL(ESP_OK, esp_rmaker_cmd_deferred_get_stats(&stats));
+    TEST_ASSERT_EQUAL(CONFIG_ESP_RMAKER_CMD_MAX_DEFERRED, stats.pending);
+    TEST_ASSERT_EQUAL(CONFIG_ESP_RMAKER_CMD_MAX_DEFERRED, stats.max_pending);
+    for (int i = 0; i < CONFIG_ESP_RMAKER_CMD_MAX_DEFERRED; i++) {
+        TEST_ASSERT_EQUAL(ESP_OK, esp_rmaker_cmd_deferred_complete(tokens[i], ESP_RMAKER_CMD_STATUS_FAILED, NULL, 0));
+    }
+
+    TEST_ASSERT_EQUAL(ESP_OK, esp_rmaker_cmd_deferred_get_stats(&stats));
+    TEST_ASSERT_EQUAL(0, stats.pending);
+    TEST_ASSERT_EQUAL(before.completed + 1 + CONFIG_ESP_RMAKER_CMD_MAX_DEFERRED, stats.completed);
+    TEST_ASSERT_EQUAL(before.timed_out + 1, stats.timed_out);
+    TEST_ASSERT_EQUAL(before.rejected + 1, stats.rejected);
+    TEST_ASSERT_EQUAL(ESP_OK, esp_rmaker_cmd_deregister(TEST_CMD_DEFER));
+    esp_rmaker_work_queue_stop();
+    esp_rmaker_work_queue_deinit();
+}
+
+#define TEST_CMD_SLOW   (ESP_RMAKER_CMD_CUSTOM_START + 23U)
+
+static SemaphoreHandle_t s_slow_sem;
+
+static esp_err_t test_cmd_slow_handler(const void *in_data, size_t in_len, void **out_data, size_t *out_len,
+                                       esp_rmaker_cmd_ctx_t *ctx, void *priv)
+{
+    xSemaphoreTake(s_slow_sem, portMAX_DELAY);
+    return ESP_OK;
+}
+
+TEST_CASE("ESP RainMaker Command Worker Pool", "[rmaker_cmd_resp]")
+{
+    const uint8_t primary = ESP_RMAKER_USER_ROLE_PRIMARY_USER;
+    uint8_t status;
+    s_slow_sem = xSemaphoreCreateCounting(UINT8_MAX, 0);
+    TEST_ASSERT_NOT_NULL(s_slow_sem);
+    TEST_ASSERT_EQUAL(ESP_OK, esp_rmaker_cmd_deferred_init(test_cmd_deferred_send, NULL));
+    TEST_ASSERT_EQUAL(ESP_OK, esp_rmaker_cmd_worker_pool_init());
+    TEST_ASSERT_EQUAL(ESP_OK, esp_rmaker_cmd_register(TEST_CMD_SLOW, ESP_RMAKER_USER_ROLE_PRIMARY_USER,
+                                                      test_cmd_slow_handler, false, NULL));
+    TEST_ASSERT_EQUAL(ESP_OK, esp_rmaker_cmd_register(TEST_CMD_ECHO, ESP_RMAKER_USER_ROLE_PRIMARY_USER,
+                                                      test_cmd_echo_handler, false, NULL));
+    TEST_ASSERT_EQUAL(ESP_ERR_INVALID_ARG, esp_rmaker_cmd_set_worker_limits(TEST_CMD_SLOW + 1, 1, 1));
+    TEST_ASSERT_EQUAL(ESP_OK, esp_rmaker_cmd_set_worker_limits(TEST_CMD_SLOW, 1, 1));
+
+    /* One running, one queued and the next one rejected right away */
+    s_sent_count = 0;
+    TEST_ASSERT_EQUAL(TEST_NO_RESPONSE, test_cmd_dispatch(NULL, primary, TEST_CMD_SLOW, NULL, NULL));
+    TEST_ASSERT_EQUAL(TEST_NO_RESPONSE, test_cmd_dispatch(NULL, primary, TEST_CMD_SLOW, NULL, NULL));
+    TEST_ASSERT_EQUAL(ESP_RMAKER_CMD_STATUS_FAILED, test_cmd_dispatch(NULL, primary, TEST_CMD_SLOW, NULL, NULL));
+
+    /* Other commands are not held up */
+    TEST_ASSERT_EQUAL(ESP_RMAKER_CMD_STATUS_SUCCESS, test_cmd_dispatch(NULL, primary, TEST_CMD_ECHO, NULL, NULL));
+    TEST_ASSERT_EQUAL(0, s_sent_count);
+
+    /* Both the accepted ones get their responses from the worker */
+    xSemaphoreGive(s_slow_sem);
+    xSemaphoreGive(s_slow_sem);
+    for (int i = 0; (i < 100) && (s_sent_count < 2); i++) {
+        vTaskDelay(pdMS_TO_TICKS(10));
+    }
+    TEST_ASSERT_EQUAL(2, s_sent_count);
+    TEST_ASSERT_EQUAL(1, test_tlv_get(s_sent_data, s_sent_len, ESP_RMAKER_TLV_TYPE_STATUS, &status, sizeof(status)));
+    TEST_ASSERT_EQUAL(ESP_RMAKER_CMD_STATUS_SUCCESS, status);
+
+    /* The limits apply again once the command is free */
+    TEST_ASSERT_EQUAL(TEST_NO_RESPONSE, test_cmd_dispatch(NULL, primary, TEST_CMD_SLOW, NULL, NULL));
+    xSemaphoreGive(s_slow_sem);
+    for (int i = 0; (i < 100) && (s_sent_count < 3); i++) {
+        vTaskDelay(pdMS_TO_TICKS(10));
+    }
+    TEST_ASSERT_EQUAL(3, s_sent_count);
+
+    /* Run right away for a transport with its own role, since a worker could not respond to it */
+    xSemaphoreGive(s_slow_sem);
+    TEST_ASSERT_EQUAL(ESP_RMAKER_CMD_STATUS_SUCCESS, test_cmd_dispatch_with_role(NULL, primary, primary,
+                                                                                 TEST_CMD_SLOW, NULL, NULL));
+    TEST_ASSERT_EQUAL(3, s_sent_count);
+    /* but within the limits of the command */
+    TEST_ASSERT_EQUAL(TEST_NO_RESPONSE, test_cmd_dispatch(NULL, primary, TEST_CMD_SLOW, NULL, NULL));
+    TEST_ASSERT_EQUAL(ESP_RMAKER_CMD_STATUS_FAILED, test_cmd_dispatch_with_role(NULL, primary, primary,
+                                                                                TEST_CMD_SLOW, NULL, NULL));
+    xSemaphoreGive(s_slow_sem);
+    for (int i = 0; (i < 100) && (s_sent_count < 4); i++) {
+        vTaskDelay(pdMS_TO_TICKS(10));
+    }
+    TEST_ASSERT_EQUAL(4, s_sent_count);
+
+    /* Commands within their limits are not rejected even if all the workers are busy */
+    s_sent_count = 0;
+    const int num_busy = CONFIG_ESP_RMAKER_CMD_WORKERS + CONFIG_ESP_RMAKER_CMD_WORKER_QUEUE_SIZE + 1;
+    TEST_ASSERT_EQUAL(ESP_OK, esp_rmaker_cmd_set_worker_limits(TEST_CMD_SLOW, num_busy, 1));
+    for (int i = 0; i < num_busy; i++) {
+        TEST_ASSERT_EQUAL(TEST_NO_RESPONSE, test_cmd_dispatch(NULL, primary, TEST_CMD_SLOW, NULL, NULL));
+    }
+    for (int i = 0; i < num_busy; i++) {
+        xSemaphoreGive(s_slow_sem);
+    }
+    for (int i = 0; (i < 100) && (s_sent_count < num_busy); i++) {
+        vTaskDelay(pdMS_TO_TICKS(10));
+    }
+    TEST_ASSERT_EQUAL(num_busy, s_sent_count);
+
+    /* Queued commands fail once the command is deregistered, while the running one completes */
+    s_sent_count = 0;
+    TEST_ASSERT_EQUAL(ESP_OK, esp_rmaker_cmd_set_worker_limits(TEST_CMD_SLOW, 1, 1));
+    TEST_ASSERT_EQUAL(TEST_NO_RESPONSE, test_cmd_dispatch(NULL, primary, TEST_CMD_SLOW, NULL, NULL));
+    TEST_ASSERT_EQUAL(TEST_NO_RESPONSE, test_cmd_dispatch(NULL, primary, TEST_CMD_SLOW, NULL, NULL));
+    TEST_ASSERT_EQUAL(ESP_OK, esp_rmaker_cmd_deregister(TEST_CMD_SLOW));
+    TEST_ASSERT_EQUAL(1, s_sent_count);
+    TEST_ASSERT_EQUAL(1, test_tlv_get(s_sent_data, s_sent_len, ESP_RMAKER_TLV_TYPE_STATUS, &status, sizeof(status)));
+    TEST_ASSERT_EQUAL(ESP_RMAKER_CMD_STATUS_FAILED, status);
+    xSemaphoreGive(s_slow_sem);
+    for (int i = 0; (i < 100) && (s_sent_count < 2); i++) {
+        vTaskDelay(pdMS_TO_TICKS(10));
+    }
+    TEST_ASSERT_EQUAL(2, s_sent_count);
+
+    TEST_ASSERT_EQUAL(ESP_OK, esp_rmaker_cmd_deregister(TEST_CMD_ECHO));
+    vSemaphoreDelete(s_slow_sem);
+}
+
+#define TEST_CMD_COUNT  (ESP_RMAKER_CMD_CUSTOM_START + 24U)
+
+static uint8_t s_count_calls;
+
+static esp_err_t test_cmd_count_handler(const void *in_data, size_t in_len, void **out_data, size_t *out_len,
+                                        esp_rmaker_cmd_ctx_t *ctx, void *priv)
+{
+    s_count_calls++;
+    *out_data = &s_count_calls;
+    *out_len = sizeof(s_count_calls);
+    return ESP_OK;
+}
+
+#if CONFIG_ESP_RMAKER_CMD_REPLAY_CACHE_SIZE > 0
+#define TEST_CMD_LARGE (ESP_RMAKER_CMD_CUSTOM_START + 35U)
+
+/* Like test_cmd_count_handler(), but with a response too large for the replay cache */
+static esp_err_t test_cmd_large_handler(const void *in_data, size_t in_len, void **out_data, size_t *out_len,
+                                        esp_rmaker_cmd_ctx_t *ctx, void *priv)
+{
+    static uint8_t large[CONFIG_ESP_RMAKER_CMD_REPLAY_CACHE_MAX_RESPONSE];
+    s_count_calls++;
+    *out_data = large;
+    *out_len = sizeof(large);
+    return ESP_OK;
+}
+#endif
+
+/* Dispatch a command with test_cmd_count_handler() and get the call count from the response, checking
+ * that the response is the same as the one prepared afresh for the request, even if it was cached.
+ * 0 if the command failed.
+ */
+static uint8_t test_cmd_count_dispatch(const char *req_id, uint8_t role, uint16_t cmd, const char *data)
+{
+    test_cmd_resp_t resp;
+    if (test_cmd_dispatch(req_id, role, cmd, data, &resp) != ESP_RMAKER_CMD_STATUS_SUCCESS) {
+        return 0;
+    }
+    TEST_ASSERT_EQUAL(1, resp.data_len);
+    void *expected = NULL;
+    size_t expected_len = 0;
+    TEST_ASSERT_EQUAL(ESP_OK, esp_rmaker_cmd_prepare_payload(req_id, 0, ESP_RMAKER_CMD_STATUS_SUCCESS, cmd,
+                                                             resp.data, 1, &expected, &expected_len));
+    TEST_ASSERT_EQUAL(expected_len, resp.raw_len);
+    TEST_ASSERT_EQUAL_MEMORY(expected, resp.raw, expected_len);
+    free(expected);
+    return resp.data[0];
+}
+
+TEST_CASE("ESP RainMaker Command Replay Cache", "[rmaker_cmd_resp]")
+{
+    uint8_t primary = ESP_RMAKER_USER_ROLE_PRIMARY_USER;
+    uint8_t secondary = ESP_RMAKER_USER_ROLE_SECONDARY_USER;
+    TEST_ASSERT_EQUAL(ESP_OK, esp_rmaker_cmd_register(TEST_CMD_COUNT, primary | secondary,
+                                                      test_cmd_count_handler, false, NULL));
+    TEST_ASSERT_EQUAL(ESP_OK, esp_rmaker_cmd_replay_cache_clear());
+    s_count_calls = 0;
+    TEST_ASSERT_EQUAL(1, test_cmd_count_dispatch("replay_a", primary, TEST_CMD_COUNT, NULL));
+#if CONFIG_ESP_RMAKER_CMD_REPLAY_CACHE_SIZE > 0
+    /* A duplicate gets the same response, without running the handler */
+    TEST_ASSERT_EQUAL(1, test_cmd_count_dispatch("replay_a", primary, TEST_CMD_COUNT, NULL));
+    TEST_ASSERT_EQUAL(1, s_count_calls);
+    TEST_ASSERT_EQUAL(2, test_cmd_count_dispatch("replay_b", primary, TEST_CMD_COUNT, NULL));
+
+    /* The least recently used response is replaced once the cache is full */
+    char req_id[REQ_ID_LEN];
+    for (int i = 0; i < CONFIG_ESP_RMAKER_CMD_REPLAY_CACHE_SIZE - 1; i++) {
+        TEST_ASSERT_EQUAL(1, test_cmd_count_dispatch("replay_a", primary, TEST_CMD_COUNT, NULL));
+        snprintf(req_id, sizeof(req_id), "replay_c%d", i);
+        test_cmd_count_dispatch(req_id, primary, TEST_CMD_COUNT, NULL);
+    }
+    uint8_t calls = s_count_calls;
+    TEST_ASSERT_EQUAL(1, test_cmd_count_dispatch("replay_a", primary, TEST_CMD_COUNT, NULL));
+    TEST_ASSERT_EQUAL(calls + 1, test_cmd_count_dispatch("replay_b", primary, TEST_CMD_COUNT, NULL));
+
+    /* Cleared responses are not sent again */
+    TEST_ASSERT_EQUAL(ESP_OK, esp_rmaker_cmd_replay_cache_clear());
+    TEST_ASSERT_EQUAL(calls + 2, test_cmd_count_dispatch("replay_a", primary, TEST_CMD_COUNT, NULL));
+
+    /* Only sent again for the same user role, and only once the access check passes */
+    TEST_ASSERT_EQUAL(0, test_cmd_count_dispatch("replay_a", ESP_RMAKER_USER_ROLE_NODE, TEST_CMD_COUNT, NULL));
+    TEST_ASSERT_EQUAL(calls + 3, test_cmd_count_dispatch("replay_a", secondary, TEST_CMD_COUNT, NULL));
+    TEST_ASSERT_EQUAL(calls + 3, test_cmd_count_dispatch("replay_a", secondary, TEST_CMD_COUNT, NULL));
+    TEST_ASSERT_EQUAL(calls + 2, test_cmd_count_dispatch("replay_a", primary, TEST_CMD_COUNT, NULL));
+
+    /* Responses larger than the limit are not cached */
+    TEST_ASSERT_EQUAL(ESP_OK, esp_rmaker_cmd_register(TEST_CMD_LARGE, primary, test_cmd_large_handler, false, NULL));
+    s_count_calls = 0;
+    for (int i = 0; i < 2; i++) {
+        TEST_ASSERT_EQUAL(ESP_RMAKER_CMD_STATUS_SUCCESS,
+                          test_cmd_dispatch("replay_large", primary, TEST_CMD_LARGE, NULL, NULL));
+    }
+    TEST_ASSERT_EQUAL(2, s_count_calls);
+    TEST_ASSERT_EQUAL(ESP_OK, esp_rmaker_cmd_deregister(TEST_CMD_LARGE));
+#else
+    TEST_ASSERT_EQUAL(2, test_cmd_count_dispatch("replay_a", primary, TEST_CMD_COUNT, NULL));
+#endif
+    TEST_ASSERT_EQUAL(ESP_OK, esp_rmaker_cmd_deregister(TEST_CMD_COUNT));
+}
+
+#define TEST_CMD_SCHEMA (ESP_RMAKER_CMD_CUSTOM_START + 25U)
+
+#define TEST_LIGHT_REQ_FIELDS(SCALAR, BYTES) \
+    SCALAR(1, U8, brightness) \
+    SCALAR(2, BOOL, power) \
+    SCALAR(3, I32, offset) \
+    BYTES(4, name, 8)
+
+#define TEST_LIGHT_RESP_FIELDS(SCALAR, BYTES) \
+    SCALAR(1, U16, level) \
+    BYTES(2, name, 8)
+
+ESP_RMAKER_CMD_SCHEMA_DEFINE(test_light_req, TEST_LIGHT_REQ_FIELDS)
+ESP_RMAKER_CMD_SCHEMA_DEFINE(test_light_resp, TEST_LIGHT_RESP_FIELDS)
+
+static esp_err_t test_light_impl(const test_light_req_t *req, test_light_resp_t *resp,
+                                 esp_rmaker_cmd_ctx_t *ctx, void *priv)
+{
+    if (!req->has_brightness) {
+        return ESP_ERR_INVALID_ARG;
+    }
+    resp->level = req->power ? req->brightness * 10 + req->offset : 0;
+    resp->name = req->name;
+    resp->name_len = req->name_len;
+    return ESP_OK;
+}
+
+ESP_RMAKER_CMD_SCHEMA_HANDLER(test_cmd_light_handler, test_light_req, test_light_resp, test_light_impl)
+
+TEST_CASE("ESP RainMaker Command Schema", "[rmaker_cmd_resp]")
+{
+    uint8_t buf[64];
+    size_t len = 0;
+    test_light_req_t req = {
+        .brightness = 42,
+        .power = true,
+        .offset = -3,
+        .name = (const uint8_t *)"lamp",
+        .name_len = 4,
+    };
+    /* Required size is reported for a small buffer */
+    TEST_ASSERT_EQUAL(ESP_ERR_INVALID_SIZE, test_light_req_encode(&req, buf, 4, &len));
+    TEST_ASSERT_EQUAL(3 + 3 + 6 + 6, len);
+    TEST_ASSERT_EQUAL(len, test_light_req_encoded_size(&req));
+    TEST_ASSERT_EQUAL(ESP_OK, test_light_req_encode(&req, buf, sizeof(buf), &len));
+    /* Scalars are little endian */
+    const uint8_t offset_tlv[] = {3, 4, 0xfd, 0xff, 0xff, 0xff};
+    TEST_ASSERT_EQUAL_MEMORY(offset_tlv, &buf[6], sizeof(offset_tlv));
+
+    test_light_req_t decoded;
+    TEST_ASSERT_EQUAL(ESP_OK, test_light_req_decode(buf, len, &decoded));
+    TEST_ASSERT_TRUE(decoded.has_brightness && decoded.has_power && decoded.has_offset && decoded.has_name);
+    TEST_ASSERT_EQUAL(42, decoded.brightness);
+    TEST_ASSERT_TRUE(decoded.power);
+    TEST_ASSERT_EQUAL(-3, decoded.offset);
+    /* Byte fields point into the input */
+    TEST_ASSERT_EQUAL_PTR(&buf[len - 4], decoded.name);
+    TEST_ASSERT_EQUAL(4, decoded.name_len);
+
+    /* Unknown fields are skipped, missing fields are flagged */
+    const uint8_t partial[] = {9, 2, 0xaa, 0xbb, 1, 1, 7};
+    TEST_ASSERT_EQUAL(ESP_OK, test_light_req_decode(partial, sizeof(partial), &decoded));
+    TEST_ASSERT_TRUE(decoded.has_brightness);
+    TEST_ASSERT_EQUAL(7, decoded.brightness);
+    TEST_ASSERT_FALSE(decoded.has_power || decoded.has_offset || decoded.has_name);
+
+    /* Invalid input */
+    const uint8_t bad_width[] = {1, 2, 7, 0};
+    TEST_ASSERT_EQUAL(ESP_ERR_INVALID_ARG, test_light_req_decode(bad_width, sizeof(bad_width), &decoded));
+    TEST_ASSERT_EQUAL(ESP_ERR_INVALID_SIZE, test_light_req_decode(buf, len - 1, &decoded));
+    TEST_ASSERT_EQUAL(ESP_ERR_INVALID_SIZE, test_light_req_decode(buf, 1, &decoded));
+    const uint8_t long_name[] = {4, 9, 'a', 'b', 'c', 'd', 'e', 'f', 'g', 'h', 'i'};
+    TEST_ASSERT_EQUAL(ESP_ERR_INVALID_SIZE, test_light_req_decode(long_name, sizeof(long_name), &decoded));
+    req.name_len = 9;
+    TEST_ASSERT_EQUAL(ESP_ERR_INVALID_ARG, test_light_req_encode(&req, buf, sizeof(buf), &len));
+    req.name_len = 4;
+
+    /* Generated handler, with the response encoded in place, and as data for a cacheable command */
+    const char *req_ids[] = {"schema_req", "schema_cached"};
+    const uint32_t flags[] = {0, ESP_RMAKER_CMD_FLAG_CACHEABLE};
+    TEST_ASSERT_EQUAL(ESP_OK, test_light_req_encode(&req, buf, sizeof(buf), &len));
+    for (int i = 0; i < 2; i++) {
+        TEST_ASSERT_EQUAL(ESP_OK, esp_rmaker_cmd_register_with_flags(TEST_CMD_SCHEMA, ESP_RMAKER_USER_ROLE_PRIMARY_USER,
+                                                                     test_cmd_light_handler, false, flags[i], NULL));
+        uint8_t input[128];
+        uint8_t role = ESP_RMAKER_USER_ROLE_PRIMARY_USER;
+        uint8_t cmd_buf[2] = {TEST_CMD_SCHEMA & 0xff, TEST_CMD_SCHEMA >> 8};
+        size_t input_len = 0;
+        input_len = test_tlv_add(input, input_len, ESP_RMAKER_TLV_TYPE_REQ_ID, req_ids[i], strlen(req_ids[i]));
+        input_len = test_tlv_add(input, input_len, ESP_RMAKER_TLV_TYPE_USER_ROLE, &role, sizeof(role));
+        input_len = test_tlv_add(input, input_len, ESP_RMAKER_TLV_TYPE_CMD, cmd_buf, sizeof(cmd_buf));
+        input_len = test_tlv_add(input, input_len, ESP_RMAKER_TLV_TYPE_DATA, buf, len);
+        void *output = NULL;
+        size_t output_len = 0;
+        TEST_ASSERT_EQUAL(ESP_OK, esp_rmaker_cmd_response_handler(input, input_len, &output, &output_len));
+        uint8_t status = 0;
+        TEST_ASSERT_EQUAL(1, test_tlv_get(output, output_len, ESP_RMAKER_TLV_TYPE_STATUS, &status, sizeof(status)));
+        TEST_ASSERT_EQUAL(ESP_RMAKER_CMD_STATUS_SUCCESS, status);
+        uint8_t resp_buf[32];
+        int resp_len = test_tlv_get(output, output_len, ESP_RMAKER_TLV_TYPE_DATA, resp_buf, sizeof(resp_buf));
+        TEST_ASSERT_GREATER_THAN(0, resp_len);
+        /* Same as the response prepared from the encoded data */
+        void *expected = NULL;
+        size_t expected_len = 0;
+        TEST_ASSERT_EQUAL(ESP_OK, esp_rmaker_cmd_prepare_payload(req_ids[i], 0, ESP_RMAKER_CMD_STATUS_SUCCESS,
+                                                                 TEST_CMD_SCHEMA, resp_buf, resp_len,
+                                                                 &expected, &expected_len));
+        TEST_ASSERT_EQUAL(expected_len, output_len);
+        TEST_ASSERT_EQUAL_MEMORY(expected, output, expected_len);
+        free(expected);
+        free(output);
+        test_light_resp_t resp;
+        TEST_ASSERT_EQUAL(ESP_OK, test_light_resp_decode(resp_buf, resp_len, &resp));
+        TEST_ASSERT_EQUAL(417, resp.level);
+        TEST_ASSERT_EQUAL(4, resp.name_len);
+        TEST_ASSERT_EQUAL_MEMORY("lamp", resp.name, 4);
+        TEST_ASSERT_EQUAL(ESP_OK, esp_rmaker_cmd_deregister(TEST_CMD_SCHEMA));
+    }
+
+    /* Responses can only be encoded from within a handler */
+    esp_rmaker_cmd_ctx_t ctx = {.cmd = TEST_CMD_SCHEMA};
+    test_light_resp_t resp = {0};
+    TEST_ASSERT_EQUAL(ESP_ERR_INVALID_STATE, esp_rmaker_cmd_respond_encoded(&ctx, 4, test_cmd_light_handler_encode,
+                                                                            &resp));
+}
+
+#define TEST_CMD_CHUNKED    (ESP_RMAKER_CMD_CUSTOM_START + 26U)
+
+static int s_chunk_calls;
+static size_t s_chunk_lens[8];
+static bool s_chunk_last;
+static int s_chunk_fail_at;
+static const uint8_t *s_chunk_input;
+static size_t s_chunk_input_len;
+static uint8_t s_chunk_sum;
+
+static esp_err_t test_cmd_chunk_handler(const void *chunk, size_t chunk_len, size_t offset, size_t total_len,
+                                        bool last, void **out_data, size_t *out_len,
+                                        esp_rmaker_cmd_ctx_t *ctx, void *priv)
+{
+    if (offset == 0) {
+        s_chunk_calls = 0;
+        s_chunk_sum = 0;
+    }
+    TEST_ASSERT_TRUE(s_chunk_calls < 8);
+    TEST_ASSERT_TRUE(offset + chunk_len <= total_len);
+    TEST_ASSERT_EQUAL(last, out_data != NULL);
+    if (chunk_len) {
+        /* Passed directly from the input */
+        TEST_ASSERT_TRUE((const uint8_t *)chunk > s_chunk_input &&
+                         (const uint8_t *)chunk + chunk_len <= s_chunk_input + s_chunk_input_len);
+    }
+    for (size_t i = 0; i < chunk_len; i++) {
+        s_chunk_sum += ((const uint8_t *)chunk)[i];
+    }
+    s_chunk_lens[s_chunk_calls++] = chunk_len;
+    s_chunk_last = last;
+    if (s_chunk_calls == s_chunk_fail_at) {
+        return ESP_FAIL;
+    }
+    if (last) {
+        TEST_ASSERT_EQUAL(total_len, offset + chunk_len);
+        *out_data = &s_chunk_sum;
+        *out_len = sizeof(s_chunk_sum);
+    }
+    return ESP_OK;
+}
+
+static uint8_t test_cmd_chunk_dispatch(const char *req_id, const uint8_t *data, size_t data_len)
+{
+    static uint8_t input[1200];
+    uint8_t role = ESP_RMAKER_USER_ROLE_PRIMARY_USER;
+    uint8_t cmd_buf[2] = {TEST_CMD_CHUNKED & 0xff, TEST_CMD_CHUNKED >> 8};
+    size_t len = 0;
+    len = test_tlv_add(input, len, ESP_RMAKER_TLV_TYPE_REQ_ID, req_id, strlen(req_id));
+    len = test_tlv_add(input, len, ESP_RMAKER_TLV_TYPE_USER_ROLE, &role, sizeof(role));
+    len = test_tlv_add(input, len, ESP_RMAKER_TLV_TYPE_CMD, cmd_buf, sizeof(cmd_buf));
+    if (data_len) {
+        len = test_tlv_add(input, len, ESP_RMAKER_TLV_TYPE_DATA, data, data_len);
+    }
+    s_chunk_input = input;
+    s_chunk_input_len = len;
+    void *output = NULL;
+    size_t output_len = 0;
+    TEST_ASSERT_EQUAL(ESP_OK, esp_rmaker_cmd_response_handler(input, len, &output, &output_len));
+    uint8_t status = TEST_NO_RESPONSE;
+    TEST_ASSERT_EQUAL(1, test_tlv_get(output, output_len, ESP_RMAKER_TLV_TYPE_STATUS, &status, sizeof(status)));
+    if (status == ESP_RMAKER_CMD_STATUS_SUCCESS) {
+        uint8_t sum = 0;
+        TEST_ASSERT_EQUAL(1, test_tlv_get(output, output_len, ESP_RMAKER_TLV_TYPE_DATA, &sum, sizeof(sum)));
+        TEST_ASSERT_EQUAL(s_chunk_sum, sum);
+    }
+    free(output);
+    return status;
+}
+
+TEST_CASE("ESP RainMaker Command Chunked Data", "[rmaker_cmd_resp]")
+{
+    static uint8_t data[600];
+    uint8_t sum = 0;
+    for (int i = 0; i < sizeof(data); i++) {
+        data[i] = (uint8_t)(i * 5);
+    }
+    TEST_ASSERT_EQUAL(ESP_ERR_INVALID_ARG, esp_rmaker_cmd_register_chunked(TEST_CMD_CHUNKED,
+                                                                           ESP_RMAKER_USER_ROLE_PRIMARY_USER,
+                                                                           NULL, false, NULL));
+    TEST_ASSERT_EQUAL(ESP_OK, esp_rmaker_cmd_register_chunked(TEST_CMD_CHUNKED, ESP_RMAKER_USER_ROLE_PRIMARY_USER,
+                                                              test_cmd_chunk_handler, false, NULL));
+    s_chunk_fail_at = 0;
+
+    /* One call per record */
+    TEST_ASSERT_EQUAL(ESP_RMAKER_CMD_STATUS_SUCCESS, test_cmd_chunk_dispatch("chunk_req", data, sizeof(data)));
+    TEST_ASSERT_EQUAL(3, s_chunk_calls);
+    TEST_ASSERT_EQUAL(255, s_chunk_lens[0]);
+    TEST_ASSERT_EQUAL(255, s_chunk_lens[1]);
+    TEST_ASSERT_EQUAL(90, s_chunk_lens[2]);
+    TEST_ASSERT_TRUE(s_chunk_last);
+    for (int i = 0; i < sizeof(data); i++) {
+        sum += data[i];
+    }
+    TEST_ASSERT_EQUAL(sum, s_chunk_sum);
+
+    /* The empty record ending data of a multiple of 255 bytes is not passed on */
+    TEST_ASSERT_EQUAL(ESP_RMAKER_CMD_STATUS_SUCCESS, test_cmd_chunk_dispatch("chunk_req_2", data, 510));
+    TEST_ASSERT_EQUAL(2, s_chunk_calls);
+    TEST_ASSERT_EQUAL(255, s_chunk_lens[1]);
+    TEST_ASSERT_TRUE(s_chunk_last);
+
+    /* No data: a single, last, call */
+    TEST_ASSERT_EQUAL(ESP_RMAKER_CMD_STATUS_SUCCESS, test_cmd_chunk_dispatch("chunk_req_3", NULL, 0));
+    TEST_ASSERT_EQUAL(1, s_chunk_calls);
+    TEST_ASSERT_EQUAL(0, s_chunk_lens[0]);
+    TEST_ASSERT_TRUE(s_chunk_last);
+
+    /* An error stops the command */
+    s_chunk_fail_at = 1;
+    TEST_ASSERT_EQUAL(ESP_RMAKER_CMD_STATUS_FAILED, test_cmd_chunk_dispatch("chunk_req_4", data, sizeof(data)));
+    TEST_ASSERT_EQUAL(1, s_chunk_calls);
+    TEST_ASSERT_FALSE(s_chunk_last);
+    s_chunk_fail_at = 0;
+
+    TEST_ASSERT_EQUAL(ESP_OK, esp_rmaker_cmd_deregister(TEST_CMD_CHUNKED));
+}
+
+#if CONFIG_ESP_RMAKER_CMD_CBOR
+#define TEST_CMD_CBOR   (ESP_RMAKER_CMD_CUSTOM_START + 27U)
+
+static uint8_t s_cbor_content_type;
+static bool s_cbor_name_in_place;
+static size_t s_cbor_note_len;
+static int64_t s_cbor_level;
+static uint8_t s_cbor_resp[16];
+
+/* Reads {"name": text, "note": long text, "level": int, "extra": [...]}, in any order */
+static esp_err_t test_cmd_cbor_handler(const void *in_data, size_t in_len, void **out_data, size_t *out_len,
+                                       esp_rmaker_cmd_ctx_t *ctx, void *priv)
+{
+    static char note[400];
+    esp_rmaker_cmd_cbor_reader_t reader;
+    size_t count;
+    s_cbor_content_type = ctx->content_type;
+    TEST_ASSERT_EQUAL(ESP_OK, esp_rmaker_cmd_cbor_reader_init(&reader, in_data));
+    TEST_ASSERT_EQUAL(ESP_OK, esp_rmaker_cmd_cbor_read_map(&reader, &count));
+    for (size_t i = 0; i < count; i++) {
+        const void *key;
+        size_t key_len;
+        TEST_ASSERT_EQUAL(ESP_OK, esp_rmaker_cmd_cbor_read_string(&reader, &key, &key_len, NULL, 0));
+        if (key_len == 4 && memcmp(key, "name", 4) == 0) {
+            const void *name;
+            size_t name_len;
+            TEST_ASSERT_EQUAL(ESP_OK, esp_rmaker_cmd_cbor_read_string(&reader, &name, &name_len, NULL, 0));
+            s_cbor_name_in_place = (name != NULL);
+        } else if (key_len == 4 && memcmp(key, "note", 4) == 0) {
+            const void *value;
+            /* Split across records, so it needs a buffer */
+            TEST_ASSERT_EQUAL(ESP_ERR_INVALID_SIZE, esp_rmaker_cmd_cbor_read_string(&reader, &value, &s_cbor_note_len,
+                                                                                    NULL, 0));
+            TEST_ASSERT_EQUAL(ESP_OK, esp_rmaker_cmd_cbor_read_string(&reader, &value, &s_cbor_note_len,
+                                                                      note, sizeof(note)));
+            TEST_ASSERT_EQUAL_PTR(note, value);
+        } else if (key_len == 5 && memcmp(key, "level", 5) == 0) {
+            TEST_ASSERT_EQUAL(ESP_OK, esp_rmaker_cmd_cbor_read_int(&reader, &s_cbor_level));
+        } else {
+            TEST_ASSERT_EQUAL(ESP_OK, esp_rmaker_cmd_cbor_skip(&reader));
+        }
+    }
+    TEST_ASSERT_TRUE(esp_rmaker_cmd_cbor_reader_at_end(&reader));
+
+    esp_rmaker_cmd_cbor_writer_t writer;
+    size_t len;
+    esp_rmaker_cmd_cbor_writer_init(&writer, s_cbor_resp, sizeof(s_cbor_resp));
+    esp_rmaker_cmd_cbor_write_map(&writer, 1);
+    esp_rmaker_cmd_cbor_write_text(&writer, "ok", 2);
+    esp_rmaker_cmd_cbor_write_bool(&writer, true);
+    TEST_ASSERT_EQUAL(ESP_OK, esp_rmaker_cmd_cbor_writer_finish(&writer, &len));
+    ctx->resp_content_type = ESP_RMAKER_CMD_CONTENT_TYPE_CBOR;
+    *out_data = s_cbor_resp;
+    *out_len = len;
+    return ESP_OK;
+}
+
+TEST_CASE("ESP RainMaker Command CBOR", "[rmaker_cmd_resp]")
+{
+    static uint8_t cbor[512];
+    static char note[300];
+    esp_rmaker_cmd_cbor_writer_t writer;
+    esp_rmaker_cmd_cbor_reader_t reader;
+    size_t len = 0;
+
+    /* Shortest encodings, as per RFC 8949 */
+    const uint8_t expected[] = {0x19, 0x01, 0xf4, 0x39, 0x01, 0xf3, 0x17, 0x18, 0x18, 0xfa, 0x3f, 0x00, 0x00, 0x00};
+    esp_rmaker_cmd_cbor_writer_init(&writer, cbor, sizeof(cbor));
+    esp_rmaker_cmd_cbor_write_uint(&writer, 500);
+    esp_rmaker_cmd_cbor_write_int(&writer, -500);
+    esp_rmaker_cmd_cbor_write_uint(&writer, 23);
+    esp_rmaker_cmd_cbor_write_uint(&writer, 24);
+    esp_rmaker_cmd_cbor_write_double(&writer, 0.5);
+    TEST_ASSERT_EQUAL(ESP_OK, esp_rmaker_cmd_cbor_writer_finish(&writer, &len));
+    TEST_ASSERT_EQUAL(sizeof(expected), len);
+    TEST_ASSERT_EQUAL_MEMORY(expected, cbor, len);
+
+    /* A small buffer still gives the size needed */
+    esp_rmaker_cmd_cbor_writer_init(&writer, cbor, 4);
+    esp_rmaker_cmd_cbor_write_uint(&writer, 500);
+    TEST_ASSERT_EQUAL(ESP_ERR_INVALID_SIZE, esp_rmaker_cmd_cbor_write_int(&writer, -500));
+    esp_rmaker_cmd_cbor_write_double(&writer, 0.1);
+    TEST_ASSERT_EQUAL(ESP_ERR_INVALID_SIZE, esp_rmaker_cmd_cbor_writer_finish(&writer, &len));
+    TEST_ASSERT_EQUAL(3 + 3 + 9, len);
+
+    /* Reading */
+    const uint8_t items[] = {0x39, 0x01, 0xf3, 0xf9, 0x3c, 0x00, 0xf5, 0xf6, 0x82, 0x01, 0xa1, 0x61, 0x61, 0x02, 0x03};
+    int64_t int_value;
+    double double_value;
+    bool bool_value;
+    size_t count;
+    esp_rmaker_cmd_cbor_type_t type;
+    esp_rmaker_cmd_cbor_reader_init_buf(&reader, items, sizeof(items));
+    /* A type mismatch leaves the reader unchanged */
+    TEST_ASSERT_EQUAL(ESP_ERR_INVALID_STATE, esp_rmaker_cmd_cbor_read_bool(&reader, &bool_value));
+    TEST_ASSERT_EQUAL(ESP_OK, esp_rmaker_cmd_cbor_read_int(&reader, &int_value));
+    TEST_ASSERT_EQUAL(-500, int_value);
+    TEST_ASSERT_EQUAL(ESP_OK, esp_rmaker_cmd_cbor_peek_type(&reader, &type));
+    TEST_ASSERT_EQUAL(ESP_RMAKER_CMD_CBOR_TYPE_FLOAT, type);
+    TEST_ASSERT_EQUAL(ESP_OK, esp_rmaker_cmd_cbor_read_double(&reader, &double_value));
+    TEST_ASSERT_TRUE(double_value == 1.0);
+    TEST_ASSERT_EQUAL(ESP_OK, esp_rmaker_cmd_cbor_read_bool(&reader, &bool_value));
+    TEST_ASSERT_TRUE(bool_value);
+    TEST_ASSERT_EQUAL(ESP_OK, esp_rmaker_cmd_cbor_read_null(&reader));
+    /* [1, {"a": 2}] is skipped as a whole */
+    TEST_ASSERT_EQUAL(ESP_OK, esp_rmaker_cmd_cbor_skip(&reader));
+    TEST_ASSERT_EQUAL(ESP_OK, esp_rmaker_cmd_cbor_read_int(&reader, &int_value));
+    TEST_ASSERT_EQUAL(3, int_value);
+    TEST_ASSERT_TRUE(esp_rmaker_cmd_cbor_reader_at_end(&reader));
+
+    /* Truncated, oversized and indefinite length items */
+    const uint8_t truncated[] = {0x19, 0x01};
+    esp_rmaker_cmd_cbor_reader_init_buf(&reader, truncated, sizeof(truncated));
+    TEST_ASSERT_EQUAL(ESP_ERR_INVALID_SIZE, esp_rmaker_cmd_cbor_read_int(&reader, &int_value));
+    const uint8_t huge_array[] = {0x9a, 0xff, 0xff, 0xff, 0xff, 0x01};
+    esp_rmaker_cmd_cbor_reader_init_buf(&reader, huge_array, sizeof(huge_array));
+    TEST_ASSERT_EQUAL(ESP_ERR_INVALID_SIZE, esp_rmaker_cmd_cbor_read_array(&reader, &count));
+    TEST_ASSERT_EQUAL(ESP_ERR_INVALID_SIZE, esp_rmaker_cmd_cbor_skip(&reader));
+    const uint8_t indefinite[] = {0x9f, 0x01, 0xff};
+    esp_rmaker_cmd_cbor_reader_init_buf(&reader, indefinite, sizeof(indefinite));
+    TEST_ASSERT_EQUAL(ESP_ERR_NOT_SUPPORTED, esp_rmaker_cmd_cbor_read_array(&reader, &count));
+
+    /* Command with CBOR data across records, read in place */
+    memset(note, 'n', sizeof(note));
+    esp_rmaker_cmd_cbor_writer_init(&writer, cbor, sizeof(cbor));
+    esp_rmaker_cmd_cbor_write_map(&writer, 4);
+    esp_rmaker_cmd_cbor_write_text(&writer, "name", 4);
+    esp_rmaker_cmd_cbor_write_text(&writer, "lamp", 4);
+    esp_rmaker_cmd_cbor_write_text(&writer, "extra", 5);
+    esp_rmaker_cmd_cbor_write_array(&writer, 2);
+    esp_rmaker_cmd_cbor_write_bytes(&writer, "\x01\x02", 2);
+    esp_rmaker_cmd_cbor_write_null(&writer);
+    esp_rmaker_cmd_cbor_write_text(&writer, "note", 4);
+    esp_rmaker_cmd_cbor_write_text(&writer, note, sizeof(note));
+    esp_rmaker_cmd_cbor_write_text(&writer, "level", 5);
+    esp_rmaker_cmd_cbor_write_int(&writer, -42);
+    TEST_ASSERT_EQUAL(ESP_OK, esp_rmaker_cmd_cbor_writer_finish(&writer, &len));
+
+    TEST_ASSERT_EQUAL(ESP_OK, esp_rmaker_cmd_register_with_flags(TEST_CMD_CBOR, ESP_RMAKER_USER_ROLE_PRIMARY_USER,
+                                                                 test_cmd_cbor_handler, false,
+                                                                 ESP_RMAKER_CMD_FLAG_DATA_VIEW, NULL));
+    static uint8_t input[600];
+    uint8_t role = ESP_RMAKER_USER_ROLE_PRIMARY_USER;
+    uint8_t cmd_buf[2] = {TEST_CMD_CBOR & 0xff, TEST_CMD_CBOR >> 8};
+    uint8_t content_type = ESP_RMAKER_CMD_CONTENT_TYPE_CBOR;
+    size_t input_len = 0;
+    input_len = test_tlv_add(input, input_len, ESP_RMAKER_TLV_TYPE_REQ_ID, "cbor_req", strlen("cbor_req"));
+    input_len = test_tlv_add(input, input_len, ESP_RMAKER_TLV_TYPE_USER_ROLE, &role, sizeof(role));
+    input_len = test_tlv_add(input, input_len, ESP_RMAKER_TLV_TYPE_CMD, cmd_buf, sizeof(cmd_buf));
+    input_len = test_tlv_add(input, input_len, ESP_RMAKER_TLV_TYPE_CONTENT_TYPE, &content_type, sizeof(content_type));
+    input_len = test_tlv_add(input, input_len, ESP_RMAKER_TLV_TYPE_DATA, cbor, len);
+    void *output = NULL;
+    size_t output_len = 0;
+    TEST_ASSERT_EQUAL(ESP_OK, esp_rmaker_cmd_response_handler(input, input_len, &output, &output_len));
+    TEST_ASSERT_EQUAL(ESP_RMAKER_CMD_CONTENT_TYPE_CBOR, s_cbor_content_type);
+    TEST_ASSERT_TRUE(s_cbor_name_in_place);
+    TEST_ASSERT_EQUAL(sizeof(note), s_cbor_note_len);
+    TEST_ASSERT_EQUAL(-42, s_cbor_level);
+
+    /* The response carries its content type */
+    uint8_t resp_type = 0;
+    TEST_ASSERT_EQUAL(1, test_tlv_get(output, output_len, ESP_RMAKER_TLV_TYPE_CONTENT_TYPE, &resp_type, sizeof(resp_type)));
+    TEST_ASSERT_EQUAL(ESP_RMAKER_CMD_CONTENT_TYPE_CBOR, resp_type);
+    uint8_t resp[16];
+    int resp_len = test_tlv_get(output, output_len, ESP_RMAKER_TLV_TYPE_DATA, resp, sizeof(resp));
+    const uint8_t expected_resp[] = {0xa1, 0x62, 'o', 'k', 0xf5};
+    TEST_ASSERT_EQUAL(sizeof(expected_resp), resp_len);
+    TEST_ASSERT_EQUAL_MEMORY(expected_resp, resp, sizeof(expected_resp));
+    free(output);
+    TEST_ASSERT_EQUAL(ESP_OK, esp_rmaker_cmd_deregister(TEST_CMD_CBOR));
+}
+#endif /* CONFIG_ESP_RMAKER_CMD_CBOR */
+
+#if CONFIG_ESP_RMAKER_CMD_TRACE
+#define TEST_CMD_TRACE      (ESP_RMAKER_CMD_CUSTOM_START + 28U)
+#define TEST_CMD_UNKNOWN    (ESP_RMAKER_CMD_CUSTOM_START + 29U)
+#define TEST_TRACE_BUSY_US  3000
+
+static esp_err_t test_cmd_trace_handler(const void *in_data, size_t in_len, void **out_data, size_t *out_len,
+                                        esp_rmaker_cmd_ctx_t *ctx, void *priv)
+{
+    int64_t start = esp_timer_get_time();
+    while (esp_timer_get_time() - start < TEST_TRACE_BUSY_US) {
+    }
+    /* Fail if there is any data */
+    return in_len ? ESP_FAIL : ESP_OK;
+}
+
+TEST_CASE("ESP RainMaker Command Trace", "[rmaker_cmd_resp]")
+{
+    esp_rmaker_cmd_trace_t trace;
+    esp_rmaker_cmd_trace_reset();
+    TEST_ASSERT_EQUAL(ESP_ERR_NOT_FOUND, esp_rmaker_cmd_trace_get(TEST_CMD_TRACE, &trace));
+    TEST_ASSERT_EQUAL(ESP_OK, esp_rmaker_cmd_register(TEST_CMD_TRACE, ESP_RMAKER_USER_ROLE_PRIMARY_USER,
+                                                      test_cmd_trace_handler, false, NULL));
+    const uint8_t primary = ESP_RMAKER_USER_ROLE_PRIMARY_USER;
+    TEST_ASSERT_EQUAL(ESP_RMAKER_CMD_STATUS_SUCCESS, test_cmd_dispatch(NULL, primary, TEST_CMD_TRACE, NULL, NULL));
+    TEST_ASSERT_EQUAL(ESP_RMAKER_CMD_STATUS_SUCCESS, test_cmd_dispatch(NULL, primary, TEST_CMD_TRACE, NULL, NULL));
+    TEST_ASSERT_EQUAL(ESP_RMAKER_CMD_STATUS_FAILED, test_cmd_dispatch(NULL, primary, TEST_CMD_TRACE, "fail", NULL));
+    TEST_ASSERT_EQUAL(ESP_RMAKER_CMD_STATUS_AUTH_FAIL,
+                      test_cmd_dispatch(NULL, ESP_RMAKER_USER_ROLE_SECONDARY_USER, TEST_CMD_TRACE, NULL, NULL));
+    TEST_ASSERT_EQUAL(ESP_RMAKER_CMD_STATUS_NOT_FOUND, test_cmd_dispatch(NULL, primary, TEST_CMD_UNKNOWN, NULL, NULL));
+
+    TEST_ASSERT_EQUAL(ESP_OK, esp_rmaker_cmd_trace_get(TEST_CMD_TRACE, &trace));
+    TEST_ASSERT_EQUAL(2, trace.status[ESP_RMAKER_CMD_STATUS_SUCCESS]);
+    TEST_ASSERT_EQUAL(1, trace.status[ESP_RMAKER_CMD_STATUS_FAILED]);
+    TEST_ASSERT_EQUAL(1, trace.status[ESP_RMAKER_CMD_STATUS_AUTH_FAIL]);
+    TEST_ASSERT_EQUAL(4, trace.phases[ESP_RMAKER_CMD_TRACE_PARSE].count);
+    TEST_ASSERT_EQUAL(3, trace.phases[ESP_RMAKER_CMD_TRACE_ENCODE].count);
+    TEST_ASSERT_EQUAL(0, trace.phases[ESP_RMAKER_CMD_TRACE_DEFERRED].count);
+
+    /* The handler time lands in the bucket for TEST_TRACE_BUSY_US or above */
+    const esp_rmaker_cmd_histogram_t *hist = &trace.phases[ESP_RMAKER_CMD_TRACE_HANDLER];
+    TEST_ASSERT_EQUAL(3, hist->count);
+    TEST_ASSERT_TRUE(hist->max_us >= TEST_TRACE_BUSY_US);
+    TEST_ASSERT_TRUE(hist->total_us >= 3 * TEST_TRACE_BUSY_US);
+    uint32_t in_range = 0;
+    for (int i = 0; i < ESP_RMAKER_CMD_TRACE_BUCKETS; i++) {
+        if (ESP_RMAKER_CMD_TRACE_BUCKET_LIMIT_US(i) > TEST_TRACE_BUSY_US) {
+            in_range += hist->buckets[i];
+        }
+    }
+    TEST_ASSERT_EQUAL(3, in_range);
+    uint32_t p50 = esp_rmaker_cmd_trace_get_percentile(hist, 50);
+    TEST_ASSERT_TRUE(p50 >= TEST_TRACE_BUSY_US && p50 <= hist->max_us);
+
+    /* Unknown commands are traced too */
+    TEST_ASSERT_EQUAL(ESP_OK, esp_rmaker_cmd_trace_get(TEST_CMD_UNKNOWN, &trace));
+    TEST_ASSERT_EQUAL(1, trace.status[ESP_RMAKER_CMD_STATUS_NOT_FOUND]);
+
+    esp_rmaker_cmd_trace_t traces[4];
+    size_t count = 0;
+    TEST_ASSERT_EQUAL(ESP_OK, esp_rmaker_cmd_trace_get_all(traces, 4, &count));
+    TEST_ASSERT_EQUAL(2, count);
+    esp_rmaker_cmd_trace_log();
+
+    esp_rmaker_cmd_trace_reset();
+    TEST_ASSERT_EQUAL(ESP_ERR_NOT_FOUND, esp_rmaker_cmd_trace_get(TEST_CMD_TRACE, &trace));
+    TEST_ASSERT_EQUAL(ESP_OK, esp_rmaker_cmd_deregister(TEST_CMD_TRACE));
+}
+#endif /* CONFIG_ESP_RMAKER_CMD_TRACE */
+
+#define TEST_CMD_ORDER  (ESP_RMAKER_CMD_CUSTOM_START + 30U)
+
+static uint8_t s_order_roles[4];
+static volatile int s_order_count;
+
+static esp_err_t test_cmd_order_handler(const void *in_data, size_t in_len, void **out_data, size_t *out_len,
+                                        esp_rmaker_cmd_ctx_t *ctx, void *priv)
+{
+    xSemaphoreTake(s_slow_sem, portMAX_DELAY);
+    s_order_roles[s_order_count++] = ctx->user_role;
+    return ESP_OK;
+}
+
+TEST_CASE("ESP RainMaker Command Role Limits", "[rmaker_cmd_resp]")
+{
+    const uint8_t primary = ESP_RMAKER_USER_ROLE_PRIMARY_USER;
+    const uint8_t secondary = ESP_RMAKER_USER_ROLE_SECONDARY_USER;
+    const uint8_t sub_role = ESP_RMAKER_USER_ROLE_SECONDARY_USER | (1 << 4);
+    uint32_t count, sub_role_count;
+    esp_rmaker_cmd_role_limits_t limits = {.rate = 10, .burst = 2};
+    TEST_ASSERT_EQUAL(ESP_ERR_INVALID_ARG, esp_rmaker_cmd_set_role_limits(0, &limits));
+    TEST_ASSERT_EQUAL(ESP_ERR_INVALID_ARG, esp_rmaker_cmd_set_role_limits(ESP_RMAKER_USER_ROLE_PRIMARY_USER | secondary, &limits));
+    TEST_ASSERT_EQUAL(ESP_ERR_INVALID_ARG, esp_rmaker_cmd_set_role_limits(secondary | (3 << 4), &limits));
+    TEST_ASSERT_EQUAL(ESP_ERR_INVALID_ARG, esp_rmaker_cmd_set_role_limits(secondary, &(esp_rmaker_cmd_role_limits_t){.rate = 1}));
+    TEST_ASSERT_EQUAL(ESP_OK, esp_rmaker_cmd_register(TEST_CMD_ECHO, ESP_RMAKER_USER_ROLE_PRIMARY_USER | secondary,
+                                                      test_cmd_echo_handler, false, NULL));
+    TEST_ASSERT_EQUAL(ESP_OK, esp_rmaker_cmd_get_throttled_count(secondary, &count));
+    TEST_ASSERT_EQUAL(ESP_OK, esp_rmaker_cmd_get_throttled_count(sub_role, &sub_role_count));
+
+    /* A burst, and then throttled, even for unknown commands. Other roles are not affected. */
+    TEST_ASSERT_EQUAL(ESP_OK, esp_rmaker_cmd_set_role_limits(secondary, &limits));
+    TEST_ASSERT_EQUAL(ESP_RMAKER_CMD_STATUS_SUCCESS, test_cmd_dispatch(NULL, secondary, TEST_CMD_ECHO, NULL, NULL));
+    TEST_ASSERT_EQUAL(ESP_RMAKER_CMD_STATUS_SUCCESS, test_cmd_dispatch(NULL, secondary, TEST_CMD_ECHO, NULL, NULL));
+    TEST_ASSERT_EQUAL(ESP_RMAKER_CMD_STATUS_FAILED, test_cmd_dispatch(NULL, secondary, TEST_CMD_ECHO, NULL, NULL));
+    TEST_ASSERT_EQUAL(ESP_RMAKER_CMD_STATUS_FAILED, test_cmd_dispatch(NULL, secondary, TEST_CMD_ECHO + 1, NULL, NULL));
+    TEST_ASSERT_EQUAL(ESP_RMAKER_CMD_STATUS_SUCCESS, test_cmd_dispatch(NULL, primary, TEST_CMD_ECHO, NULL, NULL));
+
+    /* Sub-roles without their own limits share the bucket of the role */
+    TEST_ASSERT_EQUAL(ESP_RMAKER_CMD_STATUS_FAILED, test_cmd_dispatch(NULL, sub_role, TEST_CMD_ECHO, NULL, NULL));
+    limits.burst = 1;
+    TEST_ASSERT_EQUAL(ESP_OK, esp_rmaker_cmd_set_role_limits(sub_role, &limits));
+    TEST_ASSERT_EQUAL(ESP_RMAKER_CMD_STATUS_SUCCESS, test_cmd_dispatch(NULL, sub_role, TEST_CMD_ECHO, NULL, NULL));
+    TEST_ASSERT_EQUAL(ESP_RMAKER_CMD_STATUS_FAILED, test_cmd_dispatch(NULL, sub_role, TEST_CMD_ECHO, NULL, NULL));
+    TEST_ASSERT_EQUAL(ESP_RMAKER_CMD_STATUS_FAILED, test_cmd_dispatch(NULL, secondary, TEST_CMD_ECHO, NULL, NULL));
+    TEST_ASSERT_EQUAL(ESP_OK, esp_rmaker_cmd_get_throttled_count(secondary, &count));
+    TEST_ASSERT_EQUAL(ESP_OK, esp_rmaker_cmd_get_throttled_count(sub_role, &sub_role_count));
+    TEST_ASSERT_EQUAL(4, count);
+    TEST_ASSERT_EQUAL(1, sub_role_count);
+
+    /* Refilled at the average rate */
+    vTaskDelay(pdMS_TO_TICKS(150));
+    TEST_ASSERT_EQUAL(ESP_RMAKER_CMD_STATUS_SUCCESS, test_cmd_dispatch(NULL, secondary, TEST_CMD_ECHO, NULL, NULL));
+    TEST_ASSERT_EQUAL(ESP_OK, esp_rmaker_cmd_set_role_limits(secondary, NULL));
+    TEST_ASSERT_EQUAL(ESP_OK, esp_rmaker_cmd_set_role_limits(sub_role, NULL));
+    for (int i = 0; i < 5; i++) {
+        TEST_ASSERT_EQUAL(ESP_RMAKER_CMD_STATUS_SUCCESS, test_cmd_dispatch(NULL, sub_role, TEST_CMD_ECHO, NULL, NULL));
+    }
+    TEST_ASSERT_EQUAL(ESP_OK, esp_rmaker_cmd_deregister(TEST_CMD_ECHO));
+
+    /* Commands waiting for the worker pool are run in the order of the role priorities */
+    s_slow_sem = xSemaphoreCreateCounting(4, 0);
+    TEST_ASSERT_NOT_NULL(s_slow_sem);
+    TEST_ASSERT_EQUAL(ESP_OK, esp_rmaker_cmd_deferred_init(test_cmd_deferred_send, NULL));
+    TEST_ASSERT_EQUAL(ESP_OK, esp_rmaker_cmd_worker_pool_init());
+    TEST_ASSERT_EQUAL(ESP_OK, esp_rmaker_cmd_register(TEST_CMD_ORDER, ESP_RMAKER_USER_ROLE_SUPER_ADMIN | secondary |
+                                                      ESP_RMAKER_USER_ROLE_NODE, test_cmd_order_handler, false, NULL));
+    TEST_ASSERT_EQUAL(ESP_OK, esp_rmaker_cmd_set_worker_limits(TEST_CMD_ORDER, 1, 3));
+    s_sent_count = 0;
+    s_order_count = 0;
+    TEST_ASSERT_EQUAL(TEST_NO_RESPONSE, test_cmd_dispatch(NULL, secondary, TEST_CMD_ORDER, NULL, NULL));
+    TEST_ASSERT_EQUAL(TEST_NO_RESPONSE, test_cmd_dispatch(NULL, ESP_RMAKER_USER_ROLE_NODE, TEST_CMD_ORDER, NULL, NULL));
+    TEST_ASSERT_EQUAL(TEST_NO_RESPONSE, test_cmd_dispatch(NULL, secondary, TEST_CMD_ORDER, NULL, NULL));
+    TEST_ASSERT_EQUAL(TEST_NO_RESPONSE, test_cmd_dispatch(NULL, ESP_RMAKER_USER_ROLE_SUPER_ADMIN, TEST_CMD_ORDER, NULL, NULL));
+    for (int i = 0; i < 4; i++) {
+        xSemaphoreGive(s_slow_sem);
+    }
+    for (int i = 0; (i < 100) && (s_sent_count < 4); i++) {
+        vTaskDelay(pdMS_TO_TICKS(10));
+    }
+    TEST_ASSERT_EQUAL(4, s_sent_count);
+    const uint8_t expected[] = {secondary, ESP_RMAKER_USER_ROLE_SUPER_ADMIN, secondary, ESP_RMAKER_USER_ROLE_NODE};
+    TEST_ASSERT_EQUAL_MEMORY(expected, s_order_roles, sizeof(expected));
+    TEST_ASSERT_EQUAL(ESP_OK, esp_rmaker_cmd_deregister(TEST_CMD_ORDER));
+    vSemaphoreDelete(s_slow_sem);
+}
+
+#if CONFIG_ESP_RMAKER_CMD_LOCAL
+#define TEST_CMD_ADMIN  (ESP_RMAKER_CMD_CUSTOM_START + 31U)
+
+/* Build a request frame for a command, claiming the super admin role */
+static size_t test_local_request(const uint8_t *key, uint32_t seq, const char *req_id, uint16_t cmd,
+                                 const char *data, uint8_t *frame, size_t frame_size)
+{
+    uint8_t payload[128];
+    uint8_t role = ESP_RMAKER_USER_ROLE_SUPER_ADMIN;
+    uint8_t cmd_buf[2] = {cmd & 0xff, cmd >> 8};
+    size_t len = 0;
+    len = test_tlv_add(payload, len, ESP_RMAKER_TLV_TYPE_REQ_ID, req_id, strlen(req_id));
+    len = test_tlv_add(payload, len, ESP_RMAKER_TLV_TYPE_USER_ROLE, &role, sizeof(role));
+    len = test_tlv_add(payload, len, ESP_RMAKER_TLV_TYPE_CMD, cmd_buf, sizeof(cmd_buf));
+    len = test_tlv_add(payload, len, ESP_RMAKER_TLV_TYPE_DATA, data, strlen(data));
+    size_t frame_len = 0;
+    TEST_ASSERT_EQUAL(ESP_OK, esp_rmaker_cmd_local_frame_encode(key, ESP_RMAKER_CMD_LOCAL_FRAME_REQUEST, seq,
+                                                                payload, len, frame, frame_size, &frame_len));
+    return frame_len;
+}
+
+/* Connect a client socket to the local transport, over loopback */
+static int test_local_connect(int type, uint16_t port)
+{
+    int fd = socket(AF_INET, type, 0);
+    TEST_ASSERT_TRUE(fd >= 0);
+    struct sockaddr_in addr = {
+        .sin_family = AF_INET,
+        .sin_port = htons(port),
+        .sin_addr.s_addr = htonl(INADDR_LOOPBACK),
+    };
+    struct timeval timeout = {
+        .tv_sec = 0,
+        .tv_usec = 300 * 1000,
+    };
+    setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
+    TEST_ASSERT_EQUAL(0, connect(fd, (struct sockaddr *)&addr, sizeof(addr)));
+    return fd;
+}
+
+/* Authenticate a response frame and get the status and data in it */
+static uint8_t test_local_response(const uint8_t *key, const uint8_t *frame, int frame_len, uint32_t seq,
+                                   uint8_t *data, size_t data_size)
+{
+    uint8_t type;
+    uint32_t resp_seq;
+    const void *payload;
+    size_t payload_len;
+    uint8_t status = TEST_NO_RESPONSE;
+    TEST_ASSERT_TRUE(frame_len > 0);
+    TEST_ASSERT_EQUAL(ESP_OK, esp_rmaker_cmd_local_frame_decode(key, frame, frame_len, &type, &resp_seq,
+                                                                &payload, &payload_len));
+    TEST_ASSERT_EQUAL(ESP_RMAKER_CMD_LOCAL_FRAME_RESPONSE, type);
+    TEST_ASSERT_EQUAL(seq, resp_seq);
+    TEST_ASSERT_EQUAL(1, test_tlv_get(payload, payload_len, ESP_RMAKER_TLV_TYPE_STATUS, &status, sizeof(status)));
+    if (data) {
+        memset(data, 0, data_size);
+        test_tlv_get(payload, payload_len, ESP_RMAKER_TLV_TYPE_DATA, data, data_size);
+    }
+    return status;
+}
+
+/* Read a length prefixed frame from a TCP connection */
+static int test_local_tcp_read(int fd, uint8_t *frame, size_t frame_size)
+{
+    uint8_t prefix[2];
+    if (recv(fd, prefix, sizeof(prefix), MSG_WAITALL) != sizeof(prefix)) {
+        return -1;
+    }
+    size_t len = prefix[0] | (prefix[1] << 8);
+    TEST_ASSERT_TRUE(len <= frame_size);
+    return recv(fd, frame, len, MSG_WAITALL);
+}
+
+/* Get the nonce with a HELLO, and derive the session key from it */
+static void test_local_session(int fd, bool tcp, const uint8_t *key, uint32_t seq, uint8_t *session_key)
+{
+    uint8_t frame[64];
+    uint8_t type;
+    uint32_t resp_seq;
+    const void *payload;
+    size_t payload_len;
+    size_t len = 0;
+    TEST_ASSERT_EQUAL(ESP_OK, esp_rmaker_cmd_local_frame_encode(key, ESP_RMAKER_CMD_LOCAL_FRAME_HELLO, seq, NULL, 0,
+                                                                frame + 2, sizeof(frame) - 2, &len));
+    frame[0] = len & 0xff;
+    frame[1] = len >> 8;
+    TEST_ASSERT_EQUAL(len, tcp ? send(fd, frame, len + 2, 0) - 2 : send(fd, frame + 2, len, 0));
+    int resp_len = tcp ? test_local_tcp_read(fd, frame, sizeof(frame)) : recv(fd, frame, sizeof(frame), 0);
+    TEST_ASSERT_TRUE(resp_len > 0);
+    TEST_ASSERT_EQUAL(ESP_OK, esp_rmaker_cmd_local_frame_decode(key, frame, resp_len, &type, &resp_seq,
+                                                                &payload, &payload_len));
+    TEST_ASSERT_EQUAL(ESP_RMAKER_CMD_LOCAL_FRAME_HELLO, type);
+    TEST_ASSERT_EQUAL(seq, resp_seq);
+    TEST_ASSERT_EQUAL(ESP_RMAKER_CMD_LOCAL_NONCE_LEN, payload_len);
+    TEST_ASSERT_EQUAL(ESP_OK, esp_rmaker_cmd_local_session_key(key, payload, session_key));
+}
+
+TEST_CASE("ESP RainMaker Command Local Transport", "[rmaker_cmd_resp]")
+{
+    uint8_t key[ESP_RMAKER_CMD_LOCAL_KEY_LEN];
+    uint8_t new_key[ESP_RMAKER_CMD_LOCAL_KEY_LEN];
+    for (int i = 0; i < ESP_RMAKER_CMD_LOCAL_KEY_LEN; i++) {
+        key[i] = i;
+        new_key[i] = ~i;
+    }
+    uint8_t skey[ESP_RMAKER_CMD_LOCAL_KEY_LEN];
+    uint8_t old_skey[ESP_RMAKER_CMD_LOCAL_KEY_LEN];
+    uint8_t old_frame[256];
+    size_t old_len;
+    uint8_t frame[256];
+    uint8_t resp[256];
+    uint8_t data[16];
+    uint16_t port = 0;
+    size_t len;
+    TEST_ASSERT_EQUAL(ESP_OK, esp_rmaker_cmd_register(TEST_CMD_ECHO, ESP_RMAKER_USER_ROLE_PRIMARY_USER,
+                                                      test_cmd_echo_handler, false, NULL));
+    TEST_ASSERT_EQUAL(ESP_OK, esp_rmaker_cmd_register(TEST_CMD_ADMIN, ESP_RMAKER_USER_ROLE_SUPER_ADMIN,
+                                                      test_cmd_echo_handler, false, NULL));
+    esp_rmaker_cmd_local_config_t config = {
+        .proto = ESP_RMAKER_CMD_LOCAL_UDP,
+        .user_role = ESP_RMAKER_USER_ROLE_PRIMARY_USER,
+    };
+    memcpy(config.key, key, sizeof(key));
+    TEST_ASSERT_EQUAL(ESP_ERR_INVALID_STATE, esp_rmaker_cmd_local_stop());
+    TEST_ASSERT_EQUAL(ESP_OK, esp_rmaker_cmd_local_start(&config));
+    TEST_ASSERT_EQUAL(ESP_ERR_INVALID_STATE, esp_rmaker_cmd_local_start(&config));
+    TEST_ASSERT_EQUAL(ESP_OK, esp_rmaker_cmd_local_get_port(&port));
+    TEST_ASSERT_NOT_EQUAL(0, port);
+    int fd = test_local_connect(SOCK_DGRAM, port);
+
+    /* Round trip over UDP, with the session key from the nonce */
+    test_local_session(fd, false, key, 0x1234, skey);
+    len = test_local_request(skey, 1, "local_1", TEST_CMD_ECHO, "hello", frame, sizeof(frame));
+    TEST_ASSERT_EQUAL(len, send(fd, frame, len, 0));
+    int resp_len = recv(fd, resp, sizeof(resp), 0);
+    TEST_ASSERT_EQUAL(ESP_RMAKER_CMD_STATUS_SUCCESS, test_local_response(skey, resp, resp_len, 1, data, sizeof(data)));
+    TEST_ASSERT_EQUAL_STRING("hello", (char *)data);
+    memcpy(old_skey, skey, sizeof(skey));
+    memcpy(old_frame, frame, len);
+    old_len = len;
+
+    /* The role comes from the session, and not from the command */
+    len = test_local_request(skey, 2, "local_2", TEST_CMD_ADMIN, "", frame, sizeof(frame));
+    TEST_ASSERT_EQUAL(len, send(fd, frame, len, 0));
+    resp_len = recv(fd, resp, sizeof(resp), 0);
+    TEST_ASSERT_EQUAL(ESP_RMAKER_CMD_STATUS_AUTH_FAIL, test_local_response(skey, resp, resp_len, 2, NULL, 0));
+
+    /* Replayed and unauthenticated frames are dropped, including those with the shared key itself */
+    TEST_ASSERT_EQUAL(len, send(fd, frame, len, 0));
+    TEST_ASSERT_TRUE(recv(fd, resp, sizeof(resp), 0) < 0);
+    len = test_local_request(key, 3, "local_3", TEST_CMD_ECHO, "x", frame, sizeof(frame));
+    TEST_ASSERT_EQUAL(len, send(fd, frame, len, 0));
+    TEST_ASSERT_TRUE(recv(fd, resp, sizeof(resp), 0) < 0);
+    len = test_local_request(new_key, 3, "local_3", TEST_CMD_ECHO, "x", frame, sizeof(frame));
+    TEST_ASSERT_EQUAL(len, send(fd, frame, len, 0));
+    TEST_ASSERT_TRUE(recv(fd, resp, sizeof(resp), 0) < 0);
+    frame[ESP_RMAKER_CMD_LOCAL_HEADER_LEN] ^= 1;
+    TEST_ASSERT_EQUAL(len, send(fd, frame, len, 0));
+    TEST_ASSERT_TRUE(recv(fd, resp, sizeof(resp), 0) < 0);
+
+    /* Out of order, within the window */
+    len = test_local_request(skey, 10, "local_10", TEST_CMD_ECHO, "a", frame, sizeof(frame));
+    TEST_ASSERT_EQUAL(len, send(fd, frame, len, 0));
+    resp_len = recv(fd, resp, sizeof(resp), 0);
+    TEST_ASSERT_EQUAL(ESP_RMAKER_CMD_STATUS_SUCCESS, test_local_response(skey, resp, resp_len, 10, NULL, 0));
+    len = test_local_request(skey, 5, "local_5", TEST_CMD_ECHO, "b", frame, sizeof(frame));
+    TEST_ASSERT_EQUAL(len, send(fd, frame, len, 0));
+    resp_len = recv(fd, resp, sizeof(resp), 0);
+    TEST_ASSERT_EQUAL(ESP_RMAKER_CMD_STATUS_SUCCESS, test_local_response(skey, resp, resp_len, 5, NULL, 0));
+
+    /* Only the new key works after it is changed, and the sequence numbers start afresh */
+    TEST_ASSERT_EQUAL(ESP_ERR_INVALID_ARG, esp_rmaker_cmd_local_set_key(NULL));
+    TEST_ASSERT_EQUAL(ESP_OK, esp_rmaker_cmd_local_set_key(new_key));
+    len = test_local_request(skey, 11, "local_11", TEST_CMD_ECHO, "c", frame, sizeof(frame));
+    TEST_ASSERT_EQUAL(len, send(fd, frame, len, 0));
+    TEST_ASSERT_TRUE(recv(fd, resp, sizeof(resp), 0) < 0);
+    test_local_session(fd, false, new_key, 0x5678, skey);
+    len = test_local_request(skey, 1, "local_new_1", TEST_CMD_ECHO, "d", frame, sizeof(frame));
+    TEST_ASSERT_EQUAL(len, send(fd, frame, len, 0));
+    resp_len = recv(fd, resp, sizeof(resp), 0);
+    TEST_ASSERT_EQUAL(ESP_RMAKER_CMD_STATUS_SUCCESS, test_local_response(skey, resp, resp_len, 1, NULL, 0));
+
+    /* A key can be used again, since the nonce is not. Frames from its earlier session are dropped. */
+    TEST_ASSERT_EQUAL(ESP_OK, esp_rmaker_cmd_local_set_key(key));
+    TEST_ASSERT_EQUAL(old_len, send(fd, old_frame, old_len, 0));
+    TEST_ASSERT_TRUE(recv(fd, resp, sizeof(resp), 0) < 0);
+    test_local_session(fd, false, key, 0x9abc, skey);
+    TEST_ASSERT_NOT_EQUAL(0, memcmp(old_skey, skey, sizeof(skey)));
+    len = test_local_request(skey, 1, "local_again_1", TEST_CMD_ECHO, "e", frame, sizeof(frame));
+    TEST_ASSERT_EQUAL(len, send(fd, frame, len, 0));
+    resp_len = recv(fd, resp, sizeof(resp), 0);
+    TEST_ASSERT_EQUAL(ESP_RMAKER_CMD_STATUS_SUCCESS, test_local_response(skey, resp, resp_len, 1, NULL, 0));
+    close(fd);
+    TEST_ASSERT_EQUAL(ESP_OK, esp_rmaker_cmd_local_stop());
+    TEST_ASSERT_EQUAL(ESP_ERR_INVALID_STATE, esp_rmaker_cmd_local_get_port(&port));
+
+    /* The same key works after a restart, with a fresh nonce.
+     * Over TCP, two frames sent together, and split at an odd place.
+     */
+    config.proto = ESP_RMAKER_CMD_LOCAL_TCP;
+    TEST_ASSERT_EQUAL(ESP_OK, esp_rmaker_cmd_local_start(&config));
+    TEST_ASSERT_EQUAL(ESP_OK, esp_rmaker_cmd_local_get_port(&port));
+    fd = test_local_connect(SOCK_STREAM, port);
+    test_local_session(fd, true, key, 0xdef0, skey);
+    TEST_ASSERT_NOT_EQUAL(0, memcmp(old_skey, skey, sizeof(skey)));
+    uint8_t stream[2 * sizeof(frame)];
+    size_t stream_len = 0;
+    for (uint32_t seq = 1; seq <= 2; seq++) {
+        len = test_local_request(skey, seq, seq == 1 ? "local_tcp_1" : "local_tcp_2", TEST_CMD_ECHO, "tcp",
+                                 stream + stream_len + 2, sizeof(stream) - stream_len - 2);
+        stream[stream_len] = len & 0xff;
+        stream[stream_len + 1] = len >> 8;
+        stream_len += len + 2;
+    }
+    TEST_ASSERT_EQUAL(5, send(fd, stream, 5, 0));
+    vTaskDelay(pdMS_TO_TICKS(20));
+    TEST_ASSERT_EQUAL(stream_len - 5, send(fd, stream + 5, stream_len - 5, 0));
+    for (uint32_t seq = 1; seq <= 2; seq++) {
+        resp_len = test_local_tcp_read(fd, resp, sizeof(resp));
+        TEST_ASSERT_EQUAL(ESP_RMAKER_CMD_STATUS_SUCCESS, test_local_response(skey, resp, resp_len, seq, data, sizeof(data)));
+        TEST_ASSERT_EQUAL_STRING("tcp", (char *)data);
+    }
+    close(fd);
+    TEST_ASSERT_EQUAL(ESP_OK, esp_rmaker_cmd_local_stop());
+    TEST_ASSERT_EQUAL(ESP_OK, esp_rmaker_cmd_deregister(TEST_CMD_ECHO));
+    TEST_ASSERT_EQUAL(ESP_OK, esp_rmaker_cmd_deregister(TEST_CMD_ADMIN));
+}
+#endif /* CONFIG_ESP_RMAKER_CMD_LOCAL */
+
+#define TEST_CMD_CACHED (ESP_RMAKER_CMD_CUSTOM_START + 32U)
+
+TEST_CASE("ESP RainMaker Command Response Cache", "[rmaker_cmd_resp]")
+{
+    TEST_ASSERT_EQUAL(ESP_OK, esp_rmaker_cmd_register_with_flags(TEST_CMD_CACHED,
+                                                                 ESP_RMAKER_USER_ROLE_PRIMARY_USER | ESP_RMAKER_USER_ROLE_SECONDARY_USER,
+                                                                 test_cmd_count_handler, false,
+                                                                 ESP_RMAKER_CMD_FLAG_CACHEABLE, NULL));
+    TEST_ASSERT_EQUAL(ESP_ERR_INVALID_ARG, esp_rmaker_cmd_set_cache_ttl(TEST_CMD_CACHED + 1, 100));
+    TEST_ASSERT_EQUAL(ESP_ERR_INVALID_ARG, esp_rmaker_cmd_cache_invalidate(TEST_CMD_CACHED + 1));
+
+    uint8_t primary = ESP_RMAKER_USER_ROLE_PRIMARY_USER;
+    uint8_t secondary = ESP_RMAKER_USER_ROLE_SECONDARY_USER;
+
+    /* Cached per request data, with the request id of each request */
+    uint8_t count = test_cmd_count_dispatch("cache_1", primary, TEST_CMD_CACHED, "a");
+    TEST_ASSERT_EQUAL(count, test_cmd_count_dispatch("cache_2", primary, TEST_CMD_CACHED, "a"));
+    TEST_ASSERT_EQUAL(count + 1, test_cmd_count_dispatch("cache_3", primary, TEST_CMD_CACHED, "b"));
+    TEST_ASSERT_EQUAL(count + 1, test_cmd_count_dispatch("cache_4_with_a_longer_req_id", primary, TEST_CMD_CACHED, "b"));
+
+    /* Not shared with another role */
+    TEST_ASSERT_EQUAL(count + 2, test_cmd_count_dispatch("cache_role_1", secondary, TEST_CMD_CACHED, "b"));
+    TEST_ASSERT_EQUAL(count + 2, test_cmd_count_dispatch("cache_role_2", secondary, TEST_CMD_CACHED, "b"));
+    TEST_ASSERT_EQUAL(count + 3, test_cmd_count_dispatch("cache_role_3", primary, TEST_CMD_CACHED, "b"));
+    count += 2;
+
+    /* Invalidated */
+    TEST_ASSERT_EQUAL(ESP_OK, esp_rmaker_cmd_cache_invalidate(TEST_CMD_CACHED));
+    TEST_ASSERT_EQUAL(count + 2, test_cmd_count_dispatch("cache_5", primary, TEST_CMD_CACHED, "b"));
+    TEST_ASSERT_EQUAL(count + 2, test_cmd_count_dispatch("cache_6", primary, TEST_CMD_CACHED, "b"));
+    TEST_ASSERT_EQUAL(ESP_OK, esp_rmaker_cmd_cache_invalidate(0));
+    TEST_ASSERT_EQUAL(count + 3, test_cmd_count_dispatch("cache_7", primary, TEST_CMD_CACHED, "b"));
+
+    /* Expired */
+    TEST_ASSERT_EQUAL(ESP_OK, esp_rmaker_cmd_set_cache_ttl(TEST_CMD_CACHED, 50));
+    TEST_ASSERT_EQUAL(count + 3, test_cmd_count_dispatch("cache_8", primary, TEST_CMD_CACHED, "b"));
+    vTaskDelay(pdMS_TO_TICKS(100));
+    TEST_ASSERT_EQUAL(count + 4, test_cmd_count_dispatch("cache_9", primary, TEST_CMD_CACHED, "b"));
+
+    /* Disabled */
+    TEST_ASSERT_EQUAL(ESP_OK, esp_rmaker_cmd_set_cache_ttl(TEST_CMD_CACHED, 0));
+    TEST_ASSERT_EQUAL(count + 5, test_cmd_count_dispatch("cache_10", primary, TEST_CMD_CACHED, "b"));
+    TEST_ASSERT_EQUAL(count + 6, test_cmd_count_dispatch("cache_11", primary, TEST_CMD_CACHED, "b"));
+    TEST_ASSERT_EQUAL(ESP_OK, esp_rmaker_cmd_set_cache_ttl(TEST_CMD_CACHED, 1000));
+    TEST_ASSERT_EQUAL(count + 7, test_cmd_count_dispatch("cache_12", primary, TEST_CMD_CACHED, "b"));
+    TEST_ASSERT_EQUAL(count + 7, test_cmd_count_dispatch("cache_13", primary, TEST_CMD_CACHED, "b"));
+    TEST_ASSERT_EQUAL(ESP_OK, esp_rmaker_cmd_deregister(TEST_CMD_CACHED));
+}
+
+static void *s_parse_output;
+static size_t s_parse_output_len;
+
+/* Transport for esp_rmaker_cmd_resp_test_send(), which handles the command right away */
+static esp_err_t test_cmd_parse_send(const void *data, size_t data_len, void *priv)
+{
+    return esp_rmaker_cmd_response_handler(data, data_len, &s_parse_output, &s_parse_output_len);
+}
+
+TEST_CASE("ESP RainMaker Command Response Parser", "[rmaker_cmd_resp]")
+{
+    static uint8_t data[600];
+    static uint8_t copy[600];
+    for (int i = 0; i < sizeof(data); i++) {
+        data[i] = (uint8_t)(i * 3);
+    }
+    TEST_ASSERT_EQUAL(ESP_OK, esp_rmaker_cmd_register(TEST_CMD_ECHO, ESP_RMAKER_USER_ROLE_PRIMARY_USER,
+                                                      test_cmd_echo_handler, false, NULL));
+
+    /* Data larger than a single record goes out and comes back without any limit */
+    TEST_ASSERT_EQUAL(ESP_OK, esp_rmaker_cmd_resp_test_send("parse_1", ESP_RMAKER_USER_ROLE_PRIMARY_USER, TEST_CMD_ECHO,
+                                                            data, sizeof(data), test_cmd_parse_send, NULL));
+    TEST_ASSERT_NOT_NULL(s_parse_output);
+    esp_rmaker_cmd_response_t parsed;
+    TEST_ASSERT_EQUAL(ESP_OK, esp_rmaker_cmd_parse_response(s_parse_output, s_parse_output_len, &parsed));
+    TEST_ASSERT_EQUAL_STRING("parse_1", parsed.req_id);
+    TEST_ASSERT_EQUAL(TEST_CMD_ECHO, parsed.cmd);
+    TEST_ASSERT_EQUAL(ESP_RMAKER_CMD_STATUS_SUCCESS, parsed.status);
+    TEST_ASSERT_EQUAL(ESP_RMAKER_CMD_CONTENT_TYPE_UNSPECIFIED, parsed.content_type);
+    TEST_ASSERT_EQUAL(sizeof(data), parsed.data.len);
+    /* The data is not copied */
+    TEST_ASSERT_TRUE(parsed.data.tlv > (const uint8_t *)s_parse_output);
+    TEST_ASSERT_TRUE(parsed.data.tlv < (const uint8_t *)s_parse_output + s_parse_output_len);
+    TEST_ASSERT_NULL(esp_rmaker_cmd_data_view_get_ptr(&parsed.data));
+    TEST_ASSERT_EQUAL(sizeof(copy), esp_rmaker_cmd_data_view_copy(&parsed.data, copy, sizeof(copy)));
+    TEST_ASSERT_EQUAL_MEMORY(data, copy, sizeof(data));
+    TEST_ASSERT_EQUAL(ESP_OK, esp_rmaker_cmd_resp_parse_response(s_parse_output, s_parse_output_len, NULL));
+    free(s_parse_output);
+    s_parse_output = NULL;
+
+    /* Failure status and content type, without data */
+    void *output = NULL;
+    size_t output_len = 0;
+    TEST_ASSERT_EQUAL(ESP_OK, esp_rmaker_cmd_prepare_payload_with_type("parse_2", 0, ESP_RMAKER_CMD_STATUS_FAILED,
+                                                                       TEST_CMD_ECHO, ESP_RMAKER_CMD_CONTENT_TYPE_CBOR,
+                                                                       NULL, 0, &output, &output_len));
+    TEST_ASSERT_EQUAL(ESP_OK, esp_rmaker_cmd_parse_response(output, output_len, &parsed));
+    TEST_ASSERT_EQUAL_STRING("parse_2", parsed.req_id);
+    TEST_ASSERT_EQUAL(ESP_RMAKER_CMD_STATUS_FAILED, parsed.status);
+    TEST_ASSERT_EQUAL(ESP_RMAKER_CMD_CONTENT_TYPE_CBOR, parsed.content_type);
+    TEST_ASSERT_EQUAL(0, parsed.data.len);
+    TEST_ASSERT_NULL(parsed.data.tlv);
+
+    /* Batches have to be split first */
+    uint8_t batch[128];
+    size_t batch_len = 0;
+    TEST_ASSERT_EQUAL(ESP_OK, esp_rmaker_cmd_batch_add(batch, sizeof(batch), &batch_len, output, output_len));
+    TEST_ASSERT_EQUAL(ESP_ERR_NOT_SUPPORTED, esp_rmaker_cmd_parse_response(batch, batch_len, &parsed));
+    size_t offset = 0;
+    esp_rmaker_cmd_data_view_t record;
+    TEST_ASSERT_TRUE(esp_rmaker_cmd_batch_get_next(batch, batch_len, &offset, &record));
+    TEST_ASSERT_EQUAL(ESP_OK, esp_rmaker_cmd_parse_response(esp_rmaker_cmd_data_view_get_ptr(&record), record.len,
+                                                            &parsed));
+    TEST_ASSERT_EQUAL_STRING("parse_2", parsed.req_id);
+
+    /* Invalid responses */
+    TEST_ASSERT_EQUAL(ESP_ERR_INVALID_ARG, esp_rmaker_cmd_parse_response(NULL, 0, &parsed));
+    TEST_ASSERT_EQUAL(ESP_ERR_INVALID_ARG, esp_rmaker_cmd_parse_response(output, output_len, NULL));
+    uint8_t invalid[64];
+    size_t len = test_tlv_add(invalid, 0, ESP_RMAKER_TLV_TYPE_REQ_ID, "parse_3", 7);
+    uint8_t cmd_buf[2] = {TEST_CMD_ECHO & 0xff, TEST_CMD_ECHO >> 8};
+    len = test_tlv_add(invalid, len, ESP_RMAKER_TLV_TYPE_CMD, cmd_buf, sizeof(cmd_buf));
+    /* No status */
+    TEST_ASSERT_EQUAL(ESP_ERR_INVALID_RESPONSE, esp_rmaker_cmd_parse_response(invalid, len, &parsed));
+    uint8_t status = ESP_RMAKER_CMD_STATUS_SUCCESS;
+    size_t valid_len = test_tlv_add(invalid, len, ESP_RMAKER_TLV_TYPE_STATUS, &status, sizeof(status));
+    TEST_ASSERT_EQUAL(ESP_OK, esp_rmaker_cmd_parse_response(invalid, valid_len, &parsed));
+    /* Truncated status */
+    TEST_ASSERT_EQUAL(ESP_ERR_INVALID_RESPONSE, esp_rmaker_cmd_parse_response(invalid, valid_len - 1, &parsed));
+    /* Request id too long */
+    char long_req_id[REQ_ID_LEN + 1];
+    memset(long_req_id, 'a', REQ_ID_LEN);
+    long_req_id[REQ_ID_LEN] = '\0';
+    len = test_tlv_add(invalid, 0, ESP_RMAKER_TLV_TYPE_REQ_ID, long_req_id, REQ_ID_LEN);
+    len = test_tlv_add(invalid, len, ESP_RMAKER_TLV_TYPE_CMD, cmd_buf, sizeof(cmd_buf));
+    len = test_tlv_add(invalid, len, ESP_RMAKER_TLV_TYPE_STATUS, &status, sizeof(status));
+    TEST_ASSERT_EQUAL(ESP_ERR_INVALID_RESPONSE, esp_rmaker_cmd_parse_response(invalid, len, &parsed));
+    free(output);
+    TEST_ASSERT_EQUAL(ESP_OK, esp_rmaker_cmd_deregister(TEST_CMD_ECHO));
+}
+
+#define TEST_CMD_MIDDLEWARE         (ESP_RMAKER_CMD_CUSTOM_START + 33U)
+#define TEST_CMD_NO_MIDDLEWARE      (ESP_RMAKER_CMD_CUSTOM_START + 34U)
+
+/* Middleware stay for the commands registered after them, so they only act while enabled */
+static bool s_middleware_enabled;
+static char s_middleware_log[16];
+static uint8_t s_middleware_status;
+
+static void test_middleware_log(char c)
+{
+    size_t len = strlen(s_middleware_log);
+    if (len < (sizeof(s_middleware_log) - 1)) {
+        s_middleware_log[len] = c;
+    }
+}
+
+/* Validation: rejects commands without data */
+static esp_rmaker_cmd_status_t test_middleware_validate_pre(const esp_rmaker_cmd_data_view_t *data,
+                                                            esp_rmaker_cmd_ctx_t *ctx, void *priv)
+{
+    if (!s_middleware_enabled) {
+        return ESP_RMAKER_CMD_STATUS_SUCCESS;
+    }
+    test_middleware_log('v');
+    return (data->len > 0) ? ESP_RMAKER_CMD_STATUS_SUCCESS : ESP_RMAKER_CMD_STATUS_CMD_INVALID;
+}
+
+static void test_middleware_validate_post(const esp_rmaker_cmd_data_view_t *data, const esp_rmaker_cmd_ctx_t *ctx,
+                                          uint8_t status, void *priv)
+{
+    if (s_middleware_enabled) {
+        test_middleware_log('V');
+    }
+}
+
+/* Metrics: records the status, and sets the response content type for the handler */
+static esp_rmaker_cmd_status_t test_middleware_metrics_pre(const esp_rmaker_cmd_data_view_t *data,
+                                                           esp_rmaker_cmd_ctx_t *ctx, void *priv)
+{
+    if (s_middleware_enabled) {
+        test_middleware_log('m');
+        ctx->resp_content_type = ESP_RMAKER_CMD_CONTENT_TYPE_JSON;
+    }
+    return ESP_RMAKER_CMD_STATUS_SUCCESS;
+}
+
+static void test_middleware_metrics_post(const esp_rmaker_cmd_data_view_t *data, const esp_rmaker_cmd_ctx_t *ctx,
+                                         uint8_t status, void *priv)
+{
+    if (s_middleware_enabled) {
+        test_middleware_log('M');
+        s_middleware_status = status;
+    }
+}
+
+static esp_err_t test_cmd_middleware_handler(const void *in_data, size_t in_len, void **out_data, size_t *out_len,
+                                             esp_rmaker_cmd_ctx_t *ctx, void *priv)
+{
+    test_middleware_log('h');
+    *out_data = "{}";
+    *out_len = 2;
+    return (in_len == 4 && memcmp(in_data, "fail", 4) == 0) ? ESP_FAIL : ESP_OK;
+}
+
+TEST_CASE("ESP RainMaker Command Middleware", "[rmaker_cmd_resp]")
+{
+    static const esp_rmaker_cmd_middleware_t validate = {
+        .pre = test_middleware_validate_pre,
+        .post = test_middleware_validate_post,
+    };
+    static const esp_rmaker_cmd_middleware_t metrics = {
+        .pre = test_middleware_metrics_pre,
+        .post = test_middleware_metrics_post,
+    };
+    esp_rmaker_cmd_middleware_t empty = {0};
+    const uint8_t primary = ESP_RMAKER_USER_ROLE_PRIMARY_USER;
+    test_cmd_resp_t resp;
+
+    TEST_ASSERT_EQUAL(ESP_ERR_INVALID_ARG, esp_rmaker_cmd_middleware_add(NULL));
+    TEST_ASSERT_EQUAL(ESP_ERR_INVALID_ARG, esp_rmaker_cmd_middleware_add(&empty));
+    TEST_ASSERT_EQUAL(ESP_OK, esp_rmaker_cmd_register(TEST_CMD_NO_MIDDLEWARE, ESP_RMAKER_USER_ROLE_PRIMARY_USER,
+                                                      test_cmd_middleware_handler, false, NULL));
+    TEST_ASSERT_EQUAL(ESP_OK, esp_rmaker_cmd_middleware_add(&validate));
+    TEST_ASSERT_EQUAL(ESP_OK, esp_rmaker_cmd_middleware_add(&metrics));
+    TEST_ASSERT_EQUAL(ESP_OK, esp_rmaker_cmd_register(TEST_CMD_MIDDLEWARE, ESP_RMAKER_USER_ROLE_PRIMARY_USER,
+                                                      test_cmd_middleware_handler, false, NULL));
+    s_middleware_enabled = true;
+
+    /* Pre hooks in order, then the handler, then post hooks in reverse order */
+    memset(s_middleware_log, 0, sizeof(s_middleware_log));
+    TEST_ASSERT_EQUAL(ESP_RMAKER_CMD_STATUS_SUCCESS, test_cmd_dispatch("mw_1", primary, TEST_CMD_MIDDLEWARE, "{}", &resp));
+    TEST_ASSERT_EQUAL_STRING("vmhMV", s_middleware_log);
+    TEST_ASSERT_EQUAL(ESP_RMAKER_CMD_STATUS_SUCCESS, s_middleware_status);
+    TEST_ASSERT_EQUAL(ESP_RMAKER_CMD_CONTENT_TYPE_JSON, resp.content_type);
+
+    /* Handler failure is seen by the post hooks */
+    memset(s_middleware_log, 0, sizeof(s_middleware_log));
+    TEST_ASSERT_EQUAL(ESP_RMAKER_CMD_STATUS_FAILED, test_cmd_dispatch("mw_2", primary, TEST_CMD_MIDDLEWARE, "fail", &resp));
+    TEST_ASSERT_EQUAL_STRING("vmhMV", s_middleware_log);
+    TEST_ASSERT_EQUAL(ESP_RMAKER_CMD_STATUS_FAILED, s_middleware_status);
+
+    /* Rejected by the first middleware, without running the rest or the handler */
+    s_middleware_status = ESP_RMAKER_CMD_STATUS_SUCCESS;
+    memset(s_middleware_log, 0, sizeof(s_middleware_log));
+    TEST_ASSERT_EQUAL(ESP_RMAKER_CMD_STATUS_CMD_INVALID, test_cmd_dispatch("mw_3", primary, TEST_CMD_MIDDLEWARE, "", &resp));
+    TEST_ASSERT_EQUAL_STRING("vV", s_middleware_log);
+    TEST_ASSERT_EQUAL(ESP_RMAKER_CMD_STATUS_SUCCESS, s_middleware_status);
+
+    /* Not part of the chain of a command registered before it */
+    memset(s_middleware_log, 0, sizeof(s_middleware_log));
+    TEST_ASSERT_EQUAL(ESP_RMAKER_CMD_STATUS_SUCCESS, test_cmd_dispatch("mw_4", primary, TEST_CMD_NO_MIDDLEWARE, "", &resp));
+    TEST_ASSERT_EQUAL_STRING("h", s_middleware_log);
+    TEST_ASSERT_EQUAL(ESP_RMAKER_CMD_CONTENT_TYPE_UNSPECIFIED, resp.content_type);
+
+    s_middleware_enabled = false;
+    TEST_ASSERT_EQUAL(ESP_OK, esp_rmaker_cmd_deregister(TEST_CMD_MIDDLEWARE));
+    TEST_ASSERT_EQUAL(ESP_OK, esp_rmaker_cmd_deregister(TEST_CMD_NO_MIDDLEWARE));
+}
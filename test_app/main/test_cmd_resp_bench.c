@@ -0,0 +1,278 @@
+/*
+ * SPDX-FileCopyrightText: 2026 Espressif Systems (Shanghai) CO LTD
+ *
+ * SPDX-License-Identifier: Apache-2.0
+ */
+
+/* Benchmark and fuzz tests for the command-response TLV codec.
+ *
+ * The benchmark reports commands/s, buffers allocated and payload bytes copied per command across
+ * payload sizes, including the 255 byte TLV continuation boundaries. The allocation and copy
+ * counts need CONFIG_ESP_RMAKER_CMD_RESP_STATS, which is enabled in sdkconfig.ci.linux.
+ */
+
+#include <stdio.h>
+#include <string.h>
+#include <stdlib.h>
+#include <inttypes.h>
+#include "sdkconfig.h"
+#include "unity.h"
+#include "esp_log.h"
+#include "esp_timer.h"
+#include "esp_rmaker_cmd_resp.h"
+#include "esp_rmaker_cmd_cbor.h"
+
+#define BENCH_CMD_ECHO      (ESP_RMAKER_CMD_CUSTOM_START + 40U)
+#define BENCH_CMD_VIEW      (ESP_RMAKER_CMD_CUSTOM_START + 41U)
+#define BENCH_REQ_ID        "bench_00000000"
+#define BENCH_TAG           "esp_rmaker_common_cmd_resp"
+
+#if CONFIG_IDF_TARGET_LINUX
+#define BENCH_MAX_SIZE      (64 * 1024)
+#define BENCH_TIME_US       (200 * 1000)
+#define FUZZ_ITERATIONS     50000
+#else
+/* Keep the buffers within the internal RAM of the smaller targets */
+#define BENCH_MAX_SIZE      (4 * 1024)
+#define BENCH_TIME_US       (100 * 1000)
+#define FUZZ_ITERATIONS     5000
+#endif
+
+static esp_err_t bench_echo_handler(const void *in_data, size_t in_len, void **out_data, size_t *out_len,
+                                    esp_rmaker_cmd_ctx_t *ctx, void *priv)
+{
+    *out_data = (void *)in_data;
+    *out_len = in_len;
+    return ESP_OK;
+}
+
+/* Walks all the segments, like a handler consuming the data in place would */
+static esp_err_t bench_view_handler(const void *in_data, size_t in_len, void **out_data, size_t *out_len,
+                                    esp_rmaker_cmd_ctx_t *ctx, void *priv)
+{
+    esp_rmaker_cmd_data_iter_t iter;
+    const void *segment;
+    size_t segment_len;
+    size_t total = 0;
+    esp_rmaker_cmd_data_view_iter_init((const esp_rmaker_cmd_data_view_t *)in_data, &iter);
+    while (esp_rmaker_cmd_data_view_iter_next(&iter, &segment, &segment_len)) {
+        total += segment_len;
+    }
+    return (total == in_len) ? ESP_OK : ESP_FAIL;
+}
+
+/* Discards the response, like a transport sending it out as it comes */
+static esp_err_t bench_discard_writer(const void *data, size_t len, void *priv)
+{
+    return ESP_OK;
+}
+
+static void bench_register(void)
+{
+    esp_rmaker_cmd_register(BENCH_CMD_ECHO, ESP_RMAKER_USER_ROLE_PRIMARY_USER, bench_echo_handler, false, NULL);
+    esp_rmaker_cmd_register_with_flags(BENCH_CMD_VIEW, ESP_RMAKER_USER_ROLE_PRIMARY_USER, bench_view_handler,
+                                       false, ESP_RMAKER_CMD_FLAG_DATA_VIEW, NULL);
+}
+
+static void bench_deregister(void)
+{
+    esp_rmaker_cmd_deregister(BENCH_CMD_ECHO);
+    esp_rmaker_cmd_deregister(BENCH_CMD_VIEW);
+}
+
+/* Give each command a new request id, so that the replay cache does not answer it */
+static void bench_set_req_id(uint8_t *input, uint32_t count)
+{
+    /* The request id is the first TLV */
+    snprintf((char *)&input[2 + strlen(BENCH_REQ_ID) - 8], 9, "%08" PRIx32, count);
+    input[2 + strlen(BENCH_REQ_ID)] = ESP_RMAKER_TLV_TYPE_USER_ROLE;
+}
+
+static void bench_report(const char *name, size_t size, uint32_t count, int64_t time_us)
+{
+    esp_rmaker_cmd_resp_stats_t stats;
+    uint32_t per_sec = (uint32_t)((count * 1000000ULL) / (time_us ? time_us : 1));
+    if (esp_rmaker_cmd_resp_get_stats(&stats) == ESP_OK) {
+        printf("%-16s %6u bytes: %8" PRIu32 " /s, %3" PRIu32 ".%02" PRIu32 " allocs, %8" PRIu64 " bytes copied\n",
+               name, (unsigned)size, per_sec, stats.allocs / count, ((stats.allocs % count) * 100) / count,
+               stats.bytes_copied / count);
+    } else {
+        printf("%-16s %6u bytes: %8" PRIu32 " /s\n", name, (unsigned)size, per_sec);
+    }
+}
+
+TEST_CASE("ESP RainMaker Command TLV Benchmark", "[rmaker_cmd_resp_bench]")
+{
+    const size_t sizes[] = {0, 1, 32, 254, 255, 256, 509, 510, 511, 1024, 4096, 16384, 65535, 65536};
+    const uint16_t cmds[] = {BENCH_CMD_ECHO, BENCH_CMD_VIEW, BENCH_CMD_ECHO};
+    const char *names[] = {"handler(copy)", "handler(view)", "handler(writer)"};
+    uint8_t *data = malloc(BENCH_MAX_SIZE);
+    TEST_ASSERT_NOT_NULL(data);
+    for (size_t i = 0; i < BENCH_MAX_SIZE; i++) {
+        data[i] = (uint8_t)i;
+    }
+    size_t input_size = 0;
+    esp_rmaker_cmd_encode_payload(BENCH_REQ_ID, ESP_RMAKER_USER_ROLE_PRIMARY_USER, 0, BENCH_CMD_ECHO,
+                                  data, BENCH_MAX_SIZE, NULL, 0, &input_size);
+    uint8_t *input = malloc(input_size);
+    TEST_ASSERT_NOT_NULL(input);
+    bench_register();
+    esp_log_level_set(BENCH_TAG, ESP_LOG_NONE);
+
+    uint32_t req_count = 0;
+    for (size_t i = 0; (i < sizeof(sizes) / sizeof(sizes[0])) && (sizes[i] <= BENCH_MAX_SIZE); i++) {
+        /* Command handling, with the data passed as a copy or a view, and the response written out */
+        for (int c = 0; c < 3; c++) {
+            size_t input_len = 0;
+            TEST_ASSERT_EQUAL(ESP_OK, esp_rmaker_cmd_encode_payload(BENCH_REQ_ID, ESP_RMAKER_USER_ROLE_PRIMARY_USER, 0,
+                                                                    cmds[c], data, sizes[i], input, input_size,
+                                                                    &input_len));
+            uint32_t count = 0;
+            int64_t start = esp_timer_get_time();
+            int64_t elapsed = 0;
+            esp_rmaker_cmd_resp_reset_stats();
+            do {
+                bench_set_req_id(input, ++req_count);
+                if (c == 2) {
+                    TEST_ASSERT_EQUAL(ESP_OK, esp_rmaker_cmd_response_handler_to_writer(input, input_len, 0,
+                                                                                        bench_discard_writer, NULL,
+                                                                                        NULL));
+                } else {
+                    void *output = NULL;
+                    size_t output_len = 0;
+                    TEST_ASSERT_EQUAL(ESP_OK, esp_rmaker_cmd_response_handler(input, input_len, &output, &output_len));
+                    free(output);
+                }
+                count++;
+                elapsed = esp_timer_get_time() - start;
+            } while (elapsed < BENCH_TIME_US);
+            bench_report(names[c], sizes[i], count, elapsed);
+        }
+
+        /* Response encoding */
+        uint32_t count = 0;
+        int64_t start = esp_timer_get_time();
+        int64_t elapsed = 0;
+        esp_rmaker_cmd_resp_reset_stats();
+        do {
+            void *output = NULL;
+            size_t output_len = 0;
+            TEST_ASSERT_EQUAL(ESP_OK, esp_rmaker_cmd_prepare_payload(BENCH_REQ_ID, 0, ESP_RMAKER_CMD_STATUS_SUCCESS,
+                                                                     BENCH_CMD_ECHO, data, sizes[i],
+                                                                     &output, &output_len));
+            free(output);
+            count++;
+            elapsed = esp_timer_get_time() - start;
+        } while (elapsed < BENCH_TIME_US);
+        bench_report("prepare_payload", sizes[i], count, elapsed);
+    }
+
+    esp_log_level_set(BENCH_TAG, ESP_LOG_INFO);
+    bench_deregister();
+    free(input);
+    free(data);
+}
+
+/* Fuzz entry point for the command parser.
+ *
+ * Runs a single input through the command handler, the response parser, the batch walker and
+ * the CBOR reader. It has the same signature as LLVMFuzzerTestOneInput(), so that it can be
+ * hooked up to an external fuzzer. The test below uses it with deterministic mutations of valid
+ * commands.
+ */
+int test_cmd_resp_fuzz_one_input(const uint8_t *data, size_t size)
+{
+    void *output = NULL;
+    size_t output_len = 0;
+    if ((esp_rmaker_cmd_response_handler(data, size, &output, &output_len) == ESP_OK) && output) {
+        /* Whatever was generated should be parsable too */
+        esp_rmaker_cmd_resp_parse_response(output, output_len, NULL);
+        free(output);
+    }
+    esp_rmaker_cmd_resp_parse_response(data, size, NULL);
+    size_t offset = 0;
+    esp_rmaker_cmd_data_view_t record;
+    while (esp_rmaker_cmd_batch_get_next(data, size, &offset, &record)) {
+        TEST_ASSERT_TRUE(offset <= size);
+    }
+#if CONFIG_ESP_RMAKER_CMD_CBOR
+    esp_rmaker_cmd_cbor_reader_t reader;
+    esp_rmaker_cmd_cbor_reader_init_buf(&reader, data, size);
+    while (!esp_rmaker_cmd_cbor_reader_at_end(&reader) && (esp_rmaker_cmd_cbor_skip(&reader) == ESP_OK)) {
+    }
+#endif
+    return 0;
+}
+
+static uint32_t fuzz_rand(uint32_t *state)
+{
+    /* Numerical Recipes LCG. Deterministic, so that failures can be reproduced. */
+    *state = (*state * 1664525U) + 1013904223U;
+    return *state >> 8;
+}
+
+TEST_CASE("ESP RainMaker Command TLV Fuzz", "[rmaker_cmd_resp_bench]")
+{
+    static uint8_t seeds[3][700];
+    size_t seed_lens[3] = {0};
+    static uint8_t data[300];
+    static uint8_t input[800];
+    for (size_t i = 0; i < sizeof(data); i++) {
+        data[i] = (uint8_t)(i * 3);
+    }
+    /* A small command, a command with data across records and a batch of the two */
+    esp_rmaker_cmd_encode_payload("fuzz_a", ESP_RMAKER_USER_ROLE_PRIMARY_USER, 0, BENCH_CMD_ECHO,
+                                  data, 16, seeds[0], sizeof(seeds[0]), &seed_lens[0]);
+    esp_rmaker_cmd_encode_payload("fuzz_b", ESP_RMAKER_USER_ROLE_PRIMARY_USER, 0, BENCH_CMD_VIEW,
+                                  data, sizeof(data), seeds[1], sizeof(seeds[1]), &seed_lens[1]);
+    TEST_ASSERT_EQUAL(ESP_OK, esp_rmaker_cmd_batch_add(seeds[2], sizeof(seeds[2]), &seed_lens[2], seeds[0], seed_lens[0]));
+    TEST_ASSERT_EQUAL(ESP_OK, esp_rmaker_cmd_batch_add(seeds[2], sizeof(seeds[2]), &seed_lens[2], seeds[1], seed_lens[1]));
+
+    bench_register();
+    esp_log_level_set(BENCH_TAG, ESP_LOG_NONE);
+    uint32_t state = 0x5eed;
+    for (int i = 0; i < FUZZ_ITERATIONS; i++) {
+        int seed = fuzz_rand(&state) % 3;
+        size_t len = seed_lens[seed];
+        memcpy(input, seeds[seed], len);
+        int mutations = 1 + (fuzz_rand(&state) % 4);
+        for (int m = 0; m < mutations; m++) {
+            size_t pos = len ? fuzz_rand(&state) % len : 0;
+            switch (fuzz_rand(&state) % 5) {
+            case 0:
+                /* Random byte */
+                input[pos] = (uint8_t)fuzz_rand(&state);
+                break;
+            case 1: {
+                /* Boundary values, which mostly hit the lengths */
+                const uint8_t values[] = {0, 1, 2, 254, 255};
+                input[pos] = values[fuzz_rand(&state) % sizeof(values)];
+                break;
+            }
+            case 2:
+                /* Truncate */
+                len = pos;
+                break;
+            case 3:
+                /* Append random bytes */
+                while ((len < sizeof(input)) && (fuzz_rand(&state) % 8)) {
+                    input[len++] = (uint8_t)fuzz_rand(&state);
+                }
+                break;
+            default:
+                /* Bit flip */
+                input[pos] ^= (uint8_t)(1 << (fuzz_rand(&state) % 8));
+                break;
+            }
+        }
+        /* Exact size heap copy, so that over-reads are caught on targets with heap poisoning */
+        uint8_t *buf = malloc(len ? len : 1);
+        TEST_ASSERT_NOT_NULL(buf);
+        memcpy(buf, input, len);
+        test_cmd_resp_fuzz_one_input(buf, len);
+        free(buf);
+    }
+    esp_log_level_set(BENCH_TAG, ESP_LOG_INFO);
+    esp_rmaker_cmd_replay_cache_clear();
+    bench_deregister();
+}
@@ -0,0 +1,493 @@
+/*
+ * SPDX-FileCopyrightText: 2025 Espressif Systems (Shanghai) CO LTD
+ *
+ * SPDX-License-Identifier: Apache-2.0
+ */
+
+#include <stdio.h>
+#include <string.h>
+#include "unity.h"
+#include "esp_idf_version.h"
+#include "sdkconfig.h"
+
+/* esp_mqtt_client_subscribe() is a _Generic macro before IDF v5.1.2, which cannot be mocked like this */
+#if CONFIG_IDF_TARGET_LINUX && ESP_IDF_VERSION >= ESP_IDF_VERSION_VAL(5, 1, 2)
+
+/* The MQTT glue is built into this file against a mocked esp-mqtt client, so that the tests can
+ * reach its static functions and state. Its global symbols are renamed, so as to not clash with
+ * the ones in the component.
+ */
+#define mqtt_data                                   test_mqtt_data
+#define esp_rmaker_mqtt_glue_setup                  test_mqtt_glue_setup
+#define esp_rmaker_mqtt_glue_get_subscription_info  test_mqtt_glue_get_subscription_info
+#define esp_rmaker_mqtt_glue_reconcile_subscriptions test_mqtt_glue_reconcile_subscriptions
+#define esp_rmaker_mqtt_glue_set_rate_limit         test_mqtt_glue_set_rate_limit
+#define esp_rmaker_mqtt_glue_remove_rate_limit      test_mqtt_glue_remove_rate_limit
+#define esp_rmaker_mqtt_glue_get_rate_limit_stats   test_mqtt_glue_get_rate_limit_stats
+
+#define esp_mqtt_client_init                        mock_mqtt_client_init
+#define esp_mqtt_client_start                       mock_mqtt_client_start
+#define esp_mqtt_client_stop                        mock_mqtt_client_stop
+#define esp_mqtt_client_destroy                     mock_mqtt_client_destroy
+#define esp_mqtt_set_config                         mock_mqtt_set_config
+#define esp_mqtt_client_register_event              mock_mqtt_client_register_event
+#define esp_mqtt_client_subscribe_single            mock_mqtt_client_subscribe_single
+#define esp_mqtt_client_subscribe_multiple          mock_mqtt_client_subscribe_multiple
+#define esp_mqtt_client_unsubscribe                 mock_mqtt_client_unsubscribe
+#define esp_mqtt_client_publish                     mock_mqtt_client_publish
+
+#include "../../src/esp-mqtt/esp-mqtt-glue.c"
+
+typedef struct {
+    int subscribe_packets;
+    int subscribed_topics;
+    int unsubscribes;
+    int publishes;
+    int next_msg_id;
+    bool fail;                      /* Make the subscribe and unsubscribe calls fail */
+    esp_event_handler_t handler;
+} mock_mqtt_t;
+
+static mock_mqtt_t s_mock;
+static int s_mock_client;
+
+esp_mqtt_client_handle_t mock_mqtt_client_init(const esp_mqtt_client_config_t *config)
+{
+    return (esp_mqtt_client_handle_t)&s_mock_client;
+}
+
+esp_err_t mock_mqtt_client_start(esp_mqtt_client_handle_t client)
+{
+    return ESP_OK;
+}
+
+esp_err_t mock_mqtt_client_stop(esp_mqtt_client_handle_t client)
+{
+    return ESP_OK;
+}
+
+esp_err_t mock_mqtt_client_destroy(esp_mqtt_client_handle_t client)
+{
+    return ESP_OK;
+}
+
+esp_err_t mock_mqtt_set_config(esp_mqtt_client_handle_t client, const esp_mqtt_client_config_t *config)
+{
+    return ESP_OK;
+}
+
+esp_err_t mock_mqtt_client_register_event(esp_mqtt_client_handle_t client, esp_mqtt_event_id_t event,
+        esp_event_handler_t event_handler, void *event_handler_arg)
+{
+    s_mock.handler = event_handler;
+    return ESP_OK;
+}
+
+int mock_mqtt_client_subscribe_multiple(esp_mqtt_client_handle_t client, const esp_mqtt_topic_t *topic_list, int size)
+{
+    if (s_mock.fail) {
+        return -1;
+    }
+    s_mock.subscribe_packets++;
+    s_mock.subscribed_topics += size;
+    return ++s_mock.next_msg_id;
+}
+
+int mock_mqtt_client_subscribe_single(esp_mqtt_client_handle_t client, const char *topic, int qos)
+{
+    esp_mqtt_topic_t topic_list = { .filter = topic, .qos = qos };
+    return mock_mqtt_client_subscribe_multiple(client, &topic_list, 1);
+}
+
+int mock_mqtt_client_unsubscribe(esp_mqtt_client_handle_t client, const char *topic)
+{
+    if (s_mock.fail) {
+        return -1;
+    }
+    s_mock.unsubscribes++;
+    return ++s_mock.next_msg_id;
+}
+
+int mock_mqtt_client_publish(esp_mqtt_client_handle_t client, const char *topic, const char *data, int len,
+        int qos, int retain)
+{
+    s_mock.publishes++;
+    return ++s_mock.next_msg_id;
+}
+
+static void test_mqtt_event(esp_mqtt_event_id_t event_id, int msg_id, const char *data, int data_len)
+{
+    esp_mqtt_event_t event = {
+        .event_id = event_id,
+        .client = (esp_mqtt_client_handle_t)&s_mock_client,
+        .msg_id = msg_id,
+        .data = (char *)data,
+        .data_len = data_len,
+        .total_data_len = data_len,
+    };
+    s_mock.handler(NULL, NULL, event_id, &event);
+}
+
+static esp_rmaker_mqtt_conn_params_t s_conn_params = {
+    .mqtt_host = "mock.broker",
+    .client_id = "mock_client",
+};
+
+/* Initialise the glue and bring the mocked client to the connected state */
+static void test_mqtt_glue_start(esp_rmaker_mqtt_config_t *mqtt_config)
+{
+    memset(&s_mock, 0, sizeof(s_mock));
+    memset(mqtt_config, 0, sizeof(*mqtt_config));
+    TEST_ASSERT_EQUAL(ESP_OK, test_mqtt_glue_setup(mqtt_config));
+    TEST_ASSERT_EQUAL(ESP_OK, mqtt_config->init(&s_conn_params));
+    TEST_ASSERT_NOT_NULL(s_mock.handler);
+    test_mqtt_event(MQTT_EVENT_CONNECTED, 0, NULL, 0);
+}
+
+static esp_mqtt_glue_subscription_t *test_mqtt_glue_find_entry(const char *topic)
+{
+    for (int i = 0; i < MAX_MQTT_SUBSCRIPTIONS; i++) {
+        if (mqtt_data->subscriptions[i] && strcmp(mqtt_data->subscriptions[i]->topic->str, topic) == 0) {
+            return mqtt_data->subscriptions[i];
+        }
+    }
+    return NULL;
+}
+
+static void test_mqtt_glue_cb(const char *topic, void *payload, size_t payload_len, void *priv_data)
+{
+}
+
+TEST_CASE("ESP RainMaker MQTT Topic Matching", "[mqtt_glue]")
+{
+    static const struct {
+        const char *filter;
+        const char *topic;
+        bool matches;
+    } cases[] = {
+        { "node/abc/params",        "node/abc/params",          true },
+        { "node/abc/params",        "node/abc/param",           false },
+        { "node/abc",               "node/abc/params",          false },
+        /* '+' matches exactly one level, which can be empty */
+        { "node/+/params",          "node/abc/params",          true },
+        { "node/+/params",          "node//params",             true },
+        { "node/+/params",          "node/abc/def/params",      false },
+        { "node/+",                 "node",                     false },
+        { "+/+",                    "node/abc",                 true },
+        /* '#' matches any number of levels, including the parent level */
+        { "node/#",                 "node",                     true },
+        { "node/#",                 "node/abc/params",          true },
+        { "node/#",                 "nodes/abc",                false },
+        { "node/+/#",               "node/abc",                 true },
+        { "#",                      "node/abc",                 true },
+        /* Wildcards at the first level do not match topics starting with '$' */
+        { "#",                      "$aws/things/abc",          false },
+        { "+/things/abc",           "$aws/things/abc",          false },
+        { "$aws/#",                 "$aws/things/abc",          true },
+    };
+    for (int i = 0; i < sizeof(cases) / sizeof(cases[0]); i++) {
+        TEST_ASSERT_EQUAL_MESSAGE(cases[i].matches,
+                mqtt_topic_matches(cases[i].filter, cases[i].topic, strlen(cases[i].topic)), cases[i].filter);
+    }
+
+    static const struct {
+        const char *filter;
+        bool valid;
+    } filters[] = {
+        { "node/#",                 true },
+        { "node/+/params",          true },
+        { "#",                      true },
+        { "node/#/params",          false },
+        { "node#",                  false },
+        { "node/abc+",              false },
+    };
+    for (int i = 0; i < sizeof(filters) / sizeof(filters[0]); i++) {
+        TEST_ASSERT_EQUAL_MESSAGE(filters[i].valid, mqtt_topic_filter_is_valid(filters[i].filter), filters[i].filter);
+    }
+}
+
+TEST_CASE("ESP RainMaker MQTT Topic Filter Covers", "[mqtt_glue]")
+{
+    static const struct {
+        const char *filter;
+        const char *other;
+        bool covers;
+    } cases[] = {
+        { "node/#",                 "node",                     true },
+        { "node/#",                 "node/+/params",            true },
+        { "node/#",                 "node/abc/#",               true },
+        { "node/+/params",          "node/abc/params",          true },
+        { "node/+/params",          "node/+/params",            true },
+        { "#",                      "node/#",                   true },
+        { "node/abc/params",        "node/+/params",            false },
+        { "node/+",                 "node/#",                   false },
+        { "node/+",                 "node",                     false },
+        { "node/abc/#",             "node",                     false },
+        { "#",                      "$aws/things/abc",          false },
+    };
+    for (int i = 0; i < sizeof(cases) / sizeof(cases[0]); i++) {
+        TEST_ASSERT_EQUAL_MESSAGE(cases[i].covers, mqtt_topic_filter_covers(cases[i].filter, cases[i].other),
+                cases[i].filter);
+    }
+}
+
+TEST_CASE("ESP RainMaker MQTT Wildcard Subscription", "[mqtt_glue]")
+{
+    esp_rmaker_mqtt_config_t mqtt_config;
+    test_mqtt_glue_start(&mqtt_config);
+    const char granted = 1;
+    TEST_ASSERT_EQUAL(ESP_OK, mqtt_config.subscribe("node/abc/params", test_mqtt_glue_cb, 1, NULL));
+    test_mqtt_event(MQTT_EVENT_SUBSCRIBED, test_mqtt_glue_find_entry("node/abc/params")->msg_id, &granted, 1);
+    TEST_ASSERT_EQUAL(ESP_ERR_INVALID_ARG, mqtt_config.subscribe("node/#/params", test_mqtt_glue_cb, 1, NULL));
+    TEST_ASSERT_EQUAL(1, s_mock.subscribe_packets);
+
+    /* Once the wildcard is acknowledged, the broker subscription for the topic it covers is dropped */
+    TEST_ASSERT_EQUAL(ESP_OK, mqtt_config.subscribe("node/#", test_mqtt_glue_cb, 1, NULL));
+    TEST_ASSERT_EQUAL(2, s_mock.subscribe_packets);
+    test_mqtt_event(MQTT_EVENT_SUBSCRIBED, test_mqtt_glue_find_entry("node/#")->msg_id, &granted, 1);
+    TEST_ASSERT_EQUAL(1, s_mock.unsubscribes);
+    esp_rmaker_mqtt_sub_info_t info;
+    TEST_ASSERT_EQUAL(ESP_OK, test_mqtt_glue_get_subscription_info("node/abc/params", &info));
+    TEST_ASSERT_TRUE(info.covered);
+    TEST_ASSERT_EQUAL(ESP_RMAKER_MQTT_SUB_STATE_ACKNOWLEDGED, info.state);
+
+    /* A topic subscribed afresh under the wildcard needs no SUBSCRIBE of its own */
+    TEST_ASSERT_EQUAL(ESP_OK, mqtt_config.subscribe("node/abc/config", test_mqtt_glue_cb, 1, NULL));
+    TEST_ASSERT_EQUAL(2, s_mock.subscribe_packets);
+    TEST_ASSERT_EQUAL(ESP_OK, test_mqtt_glue_get_subscription_info("node/abc/config", &info));
+    TEST_ASSERT_TRUE(info.covered);
+
+    /* Once the wildcard is unsubscribed, the covered topics are subscribed on their own */
+    TEST_ASSERT_EQUAL(ESP_OK, mqtt_config.unsubscribe("node/#"));
+    TEST_ASSERT_EQUAL(2, s_mock.unsubscribes);
+    TEST_ASSERT_EQUAL(4, s_mock.subscribed_topics);
+    TEST_ASSERT_EQUAL(ESP_OK, test_mqtt_glue_get_subscription_info("node/abc/params", &info));
+    TEST_ASSERT_FALSE(info.covered);
+    TEST_ASSERT_EQUAL(ESP_RMAKER_MQTT_SUB_STATE_REQUESTED, info.state);
+    mqtt_config.deinit();
+}
+
+static void test_mqtt_glue_other_cb(const char *topic, void *payload, size_t payload_len, void *priv_data)
+{
+}
+
+/* Get the interned copy of a topic, if it is in the pool */
+static esp_mqtt_glue_topic_t *test_mqtt_glue_pool_lookup(const char *topic)
+{
+    return esp_mqtt_glue_topic_lookup(topic, strlen(topic), esp_mqtt_glue_topic_hash(topic, strlen(topic)));
+}
+
+TEST_CASE("ESP RainMaker MQTT Topic Interning", "[mqtt_glue]")
+{
+    esp_rmaker_mqtt_config_t mqtt_config;
+    test_mqtt_glue_start(&mqtt_config);
+
+    /* All the subscriptions for a topic share a single interned copy */
+    TEST_ASSERT_EQUAL(ESP_OK, mqtt_config.subscribe("test/a", test_mqtt_glue_cb, 1, NULL));
+    TEST_ASSERT_EQUAL(ESP_OK, mqtt_config.subscribe("test/a", test_mqtt_glue_other_cb, 1, NULL));
+    TEST_ASSERT_EQUAL(ESP_OK, mqtt_config.subscribe("test/b", test_mqtt_glue_cb, 1, NULL));
+    esp_mqtt_glue_topic_t *topic_a = test_mqtt_glue_pool_lookup("test/a");
+    TEST_ASSERT_NOT_NULL(topic_a);
+    TEST_ASSERT_EQUAL(2, topic_a->ref_count);
+    int entries = 0;
+    for (int i = 0; i < MAX_MQTT_SUBSCRIPTIONS; i++) {
+        if (mqtt_data->subscriptions[i] && mqtt_data->subscriptions[i]->topic == topic_a) {
+            entries++;
+        }
+    }
+    TEST_ASSERT_EQUAL(2, entries);
+    /* An update of an existing subscription takes no new reference */
+    TEST_ASSERT_EQUAL(ESP_OK, mqtt_config.subscribe("test/a", test_mqtt_glue_cb, 1, NULL));
+    TEST_ASSERT_EQUAL(2, topic_a->ref_count);
+
+    /* Each unsubscribe removes one callback, and the UNSUBSCRIBE goes out only with the last one */
+    TEST_ASSERT_EQUAL(ESP_OK, mqtt_config.unsubscribe("test/a"));
+    TEST_ASSERT_EQUAL(1, topic_a->ref_count);
+    TEST_ASSERT_EQUAL(0, s_mock.unsubscribes);
+
+    /* An UNSUBSCRIBE which could not be sent keeps its own reference till it is retried */
+    s_mock.fail = true;
+    TEST_ASSERT_EQUAL(ESP_OK, mqtt_config.unsubscribe("test/a"));
+    s_mock.fail = false;
+    TEST_ASSERT_EQUAL_PTR(topic_a, test_mqtt_glue_pool_lookup("test/a"));
+    TEST_ASSERT_EQUAL(1, topic_a->ref_count);
+    esp_rmaker_mqtt_sub_info_t info;
+    TEST_ASSERT_EQUAL(ESP_ERR_NOT_FOUND, test_mqtt_glue_get_subscription_info("test/a", &info));
+    TEST_ASSERT_EQUAL(ESP_OK, test_mqtt_glue_reconcile_subscriptions());
+    TEST_ASSERT_EQUAL(1, s_mock.unsubscribes);
+    TEST_ASSERT_NULL(test_mqtt_glue_pool_lookup("test/a"));
+
+    /* Subscribing again before the UNSUBSCRIBE goes out cancels it, and reuses the interned copy */
+    s_mock.fail = true;
+    TEST_ASSERT_EQUAL(ESP_OK, mqtt_config.unsubscribe("test/b"));
+    s_mock.fail = false;
+    esp_mqtt_glue_topic_t *topic_b = test_mqtt_glue_pool_lookup("test/b");
+    TEST_ASSERT_NOT_NULL(topic_b);
+    TEST_ASSERT_EQUAL(ESP_OK, mqtt_config.subscribe("test/b", test_mqtt_glue_cb, 1, NULL));
+    TEST_ASSERT_EQUAL_PTR(topic_b, test_mqtt_glue_pool_lookup("test/b"));
+    TEST_ASSERT_EQUAL(1, topic_b->ref_count);
+    TEST_ASSERT_EQUAL(1, s_mock.unsubscribes);
+    mqtt_config.deinit();
+}
+
+TEST_CASE("ESP RainMaker MQTT Subscription Retry Backoff", "[mqtt_glue]")
+{
+    esp_rmaker_mqtt_config_t mqtt_config;
+    test_mqtt_glue_start(&mqtt_config);
+    TEST_ASSERT_EQUAL(ESP_OK, mqtt_config.subscribe("test/a", test_mqtt_glue_cb, 1, NULL));
+    TEST_ASSERT_EQUAL(ESP_OK, mqtt_config.subscribe("test/b", test_mqtt_glue_cb, 1, NULL));
+    TEST_ASSERT_EQUAL(2, s_mock.subscribe_packets);
+
+    /* SUBACK accepting the first topic and rejecting the second */
+    const char granted = 1;
+    const char rejected = (char)MQTT_SUBACK_FAILURE;
+    esp_mqtt_glue_subscription_t *entry_a = test_mqtt_glue_find_entry("test/a");
+    esp_mqtt_glue_subscription_t *entry_b = test_mqtt_glue_find_entry("test/b");
+    test_mqtt_event(MQTT_EVENT_SUBSCRIBED, entry_a->msg_id, &granted, 1);
+    test_mqtt_event(MQTT_EVENT_SUBSCRIBED, entry_b->msg_id, &rejected, 1);
+    esp_rmaker_mqtt_sub_info_t info;
+    TEST_ASSERT_EQUAL(ESP_OK, test_mqtt_glue_get_subscription_info("test/a", &info));
+    TEST_ASSERT_EQUAL(ESP_RMAKER_MQTT_SUB_STATE_ACKNOWLEDGED, info.state);
+    TEST_ASSERT_EQUAL(ESP_OK, test_mqtt_glue_get_subscription_info("test/b", &info));
+    TEST_ASSERT_EQUAL(ESP_RMAKER_MQTT_SUB_STATE_FAILED, info.state);
+    TEST_ASSERT_EQUAL(1, info.retries);
+
+    /* Not retried within the backoff, which doubles with every failure */
+    s_mock.subscribe_packets = 0;
+    TEST_ASSERT_EQUAL(ESP_OK, test_mqtt_glue_reconcile_subscriptions());
+    TEST_ASSERT_EQUAL(0, s_mock.subscribe_packets);
+    TEST_ASSERT_UINT32_WITHIN(pdMS_TO_TICKS(500), pdMS_TO_TICKS(MQTT_SUB_RETRY_MIN_MS),
+            entry_b->next_retry_tick - xTaskGetTickCount());
+    entry_b->next_retry_tick = xTaskGetTickCount();
+    s_mock.fail = true;
+    TEST_ASSERT_EQUAL(ESP_OK, test_mqtt_glue_reconcile_subscriptions());
+    s_mock.fail = false;
+    TEST_ASSERT_EQUAL(ESP_RMAKER_MQTT_SUB_STATE_FAILED, entry_b->state);
+    TEST_ASSERT_EQUAL(2, entry_b->retries);
+    TEST_ASSERT_UINT32_WITHIN(pdMS_TO_TICKS(500), pdMS_TO_TICKS(2 * MQTT_SUB_RETRY_MIN_MS),
+            entry_b->next_retry_tick - xTaskGetTickCount());
+
+    /* Retried once due. A request which gets no SUBACK in time is treated as failed. */
+    entry_b->next_retry_tick = xTaskGetTickCount();
+    TEST_ASSERT_EQUAL(ESP_OK, test_mqtt_glue_reconcile_subscriptions());
+    TEST_ASSERT_EQUAL(1, s_mock.subscribe_packets);
+    TEST_ASSERT_EQUAL(ESP_RMAKER_MQTT_SUB_STATE_REQUESTED, entry_b->state);
+    entry_b->request_tick -= pdMS_TO_TICKS(MQTT_SUBACK_TIMEOUT_MS + 1000);
+    TEST_ASSERT_EQUAL(ESP_OK, test_mqtt_glue_reconcile_subscriptions());
+    TEST_ASSERT_EQUAL(1, s_mock.subscribe_packets);
+    TEST_ASSERT_EQUAL(ESP_RMAKER_MQTT_SUB_STATE_FAILED, entry_b->state);
+    TEST_ASSERT_EQUAL(3, entry_b->retries);
+
+    /* The backoff is capped */
+    entry_b->retries = 20;
+    esp_mqtt_glue_set_topic_failed(entry_b->topic, xTaskGetTickCount());
+    TEST_ASSERT_UINT32_WITHIN(pdMS_TO_TICKS(500), pdMS_TO_TICKS(MQTT_SUB_RETRY_MAX_MS),
+            entry_b->next_retry_tick - xTaskGetTickCount());
+
+    /* An accepted retry resets the backoff */
+    entry_b->next_retry_tick = xTaskGetTickCount();
+    TEST_ASSERT_EQUAL(ESP_OK, test_mqtt_glue_reconcile_subscriptions());
+    test_mqtt_event(MQTT_EVENT_SUBSCRIBED, entry_b->msg_id, &granted, 1);
+    TEST_ASSERT_EQUAL(ESP_OK, test_mqtt_glue_get_subscription_info("test/b", &info));
+    TEST_ASSERT_EQUAL(ESP_RMAKER_MQTT_SUB_STATE_ACKNOWLEDGED, info.state);
+    TEST_ASSERT_EQUAL(0, info.retries);
+
+    /* Not retried while the client is being reconfigured, or is disconnected */
+    TEST_ASSERT_EQUAL(ESP_OK, mqtt_config.update_config(&s_conn_params));
+    TEST_ASSERT_FALSE(xTimerIsTimerActive(mqtt_data->reconcile_timer));
+    TEST_ASSERT_EQUAL(ESP_ERR_INVALID_STATE, test_mqtt_glue_reconcile_subscriptions());
+    test_mqtt_event(MQTT_EVENT_CONNECTED, 0, NULL, 0);
+    TEST_ASSERT_TRUE(xTimerIsTimerActive(mqtt_data->reconcile_timer));
+    test_mqtt_event(MQTT_EVENT_DISCONNECTED, 0, NULL, 0);
+    TEST_ASSERT_EQUAL(ESP_ERR_INVALID_STATE, test_mqtt_glue_reconcile_subscriptions());
+    mqtt_config.deinit();
+    TEST_ASSERT_NULL(mqtt_data);
+}
+
+TEST_CASE("ESP RainMaker MQTT Rate Limit Token Bucket", "[mqtt_glue]")
+{
+    /* Refill, as per the whole intervals elapsed, capped at the burst */
+    TickType_t interval = pdMS_TO_TICKS(100);
+    esp_mqtt_glue_rate_limit_t bucket = {
+        .config = { .burst = 3, .refill_interval_ms = 100 },
+        .last_refill_tick = 1000,
+    };
+    static const struct {
+        TickType_t elapsed;
+        uint16_t tokens;
+    } steps[] = {
+        { 0,    0 },
+        { 1,    1 },
+        { 2,    2 },    /* Partial intervals are carried over */
+        { 3,    3 },
+        { 10,   3 },
+    };
+    for (int i = 0; i < sizeof(steps) / sizeof(steps[0]); i++) {
+        esp_mqtt_glue_refill_tokens(&bucket, 1000 + steps[i].elapsed * interval + interval / 2);
+        TEST_ASSERT_EQUAL(steps[i].tokens, bucket.tokens);
+    }
+    bucket.tokens = 0;
+    bucket.last_refill_tick = 2000;
+    TEST_ASSERT_EQUAL(interval - interval / 2, esp_mqtt_glue_ticks_to_next_token(&bucket, 2000 + interval / 2));
+
+    esp_rmaker_mqtt_config_t mqtt_config;
+    test_mqtt_glue_start(&mqtt_config);
+    char data[] = "{}";
+    int msg_id;
+
+    /* Drop: messages beyond the burst are rejected */
+    esp_rmaker_mqtt_rate_limit_config_t drop = {
+        .topic_prefix = "test/drop/",
+        .burst = 2,
+        .refill_interval_ms = 60 * 1000,
+        .policy = ESP_RMAKER_MQTT_RATE_LIMIT_DROP,
+    };
+    TEST_ASSERT_EQUAL(ESP_OK, test_mqtt_glue_set_rate_limit(&drop));
+    for (int i = 0; i < 2; i++) {
+        TEST_ASSERT_EQUAL(ESP_OK, mqtt_config.publish("test/drop/1", data, strlen(data), 0, &msg_id));
+    }
+    TEST_ASSERT_EQUAL(ESP_ERR_NOT_ALLOWED, mqtt_config.publish("test/drop/1", data, strlen(data), 0, &msg_id));
+    TEST_ASSERT_EQUAL(2, s_mock.publishes);
+    esp_rmaker_mqtt_rate_limit_stats_t stats;
+    TEST_ASSERT_EQUAL(ESP_OK, test_mqtt_glue_get_rate_limit_stats("test/drop/", &stats));
+    TEST_ASSERT_EQUAL(2, stats.passed);
+    TEST_ASSERT_EQUAL(1, stats.dropped);
+
+    /* Delay: messages beyond the burst are queued, up to max_pending, and published on refill */
+    esp_rmaker_mqtt_rate_limit_config_t delay = {
+        .topic_prefix = "test/delay/",
+        .burst = 1,
+        .refill_interval_ms = 60 * 1000,
+        .policy = ESP_RMAKER_MQTT_RATE_LIMIT_DELAY,
+        .max_pending = 2,
+    };
+    TEST_ASSERT_EQUAL(ESP_OK, test_mqtt_glue_set_rate_limit(&delay));
+    s_mock.publishes = 0;
+    TEST_ASSERT_EQUAL(ESP_OK, mqtt_config.publish("test/delay/1", data, strlen(data), 0, &msg_id));
+    TEST_ASSERT_GREATER_THAN(0, msg_id);
+    for (int i = 0; i < 2; i++) {
+        TEST_ASSERT_EQUAL(ESP_ERR_NOT_FINISHED, mqtt_config.publish("test/delay/1", data, strlen(data), 0, &msg_id));
+        TEST_ASSERT_EQUAL(-1, msg_id);
+    }
+    TEST_ASSERT_EQUAL(ESP_ERR_NOT_ALLOWED, mqtt_config.publish("test/delay/1", data, strlen(data), 0, &msg_id));
+    TEST_ASSERT_EQUAL(1, s_mock.publishes);
+    xSemaphoreTake(rate_limit_lock, portMAX_DELAY);
+    esp_mqtt_glue_rate_limit_t *rate_limit = esp_mqtt_glue_find_rate_limit("test/delay/1");
+    rate_limit->last_refill_tick -= pdMS_TO_TICKS(delay.refill_interval_ms);
+    xSemaphoreGive(rate_limit_lock);
+    esp_mqtt_glue_flush_rate_limits(NULL);
+    TEST_ASSERT_EQUAL(2, s_mock.publishes);
+    TEST_ASSERT_EQUAL(ESP_OK, test_mqtt_glue_get_rate_limit_stats("test/delay/", &stats));
+    TEST_ASSERT_EQUAL(1, stats.pending);
+    TEST_ASSERT_EQUAL(1, stats.dropped);
+
+    /* Messages still queued are dropped on deinit */
+    mqtt_config.deinit();
+    TEST_ASSERT_EQUAL(ESP_OK, test_mqtt_glue_get_rate_limit_stats("test/delay/", &stats));
+    TEST_ASSERT_EQUAL(0, stats.pending);
+    TEST_ASSERT_EQUAL(2, stats.dropped);
+    TEST_ASSERT_EQUAL(ESP_OK, test_mqtt_glue_remove_rate_limit("test/drop/"));
+    TEST_ASSERT_EQUAL(ESP_OK, test_mqtt_glue_remove_rate_limit("test/delay/"));
+}
+
+#endif /* CONFIG_IDF_TARGET_LINUX && ESP_IDF_VERSION >= ESP_IDF_VERSION_VAL(5, 1, 2) */
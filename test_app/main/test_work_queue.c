@@ -48,14 +48,6 @@ static void test_delayed_work_fn(void *data)
     xSemaphoreGive(work_done_semaphore);
 }
 
-esp_err_t esp_rmaker_work_queue_add_delayed_task(esp_rmaker_work_fn_t work_fn, void *data, uint32_t delay_ms) {
-    // Implement delay logic using a timer or delay mechanism
-    // Schedule the work function to execute after delay_ms milliseconds
-    // This is a placeholder implementation
-    vTaskDelay(pdMS_TO_TICKS(delay_ms));
-    return esp_rmaker_work_queue_add_task(work_fn, data);
-}
-
 TEST_CASE("ESP RainMaker Work Queue Init", "[work_queue]")
 {
     work_done_semaphore = xSemaphoreCreateBinary();
@@ -223,3 +215,132 @@ TEST_CASE("ESP RainMaker Work Queue Store Task", "[work_queue]")
     // Deinitialize the work queue
     esp_rmaker_work_queue_deinit();
 }
+
+static SemaphoreHandle_t work_started_semaphore;
+static SemaphoreHandle_t work_release_semaphore;
+static volatile int parallel_release_count = 0;
+
+// Work function which waits till it is released, to check that others run in parallel
+static void test_parallel_work_fn(void *data)
+{
+    ESP_LOGI(TAG, "Parallel work function started with data: %s", (char *)data);
+    xSemaphoreGive(work_started_semaphore);
+    if (xSemaphoreTake(work_release_semaphore, pdMS_TO_TICKS(5000)) == pdTRUE) {
+        parallel_release_count++;
+    }
+    xSemaphoreGive(work_done_semaphore);
+}
+
+TEST_CASE("ESP RainMaker Work Queue Pool", "[work_queue]")
+{
+    // The earlier tests may have left the single worker queue initialised
+    TEST_ASSERT_EQUAL(ESP_OK, esp_rmaker_work_queue_deinit());
+
+    esp_rmaker_work_queue_config_t config = {
+        .workers = ESP_RMAKER_WORK_QUEUE_MAX_WORKERS + 1,
+    };
+    TEST_ASSERT_EQUAL(ESP_ERR_INVALID_ARG, esp_rmaker_work_queue_init_with_config(&config));
+
+    config.workers = 2;
+    config.pin_to_cores = true;
+    TEST_ASSERT_EQUAL(ESP_OK, esp_rmaker_work_queue_init_with_config(&config));
+    TEST_ASSERT_EQUAL(ESP_OK, esp_rmaker_work_queue_start());
+
+    work_done_semaphore = xSemaphoreCreateCounting(16, 0);
+    work_started_semaphore = xSemaphoreCreateCounting(2, 0);
+    work_release_semaphore = xSemaphoreCreateCounting(2, 0);
+    TEST_ASSERT_NOT_NULL(work_done_semaphore);
+    TEST_ASSERT_NOT_NULL(work_started_semaphore);
+    TEST_ASSERT_NOT_NULL(work_release_semaphore);
+
+    // Both start before either of them is released, which needs 2 workers
+    parallel_release_count = 0;
+    TEST_ASSERT_EQUAL(ESP_OK, esp_rmaker_work_queue_add_task(test_parallel_work_fn, "parallel_1"));
+    TEST_ASSERT_EQUAL(ESP_OK, esp_rmaker_work_queue_add_task(test_parallel_work_fn, "parallel_2"));
+    TEST_ASSERT_EQUAL(pdTRUE, xSemaphoreTake(work_started_semaphore, pdMS_TO_TICKS(2000)));
+    TEST_ASSERT_EQUAL(pdTRUE, xSemaphoreTake(work_started_semaphore, pdMS_TO_TICKS(2000)));
+    xSemaphoreGive(work_release_semaphore);
+    xSemaphoreGive(work_release_semaphore);
+    for (int i = 0; i < 2; i++) {
+        TEST_ASSERT_EQUAL(pdTRUE, xSemaphoreTake(work_done_semaphore, pdMS_TO_TICKS(5000)));
+    }
+    TEST_ASSERT_EQUAL(2, parallel_release_count);
+
+    // Work queued beyond the queue of a single worker all runs
+    for (int i = 0; i < 12; i++) {
+        TEST_ASSERT_EQUAL(ESP_OK, esp_rmaker_work_queue_add_task(test_work_fn, "pool_work_data"));
+    }
+    for (int i = 0; i < 12; i++) {
+        TEST_ASSERT_EQUAL(pdTRUE, xSemaphoreTake(work_done_semaphore, pdMS_TO_TICKS(5000)));
+    }
+
+    TEST_ASSERT_EQUAL(ESP_OK, esp_rmaker_work_queue_deinit());
+    vSemaphoreDelete(work_release_semaphore);
+    vSemaphoreDelete(work_started_semaphore);
+    vSemaphoreDelete(work_done_semaphore);
+}
+
+#define TEST_TIMER_COUNT    1000
+
+static int64_t timer_deadlines[TEST_TIMER_COUNT];
+static int timer_execution_count = 0;
+static int timer_early_count = 0;
+
+// Work function for many delayed works, which checks that it did not run before its deadline
+static void test_timer_work_fn(void *data)
+{
+    int index = (int)(intptr_t)data;
+    // Allow for the tick, which the delay is rounded to, being counted a bit later than the time
+    if (esp_timer_get_time() < timer_deadlines[index] - (portTICK_PERIOD_MS * 1000)) {
+        timer_early_count++;
+    }
+    if (++timer_execution_count == TEST_TIMER_COUNT) {
+        xSemaphoreGive(work_done_semaphore);
+    }
+}
+
+TEST_CASE("ESP RainMaker Work Queue Timer Wheel", "[work_queue]")
+{
+    TEST_ASSERT_EQUAL(ESP_OK, esp_rmaker_work_queue_deinit());
+    TEST_ASSERT_EQUAL(ESP_ERR_INVALID_STATE, esp_rmaker_work_queue_add_delayed_task(test_timer_work_fn, NULL, 10));
+
+    // Single worker, so that the work functions need no locking
+    esp_rmaker_work_queue_config_t config = {
+        .workers = 1,
+    };
+    TEST_ASSERT_EQUAL(ESP_OK, esp_rmaker_work_queue_init_with_config(&config));
+    TEST_ASSERT_EQUAL(ESP_OK, esp_rmaker_work_queue_start());
+    work_done_semaphore = xSemaphoreCreateCounting(2, 0);
+    TEST_ASSERT_NOT_NULL(work_done_semaphore);
+
+    // Deadline which has passed already runs right away
+    work_execution_count = 0;
+    TEST_ASSERT_EQUAL(ESP_OK, esp_rmaker_work_queue_add_task_at(test_work_fn, "deadline_work_data",
+                                                                xTaskGetTickCount() - 1));
+    TEST_ASSERT_EQUAL(pdTRUE, xSemaphoreTake(work_done_semaphore, pdMS_TO_TICKS(100)));
+    TEST_ASSERT_EQUAL(1, work_execution_count);
+
+    // Many delays, spanning multiple turns of the wheel, added without blocking
+    timer_execution_count = 0;
+    timer_early_count = 0;
+    int64_t start_time = esp_timer_get_time();
+    for (int i = 0; i < TEST_TIMER_COUNT; i++) {
+        // Reverse order of delays, so that every one is earlier than the ones before
+        uint32_t delay_ms = ((TEST_TIMER_COUNT - i) * 7) % 1500;
+        timer_deadlines[i] = esp_timer_get_time() + (delay_ms * 1000);
+        TEST_ASSERT_EQUAL(ESP_OK, esp_rmaker_work_queue_add_delayed_task(test_timer_work_fn, (void *)(intptr_t)i,
+                                                                         delay_ms));
+    }
+    int64_t add_time = (esp_timer_get_time() - start_time) / 1000;
+    ESP_LOGI(TAG, "Added %d delayed works in %" PRIi64 " ms", TEST_TIMER_COUNT, add_time);
+    TEST_ASSERT_TRUE(add_time < 500);
+
+    TEST_ASSERT_EQUAL(pdTRUE, xSemaphoreTake(work_done_semaphore, pdMS_TO_TICKS(5000)));
+    TEST_ASSERT_EQUAL(TEST_TIMER_COUNT, timer_execution_count);
+    TEST_ASSERT_EQUAL(0, timer_early_count);
+
+    // Pending delayed work is dropped on de-initialization
+    TEST_ASSERT_EQUAL(ESP_OK, esp_rmaker_work_queue_add_delayed_task(test_timer_work_fn, (void *)0, 60000));
+    TEST_ASSERT_EQUAL(ESP_OK, esp_rmaker_work_queue_deinit());
+    vSemaphoreDelete(work_done_semaphore);
+}
@@ -33,6 +33,11 @@ def test_rmaker_cmd_resp(dut: IdfDut):
     run_unity_group_fast(dut, "rmaker_cmd_resp")
 
 
+def test_rmaker_cmd_resp_bench(dut: IdfDut):
+    """Benchmark and fuzz the ESP RainMaker command response TLV codec"""
+    run_unity_group_fast(dut, "rmaker_cmd_resp_bench")
+
+
 def test_work_queue(dut: IdfDut):
     """Test ESP RainMaker work queue functionality"""
     run_unity_group_fast(dut, "work_queue")